@@ -0,0 +1,166 @@
+#include "test.hpp"
+#include "util.hpp"
+#include "psi_generator.hpp"
+
+#ifdef HAVE_DVBPSI
+#include <dvbpsi/dvbpsi.h>
+#include <dvbpsi/psi.h>
+#include <dvbpsi/pat.h>
+#endif
+
+#define BENCH_BYTES (64 << 20) // Checked for each section size
+#define BENCH_PATS 1000000
+#define CRC32_POLY 0x04C11DB7
+
+static uint32_t bytewise_table[256];
+
+/**
+ * The MPEG-2 CRC a byte at a time from one table, as libdvbpsi checks it.
+ */
+static uint32_t crc32_bytewise(const uint8_t* data, size_t len)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < len; i++)
+  {
+    crc = (crc << 8) ^ bytewise_table[(crc >> 24) ^ data[i]];
+  }
+  return crc;
+}
+
+static void bench_crc(size_t len)
+{
+  TestRandom random;
+  std::vector<uint8_t> data(len);
+  for (auto& byte : data)
+  {
+    byte = random.next();
+  }
+  CHECK_EQ(crc32_mpeg(data.data(), len), crc32_bytewise(data.data(), len));
+
+  size_t rounds = BENCH_BYTES / len;
+  // Summed so that neither can be optimised away.
+  uint32_t sum = 0;
+  double start = test_seconds();
+  for (size_t i = 0; i < rounds; i++)
+  {
+    data[0] = i;
+    sum += crc32_mpeg(data.data(), len);
+  }
+  double sliced = test_seconds() - start;
+  start = test_seconds();
+  for (size_t i = 0; i < rounds; i++)
+  {
+    data[0] = i;
+    sum -= crc32_bytewise(data.data(), len);
+  }
+  double bytewise = test_seconds() - start;
+  CHECK_EQ(sum, 0);
+  double bytes = (double)rounds * len;
+  printf("CRC of %4zu bytes: slice-by-8 %.2f GB/s, bytewise %.2f GB/s\n", len, bytes / sliced / 1e9, bytes / bytewise / 1e9);
+}
+
+#ifdef HAVE_DVBPSI
+
+static void dvbpsi_message(dvbpsi_t* dvbpsi, const dvbpsi_msg_level_t level, const char* msg)
+{
+}
+
+/**
+ * A channel's PAT packet as Channel::_create_pat used to build it.
+ */
+static void dvbpsi_pat_packet(uint16_t program, uint16_t pmt_pid, uint8_t* pkt)
+{
+  dvbpsi_pat_t pat;
+  dvbpsi_t* dvbpsi = dvbpsi_new(&dvbpsi_message, DVBPSI_MSG_NONE);
+  dvbpsi_pat_init(&pat, 1, 0, 1);
+  dvbpsi_pat_program_add(&pat, program, pmt_pid);
+  dvbpsi_psi_section_t* section = dvbpsi_pat_sections_generate(dvbpsi, &pat, 1);
+  pkt[0] = 0x47;
+  pkt[1] = 0x40;
+  pkt[2] = 0x00;
+  pkt[3] = 0x10;
+  pkt[4] = 0x00;
+  size_t len = section->p_payload_end - section->p_data;
+  if (section->b_syntax_indicator) len += 4;
+  memcpy(pkt + 5, section->p_data, len);
+  memset(pkt + 5 + len, 0xFF, TS_PACKET_SIZE - 5 - len);
+  dvbpsi_DeletePSISections(section);
+  dvbpsi_pat_empty(&pat);
+  dvbpsi_delete(dvbpsi);
+}
+
+#endif
+
+/**
+ * A PAT packet for a channel, built each time, against a copy of one
+ * built once with its continuity counter set, as channels now write them.
+ */
+static void bench_pat()
+{
+  std::vector<uint8_t> built;
+  psi_packetize(0, psi_pat_section(7, 0x107), built);
+  uint32_t sum = 0;
+
+  // Into a buffer of packets, as channels queue them.
+  std::vector<uint8_t> out(64 * TS_PACKET_SIZE);
+  double start = test_seconds();
+  for (unsigned i = 0; i < BENCH_PATS; i++)
+  {
+    uint8_t* copy = &out[(i % 64) * TS_PACKET_SIZE];
+    memcpy(copy, built.data(), TS_PACKET_SIZE);
+    copy[3] = (copy[3] & 0xF0) | (i & 0x0F);
+  }
+  double copied = test_seconds() - start;
+  sum += crc32_mpeg(out.data(), out.size());
+  printf("PAT packet, copied:  %.1f ns\n", copied * 1e9 / BENCH_PATS);
+
+  start = test_seconds();
+  for (unsigned i = 0; i < BENCH_PATS; i++)
+  {
+    std::vector<uint8_t> packets;
+    psi_packetize(0, psi_pat_section(7, 0x107), packets);
+    sum += packets[3];
+  }
+  double rebuilt = test_seconds() - start;
+  printf("PAT packet, rebuilt: %.1f ns\n", rebuilt * 1e9 / BENCH_PATS);
+
+#ifdef HAVE_DVBPSI
+  uint8_t pkt[TS_PACKET_SIZE];
+  dvbpsi_pat_packet(7, 0x107, pkt);
+  CHECK(memcmp(pkt, built.data(), TS_PACKET_SIZE) == 0);
+  start = test_seconds();
+  for (unsigned i = 0; i < BENCH_PATS; i++)
+  {
+    dvbpsi_pat_packet(7, 0x107, pkt);
+    sum += pkt[3];
+  }
+  double generated = test_seconds() - start;
+  printf("PAT packet, libdvbpsi: %.1f ns\n", generated * 1e9 / BENCH_PATS);
+#else
+  printf("Built without libdvbpsi, not comparing with it\n");
+#endif
+  CHECK(sum);
+}
+
+/**
+ * The slice-by-8 CRC against a bytewise one, and building a channel's PAT
+ * packet each time against copying one built once.
+ */
+int main(int argc, char** argv)
+{
+  for (uint32_t i = 0; i < 256; i++)
+  {
+    uint32_t crc = i << 24;
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = (crc & 0x80000000) ? (crc << 1) ^ CRC32_POLY : crc << 1;
+    }
+    bytewise_table[i] = crc;
+  }
+  for (size_t len : { 16, 184, 1024, 4096 })
+  {
+    bench_crc(len);
+  }
+  bench_pat();
+  return 0;
+}
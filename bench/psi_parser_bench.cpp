@@ -0,0 +1,71 @@
+#include <map>
+
+#include "test.hpp"
+#include "util.hpp"
+#include "psi_parser.hpp"
+
+#define BENCH_PACKETS 200000
+#define BENCH_REPEAT 20
+
+/**
+ * Packets a second through the SectionAssembler and parsers, for the PAT
+ * and every PMT in a multiplex, as while monitoring the PSI. Takes an
+ * optional recorded multiplex, or makes one up.
+ */
+int main(int argc, char** argv)
+{
+  std::vector<uint8_t> mux = argc > 1 ? test_load(argv[1]) : test_mux(12, BENCH_PACKETS);
+  CHECK(!mux.empty());
+
+  static PsiPat pat;
+  static PsiPmt pmt;
+  uint64_t tables = 0;
+  std::map<uint16_t, SectionAssembler*> assemblers;
+  assemblers[0] = new SectionAssembler([&](const uint8_t* section, size_t len)
+  {
+    if (!psi_parse_pat(section, len, pat)) return;
+    tables++;
+    for (unsigned i = 0; i < pat.count; i++)
+    {
+      if (!pat.programs[i].number || assemblers.count(pat.programs[i].pmt_pid)) continue;
+      assemblers[pat.programs[i].pmt_pid] = new SectionAssembler([&](const uint8_t* section, size_t len)
+      {
+        if (psi_parse_pmt(section, len, pmt)) tables++;
+      });
+    }
+  });
+  // A flat table, as the segmenter routes by PID.
+  std::vector<SectionAssembler*> routes(8192);
+  routes[0] = assemblers[0];
+
+  uint64_t packets = 0;
+  uint64_t psi_packets = 0;
+  double start = test_seconds();
+  for (int repeat = 0; repeat < BENCH_REPEAT; repeat++)
+  {
+    for (size_t offset = 0; offset < mux.size(); offset += TS_PACKET_SIZE)
+    {
+      uint8_t* pkt = &mux[offset];
+      SectionAssembler* assembler = routes[GET_PID(pkt)];
+      packets++;
+      if (!assembler) continue;
+      psi_packets++;
+      assembler->push(pkt);
+    }
+    for (auto& assembler : assemblers)
+    {
+      routes[assembler.first] = assembler.second;
+      // Each pass decodes the tables from scratch.
+      assembler.second->reset();
+    }
+  }
+  double elapsed = test_seconds() - start;
+  printf("%llu packets, %llu on PSI PIDs, %llu tables in %.3fs\n",
+      (unsigned long long)packets, (unsigned long long)psi_packets, (unsigned long long)tables, elapsed);
+  printf("%.1f M packets/s overall, %.2f M PSI packets/s\n", packets / elapsed / 1e6, psi_packets / elapsed / 1e6);
+  for (auto& assembler : assemblers)
+  {
+    delete assembler.second;
+  }
+  return 0;
+}
@@ -0,0 +1,115 @@
+#include <algorithm>
+
+#include "test.hpp"
+#include "ingest.hpp"
+
+#define BENCH_PACKETS 200000
+#define BENCH_SCAN_SIZE (1 << 20)
+#define BENCH_REPEAT 20
+#define BENCH_CORRUPT_EVERY 5000 // Packets between runs of junk bytes
+#define OLD_READ_SIZE (20 * TS_PACKET_SIZE) // What read_card used to read at a time
+
+/**
+ * The scalar loop find_sync() falls back to, to compare against.
+ */
+static size_t find_sync_scalar(const uint8_t* buf, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    if (buf[i] == TS_SYNC_BYTE && (i + TS_PACKET_SIZE >= len || buf[i + TS_PACKET_SIZE] == TS_SYNC_BYTE))
+    {
+      return i;
+    }
+  }
+  return len;
+}
+
+static void bench_scan(const char* name, const std::vector<uint8_t>& buf)
+{
+  size_t found = find_sync(buf.data(), buf.size());
+
+  double start = test_seconds();
+  for (int i = 0; i < BENCH_REPEAT; i++)
+  {
+    CHECK_EQ(find_sync(buf.data(), buf.size()), found);
+  }
+  double simd = test_seconds() - start;
+  start = test_seconds();
+  for (int i = 0; i < BENCH_REPEAT; i++)
+  {
+    CHECK_EQ(find_sync_scalar(buf.data(), buf.size()), found);
+  }
+  double scalar = test_seconds() - start;
+  double bytes = (double)found * BENCH_REPEAT;
+  printf("find_sync, %s: %.2f GB/s, scalar %.2f GB/s\n", name, bytes / simd / 1e9, bytes / scalar / 1e9);
+}
+
+static void bench_ingest(const char* name, const std::vector<uint8_t>& data, size_t max_read, uint64_t expected)
+{
+  TestSource source(data, max_read);
+  TsIngest ingest(source);
+  uint64_t packets = 0;
+  uint64_t batches = 0;
+  double start = test_seconds();
+  while (!ingest.eof())
+  {
+    TsBatch batch;
+    if (!ingest.next_batch(batch)) continue;
+    packets += batch.count;
+    batches++;
+    ingest.release(batch);
+  }
+  double elapsed = test_seconds() - start;
+  CHECK_EQ(packets, expected);
+  printf("TsIngest, %s: %.1f M packets/s in %llu reads\n", name, packets / elapsed / 1e6, (unsigned long long)batches);
+}
+
+/**
+ * The resynchronising scan for sync bytes, on its own and as part of
+ * TsIngest with corrupt data. Takes an optional recorded multiplex, or
+ * makes one up.
+ */
+int main(int argc, char** argv)
+{
+  TestRandom random;
+
+  // Nothing to find until the end, so every byte is looked at.
+  std::vector<uint8_t> junk(BENCH_SCAN_SIZE);
+  for (auto& byte : junk)
+  {
+    byte = random.below(255);
+    if (byte == TS_SYNC_BYTE) byte++;
+  }
+  junk[junk.size() - TS_PACKET_SIZE - 1] = TS_SYNC_BYTE;
+  junk[junk.size() - 1] = TS_SYNC_BYTE;
+  bench_scan("no sync", junk);
+
+  // Stray sync bytes that aren't followed by another a packet later.
+  std::vector<uint8_t> stray(junk);
+  for (size_t i = 0; i < stray.size() - 2 * TS_PACKET_SIZE; i += 1 + random.below(512))
+  {
+    stray[i] = TS_SYNC_BYTE;
+    if (stray[i + TS_PACKET_SIZE] == TS_SYNC_BYTE) stray[i + TS_PACKET_SIZE]++;
+  }
+  bench_scan("stray sync bytes", stray);
+
+  std::vector<uint8_t> mux = argc > 1 ? test_load(argv[1]) : test_mux(12, BENCH_PACKETS);
+  CHECK(!mux.empty());
+  uint64_t packets = mux.size() / TS_PACKET_SIZE;
+  bench_ingest("clean, whole chunks", mux, INGEST_CHUNK_SIZE, packets);
+  bench_ingest("clean, old read size", mux, OLD_READ_SIZE, packets);
+
+  // Junk between packets every so often, which has to be skipped.
+  std::vector<uint8_t> corrupt;
+  for (uint64_t i = 0; i < packets; i++)
+  {
+    if (i && i % BENCH_CORRUPT_EVERY == 0)
+    {
+      corrupt.insert(corrupt.end(), 1 + random.below(TS_PACKET_SIZE - 1), 0x00);
+    }
+    corrupt.insert(corrupt.end(), mux.begin() + i * TS_PACKET_SIZE, mux.begin() + (i + 1) * TS_PACKET_SIZE);
+  }
+  // The packet before each run of junk is lost with it, as it can't be told from a truncated one.
+  bench_ingest("corrupt, whole chunks", corrupt, INGEST_CHUNK_SIZE, packets - (packets - 1) / BENCH_CORRUPT_EVERY);
+  return 0;
+}
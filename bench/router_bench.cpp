@@ -0,0 +1,170 @@
+#include <map>
+#include <unordered_map>
+
+#include "test.hpp"
+#include "util.hpp"
+#include "channel.hpp"
+#include "pid_router.hpp"
+#include "psi_parser.hpp"
+
+#define BENCH_PACKETS 200000
+#define BENCH_REPEAT 20
+#define BENCH_BATCH 700 // Packets in a chunk of the ingest ring
+
+static const uint16_t si_pids[] = { 0, 1, 20 };
+
+/**
+ * A channel for each program in the PAT, once its PMT has been read.
+ */
+static std::vector<Channel*> find_channels(std::vector<uint8_t>& mux)
+{
+  std::map<uint16_t, Channel*> by_pmt;
+  std::vector<Channel*> channels;
+  static PsiPat pat;
+  SectionAssembler pat_sections([&](const uint8_t* section, size_t len)
+  {
+    if (!psi_parse_pat(section, len, pat)) return;
+    for (unsigned i = 0; i < pat.count; i++)
+    {
+      const PsiProgram& program = pat.programs[i];
+      if (!program.number || by_pmt.count(program.pmt_pid)) continue;
+      Channel* chan = new Channel(program.number, program.pmt_pid, "bench");
+      chan->startPmtScan();
+      by_pmt[program.pmt_pid] = chan;
+      channels.push_back(chan);
+    }
+  });
+  for (size_t offset = 0; offset < mux.size(); offset += TS_PACKET_SIZE)
+  {
+    uint8_t* pkt = &mux[offset];
+    uint16_t pid = GET_PID(pkt);
+    if (pid == 0) pat_sections.push(pkt);
+    auto chan = by_pmt.find(pid);
+    if (chan != by_pmt.end()) chan->second->readPmt(pkt);
+  }
+  return channels;
+}
+
+/**
+ * Routing packets to channels with the flat PidRouter table, against the
+ * map from PID to channel it replaced, which also looped over every
+ * channel for the SI PIDs. The PIDs are decoded first, so that only the
+ * routing is timed. Takes an optional recorded multiplex, or makes
+ * one up.
+ */
+int main(int argc, char** argv)
+{
+  std::vector<uint8_t> mux = argc > 1 ? test_load(argv[1]) : test_mux(12, BENCH_PACKETS);
+  CHECK(!mux.empty());
+  std::vector<Channel*> channels = find_channels(mux);
+  CHECK(!channels.empty());
+  size_t packets = mux.size() / TS_PACKET_SIZE;
+  std::vector<std::vector<PacketRef> > refs(channels.size());
+  // Decoded beforehand, as parse_headers() does, so only the routing is timed.
+  std::vector<uint16_t> pids(packets);
+  for (size_t i = 0; i < packets; i++)
+  {
+    uint8_t* pkt = &mux[i * TS_PACKET_SIZE];
+    pids[i] = GET_PID(pkt);
+  }
+
+  std::unordered_map<uint16_t, size_t> map;
+  for (size_t slot = 0; slot < channels.size(); slot++)
+  {
+    for (int pid : channels[slot]->pids())
+    {
+      map[pid] = slot;
+    }
+  }
+  uint64_t map_routed = 0;
+  double start = test_seconds();
+  for (int repeat = 0; repeat < BENCH_REPEAT; repeat++)
+  {
+    for (size_t batch = 0; batch < packets; batch += BENCH_BATCH)
+    {
+      size_t end = std::min<size_t>(batch + BENCH_BATCH, packets);
+      for (size_t i = batch; i < end; i++)
+      {
+        uint8_t* pkt = &mux[i * TS_PACKET_SIZE];
+        uint16_t pid = pids[i];
+        if (pid == si_pids[0] || pid == si_pids[1] || pid == si_pids[2])
+        {
+          for (size_t slot = 0; slot < channels.size(); slot++)
+          {
+            refs[slot].push_back({ pkt, pid });
+          }
+          continue;
+        }
+        if (pid == 0x1FFF) continue;
+        auto found = map.find(pid);
+        if (found != map.end()) refs[found->second].push_back({ pkt, pid });
+      }
+      for (auto& slot : refs)
+      {
+        map_routed += slot.size();
+        slot.clear();
+      }
+    }
+  }
+  double map_time = test_seconds() - start;
+
+  PidRouter router;
+  router.rebuild(channels, si_pids, sizeof(si_pids) / sizeof(si_pids[0]));
+  const PidRoute* routes = router.table();
+  uint64_t table_routed = 0;
+  start = test_seconds();
+  for (int repeat = 0; repeat < BENCH_REPEAT; repeat++)
+  {
+    for (size_t batch = 0; batch < packets; batch += BENCH_BATCH)
+    {
+      size_t end = std::min<size_t>(batch + BENCH_BATCH, packets);
+      for (size_t i = batch; i < end; i++)
+      {
+        uint8_t* pkt = &mux[i * TS_PACKET_SIZE];
+        uint16_t pid = pids[i];
+        const PidRoute& route = routes[pid];
+        if (route.count == ROUTE_ALL)
+        {
+          for (size_t slot = 0; slot < channels.size(); slot++)
+          {
+            refs[slot].push_back({ pkt, pid });
+          }
+        }
+        else if (route.count == ROUTE_OVERFLOW)
+        {
+          for (uint16_t slot : router.overflow(route))
+          {
+            refs[slot].push_back({ pkt, pid });
+          }
+        }
+        else
+        {
+          for (unsigned j = 0; j < route.count; j++)
+          {
+            refs[route.slots[j]].push_back({ pkt, pid });
+          }
+        }
+      }
+      for (auto& slot : refs)
+      {
+        table_routed += slot.size();
+        slot.clear();
+      }
+    }
+  }
+  double table_time = test_seconds() - start;
+
+  uint64_t total = (uint64_t)packets * BENCH_REPEAT;
+  printf("%zu channels, %zu packets\n", channels.size(), packets);
+  printf("Map:   %.1f M packets/s, %.2f ns a packet, %llu routed\n",
+      total / map_time / 1e6, map_time * 1e9 / total, (unsigned long long)map_routed);
+  printf("Table: %.1f M packets/s, %.2f ns a packet, %llu routed\n",
+      total / table_time / 1e6, table_time * 1e9 / total, (unsigned long long)table_routed);
+  // The map can only send a PID to one channel, the table to all that share it.
+  CHECK(table_routed >= map_routed);
+  for (auto chan : channels)
+  {
+    delete chan;
+  }
+  return 0;
+}
@@ -6,15 +6,29 @@
 #include <string>
 #include <vector>
 #include <deque>
+#include <istream>
+#include <ostream>
+#include <atomic>
+#include <mutex>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <boost/format.hpp>
 
-#include "dvbpsi.hpp"
 #include "log.hpp"
 #include "dvb_hls.hpp"
+#include "stats.hpp"
+#include "psi_parser.hpp"
+#include "es_scanner.hpp"
+#include "ts_header.hpp"
+#include "pcr_restamper.hpp"
+#include "uring.hpp"
 
-#define CHANNEL_BUF_SIZE (22 * TS_PACKET_SIZE) // Approx 4kB
+#define CHANNEL_BUF_SIZE (348 * TS_PACKET_SIZE) // Approx 64kB
+#define CHANNEL_WRITE_MIN (87 * TS_PACKET_SIZE) // Approx 16kB
+#define CHANNEL_WRITE_INTERVAL 20 // ms of output per write at the measured bitrate
+#define CHANNEL_IDLE_TIMEOUT 60 // seconds without a request before an on demand channel sleeps
+#define CHANNEL_SI_INTERVAL 1000 // ms between copies of the service's SDT and EIT, the PAT and PMT go with every PAT
 
 class WriteException : public std::runtime_error
 {
@@ -33,38 +47,146 @@ public:
 
 class Segment;
 
+/**
+ * A packet routed to a channel, with its header as parse_headers()
+ * decoded it.
+ */
+struct PacketRef
+{
+  uint8_t* pkt;
+  uint16_t pid;
+  uint16_t flags; // TS_FLAG_*
+  uint8_t payload; // Offset in the packet
+};
+
+/**
+ * The output of one service. A channel may be written from any thread,
+ * but only from one at a time.
+ */
+
 class Channel
 {
-  static timespec m_curr_time;
-  timespec m_time;
+  /**
+   * What the writer takes from the PSI and SI, see handPsi().
+   */
+  struct Psi
+  {
+    uint16_t vpid;
+    int vcodec;
+    uint16_t pcr_pid;
+    uint16_t clock_pid; // The video, or else the first stream.
+    std::vector<uint8_t> pmt; // Packets, as are the SDT and EIT.
+    std::vector<uint8_t> sdt;
+    std::vector<uint8_t> eit;
+  };
+
+  uint64_t m_time; // When the segment started, by _stream_time().
+  timespec m_now;
   uint16_t m_id;
+  uint16_t m_pmt_pid;
   std::string m_name;
   std::string m_out_dir;
   int m_output_fd;
-  uint16_t m_buffer_len;
+  size_t m_buffer_len;
+  std::vector<iovec> m_iov;
+  size_t m_pending;
+  uint64_t m_position; // Bytes queued since the output was last dropped.
+  size_t m_write_threshold;
+  timespec m_rate_time;
+  uint64_t m_rate_bytes;
   std::deque<Segment> m_segments;
   uint32_t m_sequence_number;
+  uint32_t m_discontinuity_sequence;
+  bool m_discontinuity;
+  bool m_keep_output;
   std::vector<int> m_pids;
+  std::vector<int> m_essential_pids;
+  bool m_have_pmt;
+  uint8_t m_pmt_version;
+  bool m_ca; // The PMT names a conditional access system.
+  std::atomic<bool> m_ready; // The streams are known.
+  std::atomic<bool> m_trimmed;
+  std::atomic<bool> m_parked;
+  bool m_scrambled;
+  unsigned m_scrambled_run;
   uint8_t *m_buf;
-  dvbpsi_t *m_dvbpsi_pmt;
-  bool m_enabled;
-  uint8_t m_pat[TS_PACKET_SIZE];
+  SectionAssembler m_pmt_sections;
+  bool m_scanning_pmt;
+  std::atomic<bool> m_enabled;
+  std::atomic<bool> m_active;
+  timespec m_activated;
+  std::mutex m_psi_lock; // Guards the PSI on its way to the writer.
+  Psi m_next_psi; // As decoded, until handed to the writer.
+  std::atomic<bool> m_psi_due;
+  std::deque<Psi> m_handed_psi;
+  std::vector<uint8_t> m_pat; // The writer's from here.
+  std::vector<uint8_t> m_pmt;
+  std::vector<uint8_t> m_sdt;
+  std::vector<uint8_t> m_eit;
+  uint8_t m_pat_cc;
+  uint8_t m_pmt_cc;
+  uint8_t m_sdt_cc;
+  uint8_t m_eit_cc;
+  std::vector<uint8_t> m_pmt_section; // To cache.
+  uint64_t m_si_time;
   uint16_t m_vpid;
+  int m_vcodec;
+  uint16_t m_pcr_pid;
+  uint16_t m_clock_pid;
+  StreamClock m_clock;
+  bool m_clock_jump;
+  EsScanner m_es;
+  std::vector<uint8_t> m_held; // From a video PES start until its first picture is seen.
+  std::vector<PacketRef> m_held_refs; // Their headers.
+  uint64_t m_rap_time; // Of the last random access point.
+  uint64_t m_gop; // ns between the last two.
+  PcrRestamper* m_restamper;
+  UringWriter* m_uring; // NULL to write with writev().
+  bool m_index_due; // Once the last segment is complete.
+  std::string m_labels;
+  Stat m_writes;
+  Stat m_write_bytes;
+  Stat m_threshold_stat;
+  Stat m_activation_latency;
+  Stat m_first_segment;
+  std::vector<uint32_t> m_write_times; // us for each call to writePackets() this second.
+  Stat m_write_p99;
 
-  static void _process_pmt(void* self, dvbpsi_pmt_t* pmt);
+  void _process_pmt(const uint8_t* section, size_t len);
+  void _take_psi();
+  void _write_packet(const PacketRef& ref);
+  void _output_packet(const PacketRef& ref, bool random_access);
+  int _random_access(const PacketRef& ref);
+  void _hold(const PacketRef& ref);
+  void _release(bool random_access);
+  void _settle();
+  void _update_clock(const PacketRef& ref);
+  uint64_t _stream_time() const;
+  void _queue(uint8_t* pkt);
+  void _queue_psi();
+  void _queue_restamped(const uint8_t* pkt);
+  void _set_pmt(const std::vector<uint8_t>& section);
+  void _queue_copies(const std::vector<uint8_t>& packets, uint8_t& cc);
   void _flush_channel();
+  void _compact();
+  void _update_threshold();
+  void _record_write_time(const timespec& start);
   void _create_new_segment();
   void _write_index_file();
-  bool _check_new_segment_required();
+  void _retire_segment(const Segment& segment);
+  bool _segment_due(uint64_t length) const;
   void _del_output();
-  void _create_pat(uint16_t pmt_pid);
-  uint8_t _has_dts(uint8_t* buf);
+  void _drop_output();
 
 public:
   ~Channel();
 
-  Channel(uint16_t id);
+  Channel(uint16_t id, uint16_t pmt_pid, const std::string& multiplex);
 
+  /**
+   * Name the channel from the SDT, moving any output written so far
+   * under the service id. Not while the channel is being written.
+   */
   void setName(const std::string& name);
 
   const std::string& getName() const
@@ -79,22 +201,180 @@ public:
     return m_enabled;
   }
 
+  /**
+   * Start writing segments again, timing how long until the first
+   * playlist. Channels are active until deactivated.
+   */
+  void activate(const timespec& now);
+
+  /**
+   * Stop writing segments and remove them, leaving an empty playlist.
+   * The channel must not be written to at the same time.
+   */
+  void deactivate();
+
+  bool active() const
+  {
+    return m_active;
+  }
+
+  /**
+   * Stop writing a service that can't be played as it is scrambled, and
+   * remove its output. Unlike deactivate() no playlist is left, so it
+   * drops out of the channel index. The channel must not be written to
+   * at the same time.
+   */
+  void park();
+
+  /**
+   * Write the channel again once it is free to air, if it is active.
+   */
+  void unpark(const timespec& now);
+
+  bool parked() const
+  {
+    return m_parked;
+  }
+
+  /**
+   * Record whether most of the channel's packets were scrambled over the
+   * last interval, returns how many intervals in a row have been alike.
+   */
+  unsigned scrambling(bool scrambled);
+
+  /**
+   * Whether the PMT has CA descriptors, for the service or its streams.
+   */
+  bool ca() const
+  {
+    return m_ca;
+  }
+
+  /**
+   * True while the channel carries on from segments left by the last run.
+   */
+  bool resuming() const
+  {
+    return m_discontinuity;
+  }
+
+  /**
+   * Whether the channel wants packets, once its PMT is known.
+   */
+  bool streaming() const
+  {
+    return m_enabled && m_active && m_ready && !m_parked;
+  }
+
   uint16_t id() const
   {
     return m_id;
   }
-  std::string index_file() const;
 
-  int startPmtScan(dvbpsi_message_cb callback);
+  uint16_t pmt_pid() const
+  {
+    return m_pmt_pid;
+  }
 
-  std::vector<int>* readPmt(uint8_t* buf);
+  /**
+   * Version of the PMT the streams were last decoded from.
+   */
+  uint8_t pmt_version() const
+  {
+    return m_pmt_version;
+  }
+
+  /**
+   * PCR and elementary stream PIDs, empty until the PMT is decoded.
+   * While trimmed, only the PCR, video, first audio and subtitles.
+   */
+  const std::vector<int>& pids() const
+  {
+    return m_trimmed ? m_essential_pids : m_pids;
+  }
+
+  /**
+   * Leave teletext, data and secondary audio out of pids(), to shed load.
+   * Takes effect when the routes are rebuilt. The EIT is left out at once.
+   */
+  void trim(bool trimmed)
+  {
+    m_trimmed = trimmed;
+  }
+
+  bool trimmed() const
+  {
+    return m_trimmed;
+  }
 
-  void writePacket(uint8_t* buf, uint16_t pid);
+  /**
+   * Rewrite the PCRs to suit the channel's stream on its own, see
+   * PcrRestamper. Not while the channel is being written.
+   */
+  void restamp_pcr(bool enable);
 
-  static void set_curr_time()
+  /**
+   * Write the segments through an io_uring, see UringWriter, rather than
+   * blocking on each write. Throws a DvbException if it can't be used.
+   * Not while the channel is being written.
+   */
+  void use_io_uring(bool enable);
+
+  std::string index_file() const;
+
+  /**
+   * Leave the segments and playlist behind when the channel is destroyed,
+   * for the next run to carry on from.
+   */
+  void keep_output()
   {
-    clock_gettime(CLOCK_MONOTONIC, &m_curr_time);
+    m_keep_output = 1;
   }
+
+  /**
+   * Write the service and its streams, and with keep_output() the
+   * segments and playlist sequence, as a block of lines ended by a blank one.
+   */
+  void save_state(std::ostream& out) const;
+
+  /**
+   * Create a channel from a block written by save_state(), returns NULL
+   * at the end of the input. Its playlist carries on from the segments that
+   * are still on disk, relative to the working directory.
+   */
+  static Channel* load_state(std::istream& in, const std::string& multiplex);
+
+  /**
+   * Decode the PMT, again if it has changed. The channel carries on
+   * with the streams it has until readPmt() returns them.
+   */
+  void startPmtScan();
+
+  /**
+   * Replace the SDT or EIT packets, by PID, written after the PAT every
+   * CHANNEL_SI_INTERVAL, from any thread. See SiProcessor and handPsi().
+   */
+  void set_si(uint16_t pid, const std::vector<uint8_t>& packets);
+
+  std::vector<int>* readPmt(uint8_t* buf);
+
+  /**
+   * Whether the PMT, SDT or EIT has changed since the last call. If so
+   * the change is handed to the writer, to take effect at a PacketRef
+   * with a NULL pkt which must lead the next refs given to writePackets().
+   * So it lands on the same packet however far behind the writer is.
+   */
+  bool handPsi();
+
+  /**
+   * Write the packets routed to this channel from one batch, stamped
+   * with the time the batch was taken. Segments are timed by the
+   * timestamps in the stream rather than by when it arrives. The packets are written straight
+   * from the batch, or copied into the channel buffer when there are too
+   * few to be worth a write yet, so refs only need to stay valid until
+   * this returns.
+   */
+  void writePackets(const PacketRef* refs, size_t count, const timespec& now);
 };
 
 #endif
@@ -0,0 +1,49 @@
+#ifndef CONTROL_SOCKET_H__
+#define CONTROL_SOCKET_H__
+
+#include <string>
+#include <map>
+#include <functional>
+
+#include "dvb_hls.hpp"
+
+#define CONTROL_SOCKET OUT_DIR "control"
+#define CONTROL_MAX_REQUEST 256
+
+/**
+ * A unix socket for requests from the web interface and other clients.
+ * Each connection sends one line, a command and an optional argument
+ * such as "watch BBC ONE", and gets one line back before it is closed.
+ */
+class ControlSocket
+{
+public:
+  typedef std::function<std::string(const std::string& arg)> Handler;
+
+private:
+  std::string m_path;
+  int m_fd;
+  std::map<std::string, Handler> m_handlers;
+
+  std::string _handle(const std::string& request);
+
+public:
+  ControlSocket(const std::string& path = CONTROL_SOCKET);
+
+  /**
+   * Answer requests for command with handler.
+   */
+  void on(const std::string& command, Handler handler);
+
+  void open_socket();
+
+  /**
+   * Wait up to timeout ms for a request and answer it, returns false if
+   * none arrived.
+   */
+  bool serve(int timeout);
+
+  ~ControlSocket();
+};
+
+#endif /* CONTROL_SOCKET_H__ */
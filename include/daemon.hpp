@@ -1,16 +1,20 @@
 #ifndef DAEMON_H__
 #define DAEMON_H__
 
+#include <functional>
+
 class Log;
-class Segmenter;
 
 class Daemon
 {
   Log m_log;
-  Segmenter& m_segmenter;
+  std::function<void()> m_run;
 
 public:
-  Daemon(Segmenter& segmenter);
+  /**
+   * run is called once the process has been daemonised.
+   */
+  Daemon(std::function<void()> run);
   void start();
   static void stop();
 };
@@ -4,8 +4,11 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string>
+#include <vector>
+
+#include "ts_source.hpp"
+#include "stats.hpp"
 
-#define MAX_REQUIRED_PID 20
 #define BASE_PATH "/dev/dvb/adapter%u/"
 #define FRONTEND_PATH BASE_PATH "frontend0"
 #define TUNING_PATH "/usr/share/dvb/dvb-t/"
@@ -14,8 +17,14 @@
 #define NUM_PIDS 8192
 
 
-class DvbDevice
+class DvbDevice : public TsSource
 {
+  struct MappedBuffer
+  {
+    uint8_t* data;
+    size_t length;
+  };
+
   std::string m_multiplex;
   std::string m_transmitter;
   uint32_t m_frequency;
@@ -31,9 +40,24 @@ class DvbDevice
   int m_demux;
   int m_frontend;
   uint16_t m_adapter_id;
+  bool m_use_mmap;
+  std::vector<MappedBuffer> m_buffers;
+  uint32_t m_buffer_count;
+  std::set<uint16_t> m_filter_pids;
+  size_t m_filter_limit; // PIDs the demux couldn't filter, 0 until it runs out.
+  unsigned m_buffer_size;
+  time_t m_overflow_window;
+  unsigned m_window_overflows;
+  Stat m_overflows;
+  Stat m_buffer_stat;
 
   int _poll_status();
   int _set_ts_filter();
+  void _set_pes_filter(uint16_t pid, bool start);
+  bool _map_buffers();
+  void _unmap_buffers();
+  bool _wait_readable();
+  void _handle_overflow(unsigned lost);
   int _read_multiplex();
   int _get_status();
 
@@ -41,8 +65,28 @@ public:
   DvbDevice(std::string multiplex, std::string transmitter, uint16_t adapter);
   int open_device();
   int tune();
-  int read_card(uint8_t *buf, size_t size);
-  const std::string& get_multiplex() const
+  ssize_t read_bytes(uint8_t *buf, size_t size) override;
+  bool mapped() const override
+  {
+    return !m_buffers.empty();
+  }
+  uint8_t* acquire_buffer(size_t& len, int& index) override;
+  void release_buffer(int index) override;
+  bool set_pid_filter(const std::set<uint16_t>& pids) override;
+  uint64_t overflows() const override
+  {
+    return m_overflows.get();
+  }
+
+  /**
+   * Dequeue packets from memory mapped demux buffers rather than
+   * copying them with read(), must be set before tuning.
+   */
+  void use_mmap(bool enable)
+  {
+    m_use_mmap = enable;
+  }
+  const std::string& get_multiplex() const override
   {
     return m_multiplex;
   }
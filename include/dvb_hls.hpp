@@ -2,6 +2,7 @@
 #define DVB_HLS__
 
 #define OUT_DIR "/run/shm/dvb_hls/"
+#define CHANNEL_INDEX "channels.csv" // In OUT_DIR, lists name,playlist for each channel
 #define TS_PACKET_SIZE 188
 #define TS_HEADER_SIZE 4
 
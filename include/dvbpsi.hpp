@@ -1,15 +0,0 @@
-/**
- * Includes for dvbpsi library
- */
-#ifndef DVBPSI_HPP_
-#define DVBPSI_HPP_
-
-#include <dvbpsi/dvbpsi.h>
-#include <dvbpsi/pat.h>
-#include <dvbpsi/descriptor.h>
-#include <dvbpsi/demux.h>
-#include <dvbpsi/sdt.h>
-#include <dvbpsi/pmt.h>
-
-
-#endif /* DVBPSI_HPP_ */
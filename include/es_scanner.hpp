@@ -0,0 +1,127 @@
+#ifndef ES_SCANNER_H__
+#define ES_SCANNER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ES_CODEC_NONE 0
+#define ES_CODEC_MPEG2 1 // And MPEG-1
+#define ES_CODEC_H264 2
+#define ES_CODEC_HEVC 3
+
+#define ES_MORE 0 // Nothing decided yet, scan the next packet of the PES.
+#define ES_RANDOM_ACCESS 1
+#define ES_NOT_RANDOM_ACCESS 2
+
+#define ES_CLOCK 90000ull // PTS and DTS ticks a second
+#define ES_CLOCK_WRAP (1ull << 33)
+// Streams carry a PTS at least every 0.7s, a longer step is a discontinuity.
+#define ES_CLOCK_MAX_STEP ES_CLOCK
+
+/**
+ * The video codec of a PMT stream type, ES_CODEC_NONE for anything else.
+ */
+int es_video_codec(uint8_t stream_type);
+
+/**
+ * The DTS of a PES, or its PTS when it has no DTS, from the packet it
+ * starts in, with its flags and payload offset from parse_headers(). False
+ * if the PES has neither.
+ */
+bool es_timestamp(const uint8_t* pkt, uint16_t flags, uint8_t payload, uint64_t& timestamp);
+
+/**
+ * Tells whether a video PES starts at a random access point, from the
+ * start codes of its first picture: an MPEG-2 I picture, an H.264 IDR or
+ * an I slice after a sequence parameter set, or an HEVC IRAP picture.
+ *
+ * Only the packets up to the first picture are looked at, as they pass
+ * on their way to the output, and nothing is copied. Start codes split
+ * between packets are followed.
+ */
+class EsScanner
+{
+  int m_codec;
+  uint32_t m_window; // The last bytes seen, for start codes.
+  uint8_t m_header[3]; // The bytes after a start code.
+  size_t m_header_len;
+  size_t m_header_wanted;
+  bool m_parameter_sets;
+  int m_result;
+
+  int _start_code(uint8_t code);
+  int _header();
+
+public:
+  EsScanner();
+
+  /**
+   * Start on a new PES, a packet with the payload unit start indicator.
+   */
+  void start(int codec);
+
+  /**
+   * Scan a packet of the PES, with its flags and payload offset from
+   * parse_headers(). Returns ES_MORE until it can tell.
+   */
+  int scan(const uint8_t* pkt, uint16_t flags, uint8_t payload);
+
+  /**
+   * Whether a sequence header or parameter set has been seen, which
+   * broadcasters send at random access points.
+   */
+  bool parameter_sets() const
+  {
+    return m_parameter_sets;
+  }
+};
+
+/**
+ * A stream's own clock, in ES_CLOCK ticks, from the timestamps of its PESs.
+ * The 33 bit timestamps are unwrapped, and a step back or of more than
+ * ES_CLOCK_MAX_STEP is a discontinuity: the clock carries on by the last
+ * good step instead, so that it always runs forwards with the media.
+ */
+class StreamClock
+{
+  uint64_t m_time;
+  uint64_t m_last; // The last timestamp, as it was.
+  uint64_t m_step;
+  bool m_started;
+  bool m_jump;
+
+public:
+  StreamClock();
+
+  /**
+   * Move on to the timestamp of the next PES, returns false if the
+   * clock jumped to get there.
+   */
+  bool update(uint64_t timestamp);
+
+  /**
+   * Treat the next timestamp as a jump, e.g. after a discontinuity
+   * indicator.
+   */
+  void discontinuity()
+  {
+    m_jump = 1;
+  }
+
+  /**
+   * Start again from the next timestamp.
+   */
+  void reset();
+
+  bool started() const
+  {
+    return m_started;
+  }
+
+  uint64_t time() const
+  {
+    return m_time;
+  }
+};
+
+#endif /* ES_SCANNER_H__ */
@@ -0,0 +1,119 @@
+#ifndef INGEST_H__
+#define INGEST_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include "dvb_hls.hpp"
+#include "stats.hpp"
+
+#define INGEST_CHUNK_SIZE (700 * TS_PACKET_SIZE) // Approx 128kB
+#define INGEST_CHUNKS 8
+#define TS_SYNC_BYTE 0x47
+
+class TsSource;
+
+/**
+ * A run of contiguous, aligned TS packets in the ingest ring.
+ */
+struct TsBatch
+{
+  uint8_t* packets;
+  size_t count;
+  unsigned chunk;
+  int buffer; // Index of the source's buffer, or -1 if in the ring.
+};
+
+/**
+ * Reads large chunks from a TsSource into a ring and aligns them on
+ * packet boundaries in place, resynchronising after partial or
+ * corrupt reads.
+ *
+ * The ring is a single producer, single consumer queue of batches.
+ * The producer either runs inline in next_batch() or on a dedicated
+ * ingest thread that keeps the source drained while the consumer is
+ * busy writing segments.
+ */
+class TsIngest
+{
+  TsSource& m_source;
+  uint8_t* m_ring;
+  TsBatch m_batches[INGEST_CHUNKS];
+  std::atomic<unsigned> m_written;
+  std::atomic<unsigned> m_released;
+  unsigned m_read;
+  uint8_t m_carry[TS_PACKET_SIZE];
+  size_t m_carry_len;
+  bool m_synced;
+  uint64_t m_packets;
+  Stat m_resyncs;
+  Stat m_skipped;
+  Stat m_depth;
+  Stat m_high_water;
+  Stat m_full;
+  std::thread m_thread;
+  std::atomic<bool> m_stop;
+  std::atomic<bool> m_finished;
+  std::exception_ptr m_error; // Set along with m_finished, under m_wait_lock.
+  std::mutex m_wait_lock;
+  std::condition_variable m_ready;
+
+  size_t _align(uint8_t* begin, uint8_t* end);
+  bool _fill(TsBatch& batch);
+  bool _fill_mapped(TsBatch& batch);
+  void _produce();
+
+public:
+  TsIngest(TsSource& source);
+
+  /**
+   * Move reading from the source onto its own thread, optionally
+   * pinned to cpu (if >= 0) with SCHED_FIFO priority (if > 0).
+   */
+  void start_thread(int cpu, int priority);
+
+  /**
+   * Take the next batch of packets, returns false if none arrived
+   * because the read was interrupted or timed out.
+   * Batches must be released in the order they were taken.
+   */
+  bool next_batch(TsBatch& batch);
+
+  void release(const TsBatch& batch);
+
+  /**
+   * Batches read but not yet released, out of INGEST_CHUNKS.
+   */
+  unsigned depth() const
+  {
+    return m_written.load(std::memory_order_relaxed) - m_released.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Times the ingest thread found the ring full and had to wait.
+   */
+  uint64_t stalls() const
+  {
+    return m_full.get();
+  }
+
+  /**
+   * True once the source has no more data and every batch has been taken.
+   */
+  bool eof() const;
+
+  ~TsIngest();
+};
+
+/**
+ * Find the offset of the first sync byte in buf that is followed by
+ * another one a packet later, or len if there isn't one.
+ */
+size_t find_sync(const uint8_t* buf, size_t len);
+
+#endif /* INGEST_H__ */
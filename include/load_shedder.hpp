@@ -0,0 +1,85 @@
+#ifndef LOAD_SHEDDER_H__
+#define LOAD_SHEDDER_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+#include "stats.hpp"
+
+#define LOAD_INTERVAL 1 // seconds between load checks
+#define LOAD_BUSY_HIGH 90 // percent of the time spent dispatching and writing
+#define LOAD_BUSY_LOW 60
+#define LOAD_SETTLE 3 // seconds for a step to take effect before shedding more
+#define LOAD_RECOVER 30 // seconds of light load before undoing a step
+
+/**
+ * Decides when a multiplex is falling behind and when it has recovered.
+ *
+ * The segmenter is overloaded when the demux buffer overflows, the
+ * ingest ring fills up or it spends most of its time dispatching and
+ * writing rather than waiting for packets. Each check then asks for one
+ * more step of shedding, and once the load has been light for
+ * LOAD_RECOVER seconds, for one step to be undone. The level counts the
+ * steps the segmenter has taken.
+ */
+class LoadShedder
+{
+public:
+  enum Action
+  {
+    LOAD_HOLD,
+    LOAD_SHED,
+    LOAD_RECOVER_STEP
+  };
+
+private:
+  timespec m_checked;
+  uint64_t m_busy_ns;
+  unsigned m_max_depth;
+  uint64_t m_overflows;
+  uint64_t m_stalls;
+  time_t m_changed;
+  time_t m_calm_since;
+  unsigned m_level;
+  std::string m_reason;
+  Stat m_level_stat;
+  Stat m_busy_stat;
+  Stat m_sheds;
+  Stat m_recoveries;
+
+public:
+  LoadShedder(const std::string& multiplex);
+
+  /**
+   * Account for a batch that was taken at start and has just been
+   * dispatched, with depth batches left in the ingest ring.
+   */
+  void batch(const timespec& start, unsigned depth);
+
+  /**
+   * Check the load once every LOAD_INTERVAL, from the running totals of
+   * source overflows and ingest ring stalls.
+   */
+  Action check(const timespec& now, uint64_t overflows, uint64_t stalls);
+
+  /**
+   * Record that the segmenter took a step, +1 to shed or -1 to recover.
+   */
+  void step(const timespec& now, int delta);
+
+  /**
+   * Why the last check found the multiplex overloaded.
+   */
+  const std::string& reason() const
+  {
+    return m_reason;
+  }
+
+  unsigned level() const
+  {
+    return m_level;
+  }
+};
+
+#endif /* LOAD_SHEDDER_H__ */
@@ -0,0 +1,93 @@
+#ifndef PCR_RESTAMPER_H__
+#define PCR_RESTAMPER_H__
+
+#include <stdint.h>
+#include <string>
+
+#include "stats.hpp"
+#include "util.hpp"
+
+#define PCR_SMOOTHING 16 // PCR intervals the bitrate is averaged over
+#define PCR_CATCH_UP (PCR_CLOCK / 2) // Time to make up the offset from the original PCRs in.
+#define PCR_MAX_STEP PCR_CLOCK // Between PCRs, longer is a discontinuity.
+#define PCR_MAX_OFFSET (PCR_CLOCK / 10) // Of a new PCR from the original.
+#define PCR_STATS_INTERVAL PCR_CLOCK
+
+/**
+ * How far each PCR is from the line through the two before it, against
+ * the byte position in the stream, in 27MHz ticks. A stream sent at a
+ * constant bitrate has none.
+ */
+class PcrJitter
+{
+  uint64_t m_pcr[2];
+  uint64_t m_pos[2];
+  unsigned m_count;
+  uint64_t m_peak;
+
+public:
+  PcrJitter();
+
+  void add(uint64_t pcr, uint64_t pos);
+
+  /**
+   * The largest since the last call.
+   */
+  uint64_t take_peak();
+
+  void reset();
+};
+
+/**
+ * Rewrites the PCRs of a service taken out of its multiplex. Its packets
+ * keep the PCRs they had at their place in the whole multiplex, so
+ * against the bytes of the service alone they jitter, which players take
+ * for a clock that wanders.
+ *
+ * The new PCRs follow the bytes of the service at its bitrate, averaged
+ * over the last PCR_SMOOTHING PCRs, so that they run smoothly from one to
+ * the next. To stay locked to the PTS and DTS, the rate up to the next PCR
+ * is nudged to make up any offset from the original PCRs over
+ * PCR_CATCH_UP, and the offset is never let grow past PCR_MAX_OFFSET. A
+ * step of more than PCR_MAX_STEP or a discontinuity indicator starts again
+ * from the original PCR. Only integer arithmetic is used, a few operations
+ * a PCR.
+ *
+ * The jitter of the PCRs before and after, and the peak offset of the new
+ * PCRs from the originals, are exported every PCR_STATS_INTERVAL.
+ */
+class PcrRestamper
+{
+  bool m_started;
+  uint64_t m_last; // The last original PCR.
+  uint64_t m_last_pos;
+  uint64_t m_restamped; // The last new PCR.
+  uint64_t m_rate; // 27MHz ticks a byte, in 16.16 fixed point, 0 until measured.
+  uint64_t m_next_rate; // The rate up to the next PCR, to catch up.
+  uint64_t m_stats_pcr;
+  uint64_t m_peak_offset;
+  PcrJitter m_in;
+  PcrJitter m_out;
+  Stat m_jitter_in;
+  Stat m_jitter_out;
+  Stat m_offset;
+  Stat m_clamped;
+
+  void _restart(uint64_t pcr, uint64_t pos);
+  void _update_stats(uint64_t pcr);
+
+public:
+  PcrRestamper(const std::string& labels);
+
+  /**
+   * The new PCR for one at pos bytes into the service's stream.
+   */
+  uint64_t restamp(uint64_t pcr, uint64_t pos, bool discontinuity);
+
+  /**
+   * Start again, e.g. when the stream has been interrupted.
+   */
+  void reset();
+};
+
+#endif /* PCR_RESTAMPER_H__ */
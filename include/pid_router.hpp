@@ -0,0 +1,62 @@
+#ifndef PID_ROUTER_H__
+#define PID_ROUTER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+#include "dvb.hpp"
+
+#define ROUTE_FANOUT 7
+#define ROUTE_OVERFLOW 0xFFFE // slots[0] indexes an overflow list
+#define ROUTE_ALL 0xFFFF
+
+class Channel;
+
+/**
+ * Channel slots that packets on a PID are written to. Slots and overflow
+ * lists are 16 bit, as a multiplex can carry more than 255 programs and
+ * as many PIDs can fan out.
+ */
+struct PidRoute
+{
+  uint16_t count;
+  uint16_t slots[ROUTE_FANOUT];
+};
+
+/**
+ * Routing table indexed directly by PID, so routing a packet is a
+ * single load. A PID can fan out to several channels, for streams
+ * shared between services. The table is double buffered and rebuilt
+ * off to the side, then swapped in whole.
+ */
+class PidRouter
+{
+  PidRoute* m_tables[2];
+  std::vector<std::vector<uint16_t> > m_overflow[2];
+  std::atomic<unsigned> m_active;
+
+public:
+  PidRouter();
+
+  const PidRoute* table() const
+  {
+    return m_tables[m_active.load(std::memory_order_acquire)];
+  }
+
+  const std::vector<uint16_t>& overflow(const PidRoute& route) const
+  {
+    return m_overflow[m_active.load(std::memory_order_acquire)][route.slots[0]];
+  }
+
+  /**
+   * Route the elementary streams of each streaming channel to its slot,
+   * and the broadcast PIDs to every streaming channel.
+   */
+  void rebuild(const std::vector<Channel*>& channels, const uint16_t* broadcast, size_t num_broadcast);
+
+  ~PidRouter();
+};
+
+#endif /* PID_ROUTER_H__ */
@@ -0,0 +1,26 @@
+#ifndef PLAYLIST_WATCHER_H__
+#define PLAYLIST_WATCHER_H__
+
+#include <string>
+#include <set>
+
+/**
+ * Uses inotify to report which playlists in a directory clients have
+ * read, i.e. opened and closed without writing.
+ */
+class PlaylistWatcher
+{
+  int m_fd;
+
+public:
+  PlaylistWatcher(const std::string& dir);
+
+  /**
+   * Add the names of the playlists read since the last call, without blocking.
+   */
+  void poll(std::set<std::string>& names);
+
+  ~PlaylistWatcher();
+};
+
+#endif /* PLAYLIST_WATCHER_H__ */
@@ -0,0 +1,36 @@
+#ifndef PSI_GENERATOR_H__
+#define PSI_GENERATOR_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/**
+ * Builders for the PSI that channels write for their own service. Each
+ * table is built once, as ready made packets, and only built again when
+ * its version changes. Writing a copy then only takes setting its
+ * continuity counter, see Channel.
+ */
+
+/**
+ * Start a long form section, the only one of its table.
+ */
+void psi_start_section(std::vector<uint8_t>& section, uint8_t table_id, uint16_t extension, uint8_t version);
+
+/**
+ * Fill in the length of a section and append its CRC.
+ */
+void psi_finish_section(std::vector<uint8_t>& section);
+
+/**
+ * Append a section as packets on pid, the first starting the section.
+ * The continuity counters are left at 0.
+ */
+void psi_packetize(uint16_t pid, const std::vector<uint8_t>& section, std::vector<uint8_t>& packets);
+
+/**
+ * The section of a PAT with just one program.
+ */
+std::vector<uint8_t> psi_pat_section(uint16_t program, uint16_t pmt_pid);
+
+#endif /* PSI_GENERATOR_H__ */
@@ -0,0 +1,77 @@
+#ifndef PSI_MONITOR_H__
+#define PSI_MONITOR_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <map>
+
+#include "dvb.hpp"
+#include "stats.hpp"
+#include "psi_parser.hpp"
+
+/**
+ * Watches the PAT, PMTs and SDT for changes once they have been decoded.
+ *
+ * Only the first packet of each section is looked at, for the version
+ * number and, when the whole section fits in the packet, the CRC. A
+ * change is reported once, and the table is then ignored until the
+ * segmenter has decoded it again and expects the new version.
+ */
+class PsiMonitor
+{
+  struct Table
+  {
+    uint8_t version;
+    bool changed;
+    std::map<uint8_t, uint32_t> crcs; // By section number.
+  };
+
+  bool m_pids[NUM_PIDS];
+  std::map<uint32_t, Table> m_tables; // By table id and extension.
+  Stat m_changes;
+  Stat m_reconfigs;
+  Stat m_reconfig_time;
+  Stat m_latency;
+
+public:
+  PsiMonitor(const std::string& multiplex);
+
+  /**
+   * Look at the packets on pid, e.g. for a PMT that is still to be
+   * decoded.
+   */
+  void watch(uint16_t pid)
+  {
+    m_pids[pid] = 1;
+  }
+
+  /**
+   * Watch a table that has just been decoded at version.
+   */
+  void expect(uint16_t pid, uint8_t table_id, uint16_t extension, uint8_t version);
+
+  /**
+   * Stop watching every table and PID.
+   */
+  void clear();
+
+  bool watching(uint16_t pid) const
+  {
+    return m_pids[pid];
+  }
+
+  /**
+   * True if pkt starts a section of a watched table that differs from
+   * the version expected, giving the table that changed.
+   */
+  bool changed(const uint8_t* pkt, uint8_t& table_id, uint16_t& extension);
+
+  /**
+   * Count a change that was seen at detected and has been applied, which
+   * took from start until now.
+   */
+  void applied(const timespec& detected, const timespec& start);
+};
+
+#endif /* PSI_MONITOR_H__ */
@@ -0,0 +1,176 @@
+#ifndef PSI_PARSER_H__
+#define PSI_PARSER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <functional>
+
+#define PSI_TABLE_PAT 0x00
+#define PSI_TABLE_PMT 0x02
+#define PSI_TABLE_SDT 0x42 // SDT of the actual transport stream
+
+#define PSI_SECTION_MAX 4096 // Longest private section, headers included
+#define PSI_MAX_PROGRAMS 253 // That fit in one PAT section
+#define PSI_MAX_STREAMS 201 // That fit in one PMT section, without descriptors
+#define PSI_MAX_SERVICES 201 // That fit in one SDT section, without descriptors
+
+/**
+ * Assembles the sections on one PID from its packets, in a fixed buffer.
+ *
+ * Sections are handed to the handler once their CRC has been checked,
+ * and are only valid until it returns. Tables that aren't wanted are
+ * skipped as their packets arrive rather than being buffered. Nothing is
+ * allocated after construction.
+ */
+class SectionAssembler
+{
+public:
+  typedef std::function<void(const uint8_t* section, size_t len)> Handler;
+
+private:
+  Handler m_handler;
+  uint8_t m_buf[PSI_SECTION_MAX];
+  size_t m_len;
+  size_t m_skip; // Bytes left of an unwanted section.
+  uint8_t m_cc;
+  bool m_synced;
+  bool m_filter;
+  bool m_wanted[256];
+  uint64_t m_crc_errors;
+
+  void _append(const uint8_t* data, size_t len);
+
+public:
+  SectionAssembler(Handler handler);
+
+  /**
+   * Only hand on sections of this table, and of any others wanted. Every
+   * table is handed on until the first call.
+   */
+  void want(uint8_t table_id);
+
+  /**
+   * Take a packet on the PID.
+   */
+  void push(const uint8_t* pkt);
+
+  /**
+   * Drop any partial section, e.g. to decode the PID again.
+   */
+  void reset();
+
+  uint64_t crc_errors() const { return m_crc_errors; }
+};
+
+#define PSI_SECTION_REPEAT 0 // Already seen in this version.
+#define PSI_SECTION_NEXT 1 // Another section of this version.
+#define PSI_SECTION_FIRST 2 // The first seen of a new version.
+
+/**
+ * The sections seen of the current version of a table, to tell when a
+ * table of several sections is complete.
+ */
+class PsiSections
+{
+  bool m_started;
+  uint8_t m_version;
+  uint8_t m_last;
+  uint32_t m_seen[8];
+
+public:
+  PsiSections();
+
+  /**
+   * Record a section, as one of the PSI_SECTION_* results. A different
+   * version starts the table again.
+   */
+  int add(uint8_t version, uint8_t section, uint8_t last);
+
+  bool complete() const;
+
+  void reset();
+};
+
+/**
+ * A loop of descriptors, left in the section it was parsed from.
+ */
+struct PsiDescriptors
+{
+  const uint8_t* data;
+  uint16_t len;
+};
+
+struct PsiProgram
+{
+  uint16_t number;
+  uint16_t pmt_pid;
+};
+
+struct PsiPat
+{
+  uint16_t ts_id;
+  uint8_t version;
+  uint8_t section;
+  uint8_t last_section;
+  uint16_t count;
+  PsiProgram programs[PSI_MAX_PROGRAMS];
+};
+
+struct PsiStream
+{
+  uint8_t type;
+  uint16_t pid;
+  PsiDescriptors descriptors;
+};
+
+struct PsiPmt
+{
+  uint16_t program;
+  uint8_t version;
+  uint16_t pcr_pid;
+  PsiDescriptors descriptors;
+  uint16_t count;
+  PsiStream streams[PSI_MAX_STREAMS];
+};
+
+struct PsiService
+{
+  uint16_t id;
+  uint8_t running;
+  bool free_ca; // Some of its streams are scrambled.
+  PsiDescriptors descriptors;
+};
+
+struct PsiSdt
+{
+  uint16_t ts_id;
+  uint16_t network_id;
+  uint8_t version;
+  uint8_t section;
+  uint8_t last_section;
+  uint16_t count;
+  PsiService services[PSI_MAX_SERVICES];
+};
+
+/**
+ * Parsers for sections from a SectionAssembler. Each fills in a flat,
+ * preallocated table, pointing into the section for the descriptors, and
+ * returns false for a section that isn't a current one of its table or
+ * whose lengths don't add up.
+ */
+bool psi_parse_pat(const uint8_t* section, size_t len, PsiPat& pat);
+bool psi_parse_pmt(const uint8_t* section, size_t len, PsiPmt& pmt);
+bool psi_parse_sdt(const uint8_t* section, size_t len, PsiSdt& sdt);
+
+/**
+ * The first descriptor in the loop with this tag, or NULL.
+ */
+const uint8_t* psi_find_descriptor(const PsiDescriptors& descriptors, uint8_t tag, uint8_t& len);
+
+/**
+ * The name in a service descriptor, false if there isn't one.
+ */
+bool psi_service_name(const PsiDescriptors& descriptors, std::string& name);
+
+#endif /* PSI_PARSER_H__ */
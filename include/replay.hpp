@@ -0,0 +1,47 @@
+#ifndef REPLAY_H__
+#define REPLAY_H__
+
+#include <stdint.h>
+#include <string>
+#include <time.h>
+
+#include "ts_source.hpp"
+
+/**
+ * Replays a recorded multiplex from a file or pipe, either paced
+ * to the PCR of the stream or as fast as possible.
+ */
+class ReplaySource : public TsSource
+{
+  std::string m_multiplex;
+  std::string m_path;
+  int m_fd;
+  bool m_paced;
+  bool m_eof;
+  int m_pcr_pid;
+  uint64_t m_last_pcr;
+  uint64_t m_elapsed;
+  timespec m_ref_time;
+  timespec m_start_time;
+  uint64_t m_bytes;
+
+  void _pace(const uint8_t *buf, size_t pkts);
+  void _report();
+
+public:
+  ReplaySource(const std::string& multiplex, const std::string& path, bool paced);
+  void open_source();
+  ssize_t read_bytes(uint8_t *buf, size_t size) override;
+  bool eof() const override
+  {
+    return m_eof;
+  }
+  const std::string& get_multiplex() const override
+  {
+    return m_multiplex;
+  }
+
+  ~ReplaySource();
+};
+
+#endif /* REPLAY_H__ */
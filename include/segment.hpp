@@ -4,50 +4,74 @@
 #include <string>
 #include "stdint.h"
 
-#define DECODE_CLOCK 90000ul
-
 class Segment
 {
   std::string m_name;
-  uint64_t m_first_dts;
-  uint64_t m_last_dts;
+  uint32_t m_duration;
+  bool m_discontinuity;
 
 public:
   Segment(const std::string& name);
 
-  void updateDts(uint64_t dts);
-  uint16_t duration() const;
+  /**
+   * A segment left by a previous run, of a known duration in ms.
+   */
+  Segment(const std::string& name, uint32_t duration, bool discontinuity);
+
+  /**
+   * The length of the media in ms, by the stream's clock, once the
+   * segment is finished. target_duration until then.
+   */
+  uint32_t duration() const;
+
+  void set_duration(uint32_t duration)
+  {
+    m_duration = duration;
+  }
+
   const char* name() const
   {
     return m_name.c_str();
   }
+
+  void set_name(const std::string& name)
+  {
+    m_name = name;
+  }
+
+  /**
+   * Whether the stream restarts at this segment, e.g. after the daemon
+   * was restarted.
+   */
+  bool discontinuity() const
+  {
+    return m_discontinuity;
+  }
+
+  void set_discontinuity()
+  {
+    m_discontinuity = 1;
+  }
   static const unsigned target_duration = 10;
 };
 
 Segment::Segment(const std::string& name) :
     m_name(name),
-    m_first_dts(UINT64_MAX),
-    m_last_dts(0)
+    m_duration(0),
+    m_discontinuity(0)
 {
 }
 
-void Segment::updateDts(uint64_t dts)
+Segment::Segment(const std::string& name, uint32_t duration, bool discontinuity) :
+    m_name(name),
+    m_duration(duration),
+    m_discontinuity(discontinuity)
 {
-  if (m_first_dts == UINT64_MAX)
-  {
-    m_first_dts = dts;
-  }
-  else
-  {
-    m_last_dts = dts;
-  }
 }
 
-uint16_t Segment::duration() const
+uint32_t Segment::duration() const
 {
-  return (m_last_dts > m_first_dts) ?
-      (m_last_dts - m_first_dts) / (DECODE_CLOCK / 1000) :
-      target_duration * 1000;
+  return m_duration ? m_duration : target_duration * 1000;
 }
 
 #endif
@@ -0,0 +1,93 @@
+#ifndef SEGMENT_POOL_H__
+#define SEGMENT_POOL_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include "ingest.hpp"
+#include "channel.hpp"
+#include "stats.hpp"
+
+// Batches in flight, leaving the rest of the ring for the ingest thread.
+#define POOL_BATCHES (INGEST_CHUNKS / 2)
+#define POOL_BALANCE_INTERVAL 5 // seconds
+
+/**
+ * Writes the channels of a multiplex on a pool of worker threads.
+ *
+ * Each channel has a lane: a single producer, single consumer queue of
+ * the batches with packets for it. A lane is only ever run by one worker
+ * at a time, so the packets of a channel are written in the same order
+ * as on a single thread. Lanes have a home worker, chosen by balancing
+ * their measured bitrates, and idle workers steal lanes from busy ones.
+ */
+class SegmentPool
+{
+  struct Batch
+  {
+    TsBatch batch;
+    timespec time;
+    std::atomic<unsigned> pending; // Lanes yet to write the batch.
+  };
+
+  struct Lane
+  {
+    Channel* channel;
+    std::vector<PacketRef> refs[POOL_BATCHES];
+    uint8_t queue[POOL_BATCHES];
+    std::atomic<unsigned> head;
+    std::atomic<unsigned> tail;
+    std::atomic<bool> busy;
+    std::atomic<unsigned> home;
+    uint64_t bytes;
+  };
+
+  TsIngest& m_ingest;
+  std::vector<Lane*> m_lanes;
+  Batch m_batches[POOL_BATCHES];
+  unsigned m_submitted;
+  unsigned m_released;
+  timespec m_balance_time;
+  std::vector<std::thread> m_threads;
+  std::atomic<bool> m_stop;
+  std::atomic<unsigned> m_generation;
+  std::exception_ptr m_error;
+  std::mutex m_lock;
+  std::condition_variable m_work;
+  std::condition_variable m_done;
+  Stat m_steals;
+  Stat m_stalls;
+
+  void _worker(unsigned id);
+  bool _run_lane(Lane& lane);
+  void _release(unsigned limit);
+  void _balance();
+  void _check_error();
+
+public:
+  SegmentPool(TsIngest& ingest, const std::vector<Channel*>& channels,
+      unsigned workers, const std::string& multiplex);
+
+  /**
+   * Hand a batch to the workers. refs holds the packets for each channel,
+   * indexed as the channels were given, and is left empty. The batch is
+   * released back to the ingest once every channel has written it.
+   */
+  void submit(const TsBatch& batch, const timespec& now, std::vector<std::vector<PacketRef>>& refs);
+
+  /**
+   * Wait for every submitted batch to be written and released.
+   */
+  void drain();
+
+  ~SegmentPool();
+};
+
+#endif /* SEGMENT_POOL_H__ */
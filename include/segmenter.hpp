@@ -3,39 +3,283 @@
 #include <stdint.h>
 #include <string>
 #include <vector>
-#include <unordered_map>
 #include <map>
-#include "dvbpsi.hpp"
+#include <set>
+#include <atomic>
+#include <mutex>
+#include <ostream>
+#include <functional>
+#include <time.h>
+#include "ingest.hpp"
+#include "pid_router.hpp"
+#include "ts_header.hpp"
+#include "stats.hpp"
+#include "load_shedder.hpp"
+#include "psi_parser.hpp"
+#include "psi_monitor.hpp"
+#include "si_processor.hpp"
 
-class DvbDevice;
+class TsSource;
 class Channel;
+class SegmentPool;
+class PlaylistWatcher;
+struct PacketRef;
 
 class Segmenter
 {
-  dvbpsi_t *m_dvbpsi_pat;
-  dvbpsi_t *m_dvbpsi_sdt;
-  DvbDevice& m_device;
+  TsSource& m_source;
+  SectionAssembler m_pat_sections;
+  SectionAssembler m_sdt_sections;
+  PsiSections m_pat_seen;
+  PsiSections m_sdt_seen;
+  PsiPat m_pat;
+  PsiSdt m_sdt;
+  bool m_decoding_pat;
+  bool m_decoding_sdt;
   bool m_have_pat;
   bool m_have_sdt;
-  std::unordered_map<uint16_t, Channel*> m_channel_pids;
+  std::vector<Channel*> m_channels;
   std::map<uint16_t, Channel*> m_channel_ids;
+  PidRouter m_router;
   uint16_t m_tsid;
-  bool m_quit;
+  std::atomic<bool> m_quit;
+  TsIngest m_ingest;
+  bool m_pid_filter;
+  bool m_whole_mux; // The source could not filter the last PIDs asked for.
+  size_t m_enabled_channels;
+  bool m_ingest_thread;
+  int m_ingest_cpu;
+  int m_ingest_priority;
+  TsHeaders m_headers;
+  std::vector<std::vector<PacketRef>> m_refs;
+  unsigned m_segment_threads;
+  bool m_restamp_pcr;
+  bool m_use_uring;
+  SegmentPool* m_pool;
+  unsigned m_idle_timeout;
+  PlaylistWatcher* m_watcher;
+  mutable std::mutex m_request_lock; // Also guards the channel map.
+  std::vector<std::string> m_requests;
+  std::vector<time_t> m_last_request;
+  timespec m_activity_time;
+  bool m_shed_load;
+  LoadShedder* m_load;
+  bool m_trimmed;
+  std::vector<Channel*> m_shed; // Paused to shed load, most recent last.
+  bool m_shed_exhausted;
+  bool m_use_cache;
+  bool m_progressive;
+  bool m_scanning; // Decoding PSI while streaming.
+  bool m_from_cache;
+  timespec m_scan_start;
+  std::map<uint16_t, std::string> m_names; // From the SDT, waiting to be applied.
+  std::function<void()> m_on_services;
+  bool m_rescan;
+  std::set<uint16_t> m_scan_pids;
+  size_t m_unscanned;
+  PsiMonitor* m_monitor; // Once the scan is finished.
+  uint8_t m_pat_version;
+  uint8_t m_sdt_version;
+  uint16_t m_pat_tsid;
+  std::map<uint16_t, uint16_t> m_programs; // From the PAT being decoded, by service id.
+  timespec m_pat_changed;
+  timespec m_sdt_changed;
+  std::map<uint16_t, timespec> m_pmt_changed; // PMTs being decoded again.
+  SiProcessor m_si;
+  uint8_t m_cc[NUM_PIDS];
+  uint32_t m_pid_scrambled[NUM_PIDS]; // Payload packets since the last check.
+  uint32_t m_pid_clear[NUM_PIDS];
+  timespec m_scramble_time;
+  std::map<uint16_t, uint64_t> m_parked; // Bytes per second of each parked service when it was parked.
+  Stat m_errors;
+  Stat m_tei;
+  Stat m_scrambled;
+  Stat m_cc_errors;
+  Stat m_activations;
+  Stat m_deactivations;
+  Stat m_shed_stat;
+  Stat m_parked_stat;
+  Stat m_parked_rate;
 
-  static void _process_pat(void* self, dvbpsi_pat_t* pat);
-  static void _process_sdt(void* self, dvbpsi_sdt_t* sdt);
-  static void _attach_sdt(dvbpsi_t *dvbpsi, uint8_t table_id, uint16_t extension, void* self);
-  void _write_channel_index();
+  void _pat_section(const uint8_t* section, size_t len);
+  void _sdt_section(const uint8_t* section, size_t len);
+  void _process_pat();
+  void _check_pat();
+  void _setup_channel(Channel* chan);
+  size_t _count_enabled() const;
+  void _update_routes();
+  template <typename F>
+  void _for_each_slot(const PidRoute& route, F f);
+  template <typename F>
+  void _for_each_channel(const PidRoute& route, F f);
+  void _dispatch(uint8_t* pkts, size_t count, const PidRoute* routes);
+  void _write_batch(const timespec& now);
+  void _stream();
+  std::string _cache_file() const;
+  bool _load_services();
+  void _save_services();
+  void _clear_channels();
+  void _start_scan();
+  void _scan_batch(const TsBatch& batch);
+  void _apply_names();
+  void _stop_scan();
+  void _decode_pat();
+  void _decode_sdt();
+  void _detach_pat();
+  void _detach_sdt();
+  void _start_monitor();
+  void _monitor_batch(const TsBatch& batch, const timespec& now);
+  void _psi_changed(uint8_t table_id, uint16_t extension, const timespec& now);
+  void _update_pat(const timespec& now);
+  void _update_scan_pids();
+  void _process_si(uint16_t service, uint16_t pid, const std::vector<uint8_t>& packets);
+  void _update_activity(const timespec& now);
+  bool _watched(size_t slot, const timespec& now) const;
+  void _update_load(const timespec& now);
+  bool _shed_step(const timespec& now);
+  bool _recover_step(const timespec& now);
+  void _update_scrambling(const timespec& now);
+  void _update_parked();
 
 public:
-  Segmenter(DvbDevice& device);
+  Segmenter(TsSource& source);
 
   ~Segmenter();
 
+  /**
+   * Find the services on the multiplex. With a progressive scan this
+   * returns once the PAT is decoded, and run() carries on decoding the
+   * PMTs and SDT, starting each service as soon as its PMT is known.
+   * Once the scan is finished, run() watches the tables for changes and
+   * updates only the services they affect.
+   */
   void scan();
 
+  /**
+   * Run until exit() is called or the source ends. The working directory
+   * must be the output directory.
+   */
   void run();
 
+  /**
+   * Append a name,index file line for each enabled channel that has been
+   * named, from any thread.
+   */
+  void write_index(std::ostream& index) const;
+
+  const std::string& multiplex() const;
+
+  /**
+   * The channels found by scan(), by service id.
+   */
+  const std::map<uint16_t, Channel*>& channels() const
+  {
+    return m_channel_ids;
+  }
+
+  /**
+   * Start from the services found by the last run, if they were cached,
+   * rather than waiting for the PSI. The cache is checked against the
+   * PSI while streaming, and a full scan follows if it is out of date.
+   * Channels carry on from the segments left by the last run.
+   */
+  void use_service_cache(bool enable)
+  {
+    m_use_cache = enable;
+  }
+
+  /**
+   * Let scan() return before the PMTs and SDT are decoded, see scan().
+   */
+  void use_progressive_scan(bool enable)
+  {
+    m_progressive = enable;
+  }
+
+  /**
+   * Called from run() when services are named or renamed, e.g. to
+   * rewrite the channel index.
+   */
+  void on_services_changed(std::function<void()> callback)
+  {
+    m_on_services = callback;
+  }
+
+  /**
+   * Ask the source to only deliver the PIDs of enabled channels.
+   */
+  void use_pid_filter(bool enable)
+  {
+    m_pid_filter = enable;
+  }
+
+  /**
+   * Read from the source on a dedicated thread, see TsIngest::start_thread.
+   */
+  void use_ingest_thread(int cpu, int priority)
+  {
+    m_ingest_thread = 1;
+    m_ingest_cpu = cpu;
+    m_ingest_priority = priority;
+  }
+
+  /**
+   * Write the channels on a pool of threads, see SegmentPool.
+   */
+  void use_segment_threads(unsigned threads)
+  {
+    m_segment_threads = threads;
+  }
+
+  /**
+   * Keep channels dormant until they are requested, either by a client
+   * reading their playlist or through request(), and put them back to
+   * sleep after idle_timeout seconds without a request.
+   */
+  void use_on_demand(unsigned idle_timeout)
+  {
+    m_idle_timeout = idle_timeout;
+  }
+
+  /**
+   * When the multiplex can't be kept up with, first stop writing the
+   * optional streams, then pause unwatched channels one at a time. Watched
+   * channels are those whose playlist has been read recently. The steps are
+   * undone once the load drops, see LoadShedder.
+   */
+  void use_load_shedding(bool enable)
+  {
+    m_shed_load = enable;
+  }
+
+  /**
+   * Rewrite the PCRs of every channel to suit its own stream rather than
+   * the multiplex, see PcrRestamper.
+   */
+  void use_pcr_restamping(bool enable)
+  {
+    m_restamp_pcr = enable;
+  }
+
+  /**
+   * Write the segments of every channel through io_uring where the kernel
+   * has it, see UringWriter.
+   */
+  void use_io_uring(bool enable)
+  {
+    m_use_uring = enable;
+  }
+
+  /**
+   * Ask for a service to be streamed, from any thread.
+   */
+  void request(const std::string& service);
+
+  /**
+   * The playlist of a service, or empty if it isn't in this multiplex.
+   */
+  std::string playlist(const std::string& service) const;
+
   void exit()
   {
     m_quit = 1;
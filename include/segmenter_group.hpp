@@ -0,0 +1,66 @@
+#ifndef SEGMENTER_GROUP_H__
+#define SEGMENTER_GROUP_H__
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+#include "dvb_hls.hpp"
+#include "control_socket.hpp"
+
+class Segmenter;
+
+/**
+ * The segmenters of all the multiplexes served by the process. Each
+ * segmenter runs on its own thread, and they share the output directory
+ * and one channel index. A multiplex that fails is logged and dropped,
+ * the others carry on.
+ */
+class SegmenterGroup
+{
+  std::vector<Segmenter*> m_segmenters;
+  std::mutex m_index_lock; // Also guards m_segmenters while running.
+  ControlSocket* m_control;
+  std::atomic<bool> m_quit;
+
+  template <typename F>
+  void _run_each(const char* action, F f);
+  void _serve_control();
+  std::string _watch(const std::string& service);
+
+public:
+  SegmenterGroup();
+
+  /**
+   * Add a segmenter, which the group then owns.
+   */
+  void add(Segmenter* segmenter);
+
+  /**
+   * Answer "watch <service>" on the control socket while running, waking
+   * the service if its channel is dormant.
+   */
+  void use_control_socket();
+
+  /**
+   * Scan all the multiplexes at once. Throws if none could be scanned.
+   */
+  void scan();
+
+  /**
+   * Enter the output directory and run every segmenter until they exit.
+   */
+  void run();
+
+  /**
+   * Rewrite the channel index from the channels of every multiplex.
+   */
+  void write_index();
+
+  void exit();
+
+  ~SegmenterGroup();
+};
+
+#endif /* SEGMENTER_GROUP_H__ */
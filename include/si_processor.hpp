@@ -0,0 +1,71 @@
+#ifndef SI_PROCESSOR_H__
+#define SI_PROCESSOR_H__
+
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <functional>
+
+#include "stats.hpp"
+#include "psi_parser.hpp"
+
+#define SI_PID_SDT 0x11
+#define SI_PID_EIT 0x12
+
+/**
+ * Splits the SDT and the EIT into the tables of each service.
+ *
+ * The sections on the SDT and EIT PIDs are assembled from the multiplex
+ * once, and only ones that have changed are processed. Each service gets
+ * an SDT with only its own entry, and its own EIT present/following
+ * sections. The EIT schedule and the EIT and SDT of other transport
+ * streams are dropped without being assembled. The tables are handed to
+ * the sink as ready made packets, with their continuity counters to be
+ * filled in by the channel.
+ */
+class SiProcessor
+{
+public:
+  typedef std::function<void(uint16_t service, uint16_t pid, const std::vector<uint8_t>& packets)> Sink;
+
+private:
+  struct Service
+  {
+    std::vector<uint8_t> sdt;
+    std::map<uint8_t, std::vector<uint8_t>> eit; // Sections by number.
+  };
+
+  Sink m_sink;
+  SectionAssembler m_sdt_sections;
+  SectionAssembler m_eit_sections;
+  std::map<uint32_t, uint32_t> m_crcs; // Of the last section seen, by table, extension and section number.
+  std::map<uint16_t, Service> m_services;
+  Stat m_sections;
+  Stat m_crc_errors;
+
+  void _section(const uint8_t* section, size_t len);
+  void _process_sdt(const uint8_t* section, size_t len);
+  void _process_eit(const uint8_t* section, size_t len);
+  void _send_eit(uint16_t service);
+
+public:
+  SiProcessor(Sink sink, const std::string& multiplex);
+
+  /**
+   * Take a packet on the SDT or EIT PID.
+   */
+  void push(const uint8_t* pkt);
+
+  /**
+   * Hand the tables of a service to the sink again, e.g. for a new channel.
+   */
+  void resend(uint16_t service);
+
+  /**
+   * Forget every table, so they are all processed again.
+   */
+  void clear();
+};
+
+#endif /* SI_PROCESSOR_H__ */
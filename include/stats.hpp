@@ -0,0 +1,75 @@
+#ifndef STATS_H__
+#define STATS_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+#define STATS_FILE "dvb_hls.stats"
+#define STATS_INTERVAL 5 // seconds
+
+/**
+ * A named counter or gauge, exported with all the others to the stats
+ * file in the output directory. Safe to update from any thread.
+ */
+class Stat
+{
+  std::string m_name;
+  std::atomic<uint64_t> m_value;
+
+  Stat(const Stat&) = delete;
+  Stat& operator=(const Stat&) = delete;
+
+public:
+  /**
+   * labels are in the form key="value",... and may be empty.
+   */
+  Stat(const std::string& name, const std::string& labels = "");
+  ~Stat();
+
+  void add(uint64_t n = 1)
+  {
+    m_value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  void set(uint64_t value)
+  {
+    m_value.store(value, std::memory_order_relaxed);
+  }
+
+  /**
+   * Raise the value to at least value, for high water marks.
+   */
+  void raise(uint64_t value)
+  {
+    uint64_t curr = m_value.load(std::memory_order_relaxed);
+    while (curr < value && !m_value.compare_exchange_weak(curr, value, std::memory_order_relaxed))
+    {
+    }
+  }
+
+  uint64_t get() const
+  {
+    return m_value.load(std::memory_order_relaxed);
+  }
+
+  const std::string& name() const
+  {
+    return m_name;
+  }
+};
+
+class Stats
+{
+public:
+  /**
+   * Write all the stats if STATS_INTERVAL has passed since they were
+   * last written.
+   */
+  static void write_if_due();
+  static void write();
+};
+
+std::string mux_label(const std::string& multiplex);
+
+#endif /* STATS_H__ */
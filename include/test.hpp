@@ -8,7 +8,343 @@
 #ifndef TEST_HPP_
 #define TEST_HPP_
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <algorithm>
 
+#include "dvb_hls.hpp"
+#include "psi_generator.hpp"
+#include "es_scanner.hpp"
+#include "ts_source.hpp"
 
+/**
+ * Helpers for the programs under tests/ and bench/. A test exits non-zero
+ * at the first check that fails, which is all ctest looks at.
+ */
+
+#define CHECK(cond) \
+  do \
+  { \
+    if (!(cond)) \
+    { \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      exit(1); \
+    } \
+  } while (0)
+
+#define CHECK_EQ(a, b) \
+  do \
+  { \
+    long long check_a = (a), check_b = (b); \
+    if (check_a != check_b) \
+    { \
+      fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed, %lld != %lld\n", __FILE__, __LINE__, #a, #b, check_a, check_b); \
+      exit(1); \
+    } \
+  } while (0)
+
+/**
+ * Seconds on the monotonic clock, for timing benchmarks.
+ */
+inline double test_seconds()
+{
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * A small xorshift generator, so that every run sees the same input.
+ */
+class TestRandom
+{
+  uint64_t m_state;
+
+public:
+  TestRandom(uint64_t seed = 88172645463325252ull) :
+      m_state(seed)
+  {
+  }
+
+  uint32_t next()
+  {
+    m_state ^= m_state << 13;
+    m_state ^= m_state >> 7;
+    m_state ^= m_state << 17;
+    return m_state >> 32;
+  }
+
+  uint32_t below(uint32_t n)
+  {
+    return next() % n;
+  }
+};
+
+/**
+ * Append a packet with a payload of pattern bytes, as ES data.
+ */
+inline void test_packet(std::vector<uint8_t>& out, uint16_t pid, uint8_t cc, bool pusi = 0, uint8_t pattern = 0)
+{
+  size_t start = out.size();
+  out.resize(start + TS_PACKET_SIZE, pattern);
+  uint8_t* pkt = &out[start];
+  pkt[0] = 0x47;
+  pkt[1] = (pusi ? 0x40 : 0) | (pid >> 8);
+  pkt[2] = pid & 0xFF;
+  pkt[3] = 0x10 | (cc & 0x0F);
+}
+
+/**
+ * The PMT section of a service with a video and an audio stream.
+ */
+inline std::vector<uint8_t> test_pmt_section(uint16_t program, uint16_t vpid, uint16_t apid, uint8_t version = 0)
+{
+  std::vector<uint8_t> section;
+  psi_start_section(section, 0x02, program, version);
+  section.push_back(0xE0 | (vpid >> 8)); // PCR on the video
+  section.push_back(vpid & 0xFF);
+  section.push_back(0xF0); // No program descriptors
+  section.push_back(0);
+  const uint8_t types[] = { 0x1B, 0x03 };
+  const uint16_t pids[] = { vpid, apid };
+  for (int i = 0; i < 2; i++)
+  {
+    section.push_back(types[i]);
+    section.push_back(0xE0 | (pids[i] >> 8));
+    section.push_back(pids[i] & 0xFF);
+    section.push_back(0xF0);
+    section.push_back(0);
+  }
+  psi_finish_section(section);
+  return section;
+}
+
+/**
+ * A multiplex of services, service n with its PMT on 0x100 + n, video on
+ * 0x200 + n and audio on 0x300 + n, and some null packets. The PAT and
+ * PMTs repeat every 200 packets, the rest is mostly video.
+ */
+inline std::vector<uint8_t> test_mux(unsigned services, size_t packets, uint32_t seed = 1)
+{
+  std::vector<uint8_t> pat;
+  psi_start_section(pat, 0x00, 1, 0);
+  for (unsigned n = 1; n <= services; n++)
+  {
+    pat.push_back(n >> 8);
+    pat.push_back(n & 0xFF);
+    pat.push_back(0xE0 | ((0x100 + n) >> 8));
+    pat.push_back((0x100 + n) & 0xFF);
+  }
+  psi_finish_section(pat);
+
+  TestRandom random(seed);
+  std::vector<uint8_t> cc(8192);
+  std::vector<uint8_t> out;
+  out.reserve(packets * TS_PACKET_SIZE);
+  while (out.size() < packets * TS_PACKET_SIZE)
+  {
+    if (out.size() / TS_PACKET_SIZE % 200 == 0)
+    {
+      std::vector<uint8_t> psi;
+      psi_packetize(0, pat, psi);
+      for (unsigned n = 1; n <= services; n++)
+      {
+        psi_packetize(0x100 + n, test_pmt_section(n, 0x200 + n, 0x300 + n), psi);
+      }
+      for (size_t offset = 0; offset < psi.size(); offset += TS_PACKET_SIZE)
+      {
+        uint16_t pid = ((psi[offset + 1] & 0x1F) << 8) | psi[offset + 2];
+        psi[offset + 3] |= cc[pid]++ & 0x0F;
+      }
+      out.insert(out.end(), psi.begin(), psi.end());
+      continue;
+    }
+    uint32_t r = random.below(100);
+    uint16_t pid = r < 5 ? 0x1FFF : (r < 15 ? 0x300 : 0x200) + 1 + random.below(services);
+    test_packet(out, pid, cc[pid]++, random.below(50) == 0, r);
+  }
+  out.resize(packets * TS_PACKET_SIZE);
+  return out;
+}
+
+/**
+ * Append the packet that starts a PES, with a PTS and, if pcr is not
+ * UINT64_MAX, an adaptation field carrying it as the PCR base. The rest
+ * of the payload is es, then stuffing.
+ */
+inline void test_pes_start(std::vector<uint8_t>& out, uint16_t pid, uint8_t cc, uint8_t stream_id,
+    uint64_t pts, uint64_t pcr, bool random_access, const std::vector<uint8_t>& es)
+{
+  size_t start = out.size();
+  test_packet(out, pid, cc, 1, 0xFF);
+  uint8_t* pkt = &out[start];
+  size_t offset = 4;
+  if (pcr != UINT64_MAX)
+  {
+    pkt[3] |= 0x20;
+    uint8_t af[] = { 7, (uint8_t)(0x10 | (random_access ? 0x40 : 0)), (uint8_t)(pcr >> 25), (uint8_t)(pcr >> 17),
+        (uint8_t)(pcr >> 9), (uint8_t)(pcr >> 1), (uint8_t)(((pcr & 1) << 7) | 0x7E), 0 };
+    memcpy(pkt + offset, af, sizeof(af));
+    offset += sizeof(af);
+  }
+  uint8_t pes[] = { 0, 0, 1, stream_id, 0, 0, 0x80, 0x80, 5, (uint8_t)(0x21 | ((pts >> 29) & 0x0E)),
+      (uint8_t)(pts >> 22), (uint8_t)((pts >> 14) | 1), (uint8_t)(pts >> 7), (uint8_t)((pts << 1) | 1) };
+  memcpy(pkt + offset, pes, sizeof(pes));
+  offset += sizeof(pes);
+  memcpy(pkt + offset, es.data(), std::min(es.size(), TS_PACKET_SIZE - offset));
+}
+
+/**
+ * A broadcast of services laid out as in test_mux(), seconds long at 25
+ * pictures a second. Each picture and each audio frame is a PES with a PTS
+ * counting on from start_pts, the video carries the PCR, and every 25th
+ * picture is an H.264 IDR, flagged as a random access point. The PAT, the
+ * PMTs of pmt_version and an SDT naming the services "<name> n" go out
+ * every 5 pictures.
+ */
+inline std::vector<uint8_t> test_broadcast(unsigned services, unsigned seconds, uint64_t start_pts = 0,
+    uint8_t pmt_version = 0, const std::string& name = "Service")
+{
+  std::vector<uint8_t> psi;
+  std::vector<uint8_t> pat;
+  psi_start_section(pat, 0x00, 1, 0);
+  for (unsigned n = 1; n <= services; n++)
+  {
+    pat.push_back(n >> 8);
+    pat.push_back(n & 0xFF);
+    pat.push_back(0xE0 | ((0x100 + n) >> 8));
+    pat.push_back((0x100 + n) & 0xFF);
+  }
+  psi_finish_section(pat);
+  psi_packetize(0, pat, psi);
+  std::vector<uint8_t> sdt;
+  psi_start_section(sdt, 0x42, 1, 0);
+  sdt.push_back(0); // original_network_id
+  sdt.push_back(1);
+  sdt.push_back(0xFF);
+  for (unsigned n = 1; n <= services; n++)
+  {
+    std::string service = name + " " + std::to_string(n);
+    sdt.push_back(n >> 8);
+    sdt.push_back(n & 0xFF);
+    sdt.push_back(0xFC);
+    sdt.push_back(0x80); // Running, 5 + name bytes of descriptors
+    sdt.push_back(5 + service.size());
+    sdt.push_back(0x48); // service_descriptor, digital television
+    sdt.push_back(3 + service.size());
+    sdt.push_back(0x01);
+    sdt.push_back(0);
+    sdt.push_back(service.size());
+    sdt.insert(sdt.end(), service.begin(), service.end());
+  }
+  psi_finish_section(sdt);
+  for (unsigned n = 1; n <= services; n++)
+  {
+    psi_packetize(0x100 + n, test_pmt_section(n, 0x200 + n, 0x300 + n, pmt_version), psi);
+  }
+  psi_packetize(0x11, sdt, psi);
+
+  // An access unit delimiter, then an SPS and IDR slice or a P slice.
+  const std::vector<uint8_t> idr = { 0, 0, 0, 1, 0x09, 0x10, 0, 0, 0, 1, 0x67, 0x64, 0, 0x28, 0, 0, 1, 0x65, 0x88 };
+  const std::vector<uint8_t> p_slice = { 0, 0, 0, 1, 0x09, 0x30, 0, 0, 1, 0x41, 0xC0 };
+  const std::vector<uint8_t> audio = { 0xFF, 0xFD };
+  std::vector<uint8_t> cc(8192);
+  std::vector<uint8_t> out;
+  for (unsigned frame = 0; frame < seconds * 25; frame++)
+  {
+    if (frame % 5 == 0)
+    {
+      for (size_t offset = 0; offset < psi.size(); offset += TS_PACKET_SIZE)
+      {
+        uint16_t pid = ((psi[offset + 1] & 0x1F) << 8) | psi[offset + 2];
+        out.insert(out.end(), psi.begin() + offset, psi.begin() + offset + TS_PACKET_SIZE);
+        out[out.size() - TS_PACKET_SIZE + 3] |= cc[pid]++ & 0x0F;
+      }
+    }
+    uint64_t pts = (start_pts + frame * (ES_CLOCK / 25)) & (ES_CLOCK_WRAP - 1);
+    // Sent half a second ahead of its presentation.
+    uint64_t pcr = (pts - ES_CLOCK / 2) & (ES_CLOCK_WRAP - 1);
+    for (unsigned n = 1; n <= services; n++)
+    {
+      uint16_t vpid = 0x200 + n;
+      bool key = frame % 25 == 0;
+      test_pes_start(out, vpid, cc[vpid]++, 0xE0, pts, pcr, key, key ? idr : p_slice);
+      for (int i = 0; i < (key ? 40 : 12); i++)
+      {
+        test_packet(out, vpid, cc[vpid]++, 0, frame + i);
+      }
+      uint16_t apid = 0x300 + n;
+      test_pes_start(out, apid, cc[apid]++, 0xC0, pts, UINT64_MAX, 0, audio);
+    }
+  }
+  return out;
+}
+
+/**
+ * The whole of a recorded multiplex, cut to whole packets. Empty if it
+ * can't be read.
+ */
+inline std::vector<uint8_t> test_load(const char* path)
+{
+  std::vector<uint8_t> data;
+  FILE* file = fopen(path, "rb");
+  if (!file) return data;
+  uint8_t buf[65536];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), file)) > 0)
+  {
+    data.insert(data.end(), buf, buf + len);
+  }
+  fclose(file);
+  // From the first sync byte, as recordings may start part way through a packet.
+  size_t start = 0;
+  while (start + TS_PACKET_SIZE < data.size() && !(data[start] == 0x47 && data[start + TS_PACKET_SIZE] == 0x47)) start++;
+  data.erase(data.begin(), data.begin() + start);
+  data.resize(data.size() - data.size() % TS_PACKET_SIZE);
+  return data;
+}
+
+/**
+ * Replays a multiplex from memory in reads of up to max_read bytes.
+ */
+class TestSource : public TsSource
+{
+  const std::vector<uint8_t>& m_data;
+  size_t m_offset;
+  size_t m_max_read;
+  std::string m_multiplex;
+
+public:
+  TestSource(const std::vector<uint8_t>& data, size_t max_read) :
+      m_data(data),
+      m_offset(0),
+      m_max_read(max_read),
+      m_multiplex("test")
+  {
+  }
+
+  ssize_t read_bytes(uint8_t* buf, size_t size) override
+  {
+    size_t len = std::min(std::min(size, m_max_read), m_data.size() - m_offset);
+    memcpy(buf, &m_data[m_offset], len);
+    m_offset += len;
+    return len;
+  }
+
+  bool eof() const override
+  {
+    return m_offset == m_data.size();
+  }
+
+  const std::string& get_multiplex() const override
+  {
+    return m_multiplex;
+  }
+};
 
 #endif /* TEST_HPP_ */
@@ -0,0 +1,44 @@
+#ifndef TS_HEADER_H__
+#define TS_HEADER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ingest.hpp"
+
+// Most packets a TsHeaders can hold, a whole chunk plus the carried packet.
+#define TS_BATCH_MAX (INGEST_CHUNK_SIZE / TS_PACKET_SIZE + 1)
+
+#define TS_FLAG_TEI 0x0001
+#define TS_FLAG_PUSI 0x0002
+#define TS_FLAG_PAYLOAD 0x0004
+#define TS_FLAG_ADAPTATION 0x0008
+#define TS_FLAG_PCR 0x0010
+#define TS_FLAG_DISCONTINUITY 0x0020
+#define TS_FLAG_RAI 0x0040
+#define TS_FLAG_ERROR 0x0080 // Bad sync byte or adaptation field length
+#define TS_FLAG_SCRAMBLED 0x0300 // transport_scrambling_control
+#define TS_SCRAMBLING_SHIFT 8
+
+/**
+ * Decoded headers of a batch of packets, as a structure of arrays.
+ */
+struct TsHeaders
+{
+  uint16_t pid[TS_BATCH_MAX];
+  uint16_t flags[TS_BATCH_MAX];
+  uint8_t cc[TS_BATCH_MAX];
+  uint8_t payload[TS_BATCH_MAX]; // Offset of the payload in the packet
+};
+
+/**
+ * Decode the headers of count (at most TS_BATCH_MAX) contiguous packets.
+ */
+void parse_headers(const uint8_t* pkts, size_t count, TsHeaders& hdrs);
+
+/**
+ * The same a packet at a time, without SIMD, to check parse_headers() against.
+ */
+void parse_headers_scalar(const uint8_t* pkts, size_t count, TsHeaders& hdrs);
+
+#endif /* TS_HEADER_H__ */
@@ -0,0 +1,80 @@
+#ifndef TS_SOURCE_H__
+#define TS_SOURCE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <string>
+#include <set>
+
+/**
+ * Source of transport stream packets for the Segmenter.
+ */
+class TsSource
+{
+public:
+  virtual ~TsSource()
+  {
+  }
+
+  /**
+   * Read up to size bytes of the transport stream into buf, returning
+   * as soon as some data is available. The data need not end on a
+   * packet boundary. Returns the number of bytes read, which may be 0
+   * if the read was interrupted.
+   */
+  virtual ssize_t read_bytes(uint8_t *buf, size_t size) = 0;
+
+  /**
+   * True if the source fills buffers of its own, which are then
+   * taken with acquire_buffer() instead of copied by read_bytes().
+   */
+  virtual bool mapped() const
+  {
+    return false;
+  }
+
+  /**
+   * Take the next filled buffer, returning NULL if the read was
+   * interrupted. The buffer stays valid until it is released.
+   */
+  virtual uint8_t* acquire_buffer(size_t& len, int& index)
+  {
+    return NULL;
+  }
+
+  virtual void release_buffer(int index)
+  {
+  }
+
+  /**
+   * Only deliver packets on the given PIDs, or the whole multiplex if
+   * pids is empty. Returns false if the source can't filter them, in
+   * which case the whole multiplex is delivered.
+   */
+  virtual bool set_pid_filter(const std::set<uint16_t>& pids)
+  {
+    return false;
+  }
+
+  /**
+   * Packets lost because they weren't read in time, or 0 if the source
+   * can't tell.
+   */
+  virtual uint64_t overflows() const
+  {
+    return 0;
+  }
+
+  /**
+   * True once the source has no more packets to deliver.
+   */
+  virtual bool eof() const
+  {
+    return false;
+  }
+
+  virtual const std::string& get_multiplex() const = 0;
+};
+
+#endif /* TS_SOURCE_H__ */
@@ -0,0 +1,121 @@
+#ifndef TUNER_POOL_H__
+#define TUNER_POOL_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+#include "control_socket.hpp"
+#include "stats.hpp"
+
+#define TUNER_IDLE_TIMEOUT 60 // seconds
+
+class TsSource;
+class Segmenter;
+
+/**
+ * Serves more multiplexes than there are tuners by tuning on demand.
+ *
+ * Every multiplex is scanned once at startup to build a catalogue of
+ * services. A client then asks for a service over the control socket
+ * with "watch <service>". If no tuner has its multiplex, the pool takes
+ * a free tuner, or failing that the least recently watched one that has
+ * been idle for the idle timeout, and starts a Segmenter for it. Clients
+ * should repeat the request while they are watching.
+ */
+class TunerPool
+{
+public:
+  /**
+   * Open and tune a source for multiplex on adapter, or return NULL.
+   */
+  typedef std::function<TsSource*(const std::string& multiplex, uint16_t adapter)> SourceFactory;
+  typedef std::function<void(Segmenter&)> SegmenterSetup;
+
+private:
+  struct Service
+  {
+    std::string multiplex;
+    std::string index_file;
+  };
+
+  struct Tuner
+  {
+    uint16_t adapter;
+    std::string multiplex; // Empty while free.
+    time_t last_used;
+    std::thread thread;
+    std::atomic<bool> finished;
+    std::mutex lock; // Guards segmenter, requested and stopping.
+    TsSource* source;
+    Segmenter* segmenter;
+    std::vector<std::string> requested; // Before the segmenter exists.
+    bool stopping;
+    bool retuning; // To multiplex once the stream being stopped has finished.
+  };
+
+  std::vector<Tuner*> m_tuners;
+  std::vector<std::string> m_multiplexes;
+  std::map<std::string, Service> m_services;
+  SourceFactory m_open_source;
+  SegmenterSetup m_setup;
+  unsigned m_idle_timeout;
+  std::atomic<bool> m_quit;
+  ControlSocket m_control;
+  Stat m_requests;
+  Stat m_tunes;
+  Stat m_evictions;
+  Stat m_refused;
+  Stat m_in_use;
+
+  Tuner* _find(const std::string& multiplex);
+  Tuner* _acquire(time_t now);
+  void _stream(Tuner& tuner, std::string multiplex);
+  void _start(Tuner& tuner, const std::string& multiplex);
+  void _stop(Tuner& tuner);
+  void _join(Tuner& tuner);
+  void _reap();
+  void _release_all();
+  void _update_in_use();
+  void _write_index();
+  std::string _watch(const std::string& service);
+  std::string _status(const std::string& arg);
+
+public:
+  TunerPool(const std::vector<uint16_t>& adapters, const std::vector<std::string>& multiplexes,
+      SourceFactory open_source, SegmenterSetup setup);
+
+  /**
+   * Seconds without a request before a tuner may be taken for another multiplex.
+   */
+  void set_idle_timeout(unsigned seconds)
+  {
+    m_idle_timeout = seconds;
+  }
+
+  /**
+   * Scan every multiplex, as many at a time as there are tuners, to build
+   * the catalogue of services. Throws if no services were found.
+   */
+  void survey();
+
+  /**
+   * Serve requests until exit() is called.
+   */
+  void run();
+
+  void exit()
+  {
+    m_quit = 1;
+  }
+
+  ~TunerPool();
+};
+
+#endif /* TUNER_POOL_H__ */
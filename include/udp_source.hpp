@@ -0,0 +1,67 @@
+#ifndef UDP_SOURCE_H__
+#define UDP_SOURCE_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "ts_source.hpp"
+
+#define UDP_BATCH 64
+#define UDP_MAX_DATAGRAM 2048
+#define JITTER_SLOTS 256
+#define JITTER_DEPTH 32
+
+/**
+ * Receives a multiplex as raw UDP or RTP, optionally multicast.
+ * Datagrams are received in batches with recvmmsg and RTP packets
+ * are put back in sequence order by a small jitter buffer.
+ */
+class UdpSource : public TsSource
+{
+  struct Slot
+  {
+    int16_t buffer;
+    uint16_t offset;
+    uint16_t length;
+  };
+
+  std::string m_multiplex;
+  std::string m_address;
+  int m_socket;
+  unsigned m_depth;
+  uint8_t *m_pool;
+  std::vector<uint16_t> m_free;
+  Slot m_slots[JITTER_SLOTS];
+  unsigned m_buffered;
+  uint16_t m_next_seq;
+  uint16_t m_raw_seq;
+  bool m_have_seq;
+  mmsghdr m_msgs[UDP_BATCH];
+  iovec m_iovs[UDP_BATCH];
+  uint16_t m_msg_buffers[UDP_BATCH];
+  uint64_t m_datagrams;
+  uint64_t m_lost;
+  uint64_t m_late;
+  uint64_t m_reordered;
+
+  int _receive();
+  void _insert(uint16_t buffer, size_t len);
+  void _skip_gap();
+  size_t _drain(uint8_t *buf, size_t size);
+
+public:
+  UdpSource(const std::string& multiplex, const std::string& address, unsigned depth);
+  void open_source();
+  ssize_t read_bytes(uint8_t *buf, size_t size) override;
+  const std::string& get_multiplex() const override
+  {
+    return m_multiplex;
+  }
+
+  ~UdpSource();
+};
+
+#endif /* UDP_SOURCE_H__ */
@@ -0,0 +1,185 @@
+#ifndef URING_H__
+#define URING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <map>
+#include <sys/uio.h>
+
+#include "stats.hpp"
+
+#define URING_BUFFERS 4 // Registered output buffers a channel can have in flight
+#define URING_BUFFER_SIZE 65536
+#define URING_FILES 2 // Fixed file slots, the segment being written and the last one
+#define URING_ENTRIES 16
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * A bare io_uring, set up and driven with the raw system calls. Entries
+ * are queued with get_sqe() and handed to the kernel together by
+ * submit(), and completions are read from the shared ring without a
+ * system call. For use from one thread at a time.
+ */
+class Uring
+{
+  int m_fd;
+  void* m_sq_ring;
+  size_t m_sq_ring_size;
+  void* m_cq_ring;
+  size_t m_cq_ring_size;
+  io_uring_sqe* m_sqes;
+  size_t m_sqes_size;
+  unsigned* m_sq_head;
+  unsigned* m_sq_tail;
+  unsigned* m_sq_mask;
+  unsigned* m_sq_entries;
+  unsigned* m_sq_array;
+  unsigned* m_cq_head;
+  unsigned* m_cq_tail;
+  unsigned* m_cq_mask;
+  io_uring_cqe* m_cqes;
+  unsigned m_queued;
+
+  void _unmap();
+
+public:
+  /**
+   * Throws a DvbException if the kernel, or the build, has no io_uring.
+   */
+  Uring(unsigned entries);
+  ~Uring();
+
+  /**
+   * A cleared entry to fill in, or NULL if the ring is full.
+   */
+  io_uring_sqe* get_sqe();
+
+  /**
+   * Hand the queued entries to the kernel, waiting for at least wait of
+   * them to complete. Returns the number of system calls made, 0 if there
+   * was nothing to do, or -errno.
+   */
+  int submit(unsigned wait = 0);
+
+  /**
+   * Take the next completion, false if there are none yet.
+   */
+  bool peek(uint64_t& user_data, int32_t& res);
+
+  /**
+   * Register the buffers for fixed writes and the file slots, each -1
+   * until set_file(). Return -errno on failure.
+   */
+  int register_buffers(const iovec* buffers, unsigned count);
+  int register_files(unsigned count);
+  int set_file(unsigned slot, int fd);
+
+  /**
+   * Whether the kernel can do an operation, false if it is too old to say.
+   */
+  bool supports(uint8_t opcode);
+};
+
+/**
+ * Writes the segments of one channel through an io_uring instead of
+ * blocking the thread that writes them.
+ *
+ * Queued packets are gathered into one of URING_BUFFERS registered
+ * buffers, and written from there to the segment's fixed file at its
+ * offset, so that several writes can be in flight and the packets they
+ * came from can be reused at once. Once every buffer is in flight, the
+ * writer waits for one to complete. A finished segment is closed by an
+ * entry linked to its last write, and old segments are unlinked in the
+ * same submission. Nothing reaches the kernel until submit().
+ */
+class UringWriter
+{
+  Uring m_ring;
+  uint8_t* m_buffers;
+  bool m_busy[URING_BUFFERS];
+  size_t m_lengths[URING_BUFFERS];
+  unsigned m_next; // The buffer to fill next.
+  int m_fds[URING_FILES];
+  unsigned m_writing[URING_FILES]; // Writes in flight to each file.
+  unsigned m_slot; // Of the segment being written.
+  uint64_t m_offset;
+  io_uring_sqe* m_last_write; // Queued for the segment, to link its close to.
+  unsigned m_closing;
+  std::map<uint64_t, std::string> m_unlinks; // Paths, kept until they are removed.
+  uint64_t m_unlink_id;
+  std::string m_error;
+  unsigned m_syscalls;
+  Stat m_waits;
+
+  unsigned _free_buffer();
+  void _reap(unsigned wait);
+  io_uring_sqe* _get_sqe();
+  void _complete(uint64_t user_data, int32_t res);
+
+public:
+  /**
+   * Throws a DvbException if io_uring can't be used, or can't close and
+   * unlink files, labels are for the stats as in Stat.
+   */
+  UringWriter(const std::string& labels);
+  ~UringWriter();
+
+  /**
+   * Write to a newly opened segment from now on. The last one is closed
+   * once its writes are done, the writer takes care of closing both.
+   */
+  void open(int fd);
+
+  /**
+   * Queue the packets to be written to the segment, copying them so they
+   * don't need to outlive the call. Returns the number of writes queued.
+   */
+  unsigned write(const iovec* iov, size_t count);
+
+  /**
+   * Queue the removal of a file.
+   */
+  void unlink(const std::string& path);
+
+  /**
+   * Hand everything queued to the kernel and take the completions that
+   * are ready, without waiting.
+   */
+  void submit();
+
+  /**
+   * Wait until everything queued has completed, and close the segment.
+   */
+  void finish();
+
+  /**
+   * Whether the segments before the one being written are complete.
+   */
+  bool settled() const
+  {
+    return !m_writing[(m_slot + 1) % URING_FILES];
+  }
+
+  /**
+   * Why a write failed, empty if none have.
+   */
+  const std::string& error() const
+  {
+    return m_error;
+  }
+
+  /**
+   * System calls made since the last call.
+   */
+  unsigned take_syscalls()
+  {
+    unsigned syscalls = m_syscalls;
+    m_syscalls = 0;
+    return syscalls;
+  }
+};
+
+#endif /* URING_H__ */
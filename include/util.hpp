@@ -3,9 +3,9 @@
 #include <stdexcept>
 #include <string>
 #include <stdio.h>
+#include <stdint.h>
 #include <vector>
 #include <boost/format.hpp>
-#include "dvbpsi.hpp"
 
 #ifdef BUILD_DEBUG
 #define DEBUG(msg, ...) fprintf(stderr, "Debug - " msg "\n", ##__VA_ARGS__)
@@ -13,13 +13,37 @@
 #define DEBUG(msg, ...) ((void)0)
 #endif
 
-#ifdef BUILD_DEBUG
-#define DVBPSI_MESSAGE_LEVEL DVBPSI_MSG_DEBUG
-#else
-#define DVBPSI_MESSAGE_LEVEL DVBPSI_MSG_WARN
-#endif
-
 #define GET_PID(pkt) (((pkt[1] & 0x1F) << 8) | pkt[2])
+#define HAS_PCR(pkt) ((pkt[3] & 0x20) && (pkt[5] & 0x10) && (pkt[4] >= 7))
+
+#define PCR_CLOCK 27000000ull
+#define PCR_WRAP ((1ull << 33) * 300)
+
+/**
+ * Read the PCR of a packet in 27MHz units, check HAS_PCR first.
+ */
+inline uint64_t get_pcr(const uint8_t* pkt)
+{
+  uint64_t base = ((uint64_t)pkt[6] << 25) | (pkt[7] << 17) | (pkt[8] << 9) |
+    (pkt[9] << 1) | (pkt[10] >> 7);
+  uint16_t ext = ((pkt[10] & 0x01) << 8) | pkt[11];
+  return base * 300 + ext;
+}
+
+/**
+ * Write a PCR in 27MHz units into a packet that has one.
+ */
+inline void set_pcr(uint8_t* pkt, uint64_t pcr)
+{
+  uint64_t base = pcr / 300;
+  uint16_t ext = pcr % 300;
+  pkt[6] = base >> 25;
+  pkt[7] = base >> 17;
+  pkt[8] = base >> 9;
+  pkt[9] = base >> 1;
+  pkt[10] = ((base & 1) << 7) | 0x7E | (ext >> 8);
+  pkt[11] = ext;
+}
 
 class DvbException : public std::runtime_error
 {
@@ -37,9 +61,19 @@ public:
 
 };
 
+/**
+ * The MPEG-2 CRC32 of a PSI section. Over a whole section, including
+ * its CRC, this is 0 if the section is intact.
+ */
+uint32_t crc32_mpeg(const uint8_t* data, size_t len);
+
 std::string join_path(std::vector<std::string> path);
 
-void handle_dvbpsi_message(dvbpsi_t *_, const dvbpsi_msg_level_t level, const char* msg);
+/**
+ * Create OUT_DIR if needed and make it the working directory, which is
+ * where all the channel output is written.
+ */
+void enter_output_dir();
 
 using fmt = boost::format;
 
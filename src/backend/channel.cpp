@@ -5,96 +5,356 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <sstream>
 
 #include "util.hpp"
 #include "log.hpp"
 #include "segment.hpp"
+#include "si_processor.hpp"
+#include "psi_generator.hpp"
 
 #include "channel.hpp"
-#include <dvbpsi/psi.h>
 
 #define NUM_SEGMENTS 9
 #define SEGMENT_LENGTH 9850000000ull // 9.85s in ns
+#define SEGMENT_MIN_LENGTH 6000000000ull // Shortest segment cut on a random access point
 #define NS 1000000000ull
 #define INDEX_SUFFIX ".m3u8"
-#define HAS_PCR(pkt) ((pkt[3] & 0x20) && (pkt[5] & 0x10) && (pkt[4] >= 7))
 
-timespec Channel::m_curr_time = { 0 };
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
-Channel::Channel(uint16_t id) :
-    m_time { 0 },
+static std::string service_label(const std::string& multiplex, uint16_t id)
+{
+  return (fmt("%s,service=\"%u\"") % mux_label(multiplex) % id).str();
+}
+
+Channel::Channel(uint16_t id, uint16_t pmt_pid, const std::string& multiplex) :
+    m_time(0),
+    m_now { 0 },
     m_id(id),
+    m_pmt_pid(pmt_pid),
     m_name(),
-    m_out_dir(),
+    m_out_dir((fmt("service_%u") % id).str()),
     m_output_fd(-1),
     m_buffer_len(0),
+    m_iov(),
+    m_pending(0),
+    m_position(0),
+    m_write_threshold(CHANNEL_WRITE_MIN),
+    m_rate_time { 0 },
+    m_rate_bytes(0),
     m_segments(),
     m_sequence_number(0),
+    m_discontinuity_sequence(0),
+    m_discontinuity(0),
+    m_keep_output(0),
     m_pids(0),
+    m_essential_pids(),
+    m_have_pmt(0),
+    m_pmt_version(0),
+    m_ca(0),
+    m_ready(0),
+    m_trimmed(0),
+    m_parked(0),
+    m_scrambled(0),
+    m_scrambled_run(0),
     m_buf(0),
-    m_dvbpsi_pmt(0),
+    m_pmt_sections([this](const uint8_t* section, size_t len) { _process_pmt(section, len); }),
+    m_scanning_pmt(0),
     m_enabled(1),
-    m_pat { 0 },
-    m_vpid(0)
+    m_active(1),
+    m_activated { 0 },
+    m_psi_lock(),
+    m_next_psi { 0, ES_CODEC_NONE, 0, 0, std::vector<uint8_t>(), std::vector<uint8_t>(), std::vector<uint8_t>() },
+    m_psi_due(0),
+    m_handed_psi(),
+    m_pat(),
+    m_pmt(),
+    m_sdt(),
+    m_eit(),
+    m_pat_cc(0x0F),
+    m_pmt_cc(0x0F),
+    m_sdt_cc(0x0F),
+    m_eit_cc(0x0F),
+    m_pmt_section(),
+    m_si_time(0),
+    m_vpid(0),
+    m_vcodec(ES_CODEC_NONE),
+    m_pcr_pid(0),
+    m_clock_pid(0),
+    m_clock(),
+    m_clock_jump(0),
+    m_es(),
+    m_held(),
+    m_held_refs(),
+    m_rap_time(0),
+    m_gop(SEGMENT_LENGTH - SEGMENT_MIN_LENGTH),
+    m_restamper(NULL),
+    m_uring(NULL),
+    m_index_due(0),
+    m_labels(service_label(multiplex, id)),
+    m_writes("segment_writes_total", m_labels),
+    m_write_bytes("segment_write_bytes_total", m_labels),
+    m_threshold_stat("segment_write_threshold_bytes", m_labels),
+    m_activation_latency("channel_activation_latency_ms", m_labels),
+    m_first_segment("channel_first_segment_ms", m_labels),
+    m_write_times(),
+    m_write_p99("channel_write_p99_us", m_labels)
 {
   m_buf = new uint8_t[CHANNEL_BUF_SIZE];
+  m_threshold_stat.set(m_write_threshold);
+  psi_packetize(0, psi_pat_section(id, pmt_pid), m_pat);
+  m_pmt_sections.want(PSI_TABLE_PMT);
 }
 
-void Channel::_process_pmt(void* self, dvbpsi_pmt_t* pmt)
+static bool has_descriptors(const PsiDescriptors& descriptors, uint8_t tag)
 {
-  Channel* ths = static_cast<Channel*>(self);
-  dvbpsi_pmt_es_t* es = pmt->p_first_es;
+  uint8_t len;
+  return psi_find_descriptor(descriptors, tag, len) != NULL;
+}
 
-  ths->m_pids.push_back(pmt->i_pcr_pid);
+static bool has_descriptor(const PsiStream& es, uint8_t tag)
+{
+  return has_descriptors(es.descriptors, tag);
+}
 
-  while (es)
+static bool is_audio(const PsiStream& es)
+{
+  switch (es.type)
   {
-    ths->m_pids.push_back(es->i_pid);
-    es = es->p_next;
-    if (es->i_type == 0x01 || es->i_type == 0x02) ths->m_vpid = es->i_pid;
+  case 0x03: // MPEG-1 audio
+  case 0x04: // MPEG-2 audio
+  case 0x0F: // AAC
+  case 0x11: // LATM AAC
+  case 0x81: // ATSC AC-3
+    return true;
+  case 0x06: // PES private data, AC-3, E-AC-3 or AAC descriptor
+    return has_descriptor(es, 0x6A) || has_descriptor(es, 0x7A) || has_descriptor(es, 0x7C);
+  default:
+    return false;
   }
-  dvbpsi_pmt_delete(pmt);
 }
 
-void Channel::_create_pat(uint16_t pmt_pid)
+/**
+ * Streams that can be dropped without losing the picture or main sound:
+ * teletext, data carousels and any audio after the first.
+ */
+static bool is_optional(const PsiStream& es, bool have_audio)
 {
-  uint8_t* p_pkt = &m_pat[0];
-  uint8_t len = 0;
-  dvbpsi_pat_t pat;
-  dvbpsi_psi_section_t* section = 0;
-  dvbpsi_t *dvbpsi = dvbpsi_new(handle_dvbpsi_message, DVBPSI_MESSAGE_LEVEL);
-  dvbpsi_pat_init(&pat, 1, 0, 1);
-  dvbpsi_pat_program_add(&pat, m_id, pmt_pid);
-  section = dvbpsi_pat_sections_generate(dvbpsi, &pat, 1);
+  if (is_audio(es)) return have_audio;
+  if (es.type == 0x06) return has_descriptor(es, 0x56);
+  return es.type == 0x05 || (es.type >= 0x0A && es.type <= 0x0D);
+}
 
-  m_pat[0] = 0x47;
-  m_pat[1] = 0x40;
-  m_pat[2] = 0x00;
-  m_pat[3] = 0x10;
-  m_pat[4] = 0x00;
+void Channel::_process_pmt(const uint8_t* section, size_t len)
+{
+  PsiPmt pmt;
+  if (m_have_pmt || !psi_parse_pmt(section, len, pmt) || pmt.program != m_id) return;
+  bool have_audio = 0;
+  uint16_t vpid = 0;
+  uint16_t audio_pid = 0;
+  int vcodec = ES_CODEC_NONE;
+  // CA descriptors are tag 0x09.
+  bool ca = has_descriptors(pmt.descriptors, 0x09);
+  std::vector<int> pids(1, pmt.pcr_pid);
+  std::vector<int> essential(1, pmt.pcr_pid);
 
-  len = section->p_payload_end - section->p_data;
-  if (section->b_syntax_indicator) len += 4;
+  for (uint16_t i = 0; i < pmt.count; i++)
+  {
+    const PsiStream& es = pmt.streams[i];
+    pids.push_back(es.pid);
+    if (!vpid && es_video_codec(es.type) != ES_CODEC_NONE)
+    {
+      vpid = es.pid;
+      vcodec = es_video_codec(es.type);
+    }
+    // The PCR can be carried on any stream.
+    if (!is_optional(es, have_audio) || es.pid == pmt.pcr_pid)
+    {
+      essential.push_back(es.pid);
+    }
+    if (!have_audio && is_audio(es)) audio_pid = es.pid;
+    have_audio |= is_audio(es);
+    ca |= has_descriptor(es, 0x09);
+  }
+  m_pmt_version = pmt.version;
+  m_ca = ca;
+  {
+    std::lock_guard<std::mutex> lock(m_psi_lock);
+    m_next_psi.vpid = vpid;
+    m_next_psi.vcodec = vcodec;
+    m_next_psi.pcr_pid = pmt.pcr_pid;
+    // Segments are timed by the video, or by the sound of a radio service.
+    m_next_psi.clock_pid = vpid ? vpid : audio_pid ? audio_pid : pmt.count ? pmt.streams[0].pid : 0;
+    m_psi_due = 1;
+  }
+  // Written as it is until the next version.
+  _set_pmt(std::vector<uint8_t>(section, section + len));
 
-  p_pkt += 5;
-  memcpy(p_pkt, section->p_data, len);
-  p_pkt += len;
-  memset(p_pkt, 0xFF, &m_pat[TS_PACKET_SIZE] - p_pkt);
+  // Streams restored from the cache, or changed by the broadcaster.
+  if (!m_pids.empty() && (pids != m_pids || essential != m_essential_pids))
+  {
+    INFO("Streams of '%s' have changed", m_name.c_str());
+  }
+  m_pids = pids;
+  m_essential_pids = essential;
+  m_have_pmt = 1;
+  m_ready = 1;
+}
+
+bool Channel::handPsi()
+{
+  if (!m_psi_due) return 0;
+  std::lock_guard<std::mutex> lock(m_psi_lock);
+  m_handed_psi.push_back(m_next_psi);
+  m_psi_due = 0;
+  return 1;
+}
+
+void Channel::_take_psi()
+{
+  std::lock_guard<std::mutex> lock(m_psi_lock);
+  Psi& psi = m_handed_psi.front();
+  m_vpid = psi.vpid;
+  m_vcodec = psi.vcodec;
+  m_pcr_pid = psi.pcr_pid;
+  m_clock_pid = psi.clock_pid;
+  m_pmt.swap(psi.pmt);
+  m_sdt.swap(psi.sdt);
+  m_eit.swap(psi.eit);
+  m_handed_psi.pop_front();
+}
+
+void Channel::_set_pmt(const std::vector<uint8_t>& section)
+{
+  std::vector<uint8_t> packets;
+  psi_packetize(m_pmt_pid, section, packets);
+  std::lock_guard<std::mutex> lock(m_psi_lock);
+  m_next_psi.pmt.swap(packets);
+  m_psi_due = 1;
+  m_pmt_section = section;
+}
 
-  dvbpsi_DeletePSISections(section);
-  dvbpsi_pat_empty(&pat);
-  dvbpsi_delete(dvbpsi);
+void Channel::_queue(uint8_t* pkt)
+{
+  m_rate_bytes += TS_PACKET_SIZE;
+  m_position += TS_PACKET_SIZE;
+  // Packets for one service are often adjacent in the mux.
+  if (!m_iov.empty())
+  {
+    iovec& last = m_iov.back();
+    if (static_cast<uint8_t*>(last.iov_base) + last.iov_len == pkt)
+    {
+      last.iov_len += TS_PACKET_SIZE;
+      m_pending += TS_PACKET_SIZE;
+      return;
+    }
+  }
+  m_iov.push_back({ pkt, TS_PACKET_SIZE });
+  m_pending += TS_PACKET_SIZE;
 }
 
 void Channel::_flush_channel()
 {
-  if (write(m_output_fd, m_buf, m_buffer_len) < 0)
+  if (m_uring)
   {
-    throw WriteException(fmt("Failed writing channel output: %s") % strerror(errno));
+    // Copied out, so the packets can be reused at once.
+    m_uring->write(m_iov.data(), m_iov.size());
+    m_write_bytes.add(m_pending);
+    m_iov.clear();
+    m_pending = 0;
+    m_buffer_len = 0;
+    return;
   }
+  size_t start = 0;
+  while (start < m_iov.size())
+  {
+    int count = std::min<size_t>(m_iov.size() - start, IOV_MAX);
+    ssize_t len = writev(m_output_fd, &m_iov[start], count);
+    if (len < 0)
+    {
+      if (errno == EINTR) continue;
+      throw WriteException(fmt("Failed writing channel output: %s") % strerror(errno));
+    }
+    m_writes.add();
+    m_write_bytes.add(len);
+    // Skip over whatever was written, a short write leaves a partial iovec.
+    while (len > 0)
+    {
+      iovec& iov = m_iov[start];
+      if (static_cast<size_t>(len) < iov.iov_len)
+      {
+        iov.iov_base = static_cast<uint8_t*>(iov.iov_base) + len;
+        iov.iov_len -= len;
+        break;
+      }
+      len -= iov.iov_len;
+      start++;
+    }
+  }
+  m_iov.clear();
+  m_pending = 0;
   m_buffer_len = 0;
 }
 
+void Channel::_compact()
+{
+  // Copy the queued packets into m_buf in order so they outlive the
+  // source buffers. Packets already in m_buf only move towards the end,
+  // so working backwards never overwrites one that is still to be moved.
+  size_t offset = m_pending;
+  for (auto iov = m_iov.rbegin(); iov != m_iov.rend(); ++iov)
+  {
+    offset -= iov->iov_len;
+    memmove(m_buf + offset, iov->iov_base, iov->iov_len);
+  }
+  m_iov.clear();
+  m_iov.push_back({ m_buf, m_pending });
+  m_buffer_len = m_pending;
+}
+
+void Channel::_settle()
+{
+  // Written, or copied so they outlive the packets they came from.
+  if (m_pending >= m_write_threshold)
+  {
+    _flush_channel();
+  }
+  else
+  {
+    _compact();
+  }
+}
+
+void Channel::_update_threshold()
+{
+  uint64_t elapsed = (m_now.tv_sec * NS + m_now.tv_nsec) -
+    (m_rate_time.tv_sec * NS + m_rate_time.tv_nsec);
+  if (elapsed < NS) return;
+
+  if (m_rate_time.tv_sec || m_rate_time.tv_nsec)
+  {
+    // Bytes per CHANNEL_WRITE_INTERVAL, rounded to whole packets.
+    uint64_t threshold = m_rate_bytes * CHANNEL_WRITE_INTERVAL * 1000000ull / elapsed;
+    threshold -= threshold % TS_PACKET_SIZE;
+    m_write_threshold = std::min<uint64_t>(std::max<uint64_t>(threshold, CHANNEL_WRITE_MIN), CHANNEL_BUF_SIZE);
+    m_threshold_stat.set(m_write_threshold);
+  }
+  if (!m_write_times.empty())
+  {
+    // How long the channel held up the thread writing it, worst cases and all.
+    auto p99 = m_write_times.begin() + m_write_times.size() * 99 / 100;
+    std::nth_element(m_write_times.begin(), p99, m_write_times.end());
+    m_write_p99.set(*p99);
+    m_write_times.clear();
+  }
+  m_rate_time = m_now;
+  m_rate_bytes = 0;
+}
+
 void Channel::_write_index_file()
 {
   std::string index_file = m_out_dir + INDEX_SUFFIX;
@@ -106,6 +366,18 @@ void Channel::_write_index_file()
       fmt("Failed to write the index - %s: %s") % index_file % strerror(errno)
     );
   }
+  // Segments must be available for the length of the playlist
+  // after they are removed from the file. The first is still being written.
+  int last = std::min<int>((NUM_SEGMENTS - 1) / 2, m_segments.size() - 1);
+  // Clients number the first segment listed by those that have left the
+  // playlist, and count the discontinuities that went with them.
+  uint32_t sequence = m_sequence_number;
+  uint32_t discontinuity_sequence = m_discontinuity_sequence;
+  for (int i = last + 1; i < (int)m_segments.size(); i++)
+  {
+    sequence++;
+    if (m_segments[i].discontinuity()) discontinuity_sequence++;
+  }
   fprintf
   (
     index_fd,
@@ -114,20 +386,45 @@ void Channel::_write_index_file()
     "#EXT-X-VERSION:3\n"
     "#EXT-X-MEDIA-SEQUENCE:%u\n",
     Segment::target_duration,
-    m_sequence_number
+    sequence
   );
-  m_sequence_number++;
-  // Segments must be available for the length of the playlist
-  // after they are removed from the file.
-  for (int i = (NUM_SEGMENTS - 1) / 2; i > 0; i--)
+  if (discontinuity_sequence)
   {
-    // TODO: Use calculate the length of the file using dts values
-    fprintf(index_fd, "#EXTINF:%.1f\n", m_segments[i].duration() / 1000.0);
+    fprintf(index_fd, "#EXT-X-DISCONTINUITY-SEQUENCE:%u\n", discontinuity_sequence);
+  }
+  if (m_segments.size() < 2)
+  {
+    // Nothing playable yet, clients keep polling until there is.
+    fclose(index_fd);
+    return;
+  }
+  for (int i = last; i > 0; i--)
+  {
+    if (m_segments[i].discontinuity())
+    {
+      fprintf(index_fd, "#EXT-X-DISCONTINUITY\n");
+    }
+    fprintf(index_fd, "#EXTINF:%.3f\n", m_segments[i].duration() / 1000.0);
     fprintf(index_fd, "%s\n", m_segments[i].name());
   }
   fprintf(index_fd, "\n");
   fclose(index_fd);
   DEBUG("Wrote index file: %s", index_file.c_str());
+
+  if (m_activated.tv_sec || m_activated.tv_nsec)
+  {
+    uint64_t latency = ((m_now.tv_sec * NS + m_now.tv_nsec) -
+        (m_activated.tv_sec * NS + m_activated.tv_nsec)) / 1000000;
+    INFO("'%s' playable %.1fs after activation", m_name.c_str(), latency / 1000.0);
+    m_activation_latency.set(latency);
+    m_activated = { 0 };
+  }
+}
+
+void Channel::_retire_segment(const Segment& segment)
+{
+  m_sequence_number++;
+  if (segment.discontinuity()) m_discontinuity_sequence++;
 }
 
 std::string Channel::index_file() const
@@ -137,25 +434,51 @@ std::string Channel::index_file() const
 
 void Channel::setName(const std::string& name)
 {
-  m_name = name;
+  std::string out_dir;
   for (auto chr : name)
   {
-    m_out_dir += (chr == ' ') ? '_' : tolower(chr);
+    out_dir += (chr == ' ') ? '_' : tolower(chr);
+  }
+  m_name = name;
+  if (out_dir.empty() || out_dir == m_out_dir) return;
+
+  // Until the SDT names it, the service is written under its id.
+  std::string old_index = index_file();
+  std::string old_dir = m_out_dir;
+  m_out_dir = out_dir;
+  if (m_segments.empty() && access(old_index.c_str(), F_OK) < 0) return;
+
+  mkdir(m_out_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  for (auto& segment : m_segments)
+  {
+    std::string moved = m_out_dir + (segment.name() + old_dir.size());
+    if (rename(segment.name(), moved.c_str()) < 0)
+    {
+      WARNING("Failed to move %s to %s: %s", segment.name(), moved.c_str(), strerror(errno));
+      continue;
+    }
+    segment.set_name(moved);
+  }
+  rmdir(old_dir.c_str());
+  if (unlink(old_index.c_str()) == 0)
+  {
+    try
+    {
+      _write_index_file();
+    }
+    catch (WriteException &e)
+    {
+      ERROR("%s : disabling '%s'", e.what(), m_name.c_str());
+      disable();
+    }
   }
 }
 
 void Channel::_create_new_segment()
 {
-  time_t rawtime;
-  struct tm *info;
-  time(&rawtime);
-  info = localtime(&rawtime);
-  char time_str[16];
-  strftime(time_str, sizeof(time_str), "%Y%m%d%H%M%S", info);
-  std::string segment_file(join_path({m_out_dir, time_str}));
-  segment_file += ".ts";
-
-  DEBUG("Creating new segment: %s...", segment_file.c_str());
+  uint64_t now = _stream_time();
+  // Each segment carries the SDT and EIT from the start.
+  m_si_time = 0;
   if (access(m_out_dir.c_str(), F_OK) < 0)
   {
     if (mkdir(m_out_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0)
@@ -171,118 +494,492 @@ void Channel::_create_new_segment()
   {
     Segment& old = m_segments.back();
     DEBUG("Deleting %s", old.name());
-    unlink(old.name());
+    if (m_uring)
+    {
+      m_uring->unlink(old.name());
+    }
+    else
+    {
+      unlink(old.name());
+    }
+    _retire_segment(old);
     m_segments.pop_back();
   }
+  // Named by its media sequence number, which carries on across restarts
+  // with the cache, so a replay gives the same names however fast it runs.
+  uint32_t sequence = m_sequence_number + m_segments.size();
+  std::string segment_file(join_path({m_out_dir, (fmt("%u.ts") % sequence).str()}));
+  DEBUG("Creating new segment: %s...", segment_file.c_str());
   if (m_output_fd > 0)
   {
     // Flush any remaining packets.
     _flush_channel();
-    close(m_output_fd);
+    // The writer closes its segments once they are written.
+    if (!m_uring) close(m_output_fd);
+    m_segments.front().set_duration((now - m_time) / 1000000);
   }
+  m_time = now;
   int mode = S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH;
-  if ((m_output_fd = open(segment_file.c_str(), O_WRONLY | O_CREAT, mode)) < 0)
+  if ((m_output_fd = open(segment_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode)) < 0)
   {
     throw DvbException
     (
       fmt("Failed to create new segment %s : %s") % segment_file % strerror(errno)
     );
   }
+  if (m_uring) m_uring->open(m_output_fd);
 
-  m_segments.push_front(Segment(segment_file));
-  if (m_segments.size() >= ((NUM_SEGMENTS - 1) / 2))
+  if (m_segments.empty() && (m_activated.tv_sec || m_activated.tv_nsec))
   {
-    _write_index_file();
+    uint64_t ttfs = ((m_now.tv_sec * NS + m_now.tv_nsec) -
+        (m_activated.tv_sec * NS + m_activated.tv_nsec)) / 1000000;
+    INFO("'%s' started its first segment %.1fs after activation", m_name.c_str(), ttfs / 1000.0);
+    m_first_segment.set(ttfs);
   }
-}
-
-int Channel::startPmtScan(dvbpsi_message_cb callback)
-{
-  m_dvbpsi_pmt = dvbpsi_new(callback, DVBPSI_MESSAGE_LEVEL);
-  if (m_dvbpsi_pmt == NULL)
+  m_segments.push_front(Segment(segment_file));
+  if (m_discontinuity || m_clock_jump)
   {
-    throw DvbException("Failed to decode PMT");
+    // The first segment after those left by the last run, or after the
+    // timestamps jumped.
+    m_segments.front().set_discontinuity();
+    m_discontinuity = 0;
+    m_clock_jump = 0;
   }
-
-  if (!dvbpsi_pmt_attach(m_dvbpsi_pmt, m_id, &_process_pmt, this))
+  if (m_segments.size() >= 2)
   {
-    throw DvbException("Failed to decode PMT");
+    if (m_uring)
+    {
+      // Once the last segment has been written, see writePackets().
+      m_index_due = 1;
+    }
+    else
+    {
+      _write_index_file();
+    }
   }
-  return 0;
+}
+
+void Channel::startPmtScan()
+{
+  if (m_scanning_pmt) return;
+  // The streams already known are kept until the PMT is decoded again.
+  m_have_pmt = 0;
+  m_pmt_sections.reset();
+  m_scanning_pmt = 1;
 }
 
 std::vector<int>* Channel::readPmt(uint8_t* buf)
 {
-  if (m_dvbpsi_pmt)
+  if (m_scanning_pmt)
   {
-    dvbpsi_packet_push(m_dvbpsi_pmt, buf);
-    _create_pat(GET_PID(buf));
+    m_pmt_sections.push(buf);
 
-    if (m_pids.size() > 0)
+    if (m_have_pmt)
     {
-      dvbpsi_pmt_detach(m_dvbpsi_pmt);
-      dvbpsi_delete(m_dvbpsi_pmt);
-      m_dvbpsi_pmt = NULL;
+      m_scanning_pmt = 0;
       return &m_pids;
     }
   }
   return NULL;
 }
 
-uint8_t Channel::_has_dts(uint8_t* buf)
+int Channel::_random_access(const PacketRef& ref)
 {
-  return 0;
+  if (ref.flags & TS_FLAG_RAI) return ES_RANDOM_ACCESS;
+
+  // Otherwise from the first picture, which is usually in this packet or
+  // within the next few of the PES.
+  m_es.start(m_vcodec);
+  return m_es.scan(ref.pkt, ref.flags, ref.payload);
 }
 
-void Channel::writePacket(uint8_t* buf, uint16_t pid)
+void Channel::_hold(const PacketRef& ref)
 {
-  uint8_t* pkt = buf;
+  uint16_t vpid = m_vpid;
+  bool next_pes = ref.pid == vpid && (ref.flags & TS_FLAG_PUSI);
+  int result = ES_MORE;
+  if (!next_pes)
+  {
+    // Copied, as the batch it came in may be gone before the picture arrives.
+    m_held.insert(m_held.end(), ref.pkt, ref.pkt + TS_PACKET_SIZE);
+    m_held_refs.push_back(ref);
+    if (ref.pid == vpid) result = m_es.scan(ref.pkt, ref.flags, ref.payload);
+    if (result == ES_MORE && m_held.size() < CHANNEL_BUF_SIZE) return;
+  }
+  // Cut short by the next PES, or too far in to be a picture header, the
+  // parameter sets go with a random access point.
+  _release(result == ES_RANDOM_ACCESS || (result == ES_MORE && m_es.parameter_sets()));
+  if (next_pes) _write_packet(ref);
+}
 
-  if (!m_enabled) return;
-  try
+void Channel::_release(bool random_access)
+{
+  std::vector<uint8_t> held;
+  std::vector<PacketRef> refs;
+  held.swap(m_held);
+  refs.swap(m_held_refs);
+  for (size_t i = 0; i < refs.size(); i++)
   {
-    // Start each segment with PAT
-    if ((m_output_fd == -1) || (pid == 0 && _check_new_segment_required()))
+    refs[i].pkt = &held[i * TS_PACKET_SIZE];
+  }
+  _output_packet(refs[0], random_access);
+  // None of the rest start a video PES, so none are held again.
+  for (size_t i = 1; i < refs.size(); i++)
+  {
+    _write_packet(refs[i]);
+  }
+  // Out of the held packets before they are reused.
+  _settle();
+  held.clear();
+  refs.clear();
+  m_held.swap(held);
+  m_held_refs.swap(refs);
+}
+
+void Channel::_update_clock(const PacketRef& ref)
+{
+  uint64_t timestamp;
+  if (!es_timestamp(ref.pkt, ref.flags, ref.payload, timestamp)) return;
+  bool started = m_clock.started();
+  bool continuous = m_clock.update(timestamp);
+  if (!started)
+  {
+    // Timed by the wall clock until now.
+    uint64_t now = _stream_time();
+    if (m_time) m_time = now;
+    if (m_si_time) m_si_time = now;
+    m_rap_time = 0;
+  }
+  else if (!continuous && m_output_fd != -1)
+  {
+    // Players need to be told, the segment can't carry on across it.
+    m_clock_jump = 1;
+    _create_new_segment();
+    _queue_psi();
+  }
+}
+
+uint64_t Channel::_stream_time() const
+{
+  // In ns, from ES_CLOCK ticks.
+  if (m_clock.started()) return m_clock.time() * (NS / 10000) / (ES_CLOCK / 10000);
+  return m_now.tv_sec * NS + m_now.tv_nsec;
+}
+
+void Channel::_write_packet(const PacketRef& ref)
+{
+  if (!m_held.empty())
+  {
+    // Waiting to see whether the video PES is a random access point.
+    _hold(ref);
+    return;
+  }
+  uint16_t pid = ref.pid;
+  if ((ref.flags & TS_FLAG_DISCONTINUITY) && (pid == m_pcr_pid || pid == m_clock_pid))
+  {
+    // A discontinuity indicator, the time base may change.
+    m_clock.discontinuity();
+  }
+  if (pid == m_clock_pid && (ref.flags & TS_FLAG_PUSI)) _update_clock(ref);
+
+  int result = ES_NOT_RANDOM_ACCESS;
+  if (m_vpid && pid == m_vpid && (ref.flags & TS_FLAG_PUSI))
+  {
+    result = _random_access(ref);
+    if (result == ES_MORE)
     {
-      _create_new_segment();
+      // The first picture is in a later packet, possibly of the next batch.
+      m_held.assign(ref.pkt, ref.pkt + TS_PACKET_SIZE);
+      m_held_refs.assign(1, ref);
+      return;
     }
+  }
+  _output_packet(ref, result == ES_RANDOM_ACCESS);
+}
 
-    // Rewrite PAT
-    // TODO: Also need to re-write SDT.
-    if (pid == 0)
+void Channel::_output_packet(const PacketRef& ref, bool random_access)
+{
+  uint8_t* pkt = ref.pkt;
+  uint16_t pid = ref.pid;
+  uint16_t vpid = m_vpid;
+  if (vpid)
+  {
+    // Each segment starts on a random access point of the video, with
+    // the PSI in front, so it can be decoded on its own.
+    if (m_output_fd == -1 && !m_time) m_time = _stream_time();
+    if (pid == vpid && random_access)
     {
-      pkt = &m_pat[0];
-      pkt[3] = (((pkt[3] + 1) & 0x0F) | 0x10);
+      uint64_t now = _stream_time();
+      if (m_rap_time && now > m_rap_time)
+      {
+        m_gop = std::min<uint64_t>(now - m_rap_time, SEGMENT_LENGTH - SEGMENT_MIN_LENGTH);
+      }
+      m_rap_time = now;
+      // The last one before SEGMENT_LENGTH, going by the length of the last GOP.
+      if (m_output_fd == -1 || _segment_due(SEGMENT_LENGTH - m_gop))
+      {
+        _create_new_segment();
+        _queue_psi();
+      }
     }
+    else if (pid == 0 && _segment_due(SEGMENT_LENGTH))
+    {
+      // None in time, e.g. a GOP too long to fit.
+      _create_new_segment();
+    }
+    // Nothing before the first one can be decoded.
+    if (m_output_fd == -1) return;
+  }
+  else if ((m_output_fd == -1) || (pid == 0 && _segment_due(SEGMENT_LENGTH)))
+  {
+    // Start each segment with PAT
+    _create_new_segment();
+  }
 
-    memcpy(m_buf + m_buffer_len, pkt, TS_PACKET_SIZE);
-    m_buffer_len += TS_PACKET_SIZE;
+  // The PAT is replaced by the service's own PSI.
+  if (pid == 0)
+  {
+    _queue_psi();
+    return;
+  }
+
+  if (m_restamper && pid == m_pcr_pid && (ref.flags & TS_FLAG_PCR))
+  {
+    _queue_restamped(pkt);
+    return;
+  }
+  _queue(pkt);
+}
+
+void Channel::_queue_restamped(const uint8_t* pkt)
+{
+  // A copy, as other channels may be writing the same packet.
+  if (m_buffer_len == CHANNEL_BUF_SIZE)
+  {
+    _flush_channel();
+  }
+  uint8_t* copy = m_buf + m_buffer_len;
+  memcpy(copy, pkt, TS_PACKET_SIZE);
+  set_pcr(copy, m_restamper->restamp(get_pcr(copy), m_position, copy[5] & 0x80));
+  m_buffer_len += TS_PACKET_SIZE;
+  _queue(copy);
+}
+
+void Channel::restamp_pcr(bool enable)
+{
+  if (enable && !m_restamper)
+  {
+    m_restamper = new PcrRestamper(m_labels);
+  }
+  else if (!enable && m_restamper)
+  {
+    delete m_restamper;
+    m_restamper = NULL;
+  }
+}
+
+void Channel::use_io_uring(bool enable)
+{
+  if (enable && !m_uring)
+  {
+    m_uring = new UringWriter(m_labels);
+  }
+  else if (!enable && m_uring)
+  {
+    delete m_uring;
+    m_uring = NULL;
+  }
+}
+
+void Channel::_queue_psi()
+{
+  _queue_copies(m_pat, m_pat_cc);
+  _queue_copies(m_pmt, m_pmt_cc);
+
+  uint64_t now = _stream_time();
+  if (m_si_time && now - m_si_time < CHANNEL_SI_INTERVAL * 1000000ull) return;
+  m_si_time = now;
+  _queue_copies(m_sdt, m_sdt_cc);
+  if (!m_trimmed) _queue_copies(m_eit, m_eit_cc);
+}
+
+void Channel::_queue_copies(const std::vector<uint8_t>& packets, uint8_t& cc)
+{
+  // Each copy needs its own packets, as the continuity counter differs
+  // between them.
+  for (size_t offset = 0; offset < packets.size(); offset += TS_PACKET_SIZE)
+  {
     if (m_buffer_len == CHANNEL_BUF_SIZE)
     {
       _flush_channel();
     }
+    uint8_t* pkt = m_buf + m_buffer_len;
+    memcpy(pkt, &packets[offset], TS_PACKET_SIZE);
+    cc = (cc + 1) & 0x0F;
+    pkt[3] = (pkt[3] & 0xF0) | cc;
+    m_buffer_len += TS_PACKET_SIZE;
+    _queue(pkt);
+  }
+}
+
+void Channel::set_si(uint16_t pid, const std::vector<uint8_t>& packets)
+{
+  std::lock_guard<std::mutex> lock(m_psi_lock);
+  (pid == SI_PID_SDT ? m_next_psi.sdt : m_next_psi.eit) = packets;
+  m_psi_due = 1;
+}
+
+void Channel::writePackets(const PacketRef* refs, size_t count, const timespec& now)
+{
+  if (count && !refs[0].pkt)
+  {
+    _take_psi();
+    refs++;
+    count--;
+  }
+  if (!streaming()) return;
+  m_now = now;
+  timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  try
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      _write_packet(refs[i]);
+    }
+    _update_threshold();
+    _settle();
+    if (m_uring)
+    {
+      m_uring->submit();
+      m_writes.add(m_uring->take_syscalls());
+      if (!m_uring->error().empty())
+      {
+        throw WriteException(fmt("Failed writing channel output: %s") % m_uring->error());
+      }
+      if (m_index_due && m_uring->settled())
+      {
+        _write_index_file();
+        m_index_due = 0;
+      }
+    }
   }
   catch(WriteException &e)
   {
     ERROR("%s : disabling '%s'", e.what(), m_name.c_str());
     disable(); 
   }
+  _record_write_time(start);
+}
+
+void Channel::_record_write_time(const timespec& start)
+{
+  timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  m_write_times.push_back(((end.tv_sec - start.tv_sec) * NS + end.tv_nsec - start.tv_nsec) / 1000);
 }
 
-inline bool Channel::_check_new_segment_required()
+inline bool Channel::_segment_due(uint64_t length) const
 {
-  bool new_segment = 0;
-  uint64_t delta = (m_curr_time.tv_sec * NS + m_curr_time.tv_nsec) -
-    (m_time.tv_sec * NS + m_time.tv_nsec);
-  new_segment = (delta >= SEGMENT_LENGTH);
-  if (new_segment) m_time = m_curr_time;
-  return new_segment;
+  return _stream_time() - m_time >= length;
+}
+
+void Channel::activate(const timespec& now)
+{
+  m_active = 1;
+  m_activated = now;
+}
+
+void Channel::deactivate()
+{
+  m_active = 0;
+  m_activated = { 0 };
+  _drop_output();
+  try
+  {
+    // Leave an empty playlist for clients to ask for.
+    _write_index_file();
+  }
+  catch (WriteException &e)
+  {
+    ERROR("%s : disabling '%s'", e.what(), m_name.c_str());
+    disable();
+  }
+}
+
+void Channel::park()
+{
+  m_parked = 1;
+  _drop_output();
+}
+
+void Channel::unpark(const timespec& now)
+{
+  m_parked = 0;
+  if (m_active)
+  {
+    activate(now);
+  }
+  else
+  {
+    // Back to an empty playlist for clients to ask for.
+    deactivate();
+  }
+}
+
+unsigned Channel::scrambling(bool scrambled)
+{
+  if (scrambled != m_scrambled)
+  {
+    m_scrambled = scrambled;
+    m_scrambled_run = 0;
+  }
+  return ++m_scrambled_run;
 }
 
 void Channel::disable()
 {
   m_enabled = 0;
+  if (m_uring) m_uring->finish();
+  m_iov.clear();
+  m_pending = 0;
+  m_buffer_len = 0;
+  _del_output();
+}
+
+void Channel::_drop_output()
+{
+  if (m_uring)
+  {
+    // Closes the segments too.
+    m_uring->finish();
+  }
+  else if (m_output_fd >= 0)
+  {
+    close(m_output_fd);
+  }
+  m_output_fd = -1;
+  m_index_due = 0;
+  m_iov.clear();
+  m_pending = 0;
+  m_buffer_len = 0;
   _del_output();
+  // Numbering carries on from them when the channel starts again.
+  for (auto& segment : m_segments)
+  {
+    _retire_segment(segment);
+  }
+  m_segments.clear();
+  m_discontinuity = 0;
+  m_time = 0;
+  m_rap_time = 0;
+  // The stream is picked up again wherever it has got to.
+  m_clock.reset();
+  m_clock_jump = 0;
+  m_position = 0;
+  m_held.clear();
+  m_held_refs.clear();
+  if (m_restamper) m_restamper->reset();
 }
 
 void Channel::_del_output()
@@ -296,17 +993,128 @@ void Channel::_del_output()
   remove(m_out_dir.c_str());
 }
 
-Channel::~Channel()
+void Channel::save_state(std::ostream& out) const
+{
+  out << "service " << m_id << ' ' << m_pmt_pid << ' ' << m_name << '\n';
+  out << "pids";
+  for (int pid : m_pids)
+  {
+    out << ' ' << pid;
+  }
+  out << "\nessential";
+  for (int pid : m_essential_pids)
+  {
+    out << ' ' << pid;
+  }
+  if (!m_pmt_section.empty())
+  {
+    out << "\npmt ";
+    for (uint8_t byte : m_pmt_section)
+    {
+      out << fmt("%02x") % (unsigned)byte;
+    }
+  }
+  uint32_t sequence = m_sequence_number;
+  uint32_t discontinuity_sequence = m_discontinuity_sequence;
+  if (!m_keep_output)
+  {
+    // Deleted on the way out, so gone from the playlist by the next run.
+    for (auto& segment : m_segments)
+    {
+      sequence++;
+      if (segment.discontinuity()) discontinuity_sequence++;
+    }
+  }
+  out << "\nsequence " << sequence << ' ' << discontinuity_sequence << '\n';
+  if (m_keep_output)
+  {
+    for (auto segment = m_segments.rbegin(); segment != m_segments.rend(); ++segment)
+    {
+      out << "segment " << segment->name() << ' ' << segment->duration() << ' ' << segment->discontinuity() << '\n';
+    }
+  }
+  out << '\n';
+}
+
+Channel* Channel::load_state(std::istream& in, const std::string& multiplex)
 {
-  if (m_enabled) _del_output();
-  if (m_dvbpsi_pmt)
+  std::string line, key;
+  if (!std::getline(in, line) || line.empty()) return NULL;
+
+  std::istringstream service(line);
+  unsigned id, pmt_pid;
+  if (!(service >> key >> id >> pmt_pid) || key != "service")
+  {
+    throw DvbException(fmt("Expected a service, found '%s'") % line);
+  }
+  Channel* chan = new Channel(id, pmt_pid, multiplex);
+  std::string name;
+  std::getline(service >> std::ws, name);
+  if (!name.empty()) chan->setName(name);
+
+  while (std::getline(in, line) && !line.empty())
+  {
+    std::istringstream fields(line);
+    fields >> key;
+    if (key == "pids" || key == "essential")
+    {
+      std::vector<int>& pids = (key == "pids") ? chan->m_pids : chan->m_essential_pids;
+      int pid;
+      while (fields >> pid)
+      {
+        pids.push_back(pid);
+      }
+    }
+    else if (key == "pmt")
+    {
+      std::string hex;
+      fields >> hex;
+      std::vector<uint8_t> section;
+      for (size_t i = 0; i + 1 < hex.size(); i += 2)
+      {
+        section.push_back(strtoul(hex.substr(i, 2).c_str(), NULL, 16));
+      }
+      // Written until the PMT is decoded again.
+      if (!section.empty() && !crc32_mpeg(section.data(), section.size())) chan->_set_pmt(section);
+    }
+    else if (key == "sequence")
+    {
+      fields >> chan->m_sequence_number >> chan->m_discontinuity_sequence;
+    }
+    else if (key == "segment")
+    {
+      std::string segment;
+      unsigned duration = 0;
+      bool discontinuity = 0;
+      fields >> segment >> duration >> discontinuity;
+      // Only carry on from segments that are still there.
+      if (access(segment.c_str(), R_OK) == 0)
+      {
+        chan->m_segments.push_front(Segment(segment, duration, discontinuity));
+        chan->m_discontinuity = 1;
+      }
+      else
+      {
+        chan->_retire_segment(Segment(segment, duration, discontinuity));
+      }
+    }
+  }
+  if (chan->m_pids.empty())
   {
-    dvbpsi_pmt_detach(m_dvbpsi_pmt);
-    dvbpsi_delete(m_dvbpsi_pmt);
-    m_dvbpsi_pmt = NULL;
+    delete chan;
+    throw DvbException(fmt("No streams cached for service %u") % id);
   }
+  chan->m_ready = 1;
+  return chan;
+}
+
+Channel::~Channel()
+{
+  if (m_enabled && !m_keep_output) _del_output();
   if (m_buf)
   {
     delete[] m_buf;
   }
+  delete m_restamper;
+  delete m_uring;
 }
@@ -0,0 +1,111 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/unistd.h>
+#include <poll.h>
+#include <string.h>
+#include <errno.h>
+
+#include "control_socket.hpp"
+#include "util.hpp"
+#include "log.hpp"
+
+ControlSocket::ControlSocket(const std::string& path) :
+    m_path(path),
+    m_fd(-1),
+    m_handlers()
+{
+}
+
+void ControlSocket::on(const std::string& command, Handler handler)
+{
+  m_handlers[command] = handler;
+}
+
+void ControlSocket::open_socket()
+{
+  sockaddr_un addr;
+  if (m_path.size() >= sizeof(addr.sun_path))
+  {
+    throw DvbException(fmt("Control socket path too long: %s") % m_path);
+  }
+  if ((m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+  {
+    throw DvbException(fmt("Failed to create control socket: %s") % strerror(errno));
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, m_path.c_str());
+
+  // Left behind if the last daemon was killed.
+  unlink(m_path.c_str());
+  if (bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(m_fd, 8) < 0)
+  {
+    throw DvbException(fmt("Failed to listen on %s: %s") % m_path % strerror(errno));
+  }
+  // The web server runs as another user.
+  chmod(m_path.c_str(), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  INFO("Listening for requests on %s", m_path.c_str());
+}
+
+std::string ControlSocket::_handle(const std::string& request)
+{
+  size_t space = request.find(' ');
+  std::string command = request.substr(0, space);
+  std::string arg = (space == std::string::npos) ? "" : request.substr(space + 1);
+
+  auto handler = m_handlers.find(command);
+  if (handler == m_handlers.end())
+  {
+    return "ERR unknown command " + command;
+  }
+  return handler->second(arg);
+}
+
+bool ControlSocket::serve(int timeout)
+{
+  pollfd pfd = { m_fd, POLLIN, 0 };
+  if (poll(&pfd, 1, timeout) <= 0) return false;
+
+  int client = accept4(m_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (client < 0) return false;
+
+  // Don't let a stalled client hold up the others.
+  timeval tv = { 1, 0 };
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  char buf[CONTROL_MAX_REQUEST];
+  size_t len = 0;
+  while (len < sizeof(buf))
+  {
+    ssize_t ret = read(client, buf + len, sizeof(buf) - len);
+    if (ret <= 0) break;
+    len += ret;
+    if (memchr(buf, '\n', len)) break;
+  }
+  std::string request(buf, len);
+  request = request.substr(0, request.find_first_of("\r\n"));
+  if (!request.empty())
+  {
+    std::string reply = _handle(request) + '\n';
+    DEBUG("Control request '%s': %s", request.c_str(), reply.c_str());
+    // A client that has gone away mustn't take the daemon with it.
+    if (send(client, reply.data(), reply.size(), MSG_NOSIGNAL) < 0)
+    {
+      WARNING("Failed to reply to control request: %s", strerror(errno));
+    }
+  }
+  close(client);
+  return true;
+}
+
+ControlSocket::~ControlSocket()
+{
+  if (m_fd >= 0)
+  {
+    close(m_fd);
+    unlink(m_path.c_str());
+  }
+}
@@ -7,14 +7,13 @@
 
 #include "util.hpp"
 #include "log.hpp"
-#include "segmenter.hpp"
 #include "daemon.hpp"
 
 #define PID_FILE "/run/shm/dvb_hls.pid"
 
-Daemon::Daemon(Segmenter& segmenter) :
+Daemon::Daemon(std::function<void()> run) :
   m_log(),
-  m_segmenter(segmenter)
+  m_run(run)
 {
 }
 
@@ -27,7 +26,7 @@ void Daemon::start()
   std::ofstream pid_file(PID_FILE, std::ofstream::app);
   pid_file << getpid() << std::endl;
   pid_file.close();
-  m_segmenter.run();
+  m_run();
 }
 
 void Daemon::stop()
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/unistd.h>
 #include <sys/poll.h>
 #include <signal.h>
@@ -19,6 +20,13 @@
 #include "dvb_hls.hpp"
 
 #define READ_TIMEOUT_MSECS 5000
+#define MMAP_BUFFERS 8
+#define MMAP_BUFFER_SIZE (348 * TS_PACKET_SIZE) // Approx 64kB
+#define DEMUX_BUFFER_SIZE (1 << 20)
+#define MAX_DEMUX_BUFFER_SIZE (16 << 20)
+// Grow the demux buffer after this many overflows within the window.
+#define OVERFLOW_LIMIT 3
+#define OVERFLOW_WINDOW 10 // seconds
 
 DvbDevice::DvbDevice(std::string multiplex, std::string transmitter, uint16_t adapter) :
     m_multiplex(multiplex),
@@ -35,7 +43,17 @@ DvbDevice::DvbDevice(std::string multiplex, std::string transmitter, uint16_t ad
     m_delivery_sys(0),
     m_demux(-1),
     m_frontend(-1),
-    m_adapter_id(adapter)
+    m_adapter_id(adapter),
+    m_use_mmap(0),
+    m_buffers(),
+    m_buffer_count(0),
+    m_filter_pids(),
+    m_filter_limit(0),
+    m_buffer_size(DEMUX_BUFFER_SIZE),
+    m_overflow_window(0),
+    m_window_overflows(0),
+    m_overflows("demux_overflows_total", mux_label(multiplex)),
+    m_buffer_stat("demux_buffer_bytes", mux_label(multiplex))
 {
 }
 
@@ -232,6 +250,7 @@ DvbDevice::~DvbDevice()
   if (m_demux != -1)
   {
     ioctl(m_demux, DMX_STOP);
+    _unmap_buffers();
     close(m_demux);
   }
 
@@ -240,32 +259,162 @@ DvbDevice::~DvbDevice()
 }
 
 
-int DvbDevice::_set_ts_filter()
+void DvbDevice::_set_pes_filter(uint16_t pid, bool start)
 {
   struct dmx_pes_filter_params filter_params;
-  // Common filter_params
   filter_params.input = DMX_IN_FRONTEND;
   filter_params.output = DMX_OUT_TSDEMUX_TAP;
-  filter_params.flags = DMX_IMMEDIATE_START;
+  filter_params.flags = start ? DMX_IMMEDIATE_START : 0;
   filter_params.pes_type = DMX_PES_OTHER;
-  const int pid = 8192;
+  filter_params.pid = pid;
+  if (ioctl(m_demux, DMX_SET_PES_FILTER, &filter_params) < 0)
+  {
+    throw DvbException(fmt("Failed to set the filter for PID %d: %s") % pid % strerror(errno));
+  }
+}
+
+int DvbDevice::_set_ts_filter()
+{
   char path[128];
   snprintf(path, sizeof(path), DEMUX_PATH, m_adapter_id);
   if ((m_demux = open(path, O_RDONLY | O_NONBLOCK)) < 0)
   {
     throw DvbException(fmt("Failed to open demux device: %s") % strerror(errno));
   }
-  // Increase buffer to 1MB
-  if (ioctl(m_demux, DMX_SET_BUFFER_SIZE, 1 << 20) < 0)
+  // Start with a 1MB buffer
+  if (ioctl(m_demux, DMX_SET_BUFFER_SIZE, m_buffer_size) < 0)
     throw DvbException("Failed to increase demux buffer");
-  filter_params.pid = pid;
-  if (ioctl(m_demux, DMX_SET_PES_FILTER, &filter_params) < 0)
+  m_buffer_stat.set(m_buffer_size);
+  // PID 8192 passes the whole multiplex.
+  _set_pes_filter(NUM_PIDS, true);
+  if (m_use_mmap && _map_buffers())
   {
-    throw DvbException(fmt("Failed to set the filter for PID %d: %s") % pid % strerror(errno));
+    INFO("Using %u memory mapped demux buffers", (unsigned)m_buffers.size());
   }
   return 0;
 }
 
+bool DvbDevice::set_pid_filter(const std::set<uint16_t>& pids)
+{
+  if (pids == m_filter_pids) return !pids.empty();
+  // Don't keep trying for as many PIDs as the demux has already run out at.
+  bool fits = !m_filter_limit || pids.size() < m_filter_limit;
+  if (!fits && m_filter_pids.empty()) return false;
+
+  if (!pids.empty() && fits)
+  {
+    bool ok = 1;
+    bool switching = m_filter_pids.empty();
+    if (switching)
+    {
+      // Switch over from the whole multiplex.
+      ioctl(m_demux, DMX_STOP);
+      _set_pes_filter(*pids.begin(), false);
+      m_filter_pids.insert(*pids.begin());
+    }
+    for (uint16_t pid : m_filter_pids)
+    {
+      if (!pids.count(pid))
+      {
+        ioctl(m_demux, DMX_REMOVE_PID, &pid);
+      }
+    }
+    size_t filtered = 0;
+    for (uint16_t pid : pids)
+    {
+      if (!m_filter_pids.count(pid) && ioctl(m_demux, DMX_ADD_PID, &pid) < 0)
+      {
+        WARNING("Failed to filter PID %u, receiving the whole multiplex: %s", pid, strerror(errno));
+        m_filter_limit = filtered + 1;
+        ok = 0;
+        break;
+      }
+      filtered++;
+    }
+    if (ok)
+    {
+      if (switching && ioctl(m_demux, DMX_START) < 0)
+      {
+        throw DvbException(fmt("Failed to start the demux: %s") % strerror(errno));
+      }
+      m_filter_pids = pids;
+      INFO("Filtering %u PIDs on adapter %u", (unsigned)pids.size(), m_adapter_id);
+      return true;
+    }
+  }
+
+  // Fall back to the whole multiplex.
+  ioctl(m_demux, DMX_STOP);
+  _set_pes_filter(NUM_PIDS, true);
+  m_filter_pids.clear();
+  return false;
+}
+
+bool DvbDevice::_map_buffers()
+{
+#ifdef DMX_REQBUFS
+  struct dmx_requestbuffers req = { MMAP_BUFFERS, MMAP_BUFFER_SIZE };
+  if (ioctl(m_demux, DMX_REQBUFS, &req) < 0 || req.count == 0)
+  {
+    WARNING("Demux buffers can't be memory mapped, using read(): %s", strerror(errno));
+    return false;
+  }
+  for (uint32_t i = 0; i < req.count; i++)
+  {
+    struct dmx_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.index = i;
+    if (ioctl(m_demux, DMX_QUERYBUF, &buf) < 0)
+      break;
+    void* data = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, m_demux, buf.offset);
+    if (data == MAP_FAILED)
+      break;
+    m_buffers.push_back({ static_cast<uint8_t*>(data), buf.length });
+  }
+  if (m_buffers.size() < req.count)
+  {
+    WARNING("Failed to map demux buffers, using read(): %s", strerror(errno));
+    _unmap_buffers();
+    return false;
+  }
+  for (uint32_t i = 0; i < req.count; i++)
+  {
+    struct dmx_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.index = i;
+    if (ioctl(m_demux, DMX_QBUF, &buf) < 0)
+    {
+      // Streaming only starts with the first buffer queued.
+      if (i > 0)
+        throw DvbException(fmt("Failed to queue demux buffer: %s") % strerror(errno));
+      WARNING("Failed to queue demux buffers, using read(): %s", strerror(errno));
+      _unmap_buffers();
+      return false;
+    }
+  }
+  return true;
+#else
+  WARNING("Built without support for memory mapped demux buffers, using read()");
+  return false;
+#endif
+}
+
+void DvbDevice::_unmap_buffers()
+{
+  for (auto& buf : m_buffers)
+  {
+    munmap(buf.data, buf.length);
+  }
+#ifdef DMX_REQBUFS
+  if (!m_buffers.empty())
+  {
+    struct dmx_requestbuffers req = { 0, 0 };
+    ioctl(m_demux, DMX_REQBUFS, &req);
+  }
+#endif
+  m_buffers.clear();
+}
+
 int DvbDevice::_poll_status()
 {
   struct pollfd pfd[1] = 
@@ -377,55 +526,120 @@ int DvbDevice::tune()
   return ret;
 }
 
-int DvbDevice::read_card(uint8_t *buf, size_t size)
+bool DvbDevice::_wait_readable()
 {
-  int len = -1;
   struct pollfd pfd[1] =
   {
     { /* .fd = */ m_demux, /* .events = */ POLLIN }
   };
-  int total = 0;
 
-  while (size)
+  int p = poll(pfd, 1, READ_TIMEOUT_MSECS);
+  if (p > 0)
+  {
+    return true;
+  }
+  else if (p < 0)
+  {
+    if (errno == EINTR) return false;
+    throw DvbException(fmt("Failed to read from the dvr device: %s") % strerror(errno));
+  }
+  // Check tuning status
+  if (_get_status() == 1)
+  {
+    throw DvbException("Device read timeout");
+  }
+  WARNING("Signal lost.");
+  return false;
+}
+
+void DvbDevice::_handle_overflow(unsigned lost)
+{
+  WARNING("Demux buffer overflow");
+  m_overflows.add(lost);
+
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec - m_overflow_window >= OVERFLOW_WINDOW)
+  {
+    m_overflow_window = now.tv_sec;
+    m_window_overflows = 0;
+  }
+  m_window_overflows += lost;
+
+  // Mapped buffers are sized up front, otherwise give the kernel more room.
+  if (m_window_overflows < OVERFLOW_LIMIT || mapped() || m_buffer_size >= MAX_DEMUX_BUFFER_SIZE)
+    return;
+  m_buffer_size *= 2;
+  m_window_overflows = 0;
+  ioctl(m_demux, DMX_STOP);
+  if (ioctl(m_demux, DMX_SET_BUFFER_SIZE, m_buffer_size) < 0)
+  {
+    WARNING("Failed to increase demux buffer: %s", strerror(errno));
+    m_buffer_size /= 2;
+  }
+  if (ioctl(m_demux, DMX_START) < 0)
+  {
+    throw DvbException(fmt("Failed to restart the demux: %s") % strerror(errno));
+  }
+  m_buffer_stat.set(m_buffer_size);
+  INFO("Increased demux buffer to %ukB", m_buffer_size >> 10);
+}
+
+ssize_t DvbDevice::read_bytes(uint8_t *buf, size_t size)
+{
+  while (_wait_readable())
   {
-    int p = poll(pfd, 1, READ_TIMEOUT_MSECS);
-    if (p > 0)
+    ssize_t len = read(m_demux, buf, size);
+    if (len < 0 && errno == EOVERFLOW)
     {
-      len = read(m_demux, buf, size);
-      if (len < 0 && errno == EOVERFLOW)
-      {
-        WARNING("Demux buffer overflow");
-        continue;
-      }
-      if (len < 0)
-      {
-        if (errno == EINTR) return 0;
-        throw DvbException(fmt("Failed to read from the dvr device: %s") % strerror(errno));
-      }
-      size -= len;
-      buf += len;
-      total += len;
+      _handle_overflow(1);
+      continue;
     }
-    else if (p < 0)
+    if (len < 0)
     {
-      if (errno == EINTR) return 0;
+      if (errno == EINTR || errno == EAGAIN) return 0;
       throw DvbException(fmt("Failed to read from the dvr device: %s") % strerror(errno));
     }
-    else
+    return len;
+  }
+  return 0;
+}
+
+uint8_t* DvbDevice::acquire_buffer(size_t& len, int& index)
+{
+#ifdef DMX_REQBUFS
+  while (_wait_readable())
+  {
+    struct dmx_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    if (ioctl(m_demux, DMX_DQBUF, &buf) < 0)
     {
-      // Check tuning status
-      if (_get_status() == 1)
-      {
-        throw DvbException("Device read timeout");
-      }
-      else
-      {
-        WARNING("Signal lost.");
-        return 0;
-      }
+      if (errno == EAGAIN) continue;
+      if (errno == EINTR) return NULL;
+      throw DvbException(fmt("Failed to dequeue demux buffer: %s") % strerror(errno));
     }
+    if (m_buffer_count && buf.count != m_buffer_count + 1)
+    {
+      _handle_overflow(buf.count - m_buffer_count - 1);
+    }
+    m_buffer_count = buf.count;
+    len = buf.bytesused;
+    index = buf.index;
+    return m_buffers[buf.index].data;
   }
+#endif
+  return NULL;
+}
 
-  // Return number of packets read.
-  return total / TS_PACKET_SIZE;
+void DvbDevice::release_buffer(int index)
+{
+#ifdef DMX_REQBUFS
+  struct dmx_buffer buf;
+  memset(&buf, 0, sizeof(buf));
+  buf.index = index;
+  if (ioctl(m_demux, DMX_QBUF, &buf) < 0)
+  {
+    throw DvbException(fmt("Failed to queue demux buffer: %s") % strerror(errno));
+  }
+#endif
 }
@@ -7,12 +7,21 @@
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <functional>
 #include <boost/program_options.hpp>
 
 #include "util.hpp"
 #include "log.hpp"
 #include "dvb.hpp"
+#include "replay.hpp"
+#include "udp_source.hpp"
 #include "segmenter.hpp"
+#include "channel.hpp"
+#include "segmenter_group.hpp"
+#include "tuner_pool.hpp"
 #include "daemon.hpp"
 
 #define TO_STR(identifier) #identifier
@@ -20,14 +29,33 @@
 #define VERSION_MAJOR 0
 #define VERSION_MINOR 1
 
-static std::string multiplex;
+static std::vector<std::string> multiplexes;
 static std::string transmitter;
 static std::string tuning_dir;
-static uint16_t adapter;
+static std::vector<uint16_t> adapters;
+static std::vector<std::string> replay_files;
+static bool replay_fast = false;
+static std::vector<std::string> udp_addresses;
+static unsigned jitter_depth;
+static bool use_mmap = false;
+static bool pid_filter = false;
+static bool ingest_thread = false;
+static int ingest_cpu;
+static int ingest_priority;
+static unsigned segment_threads;
+static bool on_demand = false;
+static bool shed_load = false;
+static bool restamp_pcr = false;
+static bool io_uring = false;
+static bool cold_start = false;
+static unsigned channel_idle;
+static unsigned tuners;
+static unsigned tuner_idle;
 static bool start_daemon = false;
 static bool stop_daemon = false;
 
-static Segmenter *p_segmenter = 0;
+static SegmenterGroup *p_group = 0;
+static TunerPool *p_pool = 0;
 
 namespace po = boost::program_options;
 
@@ -45,11 +73,40 @@ static int parse_arguments(int argc, char **argv)
   po::options_description desc((description % VERSION_MAJOR % VERSION_MINOR).str());
   desc.add_options()
       ("help,h", "Print this help message and exit.")
-      ("tuning-file,t", po::value<std::string>(&transmitter)->required(), "Name of the tuning file.")
+      ("tuning-file,t", po::value<std::string>(&transmitter), "Name of the tuning file.")
       ("tuning-path,p", po::value<std::string>(&tuning_dir)->default_value(TUNING_PATH),
           "Path to the tuning files.")
-      ("multiplex,m", po::value<std::string>(&multiplex)->required(), "Name of the multiplex in the tuning file to use.")
-      ("adapter,a", po::value<uint16_t>(&adapter)->default_value(0), "Adapter number to use.")
+      ("multiplex,m", po::value<std::vector<std::string>>(&multiplexes)->required(),
+          "Name of the multiplex in the tuning file to use, repeat to stream several.")
+      ("adapter,a", po::value<std::vector<uint16_t>>(&adapters),
+          "Adapter number to use for each multiplex, counting up from the last one given (or 0).")
+      ("replay,r", po::value<std::vector<std::string>>(&replay_files),
+          "Replay a recorded multiplex from a file ('-' for stdin) instead of an adapter, one for each multiplex.")
+      ("fast,f", "Replay as fast as possible rather than paced to the PCR.")
+      ("udp,u", po::value<std::vector<std::string>>(&udp_addresses),
+          "Receive the multiplex as UDP/RTP instead of from an adapter, e.g. 239.1.1.1:5004, one for each multiplex.")
+      ("ingest-thread", "Read from the adapter on a dedicated thread.")
+      ("ingest-cpu", po::value<int>(&ingest_cpu)->default_value(-1),
+          "CPU to pin the ingest thread to.")
+      ("ingest-priority", po::value<int>(&ingest_priority)->default_value(0),
+          "Real-time (SCHED_FIFO) priority of the ingest thread.")
+      ("tuners", po::value<unsigned>(&tuners)->default_value(0),
+          "Share this many adapters between the multiplexes, tuning them when a service is requested.")
+      ("tuner-idle", po::value<unsigned>(&tuner_idle)->default_value(TUNER_IDLE_TIMEOUT),
+          "Seconds without a request before a shared adapter may be retuned.")
+      ("segment-threads", po::value<unsigned>(&segment_threads)->default_value(0),
+          "Number of threads to write the channels on, 0 to write them as packets are read.")
+      ("on-demand", "Only stream a channel while its playlist is being read or it is requested over the control socket.")
+      ("channel-idle", po::value<unsigned>(&channel_idle)->default_value(CHANNEL_IDLE_TIMEOUT),
+          "Seconds without a request before an on demand channel stops streaming.")
+      ("shed-load", "When the multiplex can't be kept up with, drop optional streams and then pause unwatched channels.")
+      ("restamp-pcr", "Rewrite the PCRs of each channel to suit its own stream, for smoother playback.")
+      ("io-uring", "Write segments through io_uring rather than blocking write() calls, where the kernel supports it.")
+      ("pid-filter", "Only receive the PIDs of enabled channels from the adapter.")
+      ("mmap", "Dequeue packets from memory mapped demux buffers instead of copying them.")
+      ("jitter-depth", po::value<unsigned>(&jitter_depth)->default_value(JITTER_DEPTH),
+          "Number of RTP packets to wait for a missing packet.")
+      ("cold-start", "Scan the multiplexes rather than starting from the services cached by the last run.")
       ("daemon,d", "Run as a daemon.")
       ("stop,s", "Stop any existing daemon processes.");
   po::variables_map args;
@@ -76,6 +133,29 @@ static int parse_arguments(int argc, char **argv)
   {
     stop_daemon = args.count("stop");
     start_daemon = args.count("daemon");
+    replay_fast = args.count("fast");
+    use_mmap = args.count("mmap");
+    pid_filter = args.count("pid-filter");
+    ingest_thread = args.count("ingest-thread");
+    on_demand = args.count("on-demand");
+    shed_load = args.count("shed-load");
+    restamp_pcr = args.count("restamp-pcr");
+    io_uring = args.count("io-uring");
+    cold_start = args.count("cold-start");
+    if (ret == 0 && !stop_daemon && replay_files.empty() && udp_addresses.empty() && transmitter.empty())
+    {
+      std::cerr << desc << std::endl;
+      std::cerr << "the option '--tuning-file' is required but missing" << std::endl;
+      ret = -1;
+    }
+    else if (ret == 0 && !stop_daemon &&
+        ((!replay_files.empty() && replay_files.size() != multiplexes.size()) ||
+        (!udp_addresses.empty() && udp_addresses.size() != multiplexes.size())))
+    {
+      std::cerr << desc << std::endl;
+      std::cerr << "each '--multiplex' needs its own '--replay' or '--udp' source" << std::endl;
+      ret = -1;
+    }
   }
   return ret;
 }
@@ -99,8 +179,10 @@ static void catch_signals(int signo)
     break;
   }
   INFO("Caught signal %s shutting down...", name.c_str());
-  if (p_segmenter)
-    p_segmenter->exit();
+  if (p_group)
+    p_group->exit();
+  else if (p_pool)
+    p_pool->exit();
   else
     exit(0);
 }
@@ -113,33 +195,128 @@ static void set_sig_hndlr(int signo)
   }
 }
 
-static int run()
+static uint16_t adapter_for(size_t index)
+{
+  if (index < adapters.size()) return adapters[index];
+  uint16_t next = adapters.empty() ? 0 : adapters.back() + 1;
+  return next + (index - adapters.size());
+}
+
+static TsSource* open_source(const std::string& multiplex, uint16_t adapter)
 {
-  DvbDevice device(multiplex, join_path({tuning_dir, transmitter}), adapter);
-  Segmenter segmenter(device);
-  device.open_device();
-  if (device.tune() == 0)
+  size_t index = std::find(multiplexes.begin(), multiplexes.end(), multiplex) - multiplexes.begin();
+  if (!replay_files.empty())
   {
-    INFO("Tuned device to %s", multiplex.c_str());
-    segmenter.scan();
-    p_segmenter = &segmenter;
+    ReplaySource* source = new ReplaySource(multiplex, replay_files[index], !replay_fast);
+    source->open_source();
+    return source;
+  }
 
-    // Register signal handlers.
-    set_sig_hndlr(SIGINT);
-    set_sig_hndlr(SIGTERM);
-    set_sig_hndlr(SIGHUP);
+  if (!udp_addresses.empty())
+  {
+    UdpSource* source = new UdpSource(multiplex, udp_addresses[index], jitter_depth);
+    source->open_source();
+    return source;
+  }
 
-    if (start_daemon)
-    {
-      INFO("Starting daemon...");
-      Daemon daemon(segmenter);
-      daemon.start();
-    }
-    else
-    {
-      segmenter.run();
-    }
+  DvbDevice* device = new DvbDevice(multiplex, join_path({tuning_dir, transmitter}), adapter);
+  device->use_mmap(use_mmap);
+  device->open_device();
+  if (device->tune() != 0)
+  {
+    delete device;
+    return NULL;
+  }
+  INFO("Tuned device to %s", multiplex.c_str());
+  return device;
+}
+
+static void setup_segmenter(Segmenter& segmenter)
+{
+  segmenter.use_pid_filter(pid_filter);
+  segmenter.use_segment_threads(segment_threads);
+  segmenter.use_load_shedding(shed_load);
+  segmenter.use_pcr_restamping(restamp_pcr);
+  segmenter.use_io_uring(io_uring);
+  segmenter.use_progressive_scan(true);
+  if (on_demand)
+  {
+    segmenter.use_on_demand(std::max(channel_idle, 1u));
   }
+  if (ingest_thread)
+  {
+    segmenter.use_ingest_thread(ingest_cpu, ingest_priority);
+  }
+}
+
+static void register_signals()
+{
+  set_sig_hndlr(SIGINT);
+  set_sig_hndlr(SIGTERM);
+  set_sig_hndlr(SIGHUP);
+}
+
+static void run_until_stopped(std::function<void()> run)
+{
+  if (start_daemon)
+  {
+    INFO("Starting daemon...");
+    Daemon daemon(run);
+    daemon.start();
+  }
+  else
+  {
+    run();
+  }
+}
+
+static int run_pool()
+{
+  std::vector<uint16_t> pool_adapters;
+  for (size_t i = 0; i < tuners; i++)
+  {
+    pool_adapters.push_back(adapter_for(i));
+  }
+  TunerPool pool(pool_adapters, multiplexes, open_source, setup_segmenter);
+  pool.set_idle_timeout(tuner_idle);
+  pool.survey();
+  p_pool = &pool;
+  register_signals();
+  run_until_stopped([&pool] { pool.run(); });
+  p_pool = 0;
+  return 0;
+}
+
+static int run()
+{
+  if (tuners) return run_pool();
+
+  // Declared first so the segmenters go before their sources.
+  std::vector<std::unique_ptr<TsSource>> sources;
+  SegmenterGroup group;
+
+  for (size_t i = 0; i < multiplexes.size(); i++)
+  {
+    TsSource* source = open_source(multiplexes[i], adapter_for(i));
+    if (!source) continue;
+    sources.emplace_back(source);
+
+    Segmenter* segmenter = new Segmenter(*source);
+    setup_segmenter(*segmenter);
+    segmenter->use_service_cache(!cold_start);
+    group.add(segmenter);
+  }
+  if (sources.empty()) return 0;
+  if (on_demand)
+  {
+    group.use_control_socket();
+  }
+
+  group.scan();
+  p_group = &group;
+  register_signals();
+  run_until_stopped([&group] { group.run(); });
+  p_group = 0;
   return 0;
 }
 
@@ -166,7 +343,8 @@ int main(int argc, char **argv)
   }
   catch (std::exception &e)
   {
-    p_segmenter = 0;
+    p_group = 0;
+    p_pool = 0;
     ERROR("%s", e.what());
   }
   exit:
@@ -0,0 +1,221 @@
+#include "es_scanner.hpp"
+#include "ts_header.hpp"
+
+#define MPEG2_PICTURE 0x00
+#define MPEG2_SEQUENCE_HEADER 0xB3
+#define MPEG2_GOP 0xB8
+#define MPEG2_I_PICTURE 1
+
+#define H264_SLICE 1
+#define H264_PARTITION_C 4
+#define H264_IDR 5
+#define H264_SPS 7
+#define H264_I_SLICE 2 // slice_type modulo 5
+
+#define HEVC_LAST_VCL 9 // Non-IRAP slices are the types below
+#define HEVC_FIRST_IRAP 16
+#define HEVC_LAST_IRAP 21
+#define HEVC_VPS 32
+#define HEVC_PPS 34
+
+int es_video_codec(uint8_t stream_type)
+{
+  switch (stream_type)
+  {
+  case 0x01: // MPEG-1 video
+  case 0x02: // MPEG-2 video
+    return ES_CODEC_MPEG2;
+  case 0x1B:
+    return ES_CODEC_H264;
+  case 0x24:
+    return ES_CODEC_HEVC;
+  default:
+    return ES_CODEC_NONE;
+  }
+}
+
+static uint64_t read_timestamp(const uint8_t* data)
+{
+  return ((uint64_t)((data[0] >> 1) & 0x07) << 30) | (data[1] << 22) |
+    ((data[2] >> 1) << 15) | (data[3] << 7) | (data[4] >> 1);
+}
+
+bool es_timestamp(const uint8_t* pkt, uint16_t flags, uint8_t payload, uint64_t& timestamp)
+{
+  if (!(flags & TS_FLAG_PUSI) || !(flags & TS_FLAG_PAYLOAD)) return false;
+  size_t offset = payload;
+  const uint8_t* pes = pkt + offset;
+  if (offset + 9 > TS_PACKET_SIZE || pes[0] || pes[1] || pes[2] != 1) return false;
+  uint8_t pts_dts = pes[7] >> 6;
+  if (pts_dts == 3 && offset + 19 <= TS_PACKET_SIZE)
+  {
+    timestamp = read_timestamp(pes + 14); // The DTS after the PTS.
+    return true;
+  }
+  if (pts_dts == 2 && offset + 14 <= TS_PACKET_SIZE)
+  {
+    timestamp = read_timestamp(pes + 9);
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Read an unsigned Exp-Golomb code, as 0 past the end of the data.
+ */
+static unsigned read_ue(const uint8_t* data, size_t len, size_t& bit)
+{
+  size_t end = len * 8;
+  unsigned zeros = 0;
+  while (bit < end && !((data[bit >> 3] >> (7 - (bit & 7))) & 1))
+  {
+    zeros++;
+    bit++;
+  }
+  bit++;
+  if (bit + zeros > end || zeros > 16) return 0;
+  unsigned value = 0;
+  for (unsigned i = 0; i < zeros; i++, bit++)
+  {
+    value = (value << 1) | ((data[bit >> 3] >> (7 - (bit & 7))) & 1);
+  }
+  return (1u << zeros) - 1 + value;
+}
+
+EsScanner::EsScanner() :
+    m_codec(ES_CODEC_NONE),
+    m_window(0xFFFFFFFF),
+    m_header(),
+    m_header_len(0),
+    m_header_wanted(0),
+    m_parameter_sets(0),
+    m_result(ES_NOT_RANDOM_ACCESS)
+{
+}
+
+void EsScanner::start(int codec)
+{
+  m_codec = codec;
+  m_window = 0xFFFFFFFF;
+  m_header_len = 0;
+  m_header_wanted = 0;
+  m_parameter_sets = 0;
+  m_result = codec == ES_CODEC_NONE ? ES_NOT_RANDOM_ACCESS : ES_MORE;
+}
+
+int EsScanner::scan(const uint8_t* pkt, uint16_t flags, uint8_t payload)
+{
+  if (m_result != ES_MORE || !(flags & TS_FLAG_PAYLOAD)) return m_result;
+  size_t offset = payload;
+  if (flags & TS_FLAG_PUSI)
+  {
+    // The PES header comes first, it is never split in practice.
+    const uint8_t* pes = pkt + offset;
+    if (offset + 9 > TS_PACKET_SIZE || pes[0] || pes[1] || pes[2] != 1)
+    {
+      return m_result = ES_NOT_RANDOM_ACCESS;
+    }
+    offset += 9 + pes[8];
+  }
+  for (; offset < TS_PACKET_SIZE && m_result == ES_MORE; offset++)
+  {
+    uint8_t byte = pkt[offset];
+    if (m_header_len < m_header_wanted)
+    {
+      m_header[m_header_len++] = byte;
+      if (m_header_len == m_header_wanted) m_result = _header();
+    }
+    else if ((m_window & 0xFFFFFF) == 0x000001)
+    {
+      m_result = _start_code(byte);
+    }
+    m_window = (m_window << 8) | byte;
+  }
+  return m_result;
+}
+
+int EsScanner::_start_code(uint8_t code)
+{
+  m_header_len = 0;
+  m_header_wanted = 0;
+  if (m_codec == ES_CODEC_MPEG2)
+  {
+    if (code == MPEG2_SEQUENCE_HEADER || code == MPEG2_GOP) m_parameter_sets = 1;
+    // The picture coding type follows the temporal reference.
+    if (code == MPEG2_PICTURE) m_header_wanted = 2;
+    return ES_MORE;
+  }
+  if (m_codec == ES_CODEC_H264)
+  {
+    uint8_t type = code & 0x1F;
+    if (type == H264_IDR) return ES_RANDOM_ACCESS;
+    if (type == H264_SPS) m_parameter_sets = 1;
+    // The slice type follows the first macroblock in the slice header.
+    if (type == H264_SLICE) m_header_wanted = sizeof(m_header);
+    // Data partitions are never random access points.
+    if (type > H264_SLICE && type <= H264_PARTITION_C) return ES_NOT_RANDOM_ACCESS;
+    return ES_MORE;
+  }
+  uint8_t type = (code >> 1) & 0x3F;
+  if (type >= HEVC_FIRST_IRAP && type <= HEVC_LAST_IRAP) return ES_RANDOM_ACCESS;
+  if (type <= HEVC_LAST_VCL) return ES_NOT_RANDOM_ACCESS;
+  if (type >= HEVC_VPS && type <= HEVC_PPS) m_parameter_sets = 1;
+  return ES_MORE;
+}
+
+int EsScanner::_header()
+{
+  if (m_codec == ES_CODEC_MPEG2)
+  {
+    uint8_t type = (m_header[1] >> 3) & 0x07;
+    return type == MPEG2_I_PICTURE ? ES_RANDOM_ACCESS : ES_NOT_RANDOM_ACCESS;
+  }
+  // Open GOPs start on an I slice rather than an IDR, sent with the SPS.
+  size_t bit = 0;
+  read_ue(m_header, m_header_len, bit);
+  unsigned type = read_ue(m_header, m_header_len, bit);
+  return type % 5 == H264_I_SLICE && m_parameter_sets ? ES_RANDOM_ACCESS : ES_NOT_RANDOM_ACCESS;
+}
+
+StreamClock::StreamClock() :
+    m_time(0),
+    m_last(0),
+    m_step(0),
+    m_started(0),
+    m_jump(0)
+{
+}
+
+bool StreamClock::update(uint64_t timestamp)
+{
+  bool continuous = 1;
+  if (!m_started)
+  {
+    m_time = timestamp;
+    m_started = 1;
+  }
+  else
+  {
+    uint64_t step = (timestamp - m_last) & (ES_CLOCK_WRAP - 1);
+    if (m_jump || step > ES_CLOCK_MAX_STEP)
+    {
+      step = m_step;
+      continuous = 0;
+    }
+    else if (step)
+    {
+      m_step = step;
+    }
+    m_time += step;
+  }
+  m_last = timestamp;
+  m_jump = 0;
+  return continuous;
+}
+
+void StreamClock::reset()
+{
+  m_step = 0;
+  m_started = 0;
+  m_jump = 0;
+}
@@ -0,0 +1,296 @@
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "ingest.hpp"
+#include "ts_source.hpp"
+#include "util.hpp"
+#include "log.hpp"
+
+// Each chunk has a packet of headroom for the tail carried over from the previous read.
+#define CHUNK_STRIDE (TS_PACKET_SIZE + INGEST_CHUNK_SIZE)
+
+size_t find_sync(const uint8_t* buf, size_t len)
+{
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i sync = _mm_set1_epi8(TS_SYNC_BYTE);
+  for (; i + 16 + TS_PACKET_SIZE <= len; i += 16)
+  {
+    __m128i curr = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i));
+    __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i + TS_PACKET_SIZE));
+    int mask = _mm_movemask_epi8
+    (
+      _mm_and_si128(_mm_cmpeq_epi8(curr, sync), _mm_cmpeq_epi8(next, sync))
+    );
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t sync = vdupq_n_u8(TS_SYNC_BYTE);
+  for (; i + 16 + TS_PACKET_SIZE <= len; i += 16)
+  {
+    uint8x16_t match = vandq_u8
+    (
+      vceqq_u8(vld1q_u8(buf + i), sync),
+      vceqq_u8(vld1q_u8(buf + i + TS_PACKET_SIZE), sync)
+    );
+    // Narrow to 4 bits per byte so the match fits in a 64 bit mask.
+    uint64_t mask = vget_lane_u64
+    (
+      vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(match), 4)), 0
+    );
+    if (mask) return i + (__builtin_ctzll(mask) >> 2);
+  }
+#endif
+  for (; i < len; i++)
+  {
+    if (buf[i] == TS_SYNC_BYTE && (i + TS_PACKET_SIZE >= len || buf[i + TS_PACKET_SIZE] == TS_SYNC_BYTE))
+    {
+      return i;
+    }
+  }
+  return len;
+}
+
+TsIngest::TsIngest(TsSource& source) :
+    m_source(source),
+    m_ring(0),
+    m_batches(),
+    m_written(0),
+    m_released(0),
+    m_read(0),
+    m_carry { 0 },
+    m_carry_len(0),
+    m_synced(0),
+    m_packets(0),
+    m_resyncs("ingest_resyncs_total", mux_label(source.get_multiplex())),
+    m_skipped("ingest_skipped_bytes_total", mux_label(source.get_multiplex())),
+    m_depth("ingest_ring_depth", mux_label(source.get_multiplex())),
+    m_high_water("ingest_ring_high_water", mux_label(source.get_multiplex())),
+    m_full("ingest_ring_full_total", mux_label(source.get_multiplex())),
+    m_thread(),
+    m_stop(0),
+    m_finished(0),
+    m_error(),
+    m_wait_lock(),
+    m_ready()
+{
+  m_ring = new uint8_t[INGEST_CHUNKS * CHUNK_STRIDE];
+}
+
+size_t TsIngest::_align(uint8_t* begin, uint8_t* end)
+{
+  uint8_t* out = begin;
+  uint8_t* p = begin;
+  size_t count = 0;
+
+  while (end - p >= TS_PACKET_SIZE)
+  {
+    if (!m_synced)
+    {
+      size_t skip = find_sync(p, end - p);
+      if (skip && m_packets)
+      {
+        WARNING("Lost TS sync, skipped %u bytes", (unsigned)skip);
+        m_resyncs.add();
+        m_skipped.add(skip);
+      }
+      p += skip;
+      m_synced = 1;
+      continue;
+    }
+    // Check the stride to the next packet as well to catch truncated packets.
+    if (p[0] != TS_SYNC_BYTE || (end - p >= 2 * TS_PACKET_SIZE && p[TS_PACKET_SIZE] != TS_SYNC_BYTE))
+    {
+      m_synced = 0;
+      continue;
+    }
+    // Packets after a resync are moved down to keep the batch contiguous.
+    if (out != p) memmove(out, p, TS_PACKET_SIZE);
+    out += TS_PACKET_SIZE;
+    p += TS_PACKET_SIZE;
+    count++;
+  }
+
+  m_packets += count;
+  m_carry_len = end - p;
+  memcpy(m_carry, p, m_carry_len);
+  return count;
+}
+
+bool TsIngest::_fill_mapped(TsBatch& batch)
+{
+  size_t len;
+  int index;
+  uint8_t* data = m_source.acquire_buffer(len, index);
+  if (!data) return false;
+
+  batch.packets = data;
+  batch.count = _align(data, data + len);
+  batch.chunk = 0;
+  batch.buffer = index;
+  // Buffers hold whole packets, so a partial one means the stream is corrupt.
+  m_skipped.add(m_carry_len);
+  m_carry_len = 0;
+  return true;
+}
+
+bool TsIngest::_fill(TsBatch& batch)
+{
+  if (m_source.mapped())
+  {
+    return _fill_mapped(batch);
+  }
+  unsigned chunk = m_written.load(std::memory_order_relaxed) % INGEST_CHUNKS;
+  uint8_t* data = &m_ring[chunk * CHUNK_STRIDE] + TS_PACKET_SIZE;
+
+  ssize_t len = m_source.read_bytes(data, INGEST_CHUNK_SIZE);
+  if (len <= 0) return false;
+
+  uint8_t* begin = data - m_carry_len;
+  memcpy(begin, m_carry, m_carry_len);
+
+  batch.packets = begin;
+  batch.count = _align(begin, data + len);
+  batch.chunk = chunk;
+  batch.buffer = -1;
+  return true;
+}
+
+void TsIngest::_produce()
+{
+  std::exception_ptr error;
+  try
+  {
+    bool was_full = 0;
+    while (!m_stop && !m_source.eof())
+    {
+      unsigned written = m_written.load(std::memory_order_relaxed);
+      unsigned depth = written - m_released.load(std::memory_order_acquire);
+      if (depth == INGEST_CHUNKS)
+      {
+        // The consumer is behind, the source has to buffer for now.
+        if (!was_full) m_full.add();
+        was_full = 1;
+        usleep(1000);
+        continue;
+      }
+      was_full = 0;
+      if (!_fill(m_batches[written % INGEST_CHUNKS])) continue;
+
+      m_depth.set(depth + 1);
+      m_high_water.raise(depth + 1);
+      m_written.store(written + 1, std::memory_order_release);
+      {
+        std::lock_guard<std::mutex> lock(m_wait_lock);
+      }
+      m_ready.notify_one();
+    }
+  }
+  catch (...)
+  {
+    error = std::current_exception();
+  }
+  {
+    // next_batch() reads the error under the lock, eof() once finished.
+    std::lock_guard<std::mutex> lock(m_wait_lock);
+    m_error = error;
+    m_finished = 1;
+  }
+  m_ready.notify_one();
+}
+
+void TsIngest::start_thread(int cpu, int priority)
+{
+  m_thread = std::thread(&TsIngest::_produce, this);
+  if (cpu >= 0)
+  {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int err = pthread_setaffinity_np(m_thread.native_handle(), sizeof(cpus), &cpus);
+    if (err)
+    {
+      WARNING("Failed to pin the ingest thread to CPU %d: %s", cpu, strerror(err));
+    }
+  }
+  if (priority > 0)
+  {
+    struct sched_param param;
+    param.sched_priority = priority;
+    int err = pthread_setschedparam(m_thread.native_handle(), SCHED_FIFO, &param);
+    if (err)
+    {
+      WARNING("Failed to raise the ingest thread priority: %s", strerror(err));
+    }
+  }
+  INFO("Started ingest thread for %s", m_source.get_multiplex().c_str());
+}
+
+bool TsIngest::next_batch(TsBatch& batch)
+{
+  unsigned written = m_written.load(std::memory_order_acquire);
+  if (!m_thread.joinable())
+  {
+    if (written - m_released.load(std::memory_order_relaxed) == INGEST_CHUNKS)
+    {
+      throw DvbException("Ingest ring overrun");
+    }
+    if (!_fill(m_batches[written % INGEST_CHUNKS])) return false;
+    m_written.store(++written, std::memory_order_relaxed);
+  }
+  else if (written == m_read)
+  {
+    std::unique_lock<std::mutex> lock(m_wait_lock);
+    m_ready.wait_for
+    (
+      lock, std::chrono::milliseconds(100),
+      [this] { return m_written.load(std::memory_order_acquire) != m_read || m_finished; }
+    );
+    written = m_written.load(std::memory_order_acquire);
+    if (written == m_read)
+    {
+      if (m_error) std::rethrow_exception(m_error);
+      return false;
+    }
+  }
+  batch = m_batches[m_read % INGEST_CHUNKS];
+  m_read++;
+  return true;
+}
+
+void TsIngest::release(const TsBatch& batch)
+{
+  if (batch.buffer >= 0)
+  {
+    m_source.release_buffer(batch.buffer);
+  }
+  m_released.store(m_released.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+bool TsIngest::eof() const
+{
+  if (!m_thread.joinable()) return m_source.eof();
+  return m_finished && !m_error && m_read == m_written.load(std::memory_order_acquire);
+}
+
+TsIngest::~TsIngest()
+{
+  if (m_thread.joinable())
+  {
+    m_stop = 1;
+    m_thread.join();
+  }
+  if (m_skipped.get())
+  {
+    INFO("Resynchronised the TS %llu times, skipped %llu bytes",
+        (unsigned long long)m_resyncs.get(), (unsigned long long)m_skipped.get());
+  }
+  delete[] m_ring;
+}
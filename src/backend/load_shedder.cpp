@@ -0,0 +1,99 @@
+#include <algorithm>
+
+#include "load_shedder.hpp"
+#include "ingest.hpp"
+#include "util.hpp"
+
+#define NS 1000000000ull
+
+LoadShedder::LoadShedder(const std::string& multiplex) :
+    m_checked { 0 },
+    m_busy_ns(0),
+    m_max_depth(0),
+    m_overflows(0),
+    m_stalls(0),
+    m_changed(0),
+    m_calm_since(0),
+    m_level(0),
+    m_reason(),
+    m_level_stat("load_shed_level", mux_label(multiplex)),
+    m_busy_stat("segmenter_busy_percent", mux_label(multiplex)),
+    m_sheds("load_shed_steps_total", mux_label(multiplex)),
+    m_recoveries("load_recover_steps_total", mux_label(multiplex))
+{
+}
+
+void LoadShedder::batch(const timespec& start, unsigned depth)
+{
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  m_busy_ns += (now.tv_sec * NS + now.tv_nsec) - (start.tv_sec * NS + start.tv_nsec);
+  m_max_depth = std::max(m_max_depth, depth);
+}
+
+LoadShedder::Action LoadShedder::check(const timespec& now, uint64_t overflows, uint64_t stalls)
+{
+  uint64_t elapsed = (now.tv_sec * NS + now.tv_nsec) - (m_checked.tv_sec * NS + m_checked.tv_nsec);
+  if (elapsed < LOAD_INTERVAL * NS) return LOAD_HOLD;
+
+  bool first = !m_checked.tv_sec && !m_checked.tv_nsec;
+  unsigned busy = std::min<uint64_t>(m_busy_ns * 100 / elapsed, 100);
+  bool overflowed = overflows > m_overflows;
+  bool stalled = stalls > m_stalls;
+  unsigned depth = m_max_depth;
+  m_checked = now;
+  m_busy_ns = 0;
+  m_max_depth = 0;
+  m_overflows = overflows;
+  m_stalls = stalls;
+  if (first) return LOAD_HOLD;
+  m_busy_stat.set(busy);
+
+  m_reason.clear();
+  if (overflowed)
+  {
+    m_reason = "demux buffer overflowed";
+  }
+  else if (stalled || depth >= INGEST_CHUNKS * 3 / 4)
+  {
+    m_reason = (fmt("ingest ring %u/%u full") % depth % INGEST_CHUNKS).str();
+  }
+  else if (busy >= LOAD_BUSY_HIGH)
+  {
+    m_reason = (fmt("busy %u%% of the time") % busy).str();
+  }
+  if (!m_reason.empty())
+  {
+    m_calm_since = 0;
+    return (now.tv_sec - m_changed >= LOAD_SETTLE) ? LOAD_SHED : LOAD_HOLD;
+  }
+
+  bool calm = depth <= INGEST_CHUNKS / 4 && busy < LOAD_BUSY_LOW;
+  if (!calm)
+  {
+    m_calm_since = 0;
+    return LOAD_HOLD;
+  }
+  if (!m_calm_since) m_calm_since = now.tv_sec;
+  if (m_level && now.tv_sec - m_calm_since >= LOAD_RECOVER && now.tv_sec - m_changed >= LOAD_RECOVER)
+  {
+    return LOAD_RECOVER_STEP;
+  }
+  return LOAD_HOLD;
+}
+
+void LoadShedder::step(const timespec& now, int delta)
+{
+  m_changed = now.tv_sec;
+  if (delta > 0)
+  {
+    m_level++;
+    m_sheds.add();
+  }
+  else if (delta < 0 && m_level)
+  {
+    m_level--;
+    m_recoveries.add();
+  }
+  m_level_stat.set(m_level);
+}
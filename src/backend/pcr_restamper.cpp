@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <algorithm>
+
+#include "pcr_restamper.hpp"
+
+/**
+ * a - b, allowing for the PCR wrapping.
+ */
+static int64_t pcr_diff(uint64_t a, uint64_t b)
+{
+  uint64_t diff = (a + PCR_WRAP - b) % PCR_WRAP;
+  return diff > PCR_WRAP / 2 ? (int64_t)diff - (int64_t)PCR_WRAP : (int64_t)diff;
+}
+
+static uint64_t ticks_to_ns(uint64_t ticks)
+{
+  return ticks * 1000 / (PCR_CLOCK / 1000000);
+}
+
+PcrJitter::PcrJitter() :
+    m_pcr(),
+    m_pos(),
+    m_count(0),
+    m_peak(0)
+{
+}
+
+void PcrJitter::add(uint64_t pcr, uint64_t pos)
+{
+  if (m_count == 2 && m_pos[1] > m_pos[0])
+  {
+    int64_t ticks = pcr_diff(m_pcr[1], m_pcr[0]);
+    int64_t expected = ticks * (int64_t)(pos - m_pos[1]) / (int64_t)(m_pos[1] - m_pos[0]);
+    m_peak = std::max<uint64_t>(m_peak, llabs(pcr_diff(pcr, m_pcr[1]) - expected));
+  }
+  m_pcr[0] = m_pcr[1];
+  m_pos[0] = m_pos[1];
+  m_pcr[1] = pcr;
+  m_pos[1] = pos;
+  if (m_count < 2) m_count++;
+}
+
+uint64_t PcrJitter::take_peak()
+{
+  uint64_t peak = m_peak;
+  m_peak = 0;
+  return peak;
+}
+
+void PcrJitter::reset()
+{
+  m_count = 0;
+}
+
+PcrRestamper::PcrRestamper(const std::string& labels) :
+    m_started(0),
+    m_last(0),
+    m_last_pos(0),
+    m_restamped(0),
+    m_rate(0),
+    m_next_rate(0),
+    m_stats_pcr(0),
+    m_peak_offset(0),
+    m_in(),
+    m_out(),
+    m_jitter_in("pcr_jitter_in_ns", labels),
+    m_jitter_out("pcr_jitter_out_ns", labels),
+    m_offset("pcr_restamp_offset_ns", labels),
+    m_clamped("pcr_restamp_clamped_total", labels)
+{
+}
+
+uint64_t PcrRestamper::restamp(uint64_t pcr, uint64_t pos, bool discontinuity)
+{
+  int64_t step = pcr_diff(pcr, m_last);
+  if (!m_started || discontinuity || step < 0 || step > (int64_t)PCR_MAX_STEP || pos <= m_last_pos)
+  {
+    _restart(pcr, pos);
+    return pcr;
+  }
+  uint64_t bytes = pos - m_last_pos;
+  uint64_t rate = ((uint64_t)step << 16) / bytes;
+
+  uint64_t restamped = pcr;
+  if (m_rate)
+  {
+    m_rate = m_rate + ((int64_t)(rate - m_rate) / PCR_SMOOTHING);
+    restamped = (m_restamped + (bytes * m_next_rate >> 16)) % PCR_WRAP;
+    int64_t offset = pcr_diff(restamped, pcr);
+    if (llabs(offset) > (int64_t)PCR_MAX_OFFSET)
+    {
+      // Held as near as is allowed.
+      offset = offset < 0 ? -(int64_t)PCR_MAX_OFFSET : PCR_MAX_OFFSET;
+      restamped = (pcr + PCR_WRAP + offset) % PCR_WRAP;
+      m_clamped.add();
+    }
+    m_peak_offset = std::max<uint64_t>(m_peak_offset, llabs(offset));
+  }
+  else
+  {
+    // The first interval, which the rate starts from.
+    m_rate = rate;
+  }
+  // Make up the offset over PCR_CATCH_UP, if the rate holds.
+  int64_t catch_up = (int64_t)m_rate * pcr_diff(pcr, restamped) / (int64_t)PCR_CATCH_UP;
+  m_next_rate = std::max<int64_t>((int64_t)m_rate + catch_up, 1);
+
+  m_in.add(pcr, pos);
+  m_out.add(restamped, pos);
+  m_last = pcr;
+  m_last_pos = pos;
+  m_restamped = restamped;
+  if (pcr_diff(pcr, m_stats_pcr) >= (int64_t)PCR_STATS_INTERVAL) _update_stats(pcr);
+  return restamped;
+}
+
+void PcrRestamper::_update_stats(uint64_t pcr)
+{
+  m_jitter_in.set(ticks_to_ns(m_in.take_peak()));
+  m_jitter_out.set(ticks_to_ns(m_out.take_peak()));
+  m_offset.set(ticks_to_ns(m_peak_offset));
+  m_peak_offset = 0;
+  m_stats_pcr = pcr;
+}
+
+void PcrRestamper::_restart(uint64_t pcr, uint64_t pos)
+{
+  m_started = 1;
+  m_last = pcr;
+  m_last_pos = pos;
+  m_restamped = pcr;
+  m_rate = 0;
+  m_stats_pcr = pcr;
+  m_in.reset();
+  m_out.reset();
+}
+
+void PcrRestamper::reset()
+{
+  m_started = 0;
+}
@@ -0,0 +1,82 @@
+#include <string.h>
+#include <set>
+
+#include "pid_router.hpp"
+#include "channel.hpp"
+#include "log.hpp"
+
+PidRouter::PidRouter() :
+    m_tables { 0 },
+    m_overflow(),
+    m_active(0)
+{
+  for (auto& table : m_tables)
+  {
+    table = new PidRoute[NUM_PIDS];
+    memset(table, 0, NUM_PIDS * sizeof(PidRoute));
+  }
+}
+
+void PidRouter::rebuild(const std::vector<Channel*>& channels, const uint16_t* broadcast, size_t num_broadcast)
+{
+  unsigned next = !m_active.load(std::memory_order_relaxed);
+  PidRoute* table = m_tables[next];
+  std::vector<std::vector<uint16_t> >& overflow = m_overflow[next];
+  std::vector<std::vector<uint16_t> > slots(NUM_PIDS);
+
+  std::vector<uint16_t> streaming;
+  for (size_t slot = 0; slot < channels.size(); slot++)
+  {
+    Channel* chan = channels[slot];
+    if (!chan->streaming()) continue;
+    streaming.push_back(slot);
+    // A PID can be listed more than once, e.g. as the PCR and video PID.
+    // Channels write their own PMT.
+    std::set<uint16_t> pids(chan->pids().begin(), chan->pids().end());
+    for (uint16_t pid : pids)
+    {
+      if (pid < NUM_PIDS) slots[pid].push_back(slot);
+    }
+  }
+
+  // Broadcast to every channel, unless some are dormant or disabled.
+  bool all = streaming.size() == channels.size();
+  if (!all)
+  {
+    for (size_t i = 0; i < num_broadcast; i++)
+    {
+      slots[broadcast[i]] = streaming;
+    }
+  }
+
+  memset(table, 0, NUM_PIDS * sizeof(PidRoute));
+  overflow.clear();
+  for (uint16_t pid = 0; pid < NUM_PIDS; pid++)
+  {
+    std::vector<uint16_t>& pid_slots = slots[pid];
+    if (pid_slots.size() > ROUTE_FANOUT)
+    {
+      table[pid].count = ROUTE_OVERFLOW;
+      table[pid].slots[0] = overflow.size();
+      overflow.push_back(pid_slots);
+    }
+    else
+    {
+      table[pid].count = pid_slots.size();
+      std::copy(pid_slots.begin(), pid_slots.end(), table[pid].slots);
+    }
+  }
+  for (size_t i = 0; all && i < num_broadcast; i++)
+  {
+    table[broadcast[i]].count = ROUTE_ALL;
+  }
+  m_active.store(next, std::memory_order_release);
+}
+
+PidRouter::~PidRouter()
+{
+  for (auto table : m_tables)
+  {
+    delete[] table;
+  }
+}
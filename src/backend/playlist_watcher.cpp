@@ -0,0 +1,53 @@
+#include <sys/inotify.h>
+#include <sys/unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "playlist_watcher.hpp"
+#include "util.hpp"
+#include "log.hpp"
+
+#define PLAYLIST_SUFFIX ".m3u8"
+
+PlaylistWatcher::PlaylistWatcher(const std::string& dir) :
+    m_fd(-1)
+{
+  if ((m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+  {
+    throw DvbException(fmt("Failed to start inotify: %s") % strerror(errno));
+  }
+  // Our own writes close with IN_CLOSE_WRITE, so don't count.
+  if (inotify_add_watch(m_fd, dir.c_str(), IN_CLOSE_NOWRITE) < 0)
+  {
+    throw DvbException(fmt("Failed to watch %s: %s") % dir % strerror(errno));
+  }
+}
+
+void PlaylistWatcher::poll(std::set<std::string>& names)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(inotify_event))));
+  ssize_t len;
+  while ((len = read(m_fd, buf, sizeof(buf))) > 0)
+  {
+    for (char* ptr = buf; ptr < buf + len; ptr += sizeof(inotify_event) + ((inotify_event*)ptr)->len)
+    {
+      const inotify_event* event = reinterpret_cast<const inotify_event*>(ptr);
+      if (!event->len) continue;
+      std::string name(event->name);
+      size_t suffix = sizeof(PLAYLIST_SUFFIX) - 1;
+      if (name.size() > suffix && name.compare(name.size() - suffix, suffix, PLAYLIST_SUFFIX) == 0)
+      {
+        names.insert(name);
+      }
+    }
+  }
+  if (len < 0 && errno != EAGAIN && errno != EINTR)
+  {
+    WARNING("Failed reading inotify events: %s", strerror(errno));
+  }
+}
+
+PlaylistWatcher::~PlaylistWatcher()
+{
+  if (m_fd >= 0) close(m_fd);
+}
@@ -0,0 +1,71 @@
+#include <string.h>
+#include <algorithm>
+
+#include "psi_generator.hpp"
+#include "dvb_hls.hpp"
+#include "util.hpp"
+
+#define TABLE_PAT 0x00
+
+static void add_pid(std::vector<uint8_t>& section, uint16_t pid)
+{
+  section.push_back(0xE0 | (pid >> 8));
+  section.push_back(pid & 0xFF);
+}
+
+void psi_start_section(std::vector<uint8_t>& section, uint8_t table_id, uint16_t extension, uint8_t version)
+{
+  section.clear();
+  section.push_back(table_id);
+  section.push_back(0xB0); // Long form, the length follows.
+  section.push_back(0);
+  section.push_back(extension >> 8);
+  section.push_back(extension & 0xFF);
+  section.push_back(0xC1 | ((version & 0x1F) << 1)); // Current
+  section.push_back(0); // section_number
+  section.push_back(0); // last_section_number
+}
+
+void psi_finish_section(std::vector<uint8_t>& section)
+{
+  // The length counts from after itself, including the CRC.
+  size_t len = section.size() + 4 - 3;
+  section[1] = (section[1] & 0xF0) | (len >> 8);
+  section[2] = len & 0xFF;
+  uint32_t crc = crc32_mpeg(section.data(), section.size());
+  section.push_back(crc >> 24);
+  section.push_back(crc >> 16);
+  section.push_back(crc >> 8);
+  section.push_back(crc);
+}
+
+void psi_packetize(uint16_t pid, const std::vector<uint8_t>& section, std::vector<uint8_t>& packets)
+{
+  size_t offset = 0;
+  while (offset < section.size())
+  {
+    size_t start = packets.size();
+    packets.resize(start + TS_PACKET_SIZE, 0xFF);
+    uint8_t* pkt = &packets[start];
+    pkt[0] = 0x47;
+    pkt[1] = (offset ? 0x00 : 0x40) | (pid >> 8);
+    pkt[2] = pid & 0xFF;
+    pkt[3] = 0x10;
+    size_t header = 4;
+    if (!offset) pkt[header++] = 0; // pointer_field
+    size_t count = std::min(section.size() - offset, TS_PACKET_SIZE - header);
+    memcpy(pkt + header, &section[offset], count);
+    offset += count;
+  }
+}
+
+std::vector<uint8_t> psi_pat_section(uint16_t program, uint16_t pmt_pid)
+{
+  std::vector<uint8_t> section;
+  psi_start_section(section, TABLE_PAT, 1, 0);
+  section.push_back(program >> 8);
+  section.push_back(program & 0xFF);
+  add_pid(section, pmt_pid);
+  psi_finish_section(section);
+  return section;
+}
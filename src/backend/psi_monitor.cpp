@@ -0,0 +1,86 @@
+#include <string.h>
+
+#include "psi_monitor.hpp"
+#include "dvb_hls.hpp"
+
+#define NS 1000000000ull
+
+static uint32_t table_key(uint8_t table_id, uint16_t extension)
+{
+  return (table_id << 16) | extension;
+}
+
+static uint64_t elapsed_ns(const timespec& from, const timespec& to)
+{
+  return (to.tv_sec * NS + to.tv_nsec) - (from.tv_sec * NS + from.tv_nsec);
+}
+
+PsiMonitor::PsiMonitor(const std::string& multiplex) :
+    m_pids(),
+    m_tables(),
+    m_changes("psi_changes_total", mux_label(multiplex)),
+    m_reconfigs("psi_reconfigurations_total", mux_label(multiplex)),
+    m_reconfig_time("psi_reconfigure_us_total", mux_label(multiplex)),
+    m_latency("psi_reconfigure_latency_ms", mux_label(multiplex))
+{
+}
+
+void PsiMonitor::expect(uint16_t pid, uint8_t table_id, uint16_t extension, uint8_t version)
+{
+  m_pids[pid] = 1;
+  Table& table = m_tables[table_key(table_id, extension)];
+  table.version = version;
+  table.changed = 0;
+  // Learnt again from the next packets.
+  table.crcs.clear();
+}
+
+void PsiMonitor::clear()
+{
+  memset(m_pids, 0, sizeof(m_pids));
+  m_tables.clear();
+}
+
+bool PsiMonitor::changed(const uint8_t* pkt, uint8_t& table_id, uint16_t& extension)
+{
+  // Only the start of a section, without transport errors.
+  if ((pkt[1] & 0xC0) != 0x40 || !(pkt[3] & 0x10)) return false;
+  size_t offset = 4;
+  if (pkt[3] & 0x20) offset += 1 + pkt[4];
+  if (offset >= TS_PACKET_SIZE) return false;
+  size_t start = offset + 1 + pkt[offset];
+  if (start + 8 > TS_PACKET_SIZE) return false;
+
+  const uint8_t* section = pkt + start;
+  if (!(section[1] & 0x80) || !(section[5] & 0x01)) return false; // No syntax, or not yet current
+  auto found = m_tables.find(table_key(section[0], (section[3] << 8) | section[4]));
+  if (found == m_tables.end() || found->second.changed) return false;
+
+  Table& table = found->second;
+  bool differs = ((section[5] >> 1) & 0x1F) != table.version;
+  size_t end = start + 3 + (((section[1] & 0x0F) << 8) | section[2]);
+  if (!differs && end <= TS_PACKET_SIZE)
+  {
+    // The section is all here, so its CRC is too.
+    const uint8_t* crc_bytes = pkt + end - 4;
+    uint32_t crc = (crc_bytes[0] << 24) | (crc_bytes[1] << 16) | (crc_bytes[2] << 8) | crc_bytes[3];
+    auto known = table.crcs.insert({ section[6], crc });
+    differs = known.first->second != crc;
+  }
+  if (!differs) return false;
+
+  table.changed = 1;
+  table_id = section[0];
+  extension = (section[3] << 8) | section[4];
+  m_changes.add();
+  return true;
+}
+
+void PsiMonitor::applied(const timespec& detected, const timespec& start)
+{
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  m_reconfigs.add();
+  m_reconfig_time.add(elapsed_ns(start, now) / 1000);
+  m_latency.set(elapsed_ns(detected, now) / 1000000);
+}
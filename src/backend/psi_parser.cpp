@@ -0,0 +1,304 @@
+#include <string.h>
+#include <algorithm>
+
+#include "psi_parser.hpp"
+#include "dvb_hls.hpp"
+#include "util.hpp"
+
+#define PSI_HEADER_SIZE 8 // Of a long form section, up to its table data
+#define PSI_CRC_SIZE 4
+#define DESCRIPTOR_SERVICE 0x48
+
+SectionAssembler::SectionAssembler(Handler handler) :
+    m_handler(handler),
+    m_buf(),
+    m_len(0),
+    m_skip(0),
+    m_cc(0xFF),
+    m_synced(0),
+    m_filter(0),
+    m_wanted(),
+    m_crc_errors(0)
+{
+}
+
+void SectionAssembler::want(uint8_t table_id)
+{
+  m_filter = 1;
+  m_wanted[table_id] = 1;
+}
+
+void SectionAssembler::reset()
+{
+  m_len = 0;
+  m_skip = 0;
+  m_cc = 0xFF;
+  m_synced = 0;
+}
+
+void SectionAssembler::push(const uint8_t* pkt)
+{
+  if ((pkt[1] & 0x80) || !(pkt[3] & 0x10)) return;
+  uint8_t cc = pkt[3] & 0x0F;
+  if (m_cc != 0xFF)
+  {
+    if (cc == m_cc) return; // A repeated packet.
+    // A lost packet loses the section, wait for the next one.
+    if (cc != ((m_cc + 1) & 0x0F)) m_synced = 0;
+  }
+  m_cc = cc;
+
+  size_t offset = 4;
+  if (pkt[3] & 0x20) offset += 1 + pkt[4];
+  if (offset >= TS_PACKET_SIZE) return;
+  const uint8_t* data = pkt + offset;
+  size_t len = TS_PACKET_SIZE - offset;
+  if (pkt[1] & 0x40)
+  {
+    size_t pointer = data[0];
+    data++;
+    len--;
+    if (pointer > len)
+    {
+      m_synced = 0;
+      return;
+    }
+    // The end of the last section comes before the pointer.
+    if (m_synced) _append(data, pointer);
+    m_len = 0;
+    m_skip = 0;
+    m_synced = 1;
+    data += pointer;
+    len -= pointer;
+  }
+  if (m_synced) _append(data, len);
+}
+
+void SectionAssembler::_append(const uint8_t* data, size_t len)
+{
+  while (len && m_synced)
+  {
+    size_t skipped = std::min(m_skip, len);
+    m_skip -= skipped;
+    data += skipped;
+    len -= skipped;
+    // A section always fits, so this only stops short of the next one.
+    size_t count = std::min(len, sizeof(m_buf) - m_len);
+    if (len && !count)
+    {
+      // Full of a section that can't be finished, wait for the next one.
+      m_len = 0;
+      m_synced = 0;
+      break;
+    }
+    memcpy(m_buf + m_len, data, count);
+    m_len += count;
+    data += count;
+    len -= count;
+
+    size_t start = 0;
+    while (m_len - start >= 3)
+    {
+      const uint8_t* section = m_buf + start;
+      if (section[0] == 0xFF)
+      {
+        // Stuffing to the end of the packet.
+        start = m_len;
+        m_synced = 0;
+        break;
+      }
+      size_t total = 3 + (((section[1] & 0x0F) << 8) | section[2]);
+      if (total > sizeof(m_buf))
+      {
+        // Longer than any section can be, so corrupt.
+        start = m_len;
+        m_synced = 0;
+        break;
+      }
+      bool wanted = !m_filter || m_wanted[section[0]];
+      if (m_len - start < total)
+      {
+        if (!wanted)
+        {
+          // Skip the rest of it as it arrives rather than keeping it.
+          m_skip = total - (m_len - start);
+          start = m_len;
+        }
+        break;
+      }
+      if (wanted)
+      {
+        if ((section[1] & 0x80) && crc32_mpeg(section, total))
+        {
+          m_crc_errors++;
+        }
+        else
+        {
+          m_handler(section, total);
+        }
+      }
+      start += total;
+    }
+    memmove(m_buf, m_buf + start, m_len - start);
+    m_len -= start;
+  }
+}
+
+PsiSections::PsiSections() :
+    m_started(0),
+    m_version(0),
+    m_last(0),
+    m_seen()
+{
+}
+
+int PsiSections::add(uint8_t version, uint8_t section, uint8_t last)
+{
+  int result = PSI_SECTION_NEXT;
+  if (!m_started || version != m_version || last != m_last)
+  {
+    reset();
+    m_started = 1;
+    m_version = version;
+    m_last = last;
+    result = PSI_SECTION_FIRST;
+  }
+  uint32_t bit = 1u << (section & 31);
+  if (m_seen[section >> 5] & bit) return PSI_SECTION_REPEAT;
+  m_seen[section >> 5] |= bit;
+  return result;
+}
+
+bool PsiSections::complete() const
+{
+  if (!m_started) return false;
+  for (unsigned section = 0; section <= m_last; section++)
+  {
+    if (!(m_seen[section >> 5] & (1u << (section & 31)))) return false;
+  }
+  return true;
+}
+
+void PsiSections::reset()
+{
+  m_started = 0;
+  memset(m_seen, 0, sizeof(m_seen));
+}
+
+static bool is_current(const uint8_t* section, size_t len, uint8_t table_id)
+{
+  return len >= PSI_HEADER_SIZE + PSI_CRC_SIZE &&
+      section[0] == table_id &&
+      (section[1] & 0x80) &&
+      (section[5] & 0x01) &&
+      3u + (((section[1] & 0x0F) << 8) | section[2]) == len;
+}
+
+static uint16_t get_pid(const uint8_t* data)
+{
+  return ((data[0] & 0x1F) << 8) | data[1];
+}
+
+static uint16_t get_length(const uint8_t* data)
+{
+  return ((data[0] & 0x0F) << 8) | data[1];
+}
+
+bool psi_parse_pat(const uint8_t* section, size_t len, PsiPat& pat)
+{
+  if (!is_current(section, len, PSI_TABLE_PAT)) return false;
+  pat.ts_id = (section[3] << 8) | section[4];
+  pat.version = (section[5] >> 1) & 0x1F;
+  pat.section = section[6];
+  pat.last_section = section[7];
+  pat.count = 0;
+  size_t end = len - PSI_CRC_SIZE;
+  size_t offset = PSI_HEADER_SIZE;
+  for (; offset + 4 <= end; offset += 4)
+  {
+    if (pat.count == PSI_MAX_PROGRAMS) return false;
+    PsiProgram& program = pat.programs[pat.count++];
+    program.number = (section[offset] << 8) | section[offset + 1];
+    program.pmt_pid = get_pid(section + offset + 2);
+  }
+  return offset == end;
+}
+
+bool psi_parse_pmt(const uint8_t* section, size_t len, PsiPmt& pmt)
+{
+  if (!is_current(section, len, PSI_TABLE_PMT) || len < PSI_HEADER_SIZE + 4 + PSI_CRC_SIZE) return false;
+  pmt.program = (section[3] << 8) | section[4];
+  pmt.version = (section[5] >> 1) & 0x1F;
+  pmt.pcr_pid = get_pid(section + 8);
+  pmt.descriptors.len = get_length(section + 10);
+  pmt.descriptors.data = section + 12;
+  pmt.count = 0;
+  size_t end = len - PSI_CRC_SIZE;
+  size_t offset = 12 + pmt.descriptors.len;
+  while (offset + 5 <= end)
+  {
+    if (pmt.count == PSI_MAX_STREAMS) return false;
+    PsiStream& stream = pmt.streams[pmt.count++];
+    stream.type = section[offset];
+    stream.pid = get_pid(section + offset + 1);
+    stream.descriptors.len = get_length(section + offset + 3);
+    stream.descriptors.data = section + offset + 5;
+    offset += 5 + stream.descriptors.len;
+  }
+  return offset == end;
+}
+
+bool psi_parse_sdt(const uint8_t* section, size_t len, PsiSdt& sdt)
+{
+  if (!is_current(section, len, PSI_TABLE_SDT) || len < PSI_HEADER_SIZE + 3 + PSI_CRC_SIZE) return false;
+  sdt.ts_id = (section[3] << 8) | section[4];
+  sdt.version = (section[5] >> 1) & 0x1F;
+  sdt.section = section[6];
+  sdt.last_section = section[7];
+  sdt.network_id = (section[8] << 8) | section[9];
+  sdt.count = 0;
+  size_t end = len - PSI_CRC_SIZE;
+  size_t offset = PSI_HEADER_SIZE + 3;
+  while (offset + 5 <= end)
+  {
+    if (sdt.count == PSI_MAX_SERVICES) return false;
+    PsiService& service = sdt.services[sdt.count++];
+    service.id = (section[offset] << 8) | section[offset + 1];
+    service.running = section[offset + 3] >> 5;
+    service.free_ca = section[offset + 3] & 0x10;
+    service.descriptors.len = get_length(section + offset + 3);
+    service.descriptors.data = section + offset + 5;
+    offset += 5 + service.descriptors.len;
+  }
+  return offset == end;
+}
+
+const uint8_t* psi_find_descriptor(const PsiDescriptors& descriptors, uint8_t tag, uint8_t& len)
+{
+  size_t offset = 0;
+  while (offset + 2 <= descriptors.len)
+  {
+    const uint8_t* descriptor = descriptors.data + offset;
+    if (offset + 2 + descriptor[1] > descriptors.len) break;
+    if (descriptor[0] == tag)
+    {
+      len = descriptor[1];
+      return descriptor + 2;
+    }
+    offset += 2 + descriptor[1];
+  }
+  return NULL;
+}
+
+bool psi_service_name(const PsiDescriptors& descriptors, std::string& name)
+{
+  uint8_t len;
+  const uint8_t* data = psi_find_descriptor(descriptors, DESCRIPTOR_SERVICE, len);
+  // The service type, then the provider and service names with their lengths.
+  if (!data || len < 2 || 2 + data[1] >= len) return false;
+  const uint8_t* service_name = data + 2 + data[1];
+  if (1 + service_name[0] > data + len - service_name) return false;
+  // TODO - Handle character encodings properly here.
+  name.assign(reinterpret_cast<const char*>(service_name + 1), service_name[0]);
+  return true;
+}
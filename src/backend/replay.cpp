@@ -0,0 +1,120 @@
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/unistd.h>
+
+#include "replay.hpp"
+#include "log.hpp"
+#include "util.hpp"
+#include "dvb_hls.hpp"
+
+#define NS 1000000000ull
+// Treat PCR steps larger than this as a discontinuity.
+#define MAX_PCR_STEP PCR_CLOCK
+
+ReplaySource::ReplaySource(const std::string& multiplex, const std::string& path, bool paced) :
+    m_multiplex(multiplex),
+    m_path(path),
+    m_fd(-1),
+    m_paced(paced),
+    m_eof(0),
+    m_pcr_pid(-1),
+    m_last_pcr(0),
+    m_elapsed(0),
+    m_ref_time { 0 },
+    m_start_time { 0 },
+    m_bytes(0)
+{
+}
+
+void ReplaySource::open_source()
+{
+  if (m_path == "-")
+  {
+    m_fd = STDIN_FILENO;
+  }
+  else if ((m_fd = open(m_path.c_str(), O_RDONLY)) < 0)
+  {
+    throw DvbException(fmt("Failed to open replay file %s: %s") % m_path % strerror(errno));
+  }
+  clock_gettime(CLOCK_MONOTONIC, &m_start_time);
+  INFO("Replaying %s %s", m_path.c_str(), m_paced ? "paced to PCR" : "as fast as possible");
+}
+
+void ReplaySource::_pace(const uint8_t *buf, size_t pkts)
+{
+  for (size_t i = 0; i < pkts; i++)
+  {
+    const uint8_t* pkt = &buf[i * TS_PACKET_SIZE];
+    if (pkt[0] != 0x47 || !HAS_PCR(pkt)) continue;
+    int pid = GET_PID(pkt);
+    bool first = (m_pcr_pid == -1);
+    if (first) m_pcr_pid = pid;
+    if (pid != m_pcr_pid) continue;
+
+    uint64_t pcr = get_pcr(pkt);
+    uint64_t step = (pcr + PCR_WRAP - m_last_pcr) % PCR_WRAP;
+    m_last_pcr = pcr;
+    if (first || step > MAX_PCR_STEP)
+    {
+      // Start of stream or a discontinuity, restart the clock from here.
+      clock_gettime(CLOCK_MONOTONIC, &m_ref_time);
+      m_elapsed = 0;
+      continue;
+    }
+    m_elapsed += step;
+  }
+
+  if (m_pcr_pid == -1) return;
+  uint64_t target = m_ref_time.tv_sec * NS + m_ref_time.tv_nsec + m_elapsed * 1000 / 27;
+  timespec wake = { (time_t)(target / NS), (long)(target % NS) };
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+}
+
+void ReplaySource::_report()
+{
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double secs = (now.tv_sec - m_start_time.tv_sec) +
+    (now.tv_nsec - m_start_time.tv_nsec) / (double)NS;
+  double mbits = secs > 0 ? (m_bytes * 8) / secs / 1e6 : 0;
+  INFO
+  (
+    "Replay of %s finished: %llu packets in %.2fs (%.1f Mbit/s)",
+    m_path.c_str(), (unsigned long long)(m_bytes / TS_PACKET_SIZE), secs, mbits
+  );
+}
+
+ssize_t ReplaySource::read_bytes(uint8_t *buf, size_t size)
+{
+  if (m_eof) return 0;
+
+  ssize_t len = read(m_fd, buf, size);
+  if (len < 0)
+  {
+    if (errno == EINTR) return 0;
+    throw DvbException(fmt("Failed to read from %s: %s") % m_path % strerror(errno));
+  }
+  if (len == 0)
+  {
+    m_eof = 1;
+    _report();
+    return 0;
+  }
+
+  // Recordings start on a packet boundary, so only pace on the
+  // packets that were read whole.
+  size_t phase = (TS_PACKET_SIZE - m_bytes % TS_PACKET_SIZE) % TS_PACKET_SIZE;
+  m_bytes += len;
+  if (m_paced && (size_t)len > phase)
+  {
+    _pace(buf + phase, (len - phase) / TS_PACKET_SIZE);
+  }
+  return len;
+}
+
+ReplaySource::~ReplaySource()
+{
+  if (m_fd > STDIN_FILENO)
+    close(m_fd);
+}
@@ -0,0 +1,225 @@
+#include <algorithm>
+
+#include "segment_pool.hpp"
+#include "log.hpp"
+
+#define NS 1000000000ull
+
+SegmentPool::SegmentPool(TsIngest& ingest, const std::vector<Channel*>& channels,
+    unsigned workers, const std::string& multiplex) :
+    m_ingest(ingest),
+    m_lanes(),
+    m_batches(),
+    m_submitted(0),
+    m_released(0),
+    m_balance_time { 0 },
+    m_threads(),
+    m_stop(0),
+    m_generation(0),
+    m_error(),
+    m_lock(),
+    m_work(),
+    m_done(),
+    m_steals("segment_pool_steals_total", mux_label(multiplex)),
+    m_stalls("segment_pool_stalls_total", mux_label(multiplex))
+{
+  for (size_t i = 0; i < channels.size(); i++)
+  {
+    Lane* lane = new Lane();
+    lane->channel = channels[i];
+    lane->head = 0;
+    lane->tail = 0;
+    lane->busy = 0;
+    lane->home = i % workers;
+    lane->bytes = 0;
+    m_lanes.push_back(lane);
+  }
+  for (unsigned id = 0; id < workers; id++)
+  {
+    m_threads.push_back(std::thread(&SegmentPool::_worker, this, id));
+  }
+  INFO("Segmenting %u channels on %u threads", (unsigned)m_lanes.size(), workers);
+}
+
+bool SegmentPool::_run_lane(Lane& lane)
+{
+  if (lane.tail.load(std::memory_order_acquire) == lane.head.load(std::memory_order_acquire))
+  {
+    return false;
+  }
+  if (lane.busy.exchange(1, std::memory_order_acquire))
+  {
+    // Another worker has it.
+    return false;
+  }
+  unsigned tail = lane.tail.load(std::memory_order_relaxed);
+  bool worked = 0;
+  while (tail != lane.head.load(std::memory_order_acquire))
+  {
+    unsigned slot = lane.queue[tail % POOL_BATCHES];
+    Batch& batch = m_batches[slot];
+    std::vector<PacketRef>& refs = lane.refs[slot];
+    lane.channel->writePackets(refs.data(), refs.size(), batch.time);
+    refs.clear();
+    lane.tail.store(++tail, std::memory_order_release);
+    if (batch.pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      m_done.notify_one();
+    }
+    worked = 1;
+  }
+  lane.busy.store(0, std::memory_order_release);
+  return worked;
+}
+
+void SegmentPool::_worker(unsigned id)
+{
+  try
+  {
+    while (!m_stop)
+    {
+      unsigned generation = m_generation.load(std::memory_order_acquire);
+      bool worked = 0;
+      // Home lanes first, then steal from the other workers.
+      for (int steal = 0; steal < 2; steal++)
+      {
+        for (Lane* lane : m_lanes)
+        {
+          if ((lane->home.load(std::memory_order_relaxed) == id) == (steal == 0) && _run_lane(*lane))
+          {
+            worked = 1;
+            if (steal) m_steals.add();
+          }
+        }
+      }
+      if (!worked)
+      {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_work.wait(lock, [&] { return m_stop || m_generation.load() != generation; });
+      }
+    }
+  }
+  catch (...)
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_error = std::current_exception();
+    m_stop = 1;
+    m_work.notify_all();
+    m_done.notify_all();
+  }
+}
+
+void SegmentPool::_check_error()
+{
+  std::lock_guard<std::mutex> lock(m_lock);
+  if (m_error) std::rethrow_exception(m_error);
+}
+
+void SegmentPool::_release(unsigned limit)
+{
+  // Batches go back to the ingest in the order they were taken.
+  while (m_released != m_submitted)
+  {
+    Batch& batch = m_batches[m_released % POOL_BATCHES];
+    if (batch.pending.load(std::memory_order_acquire))
+    {
+      if (m_submitted - m_released <= limit) break;
+      std::unique_lock<std::mutex> lock(m_lock);
+      m_done.wait(lock, [&] { return !batch.pending.load(std::memory_order_acquire) || m_error; });
+      if (m_error) std::rethrow_exception(m_error);
+      continue;
+    }
+    m_ingest.release(batch.batch);
+    m_released++;
+  }
+}
+
+void SegmentPool::_balance()
+{
+  // Give the busiest lanes out first, each to the least loaded worker.
+  std::vector<Lane*> lanes(m_lanes);
+  std::sort(lanes.begin(), lanes.end(), [](Lane* a, Lane* b) { return a->bytes > b->bytes; });
+  std::vector<uint64_t> load(m_threads.size(), 0);
+  for (Lane* lane : lanes)
+  {
+    unsigned id = std::min_element(load.begin(), load.end()) - load.begin();
+    lane->home.store(id, std::memory_order_relaxed);
+    load[id] += lane->bytes;
+    lane->bytes = 0;
+  }
+}
+
+void SegmentPool::submit(const TsBatch& batch, const timespec& now, std::vector<std::vector<PacketRef>>& refs)
+{
+  _check_error();
+  if (m_submitted - m_released == POOL_BATCHES &&
+      m_batches[m_released % POOL_BATCHES].pending.load(std::memory_order_acquire))
+  {
+    m_stalls.add();
+  }
+  _release(POOL_BATCHES - 1);
+
+  unsigned slot = m_submitted % POOL_BATCHES;
+  Batch& pending = m_batches[slot];
+  pending.batch = batch;
+  pending.time = now;
+  unsigned count = 0;
+  for (size_t i = 0; i < m_lanes.size(); i++)
+  {
+    if (refs[i].empty()) continue;
+    Lane* lane = m_lanes[i];
+    lane->bytes += refs[i].size() * TS_PACKET_SIZE;
+    // Swap in the vector the lane emptied last time round, keeping both allocated.
+    lane->refs[slot].swap(refs[i]);
+    count++;
+  }
+  pending.pending.store(count, std::memory_order_relaxed);
+  m_submitted++;
+
+  if (count)
+  {
+    for (Lane* lane : m_lanes)
+    {
+      if (lane->refs[slot].empty()) continue;
+      unsigned head = lane->head.load(std::memory_order_relaxed);
+      lane->queue[head % POOL_BATCHES] = slot;
+      lane->head.store(head + 1, std::memory_order_release);
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      m_generation++;
+    }
+    m_work.notify_all();
+  }
+  _release(POOL_BATCHES);
+
+  uint64_t elapsed = (now.tv_sec * NS + now.tv_nsec) - (m_balance_time.tv_sec * NS + m_balance_time.tv_nsec);
+  if (elapsed >= POOL_BALANCE_INTERVAL * NS)
+  {
+    if (m_balance_time.tv_sec || m_balance_time.tv_nsec) _balance();
+    m_balance_time = now;
+  }
+}
+
+void SegmentPool::drain()
+{
+  _release(0);
+}
+
+SegmentPool::~SegmentPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_stop = 1;
+  }
+  m_work.notify_all();
+  for (auto& thread : m_threads)
+  {
+    thread.join();
+  }
+  for (Lane* lane : m_lanes)
+  {
+    delete lane;
+  }
+}
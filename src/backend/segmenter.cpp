@@ -3,260 +3,1244 @@
 #include <stddef.h>
 #include <string.h>
 #include "segmenter.hpp"
-#include <dvbpsi/psi.h>
-#include <dvbpsi/dr_48.h>
 #include <fstream>
+#include <sstream>
+#include <iterator>
+#include <algorithm>
 #include <unistd.h>
 
 #include "dvb.hpp"
+#include "ts_source.hpp"
 #include "channel.hpp"
+#include "segment_pool.hpp"
+#include "playlist_watcher.hpp"
 #include "util.hpp"
 #include "log.hpp"
+#include "stats.hpp"
 
-Segmenter::Segmenter(DvbDevice &device) :
-    m_dvbpsi_pat(0),
-    m_dvbpsi_sdt(0),
-    m_device(device),
+#define NS 1000000000ull
+#define SERVICES_SUFFIX ".services"
+#define ACTIVITY_INTERVAL (NS / 4) // How often to check for requested channels
+#define SCRAMBLE_INTERVAL NS // How often to check which channels are scrambled
+#define PARK_AFTER 10 // Intervals mostly scrambled before a channel is parked
+#define PARK_AFTER_CA 3 // Or when its PMT names a CA system
+#define UNPARK_AFTER 2 // Intervals mostly clear before it is written again
+
+// PAT, CAT and TDT are written to every channel. Each channel gets its
+// own SDT and EIT from the SiProcessor, and the NIT is dropped.
+static const uint16_t si_pids[] = { 0, 1, 20 };
+
+Segmenter::Segmenter(TsSource &source) :
+    m_source(source),
+    m_pat_sections([this](const uint8_t* section, size_t len) { _pat_section(section, len); }),
+    m_sdt_sections([this](const uint8_t* section, size_t len) { _sdt_section(section, len); }),
+    m_pat_seen(),
+    m_sdt_seen(),
+    m_pat(),
+    m_sdt(),
+    m_decoding_pat(0),
+    m_decoding_sdt(0),
     m_have_pat(0),
     m_have_sdt(0),
-    m_channel_pids(),
+    m_channels(),
     m_channel_ids(),
+    m_router(),
     m_tsid(0),
-    m_quit(0)
+    m_quit(0),
+    m_ingest(source),
+    m_pid_filter(0),
+    m_whole_mux(0),
+    m_enabled_channels(0),
+    m_ingest_thread(0),
+    m_ingest_cpu(-1),
+    m_ingest_priority(0),
+    m_headers(),
+    m_refs(),
+    m_segment_threads(0),
+    m_restamp_pcr(0),
+    m_use_uring(0),
+    m_pool(0),
+    m_idle_timeout(0),
+    m_watcher(0),
+    m_request_lock(),
+    m_requests(),
+    m_last_request(),
+    m_activity_time { 0 },
+    m_shed_load(0),
+    m_load(0),
+    m_trimmed(0),
+    m_shed(),
+    m_shed_exhausted(0),
+    m_use_cache(0),
+    m_progressive(0),
+    m_scanning(0),
+    m_from_cache(0),
+    m_scan_start { 0 },
+    m_names(),
+    m_on_services(),
+    m_rescan(0),
+    m_scan_pids(),
+    m_unscanned(0),
+    m_monitor(0),
+    m_pat_version(0),
+    m_sdt_version(0),
+    m_pat_tsid(0),
+    m_programs(),
+    m_pat_changed { 0 },
+    m_sdt_changed { 0 },
+    m_pmt_changed(),
+    m_si([this](uint16_t service, uint16_t pid, const std::vector<uint8_t>& packets)
+        { _process_si(service, pid, packets); }, source.get_multiplex()),
+    m_cc(),
+    m_pid_scrambled(),
+    m_pid_clear(),
+    m_scramble_time { 0 },
+    m_parked(),
+    m_errors("ts_errors_total", mux_label(source.get_multiplex())),
+    m_tei("ts_transport_errors_total", mux_label(source.get_multiplex())),
+    m_scrambled("ts_scrambled_total", mux_label(source.get_multiplex())),
+    m_cc_errors("ts_cc_errors_total", mux_label(source.get_multiplex())),
+    m_activations("channel_activations_total", mux_label(source.get_multiplex())),
+    m_deactivations("channel_deactivations_total", mux_label(source.get_multiplex())),
+    m_shed_stat("channels_shed", mux_label(source.get_multiplex())),
+    m_parked_stat("channels_parked", mux_label(source.get_multiplex())),
+    m_parked_rate("channels_parked_bytes_per_second", mux_label(source.get_multiplex()))
 {
+  memset(m_cc, 0xFF, sizeof(m_cc));
+  m_pat_sections.want(PSI_TABLE_PAT);
+  m_sdt_sections.want(PSI_TABLE_SDT);
 }
 
-void Segmenter::_process_pat(void* self, dvbpsi_pat_t* pat)
+template <typename F>
+inline void Segmenter::_for_each_slot(const PidRoute& route, F f)
 {
-  Segmenter* ths = static_cast<Segmenter*>(self);
-  dvbpsi_pat_program_t* program = pat->p_first_program;
-  ths->m_tsid = pat->i_ts_id;
-
-  while (program)
+  if (route.count == ROUTE_ALL)
+  {
+    for (size_t slot = 0; slot < m_channels.size(); slot++)
+    {
+      f(slot);
+    }
+  }
+  else if (route.count == ROUTE_OVERFLOW)
+  {
+    for (uint16_t slot : m_router.overflow(route))
+    {
+      f(slot);
+    }
+  }
+  else
   {
-    if (program->i_pid != 16)
+    for (unsigned i = 0; i < route.count; i++)
     {
-      Channel* chan = new Channel(program->i_number);
-      ths->m_channel_ids[program->i_number] = chan;
-      ths->m_channel_pids[program->i_pid] = chan;
+      f(route.slots[i]);
     }
-    program = program->p_next;
   }
-  ths->m_have_pat = 1;
+}
+
+template <typename F>
+inline void Segmenter::_for_each_channel(const PidRoute& route, F f)
+{
+  _for_each_slot(route, [&](size_t slot) { f(m_channels[slot]); });
+}
+
+void Segmenter::_pat_section(const uint8_t* section, size_t len)
+{
+  if (!m_decoding_pat || m_have_pat || !psi_parse_pat(section, len, m_pat)) return;
+  int seen = m_pat_seen.add(m_pat.version, m_pat.section, m_pat.last_section);
+  if (seen == PSI_SECTION_REPEAT) return;
+  if (seen == PSI_SECTION_FIRST) m_programs.clear();
+  for (uint16_t i = 0; i < m_pat.count; i++)
+  {
+    // Program 0 is the NIT.
+    const PsiProgram& program = m_pat.programs[i];
+    if (program.number) m_programs[program.number] = program.pmt_pid;
+  }
+  m_pat_version = m_pat.version;
+  m_pat_tsid = m_pat.ts_id;
+  if (m_pat_seen.complete()) _process_pat();
+}
+
+void Segmenter::_setup_channel(Channel* chan)
+{
+  chan->restamp_pcr(m_restamp_pcr);
+  if (!m_use_uring) return;
+  try
+  {
+    chan->use_io_uring(true);
+  }
+  catch (DvbException& e)
+  {
+    // Once for the multiplex, the rest would fail alike.
+    WARNING("%s, writing segments with write()", e.what());
+    m_use_uring = 0;
+  }
+}
+
+void Segmenter::_process_pat()
+{
+  if (m_from_cache)
+  {
+    _check_pat();
+    return;
+  }
+  m_have_pat = 1;
+  if (m_monitor)
+  {
+    // Applied between packets, see _update_pat().
+    m_rescan |= m_pat_tsid != m_tsid;
+    return;
+  }
+  m_tsid = m_pat_tsid;
+
+  std::lock_guard<std::mutex> lock(m_request_lock);
+  for (auto& program : m_programs)
+  {
+    Channel* chan = new Channel(program.first, program.second, m_source.get_multiplex());
+    _setup_channel(chan);
+    // Time each service from the start of the scan.
+    chan->activate(m_scan_start);
+    m_channel_ids[program.first] = chan;
+    m_channels.push_back(chan);
+  }
+  m_programs.clear();
   DEBUG("Decoded PAT");
-  dvbpsi_pat_delete(pat);
 }
 
-void Segmenter::_attach_sdt(dvbpsi_t *dvbpsi, uint8_t table_id, uint16_t extension, void* self)
+void Segmenter::_check_pat()
+{
+  // The cached services must match the PAT exactly.
+  bool same = m_pat_tsid == m_tsid && m_programs.size() == m_channel_ids.size();
+  for (auto& program : m_programs)
+  {
+    auto found = m_channel_ids.find(program.first);
+    same &= found != m_channel_ids.end() && found->second->pmt_pid() == program.second;
+  }
+  m_rescan = !same;
+  m_programs.clear();
+  m_have_pat = 1;
+  DEBUG("Checked PAT against the cache");
+}
+
+void Segmenter::_sdt_section(const uint8_t* section, size_t len)
 {
-  if (table_id == 0x42)
+  if (!m_decoding_sdt || m_have_sdt || !psi_parse_sdt(section, len, m_sdt)) return;
+  if (m_sdt.ts_id != m_tsid) return;
+  if (m_sdt_seen.add(m_sdt.version, m_sdt.section, m_sdt.last_section) == PSI_SECTION_REPEAT) return;
+  m_sdt_version = m_sdt.version;
+  for (uint16_t i = 0; i < m_sdt.count; i++)
   {
-    if (dvbpsi_sdt_attach(dvbpsi, table_id, extension, &_process_sdt, self) < 0)
+    const PsiService& service = m_sdt.services[i];
+    auto found = m_channel_ids.find(service.id);
+    std::string name;
+    if (found == m_channel_ids.end() || !psi_service_name(service.descriptors, name)) continue;
+    Channel* chan = found->second;
+    if (m_from_cache)
     {
-      throw DvbException("Failed to decode SDT.");
+      // A renamed service moves its output, so start again.
+      m_rescan |= (name != chan->getName());
+      continue;
     }
+    // Applied once the channels aren't being written.
+    if (name != chan->getName()) m_names[service.id] = name;
   }
+  m_have_sdt = m_sdt_seen.complete();
 }
 
-void Segmenter::_process_sdt(void* self, dvbpsi_sdt_t* sdt)
+void Segmenter::scan()
 {
-  Segmenter* ths = static_cast<Segmenter*>(self);
-  dvbpsi_sdt_service_t* service = sdt->p_first_service;
-  while(service)
+  clock_gettime(CLOCK_MONOTONIC, &m_scan_start);
+  if (m_use_cache && !m_rescan && _load_services())
   {
-    Channel* chan = ths->m_channel_ids[service->i_service_id];
-    dvbpsi_descriptor_t* descriptor = service->p_first_descriptor;
-    while(descriptor)
+    INFO("Starting %s from %d cached services, verifying them while streaming",
+        m_source.get_multiplex().c_str(), (int)m_channel_ids.size());
+    m_from_cache = 1;
+    _start_scan();
+    return;
+  }
+
+  _decode_pat();
+
+  TsBatch batch;
+
+  while (!m_have_pat && m_ingest.next_batch(batch))
+  {
+    for (size_t i = 0; i < batch.count && !m_have_pat; i++)
     {
-      if (descriptor->i_tag == 0x48)
+      if (m_quit) return;
+      uint8_t* buf = &batch.packets[i * TS_PACKET_SIZE];
+      if (GET_PID(buf) == 0x0)
       {
-        dvbpsi_service_dr_t* service_dr = dvbpsi_DecodeServiceDr(descriptor);
-        // TODO - Handle character encodings properly here.
-        std::string name
-        (
-            reinterpret_cast<char*>(&service_dr->i_service_name[0]),
-            service_dr->i_service_name_length
-        );
-        chan->setName(name);
-        DEBUG("Found channel: %s", name.c_str());
-        break;
+        DEBUG("Decoding PAT");
+        m_pat_sections.push(buf);
       }
-      descriptor = descriptor->p_next;
     }
-    service = service->p_next;
+    m_ingest.release(batch);
+  }
+  if (!m_have_pat) return;
+  _detach_pat();
+
+  _start_scan();
+  if (m_progressive)
+  {
+    INFO("Found %d services on %s, starting each as its PMT arrives",
+        (int)m_channel_ids.size(), m_source.get_multiplex().c_str());
+    return;
+  }
+  while (m_scanning && !m_quit && m_ingest.next_batch(batch))
+  {
+    _scan_batch(batch);
+    m_ingest.release(batch);
   }
-  ths->m_have_sdt = 1;
-  dvbpsi_sdt_detach(ths->m_dvbpsi_sdt, 0x42, ths->m_tsid);
+  INFO("Found %d channels", m_channel_ids.size());
 }
 
-void Segmenter::scan()
+void Segmenter::write_index(std::ostream& index) const
 {
-  m_dvbpsi_pat = dvbpsi_new(handle_dvbpsi_message, DVBPSI_MESSAGE_LEVEL);
+  std::lock_guard<std::mutex> lock(m_request_lock);
+  for (auto& item : m_channel_ids)
+  {
+    Channel* chan = item.second;
+    if (chan->enabled() && !chan->parked() && !chan->getName().empty())
+    {
+      index << chan->getName() << ',' << chan->index_file() << std::endl;
+    }
+  }
+}
 
-  if (m_dvbpsi_pat == NULL)
-    throw DvbException("Failed to decode PAT.");
+const std::string& Segmenter::multiplex() const
+{
+  return m_source.get_multiplex();
+}
 
-  if (!dvbpsi_pat_attach(m_dvbpsi_pat, &_process_pat, this))
-    throw DvbException("Failed to decode PAT.");
+void Segmenter::run()
+{
+  if (m_ingest_thread)
+  {
+    m_ingest.start_thread(m_ingest_cpu, m_ingest_priority);
+  }
+  _stream();
+  while (m_rescan && !m_quit)
+  {
+    WARNING("Services on %s have changed, rescanning", m_source.get_multiplex().c_str());
+    _clear_channels();
+    scan();
+    m_rescan = 0;
+    _stream();
+  }
+  if (m_use_cache && !m_scanning && m_pmt_changed.empty())
+  {
+    // Leave the segments for the next run to carry on from.
+    for (Channel* chan : m_channels)
+    {
+      chan->keep_output();
+    }
+    _save_services();
+  }
+}
 
-  uint8_t buf[TS_PACKET_SIZE];
+void Segmenter::_stream()
+{
+  TsBatch batch;
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
 
-  while (m_device.read_card(buf, TS_PACKET_SIZE) == 1)
+  if (m_use_cache && !m_scanning)
   {
-    if (m_quit) return;
-    if (GET_PID(buf) == 0x0)
+    _save_services();
+  }
+  if (m_idle_timeout || m_shed_load)
+  {
+    // Playlist reads tell which channels are being watched.
+    if (!m_watcher) m_watcher = new PlaylistWatcher(OUT_DIR);
+    m_last_request.assign(m_channels.size(), 0);
+  }
+  if (m_idle_timeout)
+  {
+    // Channels sleep until their playlist is read, except those that
+    // were streaming before a restart.
+    for (size_t slot = 0; slot < m_channels.size(); slot++)
     {
-      DEBUG("Decoding PAT");
-      dvbpsi_packet_push(m_dvbpsi_pat, buf);
-      if (m_have_pat)
+      Channel* chan = m_channels[slot];
+      if (!chan->enabled()) continue;
+      if (chan->resuming())
+      {
+        m_last_request[slot] = now.tv_sec;
+      }
+      else
       {
-        dvbpsi_pat_detach(m_dvbpsi_pat);
-        dvbpsi_delete(m_dvbpsi_pat);
-        m_dvbpsi_pat = NULL;
-        break;
+        chan->deactivate();
       }
     }
   }
+  if (m_shed_load && !m_load)
+  {
+    m_load = new LoadShedder(m_source.get_multiplex());
+  }
+  // Scrambling is counted from here on.
+  m_scramble_time = now;
+  memset(m_pid_scrambled, 0, sizeof(m_pid_scrambled));
+  memset(m_pid_clear, 0, sizeof(m_pid_clear));
+  _update_routes();
+  m_refs.clear();
+  m_refs.resize(m_channels.size());
+  if (m_segment_threads)
+  {
+    m_pool = new SegmentPool(m_ingest, m_channels, m_segment_threads, m_source.get_multiplex());
+  }
+
+  while (!m_quit && !m_rescan && !m_ingest.eof())
+  {
+    Stats::write_if_due();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (m_watcher) _update_activity(now);
+    if (m_load) _update_load(now);
+    _update_scrambling(now);
+    if (!m_ingest.next_batch(batch)) continue;
+    timespec taken;
+    if (m_load) clock_gettime(CLOCK_MONOTONIC, &taken);
+    if (m_scanning)
+    {
+      _scan_batch(batch);
+    }
+    else if (m_monitor)
+    {
+      _monitor_batch(batch, now);
+    }
+    for (size_t slot = 0; slot < m_channels.size(); slot++)
+    {
+      // Ahead of the packets of the batch the PSI was decoded in.
+      if (m_channels[slot]->handPsi()) m_refs[slot].push_back({ NULL, 0, 0, 0 });
+    }
+    const PidRoute* routes = m_router.table();
+    for (size_t start = 0; start < batch.count; start += TS_BATCH_MAX)
+    {
+      size_t count = std::min<size_t>(batch.count - start, TS_BATCH_MAX);
+      _dispatch(&batch.packets[start * TS_PACKET_SIZE], count, routes);
+    }
+    if (m_pool)
+    {
+      m_pool->submit(batch, now, m_refs);
+    }
+    else
+    {
+      _write_batch(now);
+      m_ingest.release(batch);
+    }
+    if (_count_enabled() != m_enabled_channels)
+    {
+      _update_routes();
+    }
+    if (m_load) m_load->batch(taken, m_ingest.depth());
+  }
+  if (m_pool)
+  {
+    m_pool->drain();
+    delete m_pool;
+    m_pool = 0;
+  }
+}
+
+std::string Segmenter::_cache_file() const
+{
+  std::string name;
+  for (auto chr : m_source.get_multiplex())
+  {
+    name += (chr == ' ' || chr == '/') ? '_' : tolower(chr);
+  }
+  return OUT_DIR + name + SERVICES_SUFFIX;
+}
+
+bool Segmenter::_load_services()
+{
+  std::ifstream in(_cache_file());
+  if (!in) return false;
+  try
+  {
+    std::string line, key;
+    std::getline(in, line);
+    std::istringstream header(line);
+    if (!(header >> key >> m_tsid) || key != "tsid")
+    {
+      throw DvbException("Missing the transport stream id");
+    }
+    Channel* chan;
+    while ((chan = Channel::load_state(in, m_source.get_multiplex())))
+    {
+      _setup_channel(chan);
+      chan->activate(m_scan_start);
+      std::lock_guard<std::mutex> lock(m_request_lock);
+      m_channel_ids[chan->id()] = chan;
+      m_channels.push_back(chan);
+    }
+  }
+  catch (std::exception& e)
+  {
+    WARNING("Ignoring the cached services of %s: %s", m_source.get_multiplex().c_str(), e.what());
+    _clear_channels();
+    return false;
+  }
+  return !m_channels.empty();
+}
 
-  m_dvbpsi_sdt = dvbpsi_new(handle_dvbpsi_message, DVBPSI_MESSAGE_LEVEL);
-  if (m_dvbpsi_sdt == NULL)
-    throw DvbException("Failed to decode SDT.");
-  if (!dvbpsi_AttachDemux(m_dvbpsi_sdt, &_attach_sdt, this))
-    throw DvbException("Failed to decode SDT.");
+void Segmenter::_save_services()
+{
+  std::string file = _cache_file();
+  {
+    std::ofstream out(file + ".tmp");
+    out << "tsid " << m_tsid << '\n';
+    for (auto& item : m_channel_ids)
+    {
+      item.second->save_state(out);
+    }
+    if (!out)
+    {
+      WARNING("Failed to cache the services of %s in %s", m_source.get_multiplex().c_str(), file.c_str());
+      return;
+    }
+  }
+  rename((file + ".tmp").c_str(), file.c_str());
+}
 
-  int chan_count = m_channel_pids.size();
-  for (auto pair : m_channel_pids)
+void Segmenter::_clear_channels()
+{
+  if (m_use_cache) remove(_cache_file().c_str());
+  _stop_scan();
+  std::lock_guard<std::mutex> lock(m_request_lock);
+  for (auto& item : m_channel_ids)
   {
-    pair.second->startPmtScan(handle_dvbpsi_message);
+    delete item.second;
   }
-  while (m_device.read_card(buf, TS_PACKET_SIZE) == 1)
+  m_channel_ids.clear();
+  m_channels.clear();
+  m_shed.clear();
+  m_shed_stat.set(0);
+  m_parked.clear();
+  _update_parked();
+  m_trimmed = 0;
+  m_have_pat = 0;
+  m_have_sdt = 0;
+  // Start over with the new channels.
+  delete m_load;
+  m_load = 0;
+  delete m_monitor;
+  m_monitor = 0;
+  m_programs.clear();
+  m_pmt_changed.clear();
+  // Resent to the new channels.
+  m_si.clear();
+}
+
+void Segmenter::_start_scan()
+{
+  m_scanning = 1;
+  if (m_from_cache) _decode_pat();
+  _decode_sdt();
+  m_scan_pids.clear();
+  for (Channel* chan : m_channels)
   {
-    if (m_quit) return;
+    chan->startPmtScan();
+    m_scan_pids.insert(chan->pmt_pid());
+  }
+  m_unscanned = m_channels.size();
+}
+
+void Segmenter::_scan_batch(const TsBatch& batch)
+{
+  bool decoded = 0;
+  for (size_t i = 0; i < batch.count && !m_rescan; i++)
+  {
+    uint8_t* buf = &batch.packets[i * TS_PACKET_SIZE];
     uint16_t pid = GET_PID(buf);
-    if (m_channel_pids.count(pid))
+    if (pid == 0x0 && m_decoding_pat && !m_have_pat)
+    {
+      m_pat_sections.push(buf);
+    }
+    else if (pid == 0x11 && m_decoding_sdt && !m_have_sdt)
     {
-      Channel* chan = m_channel_pids[pid];
-      std::vector<int>* pids = chan->readPmt(buf);
-      if (pids)
+      DEBUG("Processing SDT pkt");
+      m_sdt_sections.push(buf);
+    }
+    else if (m_scan_pids.count(pid))
+    {
+      // Several programs can share a PMT PID.
+      for (Channel* chan : m_channels)
       {
-        for (int pid : *pids)
+        if (chan->pmt_pid() == pid && chan->readPmt(buf))
         {
-          m_channel_pids[pid] = chan;
+          m_unscanned--;
+          decoded = 1;
         }
-        chan_count--;
       }
     }
-    else if (pid == 0x11)
+  }
+  _apply_names();
+  // A channel goes live as soon as its streams are known.
+  if (decoded) _update_routes();
+  if (!m_rescan && !(m_have_pat && m_have_sdt && !m_unscanned)) return;
+
+  bool from_cache = m_from_cache;
+  _stop_scan();
+  if (m_rescan) return;
+  if (from_cache)
+  {
+    INFO("Verified the cached services of %s", m_source.get_multiplex().c_str());
+  }
+  else
+  {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t elapsed = ((now.tv_sec * NS + now.tv_nsec) - (m_scan_start.tv_sec * NS + m_scan_start.tv_nsec)) / 1000000;
+    INFO("Scanned %s in %.1fs", m_source.get_multiplex().c_str(), elapsed / 1000.0);
+  }
+  _start_monitor();
+  if (m_use_cache) _save_services();
+  _update_routes();
+}
+
+void Segmenter::_apply_names()
+{
+  if (m_names.empty()) return;
+  // Naming a channel moves its output.
+  if (m_pool) m_pool->drain();
+  {
+    std::lock_guard<std::mutex> lock(m_request_lock);
+    for (auto& item : m_names)
     {
-      DEBUG("Processing SDT pkt");
-      dvbpsi_packet_push(m_dvbpsi_sdt, buf);
+      auto found = m_channel_ids.find(item.first);
+      if (found == m_channel_ids.end()) continue;
+      found->second->setName(item.second);
+      DEBUG("Found channel: %s", item.second.c_str());
     }
-    // Decoded all PMTs and decoded the SDT
-    if (chan_count == 0 && m_have_sdt)
+  }
+  m_names.clear();
+  if (m_on_services) m_on_services();
+}
+
+void Segmenter::_stop_scan()
+{
+  m_scanning = 0;
+  m_from_cache = 0;
+  m_scan_pids.clear();
+  _detach_sdt();
+  _detach_pat();
+}
+
+void Segmenter::_decode_pat()
+{
+  m_have_pat = 0;
+  m_decoding_pat = 1;
+  m_pat_sections.reset();
+  m_pat_seen.reset();
+  m_programs.clear();
+}
+
+void Segmenter::_decode_sdt()
+{
+  m_have_sdt = 0;
+  m_decoding_sdt = 1;
+  m_sdt_sections.reset();
+  m_sdt_seen.reset();
+}
+
+void Segmenter::_detach_pat()
+{
+  m_decoding_pat = 0;
+}
+
+void Segmenter::_detach_sdt()
+{
+  m_decoding_sdt = 0;
+}
+
+void Segmenter::_start_monitor()
+{
+  if (!m_monitor) m_monitor = new PsiMonitor(m_source.get_multiplex());
+  m_monitor->clear();
+  m_monitor->expect(0x0, PSI_TABLE_PAT, m_tsid, m_pat_version);
+  m_monitor->expect(0x11, PSI_TABLE_SDT, m_tsid, m_sdt_version);
+  for (Channel* chan : m_channels)
+  {
+    m_monitor->expect(chan->pmt_pid(), PSI_TABLE_PMT, chan->id(), chan->pmt_version());
+  }
+}
+
+void Segmenter::_monitor_batch(const TsBatch& batch, const timespec& now)
+{
+  std::vector<std::pair<Channel*, timespec>> decoded;
+  for (size_t i = 0; i < batch.count && !m_rescan; i++)
+  {
+    uint8_t* buf = &batch.packets[i * TS_PACKET_SIZE];
+    uint16_t pid = GET_PID(buf);
+    if (!m_monitor->watching(pid)) continue;
+    uint8_t table_id;
+    uint16_t extension;
+    if (m_monitor->changed(buf, table_id, extension))
+    {
+      _psi_changed(table_id, extension, now);
+    }
+    // Only the tables that have changed are decoded.
+    if (pid == 0x0 && m_decoding_pat && !m_have_pat)
+    {
+      m_pat_sections.push(buf);
+    }
+    else if (pid == 0x11 && m_decoding_sdt && !m_have_sdt)
+    {
+      m_sdt_sections.push(buf);
+    }
+    else if (m_scan_pids.count(pid))
     {
-      dvbpsi_DetachDemux(m_dvbpsi_sdt);
-      dvbpsi_delete(m_dvbpsi_sdt);
-      m_dvbpsi_sdt = 0;
-      break;
+      for (Channel* chan : m_channels)
+      {
+        if (chan->pmt_pid() == pid && chan->readPmt(buf))
+        {
+          decoded.push_back({ chan, m_pmt_changed[chan->id()] });
+          m_pmt_changed.erase(chan->id());
+        }
+      }
     }
   }
-  INFO("Found %d channels", m_channel_ids.size());
+  if (m_rescan) return;
+
+  timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (!decoded.empty())
+  {
+    // Only the routes of these channels change, the table is swapped in whole.
+    _update_scan_pids();
+    _update_routes();
+    for (auto& item : decoded)
+    {
+      Channel* chan = item.first;
+      m_monitor->expect(chan->pmt_pid(), PSI_TABLE_PMT, chan->id(), chan->pmt_version());
+      m_monitor->applied(item.second, start);
+    }
+    if (m_use_cache && m_pmt_changed.empty()) _save_services();
+  }
+  if (m_decoding_pat && m_have_pat)
+  {
+    _update_pat(now);
+  }
+  if (m_decoding_sdt && m_have_sdt)
+  {
+    _detach_sdt();
+    _apply_names();
+    m_monitor->expect(0x11, PSI_TABLE_SDT, m_tsid, m_sdt_version);
+    m_monitor->applied(m_sdt_changed, start);
+  }
+}
+
+void Segmenter::_psi_changed(uint8_t table_id, uint16_t extension, const timespec& now)
+{
+  if (table_id == PSI_TABLE_PAT)
+  {
+    INFO("PAT of %s has changed", m_source.get_multiplex().c_str());
+    m_pat_changed = now;
+    _detach_pat();
+    _decode_pat();
+  }
+  else if (table_id == PSI_TABLE_SDT)
+  {
+    INFO("SDT of %s has changed", m_source.get_multiplex().c_str());
+    m_sdt_changed = now;
+    _detach_sdt();
+    _decode_sdt();
+  }
+  else if (table_id == PSI_TABLE_PMT)
+  {
+    auto found = m_channel_ids.find(extension);
+    if (found == m_channel_ids.end()) return;
+    Channel* chan = found->second;
+    INFO("PMT of service %u on %s has changed", chan->id(), m_source.get_multiplex().c_str());
+    m_pmt_changed[chan->id()] = now;
+    chan->startPmtScan();
+    m_scan_pids.insert(chan->pmt_pid());
+  }
 }
 
-void Segmenter::_write_channel_index()
+void Segmenter::_update_pat(const timespec& now)
 {
-  std::string fname(m_device.get_multiplex() + ".csv");
-  std::ofstream chan_index(fname.c_str());
+  timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  _detach_pat();
+  // A different transport stream altogether.
+  if (m_rescan) return;
+
+  // A service that moves its PMT starts again.
+  std::set<Channel*> removed;
+  std::map<uint16_t, uint16_t> added;
   for (auto& item : m_channel_ids)
   {
-    Channel* chan = item.second;
-    if (chan->enabled())
+    auto found = m_programs.find(item.first);
+    if (found == m_programs.end() || found->second != item.second->pmt_pid()) removed.insert(item.second);
+  }
+  for (auto& program : m_programs)
+  {
+    auto found = m_channel_ids.find(program.first);
+    if (found == m_channel_ids.end() || found->second->pmt_pid() != program.second) added.insert(program);
+  }
+  if (!removed.empty() || !added.empty())
+  {
+    // The workers have a lane for each channel, so they start again.
+    if (m_pool)
     {
-      chan_index << chan->getName() << ',' << chan->index_file() << std::endl;
+      m_pool->drain();
+      delete m_pool;
+      m_pool = 0;
     }
+    {
+      std::lock_guard<std::mutex> lock(m_request_lock);
+      std::vector<Channel*> channels;
+      std::vector<time_t> last_request;
+      for (size_t slot = 0; slot < m_channels.size(); slot++)
+      {
+        Channel* chan = m_channels[slot];
+        if (removed.count(chan))
+        {
+          INFO("Service %u has left %s", chan->id(), m_source.get_multiplex().c_str());
+          m_channel_ids.erase(chan->id());
+          m_pmt_changed.erase(chan->id());
+          m_names.erase(chan->id());
+          m_shed.erase(std::remove(m_shed.begin(), m_shed.end(), chan), m_shed.end());
+          m_parked.erase(chan->id());
+          delete chan;
+          continue;
+        }
+        channels.push_back(chan);
+        if (!m_last_request.empty()) last_request.push_back(m_last_request[slot]);
+      }
+      for (auto& program : added)
+      {
+        INFO("Service %u has joined %s", program.first, m_source.get_multiplex().c_str());
+        Channel* chan = new Channel(program.first, program.second, m_source.get_multiplex());
+        _setup_channel(chan);
+        // On demand channels sleep until they are requested, as at startup.
+        if (m_idle_timeout)
+        {
+          chan->deactivate();
+        }
+        else
+        {
+          chan->activate(now);
+        }
+        chan->trim(m_trimmed);
+        chan->startPmtScan();
+        m_monitor->watch(program.second);
+        m_pmt_changed[program.first] = now;
+        m_channel_ids[program.first] = chan;
+        m_si.resend(program.first);
+        channels.push_back(chan);
+        if (!m_last_request.empty()) last_request.push_back(0);
+      }
+      m_channels.swap(channels);
+      m_last_request.swap(last_request);
+    }
+    m_shed_stat.set(m_shed.size());
+    _update_parked();
+    m_refs.clear();
+    m_refs.resize(m_channels.size());
+    if (m_segment_threads)
+    {
+      m_pool = new SegmentPool(m_ingest, m_channels, m_segment_threads, m_source.get_multiplex());
+    }
+    _update_scan_pids();
+    _update_routes();
+    if (!added.empty())
+    {
+      // The SDT may already have named the new services.
+      _detach_sdt();
+      m_sdt_changed = now;
+      _decode_sdt();
+    }
+    if (m_on_services) m_on_services();
   }
+  m_monitor->expect(0x0, PSI_TABLE_PAT, m_tsid, m_pat_version);
+  m_monitor->applied(m_pat_changed, start);
 }
 
-void Segmenter::run()
+void Segmenter::_update_scan_pids()
 {
-  const uint8_t num_packets = 20;
-  uint8_t buf[TS_PACKET_SIZE * num_packets];
-  uint8_t* pkt;
-  uint16_t pid;
-  size_t pkts;
-  bool required_pids[MAX_REQUIRED_PID + 1] = { 0 };
-  required_pids[0] = 1; // PAT
-  required_pids[1] = 1; // CAT
-  required_pids[16] = 1; // NIT
-  required_pids[17] = 1; // SDT
-  required_pids[18] = 1; // EIT
-  required_pids[20] = 1; // TDT
+  m_scan_pids.clear();
+  for (auto& item : m_pmt_changed)
+  {
+    m_scan_pids.insert(m_channel_ids[item.first]->pmt_pid());
+  }
+}
 
-  if (access(OUT_DIR, F_OK) < 0)
+std::string Segmenter::playlist(const std::string& service) const
+{
+  std::lock_guard<std::mutex> lock(m_request_lock);
+  for (auto& item : m_channel_ids)
   {
-    if (mkdir(OUT_DIR, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0)
+    if (item.second->getName() == service) return item.second->index_file();
+  }
+  return "";
+}
+
+void Segmenter::request(const std::string& service)
+{
+  // Every channel streams anyway.
+  if (!m_idle_timeout) return;
+  std::lock_guard<std::mutex> lock(m_request_lock);
+  m_requests.push_back(service);
+}
+
+void Segmenter::_update_activity(const timespec& now)
+{
+  uint64_t elapsed = (now.tv_sec * NS + now.tv_nsec) - (m_activity_time.tv_sec * NS + m_activity_time.tv_nsec);
+  if (elapsed < ACTIVITY_INTERVAL) return;
+  m_activity_time = now;
+
+  std::set<std::string> playlists;
+  m_watcher->poll(playlists);
+  std::vector<std::string> services;
+  {
+    std::lock_guard<std::mutex> lock(m_request_lock);
+    services.swap(m_requests);
+  }
+
+  std::vector<Channel*> wake, sleep;
+  for (size_t slot = 0; slot < m_channels.size(); slot++)
+  {
+    Channel* chan = m_channels[slot];
+    if (!chan->enabled() || chan->parked() || chan->getName().empty()) continue;
+    bool requested = playlists.count(chan->index_file()) ||
+        std::find(services.begin(), services.end(), chan->getName()) != services.end();
+    if (requested)
+    {
+      m_last_request[slot] = now.tv_sec;
+      // A watched channel comes back even if it was shed.
+      if (!chan->active()) wake.push_back(chan);
+    }
+    else if (m_idle_timeout && chan->active() && now.tv_sec - m_last_request[slot] >= m_idle_timeout)
     {
-      throw DvbException
-      (
-        fmt("Failed to create output directory %s : %s") % OUT_DIR % strerror(errno)
-      );
+      sleep.push_back(chan);
     }
   }
-  chdir(OUT_DIR);
+  if (wake.empty() && sleep.empty()) return;
+
+  // The workers must be done with the channels before they change.
+  if (m_pool) m_pool->drain();
+  for (Channel* chan : wake)
+  {
+    INFO("Activating '%s'", chan->getName().c_str());
+    chan->activate(now);
+    m_activations.add();
+    m_shed.erase(std::remove(m_shed.begin(), m_shed.end(), chan), m_shed.end());
+    m_shed_stat.set(m_shed.size());
+  }
+  for (Channel* chan : sleep)
+  {
+    INFO("'%s' idle for %us, deactivating", chan->getName().c_str(), m_idle_timeout);
+    chan->deactivate();
+    m_deactivations.add();
+  }
+  _update_routes();
+}
+
+bool Segmenter::_watched(size_t slot, const timespec& now) const
+{
+  unsigned window = m_idle_timeout ? m_idle_timeout : CHANNEL_IDLE_TIMEOUT;
+  return m_last_request[slot] && now.tv_sec - m_last_request[slot] < window;
+}
 
-  _write_channel_index();
+bool Segmenter::_shed_step(const timespec& now)
+{
+  if (!m_trimmed)
+  {
+    // The EIT, teletext, data and extra audio go first.
+    INFO("Dropping optional streams from %s", m_source.get_multiplex().c_str());
+    m_trimmed = 1;
+    for (Channel* chan : m_channels)
+    {
+      chan->trim(true);
+    }
+    return true;
+  }
 
-  while (!m_quit)
+  // Then the unwatched channel requested longest ago, the highest
+  // service id if there's a tie.
+  Channel* victim = NULL;
+  time_t oldest = 0;
+  for (size_t slot = 0; slot < m_channels.size(); slot++)
   {
-    Channel::set_curr_time();
-    pkts = m_device.read_card(buf, TS_PACKET_SIZE * num_packets);
-    for (size_t i = 0; i < pkts; i++)
+    Channel* chan = m_channels[slot];
+    if (!chan->streaming() || chan->getName().empty() || _watched(slot, now)) continue;
+    if (!victim || m_last_request[slot] < oldest ||
+        (m_last_request[slot] == oldest && chan->id() > victim->id()))
     {
-      pkt = &buf[i*TS_PACKET_SIZE];
-      pid = GET_PID(pkt);
-      if (pid <= MAX_REQUIRED_PID && required_pids[pid])
+      victim = chan;
+      oldest = m_last_request[slot];
+    }
+  }
+  if (!victim)
+  {
+    if (!m_shed_exhausted)
+    {
+      WARNING("Only watched channels are left on %s, nothing more to shed", m_source.get_multiplex().c_str());
+    }
+    m_shed_exhausted = 1;
+    return false;
+  }
+  INFO("Pausing '%s' to shed load", victim->getName().c_str());
+  if (m_pool) m_pool->drain();
+  victim->deactivate();
+  m_shed.push_back(victim);
+  m_shed_stat.set(m_shed.size());
+  return true;
+}
+
+bool Segmenter::_recover_step(const timespec& now)
+{
+  m_shed_exhausted = 0;
+  if (!m_shed.empty())
+  {
+    Channel* chan = m_shed.back();
+    m_shed.pop_back();
+    m_shed_stat.set(m_shed.size());
+    // On demand channels wait to be asked for again.
+    if (!m_idle_timeout && chan->enabled())
+    {
+      INFO("Resuming '%s'", chan->getName().c_str());
+      // Not while a worker is writing it.
+      if (m_pool) m_pool->drain();
+      chan->activate(now);
+    }
+    return true;
+  }
+  if (m_trimmed)
+  {
+    INFO("Restoring optional streams to %s", m_source.get_multiplex().c_str());
+    m_trimmed = 0;
+    for (Channel* chan : m_channels)
+    {
+      chan->trim(false);
+    }
+    return true;
+  }
+  return false;
+}
+
+void Segmenter::_update_load(const timespec& now)
+{
+  LoadShedder::Action action = m_load->check(now, m_source.overflows(), m_ingest.stalls());
+  if (action == LoadShedder::LOAD_SHED)
+  {
+    WARNING("%s is falling behind, %s", m_source.get_multiplex().c_str(), m_load->reason().c_str());
+    m_load->step(now, _shed_step(now) ? 1 : 0);
+  }
+  else if (action == LoadShedder::LOAD_RECOVER_STEP)
+  {
+    m_load->step(now, _recover_step(now) ? -1 : 0);
+  }
+  else
+  {
+    return;
+  }
+  _update_routes();
+}
+
+void Segmenter::_update_scrambling(const timespec& now)
+{
+  uint64_t elapsed = (now.tv_sec * NS + now.tv_nsec) - (m_scramble_time.tv_sec * NS + m_scramble_time.tv_nsec);
+  if (elapsed < SCRAMBLE_INTERVAL) return;
+  m_scramble_time = now;
+
+  std::vector<Channel*> park, unpark;
+  for (Channel* chan : m_channels)
+  {
+    const std::vector<int>& pids = chan->pids();
+    if (!chan->enabled()) continue;
+    uint64_t scrambled = 0, clear = 0;
+    for (size_t i = 0; i < pids.size(); i++)
+    {
+      // The PCR is usually carried by one of the streams.
+      if (i && pids[i] == pids[0]) continue;
+      scrambled += m_pid_scrambled[pids[i]];
+      clear += m_pid_clear[pids[i]];
+    }
+    // Nothing received, e.g. asleep behind the PID filter.
+    if (!scrambled && !clear) continue;
+    bool is_scrambled = scrambled > clear;
+    unsigned run = chan->scrambling(is_scrambled);
+    if (is_scrambled && !chan->parked() && run >= (chan->ca() ? PARK_AFTER_CA : PARK_AFTER))
+    {
+      park.push_back(chan);
+      m_parked[chan->id()] = (scrambled + clear) * TS_PACKET_SIZE * NS / elapsed;
+    }
+    else if (!is_scrambled && chan->parked() && run >= UNPARK_AFTER)
+    {
+      unpark.push_back(chan);
+      m_parked.erase(chan->id());
+    }
+  }
+  memset(m_pid_scrambled, 0, sizeof(m_pid_scrambled));
+  memset(m_pid_clear, 0, sizeof(m_pid_clear));
+  if (park.empty() && unpark.empty()) return;
+
+  // The workers must be done with the channels before they change.
+  if (m_pool) m_pool->drain();
+  for (Channel* chan : park)
+  {
+    INFO("'%s' is scrambled, parking it", chan->getName().c_str());
+    chan->park();
+  }
+  for (Channel* chan : unpark)
+  {
+    INFO("'%s' is free to air again, unparking it", chan->getName().c_str());
+    chan->unpark(now);
+  }
+  _update_parked();
+  _update_routes();
+  // Parked channels are left out of the index.
+  if (m_on_services) m_on_services();
+}
+
+void Segmenter::_update_parked()
+{
+  uint64_t rate = 0;
+  for (auto& item : m_parked)
+  {
+    rate += item.second;
+  }
+  m_parked_stat.set(m_parked.size());
+  m_parked_rate.set(rate);
+}
+
+void Segmenter::_write_batch(const timespec& now)
+{
+  for (size_t slot = 0; slot < m_channels.size(); slot++)
+  {
+    std::vector<PacketRef>& refs = m_refs[slot];
+    if (refs.empty()) continue;
+    m_channels[slot]->writePackets(refs.data(), refs.size(), now);
+    refs.clear();
+  }
+}
+
+void Segmenter::_dispatch(uint8_t* pkts, size_t count, const PidRoute* routes)
+{
+  unsigned errors = 0, tei = 0, scrambled = 0, cc_errors = 0;
+
+  parse_headers(pkts, count, m_headers);
+  for (size_t i = 0; i < count; i++)
+  {
+    uint16_t flags = m_headers.flags[i];
+    if (flags & (TS_FLAG_ERROR | TS_FLAG_TEI))
+    {
+      // Drop corrupt packets
+      errors += (flags & TS_FLAG_ERROR) != 0;
+      tei += (flags & TS_FLAG_TEI) != 0;
+      continue;
+    }
+    uint16_t pid = m_headers.pid[i];
+    if (pid == SI_PID_SDT || (pid == SI_PID_EIT && !m_trimmed))
+    {
+      // Rewritten for each channel rather than routed.
+      m_si.push(&pkts[i * TS_PACKET_SIZE]);
+      continue;
+    }
+    if (flags & TS_FLAG_PAYLOAD)
+    {
+      // Every stream is counted, so parked channels are still watched.
+      if (flags & TS_FLAG_SCRAMBLED)
       {
-        // Write packet to all channels
-        for (auto& item : m_channel_ids)
-        {
-          item.second->writePacket(pkt, pid);
-        }
+        m_pid_scrambled[pid]++;
       }
       else
       {
-        //uint16_t id = 0;
-        if (pid != 0x1FFF) // Null pid
-        {
-          auto it = m_channel_pids.find(pid);
-          if (it != m_channel_pids.end())
-          {
-            it->second->writePacket(pkt, pid);
-            //id = it->second->id();
-          }
-        }
+        m_pid_clear[pid]++;
       }
     }
+    const PidRoute& route = routes[pid];
+    if (!route.count) continue;
+
+    scrambled += (flags & TS_FLAG_SCRAMBLED) != 0;
+    if (flags & TS_FLAG_PAYLOAD)
+    {
+      // The counter only advances with a payload, and may repeat once.
+      uint8_t cc = m_headers.cc[i];
+      uint8_t last = m_cc[pid];
+      if (last != 0xFF && !(flags & TS_FLAG_DISCONTINUITY) && cc != last && cc != ((last + 1) & 0x0F))
+      {
+        cc_errors++;
+      }
+      m_cc[pid] = cc;
+    }
+
+    uint8_t* pkt = &pkts[i * TS_PACKET_SIZE];
+    uint8_t payload = m_headers.payload[i];
+    _for_each_slot(route, [&](size_t slot) { m_refs[slot].push_back({ pkt, pid, flags, payload }); });
   }
+
+  if (errors) m_errors.add(errors);
+  if (tei) m_tei.add(tei);
+  if (scrambled) m_scrambled.add(scrambled);
+  if (cc_errors) m_cc_errors.add(cc_errors);
 }
 
-Segmenter::~Segmenter()
+void Segmenter::_process_si(uint16_t service, uint16_t pid, const std::vector<uint8_t>& packets)
+{
+  auto found = m_channel_ids.find(service);
+  if (found != m_channel_ids.end()) found->second->set_si(pid, packets);
+}
+
+size_t Segmenter::_count_enabled() const
 {
-  // Remove index file.
-  remove((m_device.get_multiplex() + ".csv").c_str());
+  size_t enabled = 0;
   for (auto& item : m_channel_ids)
   {
-    delete item.second;
+    enabled += item.second->enabled();
+  }
+  return enabled;
+}
+
+void Segmenter::_update_routes()
+{
+  m_enabled_channels = _count_enabled();
+  size_t num_si = sizeof(si_pids) / sizeof(si_pids[0]);
+  m_router.rebuild(m_channels, si_pids, num_si);
+  if (!m_pid_filter) return;
+
+  // SI plus the PMT and elementary streams of the enabled channels. The
+  // EIT is dropped to shed load.
+  std::set<uint16_t> pids(si_pids, si_pids + num_si);
+  pids.insert(SI_PID_SDT);
+  if (!m_trimmed) pids.insert(SI_PID_EIT);
+  // Every PMT until the scan is finished, and then to watch for changes.
+  pids.insert(m_scan_pids.begin(), m_scan_pids.end());
+  for (Channel* chan : m_channels)
+  {
+    if (m_monitor) pids.insert(chan->pmt_pid());
+    if (chan->streaming())
+    {
+      pids.insert(chan->pmt_pid());
+      pids.insert(chan->pids().begin(), chan->pids().end());
+    }
+    else if (chan->enabled() && chan->parked() && chan->pids().size() > 1)
+    {
+      // Its first stream is enough to tell when it is free to air again.
+      pids.insert(chan->pids()[1]);
+    }
   }
-  if (m_dvbpsi_sdt)
+  // Routes are updated on every scan and channel change, so only say so
+  // when the source stops filtering.
+  bool whole_mux = !m_source.set_pid_filter(pids);
+  if (whole_mux && !m_whole_mux)
   {
-    dvbpsi_DetachDemux(m_dvbpsi_sdt);
-    dvbpsi_delete(m_dvbpsi_sdt);
-    m_dvbpsi_sdt = 0;
+    INFO("Receiving the whole multiplex for %s", m_source.get_multiplex().c_str());
   }
-  if (m_dvbpsi_pat)
+  m_whole_mux = whole_mux;
+}
+
+Segmenter::~Segmenter()
+{
+  // The workers must stop before the channels go.
+  delete m_pool;
+  delete m_watcher;
+  delete m_load;
+  delete m_monitor;
+  for (auto& item : m_channel_ids)
   {
-    dvbpsi_pat_detach(m_dvbpsi_pat);
-    dvbpsi_delete(m_dvbpsi_pat);
-    m_dvbpsi_pat = 0;
+    delete item.second;
   }
 }
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <fstream>
+#include <thread>
+#include <exception>
+
+#include "segmenter_group.hpp"
+#include "segmenter.hpp"
+#include "util.hpp"
+#include "log.hpp"
+
+SegmenterGroup::SegmenterGroup() :
+    m_segmenters(),
+    m_index_lock(),
+    m_control(0),
+    m_quit(0)
+{
+}
+
+void SegmenterGroup::use_control_socket()
+{
+  if (m_control) return;
+  m_control = new ControlSocket();
+  m_control->on("watch", [this](const std::string& arg) { return _watch(arg); });
+}
+
+void SegmenterGroup::add(Segmenter* segmenter)
+{
+  // Services are named as the scan goes on.
+  segmenter->on_services_changed([this] { write_index(); });
+  m_segmenters.push_back(segmenter);
+}
+
+template <typename F>
+void SegmenterGroup::_run_each(const char* action, F f)
+{
+  std::vector<std::exception_ptr> errors(m_segmenters.size());
+  if (m_segmenters.size() == 1)
+  {
+    // No need for a thread, and errors reach the caller unchanged.
+    f(m_segmenters[0]);
+    return;
+  }
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < m_segmenters.size(); i++)
+  {
+    threads.push_back(std::thread([this, &errors, &f, action, i]
+    {
+      try
+      {
+        f(m_segmenters[i]);
+      }
+      catch (std::exception& e)
+      {
+        ERROR("Failed to %s %s: %s", action, m_segmenters[i]->multiplex().c_str(), e.what());
+        errors[i] = std::current_exception();
+      }
+    }));
+  }
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  std::exception_ptr first;
+  std::vector<Segmenter*> remaining;
+  for (size_t i = 0; i < m_segmenters.size(); i++)
+  {
+    if (!errors[i])
+    {
+      remaining.push_back(m_segmenters[i]);
+      continue;
+    }
+    if (!first) first = errors[i];
+    delete m_segmenters[i];
+  }
+  std::lock_guard<std::mutex> lock(m_index_lock);
+  m_segmenters = remaining;
+  if (m_segmenters.empty() && first) std::rethrow_exception(first);
+}
+
+void SegmenterGroup::scan()
+{
+  // Cached services carry on from segments in the output directory.
+  enter_output_dir();
+  _run_each("scan", [](Segmenter* segmenter) { segmenter->scan(); });
+}
+
+void SegmenterGroup::run()
+{
+  enter_output_dir();
+  write_index();
+  std::thread control;
+  if (m_control)
+  {
+    m_control->open_socket();
+    control = std::thread(&SegmenterGroup::_serve_control, this);
+  }
+  try
+  {
+    _run_each("run", [](Segmenter* segmenter) { segmenter->run(); });
+  }
+  catch (...)
+  {
+    m_quit = 1;
+    if (control.joinable()) control.join();
+    throw;
+  }
+  m_quit = 1;
+  if (control.joinable()) control.join();
+}
+
+void SegmenterGroup::_serve_control()
+{
+  while (!m_quit)
+  {
+    m_control->serve(1000);
+  }
+}
+
+std::string SegmenterGroup::_watch(const std::string& service)
+{
+  std::lock_guard<std::mutex> lock(m_index_lock);
+  for (Segmenter* segmenter : m_segmenters)
+  {
+    std::string playlist = segmenter->playlist(service);
+    if (playlist.empty()) continue;
+    segmenter->request(service);
+    return "OK " + playlist;
+  }
+  return "ERR unknown service " + service;
+}
+
+void SegmenterGroup::write_index()
+{
+  // Replace the index in one go so the web interface never reads half of it.
+  std::lock_guard<std::mutex> lock(m_index_lock);
+  {
+    std::ofstream index(CHANNEL_INDEX ".tmp");
+    for (Segmenter* segmenter : m_segmenters)
+    {
+      segmenter->write_index(index);
+    }
+  }
+  rename(CHANNEL_INDEX ".tmp", CHANNEL_INDEX);
+}
+
+void SegmenterGroup::exit()
+{
+  m_quit = 1;
+  for (Segmenter* segmenter : m_segmenters)
+  {
+    segmenter->exit();
+  }
+}
+
+SegmenterGroup::~SegmenterGroup()
+{
+  // Remove index file.
+  remove(CHANNEL_INDEX);
+  delete m_control;
+  for (Segmenter* segmenter : m_segmenters)
+  {
+    delete segmenter;
+  }
+}
@@ -0,0 +1,129 @@
+#include <string.h>
+#include <algorithm>
+
+#include "si_processor.hpp"
+#include "dvb_hls.hpp"
+#include "util.hpp"
+#include "psi_generator.hpp"
+
+#define TABLE_SDT_ACTUAL PSI_TABLE_SDT
+#define TABLE_EIT_ACTUAL_PF 0x4E
+#define SDT_HEADER_SIZE 11 // Up to the first service
+#define EIT_SCHEDULE_FLAG 0x02
+
+SiProcessor::SiProcessor(Sink sink, const std::string& multiplex) :
+    m_sink(sink),
+    m_sdt_sections([this](const uint8_t* section, size_t len) { _section(section, len); }),
+    m_eit_sections([this](const uint8_t* section, size_t len) { _section(section, len); }),
+    m_crcs(),
+    m_services(),
+    m_sections("si_sections_total", mux_label(multiplex)),
+    m_crc_errors("si_crc_errors_total", mux_label(multiplex))
+{
+  m_sdt_sections.want(TABLE_SDT_ACTUAL);
+  m_eit_sections.want(TABLE_EIT_ACTUAL_PF);
+}
+
+void SiProcessor::push(const uint8_t* pkt)
+{
+  if (GET_PID(pkt) == SI_PID_SDT)
+  {
+    m_sdt_sections.push(pkt);
+  }
+  else
+  {
+    m_eit_sections.push(pkt);
+  }
+  m_crc_errors.set(m_sdt_sections.crc_errors() + m_eit_sections.crc_errors());
+}
+
+void SiProcessor::_section(const uint8_t* section, size_t len)
+{
+  // Long form sections that are current, with room for the CRC.
+  if (len < SDT_HEADER_SIZE + 4 || !(section[1] & 0x80) || !(section[5] & 0x01)) return;
+
+  // Only sections that have changed are processed.
+  const uint8_t* end = section + len - 4;
+  uint32_t crc = (end[0] << 24) | (end[1] << 16) | (end[2] << 8) | end[3];
+  uint32_t key = (section[0] << 24) | (section[3] << 16) | (section[4] << 8) | section[6];
+  auto known = m_crcs.find(key);
+  if (known != m_crcs.end() && known->second == crc) return;
+  m_crcs[key] = crc;
+  m_sections.add();
+
+  if (section[0] == TABLE_SDT_ACTUAL)
+  {
+    _process_sdt(section, len);
+  }
+  else
+  {
+    _process_eit(section, len);
+  }
+}
+
+void SiProcessor::_process_sdt(const uint8_t* section, size_t len)
+{
+  size_t end = len - 4;
+  size_t offset = SDT_HEADER_SIZE;
+  while (offset + 5 <= end)
+  {
+    uint16_t id = (section[offset] << 8) | section[offset + 1];
+    size_t entry = 5 + (((section[offset + 3] & 0x0F) << 8) | section[offset + 4]);
+    if (offset + entry > end) break;
+
+    // The same header, as the only section, with just this service.
+    std::vector<uint8_t> sdt;
+    sdt.reserve(SDT_HEADER_SIZE + entry + 4);
+    sdt.insert(sdt.end(), section, section + SDT_HEADER_SIZE);
+    sdt.insert(sdt.end(), section + offset, section + offset + entry);
+    sdt[6] = 0;
+    sdt[7] = 0;
+    // Its schedule isn't passed on.
+    sdt[SDT_HEADER_SIZE + 2] &= ~EIT_SCHEDULE_FLAG;
+    psi_finish_section(sdt);
+
+    std::vector<uint8_t> packets;
+    psi_packetize(SI_PID_SDT, sdt, packets);
+    Service& service = m_services[id];
+    if (packets != service.sdt)
+    {
+      service.sdt.swap(packets);
+      m_sink(id, SI_PID_SDT, service.sdt);
+    }
+    offset += entry;
+  }
+}
+
+void SiProcessor::_process_eit(const uint8_t* section, size_t len)
+{
+  // Present/following sections are already per service.
+  uint16_t id = (section[3] << 8) | section[4];
+  m_services[id].eit[section[6]].assign(section, section + len);
+  _send_eit(id);
+}
+
+void SiProcessor::_send_eit(uint16_t id)
+{
+  std::vector<uint8_t> packets;
+  for (auto& item : m_services[id].eit)
+  {
+    psi_packetize(SI_PID_EIT, item.second, packets);
+  }
+  m_sink(id, SI_PID_EIT, packets);
+}
+
+void SiProcessor::resend(uint16_t id)
+{
+  auto found = m_services.find(id);
+  if (found == m_services.end()) return;
+  if (!found->second.sdt.empty()) m_sink(id, SI_PID_SDT, found->second.sdt);
+  if (!found->second.eit.empty()) _send_eit(id);
+}
+
+void SiProcessor::clear()
+{
+  m_sdt_sections.reset();
+  m_eit_sections.reset();
+  m_crcs.clear();
+  m_services.clear();
+}
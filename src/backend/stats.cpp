@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <time.h>
+#include <mutex>
+#include <set>
+#include <vector>
+#include <algorithm>
+
+#include "stats.hpp"
+#include "log.hpp"
+
+static std::mutex stats_lock;
+static std::set<Stat*>* registered = 0;
+static time_t last_write = 0;
+
+Stat::Stat(const std::string& name, const std::string& labels) :
+    m_name(labels.empty() ? name : name + '{' + labels + '}'),
+    m_value(0)
+{
+  std::lock_guard<std::mutex> lock(stats_lock);
+  if (!registered) registered = new std::set<Stat*>();
+  registered->insert(this);
+}
+
+Stat::~Stat()
+{
+  std::lock_guard<std::mutex> lock(stats_lock);
+  registered->erase(this);
+}
+
+void Stats::write_if_due()
+{
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  {
+    std::lock_guard<std::mutex> lock(stats_lock);
+    if (now.tv_sec - last_write < STATS_INTERVAL) return;
+    last_write = now.tv_sec;
+  }
+  write();
+}
+
+void Stats::write()
+{
+  // Write to a temporary file so readers never see a partial file.
+  std::lock_guard<std::mutex> lock(stats_lock);
+  FILE* stats_fd = fopen(STATS_FILE ".tmp", "w");
+  if (stats_fd == NULL)
+  {
+    WARNING("Failed to write " STATS_FILE);
+    return;
+  }
+  if (registered)
+  {
+    std::vector<Stat*> stats(registered->begin(), registered->end());
+    std::sort(stats.begin(), stats.end(), [](Stat* a, Stat* b) { return a->name() < b->name(); });
+    for (Stat* stat : stats)
+    {
+      fprintf(stats_fd, "%s %llu\n", stat->name().c_str(), (unsigned long long)stat->get());
+    }
+  }
+  fclose(stats_fd);
+  rename(STATS_FILE ".tmp", STATS_FILE);
+}
+
+std::string mux_label(const std::string& multiplex)
+{
+  return "mux=\"" + multiplex + '"';
+}
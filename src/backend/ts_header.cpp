@@ -0,0 +1,163 @@
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "ts_header.hpp"
+
+/*
+ * The 4 byte header is loaded as a little endian word:
+ *   bits 0-7 sync, 8-12 PID high, 13 priority, 14 PUSI, 15 TEI,
+ *   16-23 PID low, 24-27 CC, 28-29 adaptation field control,
+ *   30-31 scrambling control.
+ */
+static inline uint32_t load_header(const uint8_t* pkt)
+{
+  uint32_t header;
+  memcpy(&header, pkt, sizeof(header));
+  return header;
+}
+
+static inline void parse_header(uint32_t h, TsHeaders& hdrs, size_t i)
+{
+  hdrs.pid[i] = (h & 0x1F00) | ((h >> 16) & 0xFF);
+  hdrs.flags[i] = ((h >> 15) & TS_FLAG_TEI) | ((h >> 13) & TS_FLAG_PUSI) |
+    ((h >> 26) & (TS_FLAG_PAYLOAD | TS_FLAG_ADAPTATION)) | ((h >> 22) & TS_FLAG_SCRAMBLED) |
+    ((h & 0xFF) != TS_SYNC_BYTE ? TS_FLAG_ERROR : 0);
+  hdrs.cc[i] = (h >> 24) & 0x0F;
+}
+
+/**
+ * The adaptation field flags and payload offsets, which need the bytes
+ * after the header.
+ */
+static void parse_adaptation(const uint8_t* pkts, size_t count, TsHeaders& hdrs)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    uint16_t& flags = hdrs.flags[i];
+    hdrs.payload[i] = TS_HEADER_SIZE;
+    if (!(flags & TS_FLAG_ADAPTATION)) continue;
+
+    const uint8_t* pkt = pkts + i * TS_PACKET_SIZE;
+    uint8_t af_len = pkt[4];
+    if (af_len > TS_PACKET_SIZE - TS_HEADER_SIZE - 1)
+    {
+      flags |= TS_FLAG_ERROR;
+      continue;
+    }
+    hdrs.payload[i] = TS_HEADER_SIZE + 1 + af_len;
+    if (af_len)
+    {
+      flags |= ((pkt[5] & 0x80) ? TS_FLAG_DISCONTINUITY : 0) |
+        ((pkt[5] & 0x40) ? TS_FLAG_RAI : 0) |
+        ((pkt[5] & 0x10) && af_len >= 7 ? TS_FLAG_PCR : 0);
+    }
+  }
+}
+
+#if defined(__SSE2__)
+static inline void parse_headers_x4(const uint8_t* pkts, __m128i& pid, __m128i& flags, __m128i& cc)
+{
+  __m128i h = _mm_set_epi32
+  (
+    load_header(pkts + 3 * TS_PACKET_SIZE), load_header(pkts + 2 * TS_PACKET_SIZE),
+    load_header(pkts + TS_PACKET_SIZE), load_header(pkts)
+  );
+  pid = _mm_or_si128
+  (
+    _mm_and_si128(h, _mm_set1_epi32(0x1F00)),
+    _mm_and_si128(_mm_srli_epi32(h, 16), _mm_set1_epi32(0xFF))
+  );
+  __m128i sync_ok = _mm_cmpeq_epi32(_mm_and_si128(h, _mm_set1_epi32(0xFF)), _mm_set1_epi32(TS_SYNC_BYTE));
+  flags = _mm_or_si128
+  (
+    _mm_or_si128
+    (
+      _mm_and_si128(_mm_srli_epi32(h, 15), _mm_set1_epi32(TS_FLAG_TEI)),
+      _mm_and_si128(_mm_srli_epi32(h, 13), _mm_set1_epi32(TS_FLAG_PUSI))
+    ),
+    _mm_or_si128
+    (
+      _mm_and_si128(_mm_srli_epi32(h, 26), _mm_set1_epi32(TS_FLAG_PAYLOAD | TS_FLAG_ADAPTATION)),
+      _mm_and_si128(_mm_srli_epi32(h, 22), _mm_set1_epi32(TS_FLAG_SCRAMBLED))
+    )
+  );
+  flags = _mm_or_si128(flags, _mm_andnot_si128(sync_ok, _mm_set1_epi32(TS_FLAG_ERROR)));
+  cc = _mm_and_si128(_mm_srli_epi32(h, 24), _mm_set1_epi32(0x0F));
+}
+#elif defined(__ARM_NEON)
+static inline void parse_headers_x4(const uint8_t* pkts, uint16x4_t& pid, uint16x4_t& flags, uint16x4_t& cc)
+{
+  uint32x4_t h = vdupq_n_u32(0);
+  h = vsetq_lane_u32(load_header(pkts), h, 0);
+  h = vsetq_lane_u32(load_header(pkts + TS_PACKET_SIZE), h, 1);
+  h = vsetq_lane_u32(load_header(pkts + 2 * TS_PACKET_SIZE), h, 2);
+  h = vsetq_lane_u32(load_header(pkts + 3 * TS_PACKET_SIZE), h, 3);
+  pid = vmovn_u32
+  (
+    vorrq_u32(vandq_u32(h, vdupq_n_u32(0x1F00)), vandq_u32(vshrq_n_u32(h, 16), vdupq_n_u32(0xFF)))
+  );
+  uint32x4_t sync_ok = vceqq_u32(vandq_u32(h, vdupq_n_u32(0xFF)), vdupq_n_u32(TS_SYNC_BYTE));
+  uint32x4_t f = vorrq_u32
+  (
+    vorrq_u32
+    (
+      vandq_u32(vshrq_n_u32(h, 15), vdupq_n_u32(TS_FLAG_TEI)),
+      vandq_u32(vshrq_n_u32(h, 13), vdupq_n_u32(TS_FLAG_PUSI))
+    ),
+    vorrq_u32
+    (
+      vandq_u32(vshrq_n_u32(h, 26), vdupq_n_u32(TS_FLAG_PAYLOAD | TS_FLAG_ADAPTATION)),
+      vandq_u32(vshrq_n_u32(h, 22), vdupq_n_u32(TS_FLAG_SCRAMBLED))
+    )
+  );
+  f = vorrq_u32(f, vbicq_u32(vdupq_n_u32(TS_FLAG_ERROR), sync_ok));
+  flags = vmovn_u32(f);
+  cc = vmovn_u32(vandq_u32(vshrq_n_u32(h, 24), vdupq_n_u32(0x0F)));
+}
+#endif
+
+void parse_headers(const uint8_t* pkts, size_t count, TsHeaders& hdrs)
+{
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i pid[2], flags[2], cc[2];
+    parse_headers_x4(pkts + i * TS_PACKET_SIZE, pid[0], flags[0], cc[0]);
+    parse_headers_x4(pkts + (i + 4) * TS_PACKET_SIZE, pid[1], flags[1], cc[1]);
+    // All values fit in 15 bits, so signed saturation is harmless.
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&hdrs.pid[i]), _mm_packs_epi32(pid[0], pid[1]));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&hdrs.flags[i]), _mm_packs_epi32(flags[0], flags[1]));
+    __m128i cc16 = _mm_packs_epi32(cc[0], cc[1]);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(&hdrs.cc[i]), _mm_packus_epi16(cc16, cc16));
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 8 <= count; i += 8)
+  {
+    uint16x4_t pid[2], flags[2], cc[2];
+    parse_headers_x4(pkts + i * TS_PACKET_SIZE, pid[0], flags[0], cc[0]);
+    parse_headers_x4(pkts + (i + 4) * TS_PACKET_SIZE, pid[1], flags[1], cc[1]);
+    vst1q_u16(&hdrs.pid[i], vcombine_u16(pid[0], pid[1]));
+    vst1q_u16(&hdrs.flags[i], vcombine_u16(flags[0], flags[1]));
+    vst1_u8(&hdrs.cc[i], vmovn_u16(vcombine_u16(cc[0], cc[1])));
+  }
+#endif
+  for (; i < count; i++)
+  {
+    parse_header(load_header(pkts + i * TS_PACKET_SIZE), hdrs, i);
+  }
+  parse_adaptation(pkts, count, hdrs);
+}
+
+void parse_headers_scalar(const uint8_t* pkts, size_t count, TsHeaders& hdrs)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    parse_header(load_header(pkts + i * TS_PACKET_SIZE), hdrs, i);
+  }
+  parse_adaptation(pkts, count, hdrs);
+}
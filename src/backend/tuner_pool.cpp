@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <fstream>
+#include <memory>
+
+#include "tuner_pool.hpp"
+#include "ts_source.hpp"
+#include "segmenter.hpp"
+#include "channel.hpp"
+#include "util.hpp"
+#include "log.hpp"
+
+static time_t monotonic_seconds()
+{
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+TunerPool::TunerPool(const std::vector<uint16_t>& adapters, const std::vector<std::string>& multiplexes,
+    SourceFactory open_source, SegmenterSetup setup) :
+    m_tuners(),
+    m_multiplexes(multiplexes),
+    m_services(),
+    m_open_source(open_source),
+    m_setup(setup),
+    m_idle_timeout(TUNER_IDLE_TIMEOUT),
+    m_quit(0),
+    m_control(),
+    m_requests("tuner_requests_total"),
+    m_tunes("tuner_tunes_total"),
+    m_evictions("tuner_evictions_total"),
+    m_refused("tuner_refused_total"),
+    m_in_use("tuners_in_use")
+{
+  for (uint16_t adapter : adapters)
+  {
+    Tuner* tuner = new Tuner();
+    tuner->adapter = adapter;
+    tuner->last_used = 0;
+    tuner->finished = 0;
+    tuner->source = NULL;
+    tuner->segmenter = NULL;
+    tuner->stopping = 0;
+    tuner->retuning = 0;
+    m_tuners.push_back(tuner);
+  }
+  m_control.on("watch", [this](const std::string& arg) { return _watch(arg); });
+  m_control.on("status", [this](const std::string& arg) { return _status(arg); });
+}
+
+void TunerPool::survey()
+{
+  // Channels clean up their output relative to the working directory.
+  enter_output_dir();
+
+  std::mutex lock;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < m_tuners.size(); t++)
+  {
+    threads.push_back(std::thread([this, &lock, t]
+    {
+      for (size_t i = t; i < m_multiplexes.size(); i += m_tuners.size())
+      {
+        const std::string& multiplex = m_multiplexes[i];
+        try
+        {
+          std::unique_ptr<TsSource> source(m_open_source(multiplex, m_tuners[t]->adapter));
+          if (!source)
+          {
+            WARNING("Failed to tune adapter %u to %s", m_tuners[t]->adapter, multiplex.c_str());
+            continue;
+          }
+          Segmenter segmenter(*source);
+          segmenter.scan();
+
+          std::lock_guard<std::mutex> guard(lock);
+          for (auto& item : segmenter.channels())
+          {
+            Channel* chan = item.second;
+            if (chan->getName().empty()) continue;
+            m_services[chan->getName()] = { multiplex, chan->index_file() };
+          }
+        }
+        catch (std::exception& e)
+        {
+          ERROR("Failed to scan %s: %s", multiplex.c_str(), e.what());
+        }
+      }
+    }));
+  }
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+  if (m_services.empty())
+  {
+    throw DvbException("No services found on any multiplex");
+  }
+  INFO("Found %u services on %u multiplexes for %u tuners",
+      (unsigned)m_services.size(), (unsigned)m_multiplexes.size(), (unsigned)m_tuners.size());
+}
+
+void TunerPool::_write_index()
+{
+  {
+    std::ofstream index(CHANNEL_INDEX ".tmp");
+    for (auto& item : m_services)
+    {
+      index << item.first << ',' << item.second.index_file << std::endl;
+    }
+  }
+  rename(CHANNEL_INDEX ".tmp", CHANNEL_INDEX);
+}
+
+TunerPool::Tuner* TunerPool::_find(const std::string& multiplex)
+{
+  for (Tuner* tuner : m_tuners)
+  {
+    if (tuner->multiplex == multiplex) return tuner;
+  }
+  return NULL;
+}
+
+TunerPool::Tuner* TunerPool::_acquire(time_t now)
+{
+  // A free tuner, or else the least recently used idle one.
+  Tuner* lru = NULL;
+  for (Tuner* tuner : m_tuners)
+  {
+    if (tuner->multiplex.empty()) return tuner;
+    if (now - tuner->last_used < m_idle_timeout) continue;
+    if (!lru || tuner->last_used < lru->last_used) lru = tuner;
+  }
+  return lru;
+}
+
+void TunerPool::_stream(Tuner& tuner, std::string multiplex)
+{
+  try
+  {
+    TsSource* source = m_open_source(multiplex, tuner.adapter);
+    if (!source)
+    {
+      WARNING("Failed to tune adapter %u to %s", tuner.adapter, multiplex.c_str());
+    }
+    else
+    {
+      Segmenter* segmenter = NULL;
+      {
+        std::lock_guard<std::mutex> lock(tuner.lock);
+        tuner.source = source;
+        if (!tuner.stopping)
+        {
+          tuner.segmenter = segmenter = new Segmenter(*source);
+          m_setup(*segmenter);
+          // Services asked for while tuning.
+          for (auto& service : tuner.requested)
+          {
+            segmenter->request(service);
+          }
+          tuner.requested.clear();
+        }
+      }
+      if (segmenter)
+      {
+        segmenter->scan();
+        segmenter->run();
+      }
+    }
+  }
+  catch (std::exception& e)
+  {
+    ERROR("Failed streaming %s on adapter %u: %s", multiplex.c_str(), tuner.adapter, e.what());
+  }
+  tuner.finished = 1;
+}
+
+void TunerPool::_start(Tuner& tuner, const std::string& multiplex)
+{
+  INFO("Tuning adapter %u to %s", tuner.adapter, multiplex.c_str());
+  tuner.multiplex = multiplex;
+  tuner.finished = 0;
+  tuner.stopping = 0;
+  tuner.retuning = 0;
+  // The stream thread is given its own copy, as a retune changes the tuner's.
+  tuner.thread = std::thread(&TunerPool::_stream, this, std::ref(tuner), multiplex);
+  m_tunes.add();
+  _update_in_use();
+}
+
+void TunerPool::_stop(Tuner& tuner)
+{
+  INFO("Releasing adapter %u from %s", tuner.adapter, tuner.multiplex.c_str());
+  std::lock_guard<std::mutex> lock(tuner.lock);
+  tuner.stopping = 1;
+  if (tuner.segmenter) tuner.segmenter->exit();
+  tuner.requested.clear();
+}
+
+void TunerPool::_join(Tuner& tuner)
+{
+  tuner.thread.join();
+  // The segmenter removes its channels' output.
+  delete tuner.segmenter;
+  delete tuner.source;
+  tuner.segmenter = NULL;
+  tuner.source = NULL;
+}
+
+void TunerPool::_update_in_use()
+{
+  unsigned in_use = 0;
+  for (Tuner* tuner : m_tuners)
+  {
+    in_use += !tuner->multiplex.empty();
+  }
+  m_in_use.set(in_use);
+}
+
+void TunerPool::_reap()
+{
+  // Stream threads are only ever joined here, once they have finished,
+  // so a request never waits for a segmenter to wind down.
+  for (Tuner* tuner : m_tuners)
+  {
+    if (!tuner->thread.joinable() || !tuner->finished) continue;
+    _join(*tuner);
+    if (tuner->retuning)
+    {
+      _start(*tuner, tuner->multiplex);
+    }
+    else
+    {
+      tuner->multiplex.clear();
+      _update_in_use();
+    }
+  }
+}
+
+void TunerPool::_release_all()
+{
+  for (Tuner* tuner : m_tuners)
+  {
+    if (tuner->thread.joinable())
+    {
+      _stop(*tuner);
+      _join(*tuner);
+    }
+    tuner->multiplex.clear();
+    tuner->retuning = 0;
+  }
+  _update_in_use();
+}
+
+std::string TunerPool::_watch(const std::string& service)
+{
+  m_requests.add();
+  // Free up tuners whose stream has ended before looking for one.
+  _reap();
+  auto found = m_services.find(service);
+  if (found == m_services.end())
+  {
+    return "ERR unknown service " + service;
+  }
+
+  time_t now = monotonic_seconds();
+  const std::string& multiplex = found->second.multiplex;
+  Tuner* tuner = _find(multiplex);
+  if (!tuner)
+  {
+    if (!(tuner = _acquire(now)))
+    {
+      m_refused.add();
+      return "ERR no free tuner for " + multiplex;
+    }
+    if (tuner->multiplex.empty())
+    {
+      _start(*tuner, multiplex);
+    }
+    else
+    {
+      // Tuned to the new multiplex by _reap() once the old stream stops.
+      m_evictions.add();
+      _stop(*tuner);
+      tuner->multiplex = multiplex;
+      tuner->retuning = 1;
+    }
+  }
+  tuner->last_used = now;
+  {
+    // Wake the service's channel if it is dormant.
+    std::lock_guard<std::mutex> lock(tuner->lock);
+    if (tuner->segmenter && !tuner->stopping)
+    {
+      tuner->segmenter->request(service);
+    }
+    else
+    {
+      tuner->requested.push_back(service);
+    }
+  }
+  return "OK " + found->second.index_file;
+}
+
+std::string TunerPool::_status(const std::string&)
+{
+  time_t now = monotonic_seconds();
+  std::string status = "OK";
+  for (Tuner* tuner : m_tuners)
+  {
+    status += (fmt(" adapter%u=") % tuner->adapter).str();
+    if (tuner->multiplex.empty())
+    {
+      status += "free";
+    }
+    else
+    {
+      status += (fmt("\"%s\",idle:%us") % tuner->multiplex % (unsigned)(now - tuner->last_used)).str();
+    }
+  }
+  return status;
+}
+
+void TunerPool::run()
+{
+  enter_output_dir();
+  _write_index();
+  m_control.open_socket();
+
+  while (!m_quit)
+  {
+    m_control.serve(1000);
+    _reap();
+    Stats::write_if_due();
+  }
+  _release_all();
+}
+
+TunerPool::~TunerPool()
+{
+  _release_all();
+  for (Tuner* tuner : m_tuners)
+  {
+    delete tuner;
+  }
+  remove(CHANNEL_INDEX);
+}
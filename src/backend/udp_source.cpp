@@ -0,0 +1,321 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/unistd.h>
+#include <sys/poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+
+#include "udp_source.hpp"
+#include "log.hpp"
+#include "util.hpp"
+#include "dvb_hls.hpp"
+
+#define READ_TIMEOUT_MSECS 5000
+#define RTP_HEADER_SIZE 12
+#define RECV_BUFFER_SIZE (8 << 20)
+
+UdpSource::UdpSource(const std::string& multiplex, const std::string& address, unsigned depth) :
+    m_multiplex(multiplex),
+    m_address(address),
+    m_socket(-1),
+    m_depth(std::min(depth, (unsigned)JITTER_SLOTS - UDP_BATCH)),
+    m_pool(0),
+    m_free(),
+    m_buffered(0),
+    m_next_seq(0),
+    m_raw_seq(0),
+    m_have_seq(0),
+    m_datagrams(0),
+    m_lost(0),
+    m_late(0),
+    m_reordered(0)
+{
+  const unsigned buffers = JITTER_SLOTS + UDP_BATCH;
+  m_pool = new uint8_t[buffers * UDP_MAX_DATAGRAM];
+  for (unsigned i = 0; i < buffers; i++)
+  {
+    m_free.push_back(i);
+  }
+  for (auto& slot : m_slots)
+  {
+    slot.buffer = -1;
+  }
+  memset(m_msgs, 0, sizeof(m_msgs));
+  for (int i = 0; i < UDP_BATCH; i++)
+  {
+    m_msgs[i].msg_hdr.msg_iov = &m_iovs[i];
+    m_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+void UdpSource::open_source()
+{
+  // Accept udp://@group:port, rtp://@group:port or just group:port.
+  std::string addr = m_address;
+  size_t scheme = addr.find("://");
+  if (scheme != std::string::npos) addr = addr.substr(scheme + 3);
+  if (!addr.empty() && addr[0] == '@') addr = addr.substr(1);
+  size_t colon = addr.rfind(':');
+  if (colon == std::string::npos)
+  {
+    throw DvbException(fmt("No port given in address '%s'") % m_address);
+  }
+  std::string host = addr.substr(0, colon);
+  int port = atoi(addr.substr(colon + 1).c_str());
+
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_port = htons(port);
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (!host.empty() && inet_aton(host.c_str(), &local.sin_addr) == 0)
+  {
+    throw DvbException(fmt("Invalid address '%s'") % m_address);
+  }
+  bool multicast = IN_MULTICAST(ntohl(local.sin_addr.s_addr));
+  struct in_addr group = local.sin_addr;
+  if (!multicast) local.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if ((m_socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0)
+  {
+    throw DvbException(fmt("Failed to create socket: %s") % strerror(errno));
+  }
+  int one = 1;
+  setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  // A deep socket buffer absorbs bursts while the segmenter is busy.
+  int rcvbuf = RECV_BUFFER_SIZE;
+  if (setsockopt(m_socket, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+  {
+    setsockopt(m_socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  }
+  if (bind(m_socket, (struct sockaddr*)&local, sizeof(local)) < 0)
+  {
+    throw DvbException(fmt("Failed to bind to %s: %s") % m_address % strerror(errno));
+  }
+  if (multicast)
+  {
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr = group;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(m_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+    {
+      throw DvbException(fmt("Failed to join multicast group %s: %s") % host % strerror(errno));
+    }
+  }
+  INFO("Receiving %s on %s", m_multiplex.c_str(), m_address.c_str());
+}
+
+void UdpSource::_insert(uint16_t buffer, size_t len)
+{
+  uint8_t* data = &m_pool[buffer * UDP_MAX_DATAGRAM];
+  size_t offset = 0;
+  uint16_t seq;
+
+  if (len >= TS_PACKET_SIZE && data[0] == 0x47)
+  {
+    // Plain UDP, there is no sequence number so take it in arrival order.
+    seq = m_raw_seq++;
+  }
+  else if (len > RTP_HEADER_SIZE && (data[0] & 0xC0) == 0x80)
+  {
+    offset = RTP_HEADER_SIZE + 4 * (data[0] & 0x0F);
+    if ((data[0] & 0x10) && offset + 4 <= len)
+    {
+      offset += 4 + 4 * ((data[offset + 2] << 8) | data[offset + 3]);
+    }
+    if ((data[0] & 0x20) && data[len - 1] < len)
+    {
+      len -= data[len - 1];
+    }
+    seq = (data[2] << 8) | data[3];
+  }
+  else
+  {
+    m_free.push_back(buffer);
+    return;
+  }
+  // Only whole TS packets are passed on.
+  if (offset >= len)
+  {
+    m_free.push_back(buffer);
+    return;
+  }
+  len = offset + ((len - offset) / TS_PACKET_SIZE) * TS_PACKET_SIZE;
+
+  if (!m_have_seq)
+  {
+    m_next_seq = seq;
+    m_have_seq = 1;
+  }
+  int16_t delta = seq - m_next_seq;
+  if (delta < 0)
+  {
+    // Arrived after we gave up waiting for it.
+    m_late++;
+    m_free.push_back(buffer);
+    return;
+  }
+  if (delta >= JITTER_SLOTS)
+  {
+    // Sender restart or a long outage, start again from this packet.
+    WARNING("RTP sequence jumped from %u to %u on %s", m_next_seq, seq, m_address.c_str());
+    for (auto& slot : m_slots)
+    {
+      if (slot.buffer >= 0)
+      {
+        m_free.push_back(slot.buffer);
+        slot.buffer = -1;
+      }
+    }
+    m_buffered = 0;
+    m_next_seq = seq;
+  }
+
+  Slot& slot = m_slots[seq % JITTER_SLOTS];
+  if (slot.buffer >= 0)
+  {
+    // Duplicate
+    m_late++;
+    m_free.push_back(buffer);
+    return;
+  }
+  if (m_buffered && m_slots[(seq + 1) % JITTER_SLOTS].buffer >= 0)
+  {
+    m_reordered++;
+  }
+  slot.buffer = buffer;
+  slot.offset = offset;
+  slot.length = len;
+  m_buffered++;
+}
+
+void UdpSource::_skip_gap()
+{
+  unsigned lost = 0;
+  while (m_buffered && m_slots[m_next_seq % JITTER_SLOTS].buffer < 0)
+  {
+    m_next_seq++;
+    lost++;
+  }
+  if (lost)
+  {
+    m_lost += lost;
+    WARNING("Lost %u packets on %s", lost, m_address.c_str());
+  }
+}
+
+size_t UdpSource::_drain(uint8_t *buf, size_t size)
+{
+  size_t total = 0;
+  while (m_buffered && total < size)
+  {
+    Slot& slot = m_slots[m_next_seq % JITTER_SLOTS];
+    if (slot.buffer < 0)
+    {
+      // Wait for the missing packet until the jitter buffer fills up.
+      if (m_buffered <= m_depth) break;
+      _skip_gap();
+      continue;
+    }
+    size_t len = std::min<size_t>(slot.length - slot.offset, size - total);
+    len -= len % TS_PACKET_SIZE;
+    if (len == 0) break;
+    memcpy(buf + total, &m_pool[slot.buffer * UDP_MAX_DATAGRAM + slot.offset], len);
+    total += len;
+    slot.offset += len;
+    if (slot.offset == slot.length)
+    {
+      m_free.push_back(slot.buffer);
+      slot.buffer = -1;
+      m_buffered--;
+      m_next_seq++;
+    }
+  }
+  return total;
+}
+
+int UdpSource::_receive()
+{
+  unsigned vlen = std::min<size_t>(UDP_BATCH, m_free.size());
+  for (unsigned i = 0; i < vlen; i++)
+  {
+    m_msg_buffers[i] = m_free.back();
+    m_free.pop_back();
+    m_iovs[i].iov_base = &m_pool[m_msg_buffers[i] * UDP_MAX_DATAGRAM];
+    m_iovs[i].iov_len = UDP_MAX_DATAGRAM;
+    m_msgs[i].msg_hdr.msg_flags = 0;
+  }
+  int count = recvmmsg(m_socket, m_msgs, vlen, MSG_DONTWAIT, NULL);
+  int received = std::max(count, 0);
+  for (int i = 0; i < received; i++)
+  {
+    if (m_msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+    {
+      m_free.push_back(m_msg_buffers[i]);
+      continue;
+    }
+    _insert(m_msg_buffers[i], m_msgs[i].msg_len);
+  }
+  for (unsigned i = received; i < vlen; i++)
+  {
+    m_free.push_back(m_msg_buffers[i]);
+  }
+  if (count < 0 && errno != EAGAIN && errno != EINTR)
+  {
+    throw DvbException(fmt("Failed to receive from %s: %s") % m_address % strerror(errno));
+  }
+  m_datagrams += received;
+  return received;
+}
+
+ssize_t UdpSource::read_bytes(uint8_t *buf, size_t size)
+{
+  struct pollfd pfd[1] =
+  {
+    { /* .fd = */ m_socket, /* .events = */ POLLIN }
+  };
+  size_t total = _drain(buf, size);
+
+  while (total == 0)
+  {
+    int p = poll(pfd, 1, READ_TIMEOUT_MSECS);
+    if (p > 0)
+    {
+      _receive();
+    }
+    else if (p < 0)
+    {
+      if (errno == EINTR) return 0;
+      throw DvbException(fmt("Failed to read from %s: %s") % m_address % strerror(errno));
+    }
+    else if (m_buffered)
+    {
+      // Nothing more is coming, stop waiting for missing packets.
+      _skip_gap();
+    }
+    else
+    {
+      WARNING("No data received on %s", m_address.c_str());
+      return 0;
+    }
+    total = _drain(buf, size);
+  }
+  return total;
+}
+
+UdpSource::~UdpSource()
+{
+  if (m_socket != -1)
+  {
+    INFO
+    (
+      "Received %llu datagrams on %s: %llu lost, %llu late, %llu reordered",
+      (unsigned long long)m_datagrams, m_address.c_str(), (unsigned long long)m_lost,
+      (unsigned long long)m_late, (unsigned long long)m_reordered
+    );
+    close(m_socket);
+  }
+  delete[] m_pool;
+}
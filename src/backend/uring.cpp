@@ -0,0 +1,477 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/unistd.h>
+
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+
+#include "uring.hpp"
+#include "util.hpp"
+#include "log.hpp"
+
+// What each completion is for, in the top half of its user data.
+#define URING_WRITE (1ull << 32) // Buffer in the low byte, file slot in the next
+#define URING_CLOSE (2ull << 32) // The file descriptor
+#define URING_UNLINK (3ull << 32) // The key of the path
+
+#ifdef HAVE_IO_URING
+
+Uring::Uring(unsigned entries) :
+    m_fd(-1),
+    m_sq_ring(MAP_FAILED),
+    m_sq_ring_size(0),
+    m_cq_ring(MAP_FAILED),
+    m_cq_ring_size(0),
+    m_sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+    m_sqes_size(0),
+    m_queued(0)
+{
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  m_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (m_fd < 0)
+  {
+    throw DvbException(fmt("io_uring is not available: %s") % strerror(errno));
+  }
+  m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+  }
+  m_sq_ring = mmap(NULL, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    m_cq_ring = m_sq_ring;
+  }
+  else if (m_sq_ring != MAP_FAILED)
+  {
+    m_cq_ring = mmap(NULL, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+  }
+  m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  if (m_cq_ring != MAP_FAILED)
+  {
+    m_sqes = static_cast<io_uring_sqe*>(mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+  }
+  if (m_sqes == MAP_FAILED)
+  {
+    int error = errno;
+    _unmap();
+    close(m_fd);
+    throw DvbException(fmt("Failed to map the io_uring: %s") % strerror(error));
+  }
+
+  uint8_t* sq = static_cast<uint8_t*>(m_sq_ring);
+  m_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  m_sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  m_sq_entries = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_entries);
+  m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  uint8_t* cq = static_cast<uint8_t*>(m_cq_ring);
+  m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  m_cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+void Uring::_unmap()
+{
+  if (m_sqes != MAP_FAILED) munmap(m_sqes, m_sqes_size);
+  if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring) munmap(m_cq_ring, m_cq_ring_size);
+  if (m_sq_ring != MAP_FAILED) munmap(m_sq_ring, m_sq_ring_size);
+}
+
+Uring::~Uring()
+{
+  _unmap();
+  close(m_fd);
+}
+
+io_uring_sqe* Uring::get_sqe()
+{
+  unsigned tail = *m_sq_tail;
+  if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= *m_sq_entries) return NULL;
+  unsigned index = tail & *m_sq_mask;
+  io_uring_sqe* sqe = &m_sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  m_sq_array[index] = index;
+  // The kernel only sees it once the tail passes it.
+  __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+  m_queued++;
+  return sqe;
+}
+
+int Uring::submit(unsigned wait)
+{
+  if (!m_queued && !wait) return 0;
+  while (syscall(__NR_io_uring_enter, m_fd, m_queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0)
+  {
+    if (errno != EINTR) return -errno;
+  }
+  m_queued = 0;
+  return 1;
+}
+
+bool Uring::peek(uint64_t& user_data, int32_t& res)
+{
+  unsigned head = *m_cq_head;
+  if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) return false;
+  const io_uring_cqe& cqe = m_cqes[head & *m_cq_mask];
+  user_data = cqe.user_data;
+  res = cqe.res;
+  __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+int Uring::register_buffers(const iovec* buffers, unsigned count)
+{
+  if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, buffers, count) < 0) return -errno;
+  return 0;
+}
+
+int Uring::register_files(unsigned count)
+{
+  std::vector<int> fds(count, -1);
+  if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_FILES, fds.data(), count) < 0) return -errno;
+  return 0;
+}
+
+int Uring::set_file(unsigned slot, int fd)
+{
+  io_uring_files_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = slot;
+  update.fds = reinterpret_cast<uintptr_t>(&fd);
+  if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 0) return -errno;
+  return 0;
+}
+
+bool Uring::supports(uint8_t opcode)
+{
+  std::vector<uint8_t> buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+  io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buf.data());
+  if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+  return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+}
+
+UringWriter::UringWriter(const std::string& labels) :
+    m_ring(URING_ENTRIES),
+    m_buffers(NULL),
+    m_busy(),
+    m_lengths(),
+    m_next(0),
+    m_fds(),
+    m_writing(),
+    m_slot(0),
+    m_offset(0),
+    m_last_write(NULL),
+    m_closing(0),
+    m_unlinks(),
+    m_unlink_id(0),
+    m_error(),
+    m_syscalls(0),
+    m_waits("segment_write_waits_total", labels)
+{
+  // Closing needs Linux 5.6 and unlinking 5.11.
+  const uint8_t opcodes[] = { IORING_OP_WRITE_FIXED, IORING_OP_CLOSE, IORING_OP_UNLINKAT };
+  const char* names[] = { "write", "close", "unlink" };
+  for (unsigned i = 0; i < sizeof(opcodes); i++)
+  {
+    if (!m_ring.supports(opcodes[i]))
+    {
+      throw DvbException(fmt("io_uring can't %s files on this kernel") % names[i]);
+    }
+  }
+  void* buffers;
+  if (posix_memalign(&buffers, sysconf(_SC_PAGESIZE), URING_BUFFERS * URING_BUFFER_SIZE))
+  {
+    throw DvbException("Failed to allocate the io_uring buffers");
+  }
+  m_buffers = static_cast<uint8_t*>(buffers);
+  iovec iov[URING_BUFFERS];
+  for (unsigned i = 0; i < URING_BUFFERS; i++)
+  {
+    iov[i] = { m_buffers + i * URING_BUFFER_SIZE, URING_BUFFER_SIZE };
+  }
+  int error = m_ring.register_buffers(iov, URING_BUFFERS);
+  if (!error) error = m_ring.register_files(URING_FILES);
+  if (error)
+  {
+    free(m_buffers);
+    throw DvbException(fmt("Failed to register the io_uring buffers and files: %s") % strerror(-error));
+  }
+  for (unsigned i = 0; i < URING_FILES; i++)
+  {
+    m_fds[i] = -1;
+  }
+}
+
+UringWriter::~UringWriter()
+{
+  finish();
+  free(m_buffers);
+}
+
+io_uring_sqe* UringWriter::_get_sqe()
+{
+  io_uring_sqe* sqe = m_ring.get_sqe();
+  if (!sqe)
+  {
+    // Full, so make room.
+    submit();
+    sqe = m_ring.get_sqe();
+  }
+  return sqe;
+}
+
+unsigned UringWriter::_free_buffer()
+{
+  for (;;)
+  {
+    for (unsigned i = 0; i < URING_BUFFERS; i++)
+    {
+      unsigned buffer = (m_next + i) % URING_BUFFERS;
+      if (!m_busy[buffer])
+      {
+        m_next = (buffer + 1) % URING_BUFFERS;
+        return buffer;
+      }
+    }
+    // Every buffer is in flight, the disk can't keep up.
+    m_waits.add();
+    _reap(1);
+    if (!m_error.empty()) return URING_BUFFERS;
+  }
+}
+
+void UringWriter::_reap(unsigned wait)
+{
+  int syscalls = m_ring.submit(wait);
+  if (syscalls < 0)
+  {
+    m_error = strerror(-syscalls);
+    return;
+  }
+  m_syscalls += syscalls;
+  // Anything queued has gone, too late to link to.
+  if (syscalls) m_last_write = NULL;
+  uint64_t user_data;
+  int32_t res;
+  while (m_ring.peek(user_data, res))
+  {
+    _complete(user_data, res);
+  }
+}
+
+void UringWriter::open(int fd)
+{
+  unsigned slot = (m_slot + 1) % URING_FILES;
+  // The segment before last, long since written.
+  while (m_writing[slot] && m_error.empty())
+  {
+    _reap(1);
+  }
+  int error = m_ring.set_file(slot, fd);
+  m_syscalls++;
+  if (error) m_error = strerror(-error);
+
+  int last = m_fds[m_slot];
+  if (last >= 0)
+  {
+    io_uring_sqe* sqe = _get_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = last;
+    sqe->user_data = URING_CLOSE | last;
+    // After the last of its writes, if they haven't been submitted yet.
+    if (m_last_write) m_last_write->flags |= IOSQE_IO_LINK;
+    m_closing++;
+  }
+  m_fds[m_slot] = -1;
+  m_slot = slot;
+  m_fds[slot] = fd;
+  m_offset = 0;
+  m_last_write = NULL;
+}
+
+unsigned UringWriter::write(const iovec* iov, size_t count)
+{
+  unsigned writes = 0;
+  size_t i = 0;
+  size_t done = 0; // Of iov[i]
+  while (i < count && m_error.empty())
+  {
+    unsigned buffer = _free_buffer();
+    if (buffer == URING_BUFFERS) break;
+    uint8_t* data = m_buffers + buffer * URING_BUFFER_SIZE;
+    size_t len = 0;
+    while (i < count && len < URING_BUFFER_SIZE)
+    {
+      size_t n = std::min(iov[i].iov_len - done, URING_BUFFER_SIZE - len);
+      memcpy(data + len, static_cast<const uint8_t*>(iov[i].iov_base) + done, n);
+      len += n;
+      done += n;
+      if (done == iov[i].iov_len)
+      {
+        i++;
+        done = 0;
+      }
+    }
+    io_uring_sqe* sqe = _get_sqe();
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = m_slot;
+    sqe->addr = reinterpret_cast<uintptr_t>(data);
+    sqe->len = len;
+    sqe->off = m_offset;
+    sqe->buf_index = buffer;
+    sqe->user_data = URING_WRITE | (m_slot << 8) | buffer;
+    m_busy[buffer] = 1;
+    m_lengths[buffer] = len;
+    m_writing[m_slot]++;
+    m_offset += len;
+    m_last_write = sqe;
+    writes++;
+  }
+  return writes;
+}
+
+void UringWriter::unlink(const std::string& path)
+{
+  uint64_t id = m_unlink_id++ & 0xFFFFFFFF;
+  const std::string& kept = m_unlinks[id] = path;
+  io_uring_sqe* sqe = _get_sqe();
+  sqe->opcode = IORING_OP_UNLINKAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = reinterpret_cast<uintptr_t>(kept.c_str());
+  sqe->user_data = URING_UNLINK | id;
+}
+
+void UringWriter::submit()
+{
+  _reap(0);
+}
+
+void UringWriter::_complete(uint64_t user_data, int32_t res)
+{
+  uint64_t kind = user_data & ~0xFFFFFFFFull;
+  uint32_t value = user_data & 0xFFFFFFFF;
+  if (kind == URING_WRITE)
+  {
+    unsigned buffer = value & 0xFF;
+    m_busy[buffer] = 0;
+    m_writing[value >> 8]--;
+    if (res < 0)
+    {
+      m_error = strerror(-res);
+    }
+    else if ((size_t)res < m_lengths[buffer])
+    {
+      m_error = "Short write";
+    }
+  }
+  else if (kind == URING_CLOSE)
+  {
+    m_closing--;
+    if (res < 0)
+    {
+      // Cancelled along with a failed write, or refused, so don't leak it.
+      DEBUG("io_uring close of %u failed: %s", value, strerror(-res));
+      close((int)value);
+    }
+  }
+  else if (kind == URING_UNLINK)
+  {
+    auto path = m_unlinks.find(value);
+    if (res < 0 && res != -ENOENT)
+    {
+      // Or the old segments fill the disk.
+      if (::unlink(path->second.c_str()) < 0 && errno != ENOENT)
+      {
+        WARNING("Failed to delete %s: %s", path->second.c_str(), strerror(errno));
+      }
+    }
+    m_unlinks.erase(path);
+  }
+}
+
+void UringWriter::finish()
+{
+  _reap(0);
+  for (;;)
+  {
+    bool busy = m_closing || !m_unlinks.empty();
+    for (unsigned i = 0; i < URING_BUFFERS; i++)
+    {
+      busy |= m_busy[i];
+    }
+    if (!busy || !m_error.empty()) break;
+    _reap(1);
+  }
+  for (unsigned i = 0; i < URING_FILES; i++)
+  {
+    if (m_fds[i] >= 0)
+    {
+      close(m_fds[i]);
+      m_fds[i] = -1;
+    }
+    // Let go of the files, so removed segments are freed.
+    m_ring.set_file(i, -1);
+  }
+  m_last_write = NULL;
+}
+
+#else
+
+Uring::Uring(unsigned entries)
+{
+  throw DvbException("Built without io_uring");
+}
+
+Uring::~Uring()
+{
+}
+
+bool Uring::supports(uint8_t opcode)
+{
+  return false;
+}
+
+UringWriter::UringWriter(const std::string& labels) :
+    m_ring(URING_ENTRIES),
+    m_waits("segment_write_waits_total", labels)
+{
+}
+
+UringWriter::~UringWriter()
+{
+}
+
+void UringWriter::open(int fd)
+{
+}
+
+unsigned UringWriter::write(const iovec* iov, size_t count)
+{
+  return 0;
+}
+
+void UringWriter::unlink(const std::string& path)
+{
+}
+
+void UringWriter::submit()
+{
+}
+
+void UringWriter::finish()
+{
+}
+
+#endif
@@ -1,5 +1,80 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
 #include "util.hpp"
 #include "log.hpp"
+#include "dvb_hls.hpp"
+
+#define CRC32_POLY 0x04C11DB7
+
+constexpr uint32_t crc32_shift(uint32_t crc, unsigned bits)
+{
+  return bits ? crc32_shift((crc & 0x80000000) ? (crc << 1) ^ CRC32_POLY : crc << 1, bits - 1) : crc;
+}
+
+/**
+ * Entry i of slice k, the CRC of byte i followed by k zero bytes.
+ */
+constexpr uint32_t crc32_entry(unsigned k, uint32_t i)
+{
+  return crc32_shift(i << 24, 8 * (k + 1));
+}
+
+template <unsigned... I>
+struct Indices
+{
+};
+
+template <unsigned N, unsigned... I>
+struct MakeIndices : MakeIndices<N - 1, N - 1, I...>
+{
+};
+
+template <unsigned... I>
+struct MakeIndices<0, I...>
+{
+  typedef Indices<I...> type;
+};
+
+struct Crc32Tables
+{
+  uint32_t slices[8][256];
+};
+
+template <unsigned... I>
+constexpr Crc32Tables crc32_tables(Indices<I...>)
+{
+  return
+  {{
+    { crc32_entry(0, I)... }, { crc32_entry(1, I)... }, { crc32_entry(2, I)... }, { crc32_entry(3, I)... },
+    { crc32_entry(4, I)... }, { crc32_entry(5, I)... }, { crc32_entry(6, I)... }, { crc32_entry(7, I)... }
+  }};
+}
+
+// Built by the compiler.
+static constexpr Crc32Tables crc32_table = crc32_tables(MakeIndices<256>::type());
+
+uint32_t crc32_mpeg(const uint8_t* data, size_t len)
+{
+  const uint32_t (*slices)[256] = crc32_table.slices;
+  uint32_t crc = 0xFFFFFFFF;
+  // Slice by 8, each byte looked up in the table for its distance from the end.
+  for (; len >= 8; data += 8, len -= 8)
+  {
+    uint32_t word = crc ^ ((data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3]);
+    crc = slices[7][word >> 24] ^ slices[6][(word >> 16) & 0xFF] ^
+        slices[5][(word >> 8) & 0xFF] ^ slices[4][word & 0xFF] ^
+        slices[3][data[4]] ^ slices[2][data[5]] ^ slices[1][data[6]] ^ slices[0][data[7]];
+  }
+  for (; len; data++, len--)
+  {
+    crc = (crc << 8) ^ slices[0][(crc >> 24) ^ *data];
+  }
+  return crc;
+}
 
 std::string join_path(std::vector<std::string> path)
 {
@@ -16,20 +91,20 @@ std::string join_path(std::vector<std::string> path)
   return joined;
 }
 
-void handle_dvbpsi_message(dvbpsi_t *_, const dvbpsi_msg_level_t level, const char* msg)
+void enter_output_dir()
 {
-  switch (level)
+  if (access(OUT_DIR, F_OK) < 0)
+  {
+    if (mkdir(OUT_DIR, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0)
+    {
+      throw DvbException
+      (
+        fmt("Failed to create output directory %s : %s") % OUT_DIR % strerror(errno)
+      );
+    }
+  }
+  if (chdir(OUT_DIR) < 0)
   {
-  case DVBPSI_MSG_ERROR:
-    ERROR("%s", msg);
-    break;
-  case DVBPSI_MSG_WARN:
-    WARNING("%s", msg);
-    break;
-  case DVBPSI_MSG_DEBUG:
-    DEBUG("%s", msg);
-    break;
-  default:
-    return;
+    throw DvbException(fmt("Failed to enter output directory %s : %s") % OUT_DIR % strerror(errno));
   }
 }
@@ -4,9 +4,18 @@ list($channels, $status) = get_channel_info();
 header("Content-Disposition: attachment; filename=channels.m3u8");
 header("Content-Type: application/x-mpegurl");
 echo "#EXTM3U\n\n";
+// With a control socket the daemon tunes channels on demand.
+$on_demand = file_exists("/run/shm/dvb_hls/control");
 foreach ($channels as $chan)
 {
     echo "#EXTINF:-1, $chan[0]\n";
-    echo "http://{$_SERVER['SERVER_NAME']}/streams/$chan[1]\n\n";
+    if ($on_demand)
+    {
+        echo "http://{$_SERVER['SERVER_NAME']}/watch.php?channel=" . urlencode($chan[0]) . "\n\n";
+    }
+    else
+    {
+        echo "http://{$_SERVER['SERVER_NAME']}/streams/$chan[1]\n\n";
+    }
 }
 ?>
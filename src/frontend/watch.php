@@ -0,0 +1,42 @@
+<?php
+// Asks the daemon to tune to a channel before redirecting to its stream,
+// for when there are fewer tuners than multiplexes (--tuners).
+$channel = isset($_GET['channel']) ? $_GET['channel'] : '';
+$socket = @stream_socket_client("unix:///run/shm/dvb_hls/control", $errno, $errstr, 2);
+if ($socket === false || $channel == '')
+{
+    header("HTTP/1.0 404 Not Found");
+    exit;
+}
+fwrite($socket, "watch " . str_replace(array("\r", "\n"), '', $channel) . "\n");
+$reply = trim(fgets($socket));
+fclose($socket);
+list($status, $detail) = explode(" ", $reply, 2);
+if ($status != 'OK')
+{
+    header("HTTP/1.0 503 Service Unavailable");
+    echo "$detail\n";
+    exit;
+}
+// A multiplex that has only just been tuned has no playlist yet, so wait
+// for the channel's first segment rather than send the player to a 404.
+$index = "/run/shm/dvb_hls/$detail";
+for ($wait = 0; $wait < 30000; $wait += 250)
+{
+    clearstatcache();
+    $playlist = @file_get_contents($index);
+    if ($playlist !== false && strpos($playlist, "#EXTINF") !== false)
+    {
+        break;
+    }
+    usleep(250000);
+}
+if ($playlist === false)
+{
+    header("HTTP/1.0 503 Service Unavailable");
+    header("Retry-After: 10");
+    echo "$channel isn't streaming yet\n";
+    exit;
+}
+header("Location: http://{$_SERVER['SERVER_NAME']}/streams/$detail");
+?>
@@ -0,0 +1,479 @@
+#include <unistd.h>
+#include <ftw.h>
+#include <fstream>
+#include <string>
+
+#include "test.hpp"
+#include "es_scanner.hpp"
+#include "channel.hpp"
+
+#define TEST_STEP (ES_CLOCK / 25)
+#define TEST_VPID 0x201
+#define TEST_APID 0x301
+#define TEST_SEGMENT_LENGTH 9.85 // seconds, SEGMENT_LENGTH in channel.cpp
+
+// H.264 NAL units, each with the start of its header.
+static const std::vector<uint8_t> H264_AUD = { 0, 0, 0, 1, 0x09, 0x10 };
+static const std::vector<uint8_t> H264_SPS = { 0, 0, 0, 1, 0x67, 0x64, 0x00, 0x28 };
+static const uint8_t H264_IDR[] = { 0x65, 0x88, 0x80, 0x40 };
+static const uint8_t H264_P_SLICE[] = { 0x41, 0xC0, 0x00, 0x40 }; // first_mb_in_slice 0, slice_type 0
+static const uint8_t H264_I_SLICE[] = { 0x41, 0xB0, 0x00, 0x40 }; // slice_type 2
+
+/**
+ * Timestamps that wrap at 33 bits carry the clock on past the wrap.
+ */
+static void test_clock_wrap()
+{
+  StreamClock clock;
+  CHECK(!clock.started());
+  uint64_t start = ES_CLOCK_WRAP - 10 * TEST_STEP + 17;
+  CHECK(clock.update(start));
+  CHECK(clock.started());
+  CHECK_EQ(clock.time(), start);
+  for (uint64_t i = 1; i <= 20; i++)
+  {
+    CHECK(clock.update((start + i * TEST_STEP) & (ES_CLOCK_WRAP - 1)));
+    CHECK_EQ(clock.time(), start + i * TEST_STEP);
+  }
+  // A repeated timestamp stands still.
+  uint64_t time = clock.time();
+  CHECK(clock.update(time & (ES_CLOCK_WRAP - 1)));
+  CHECK_EQ(clock.time(), time);
+  // And a step of just under ES_CLOCK_MAX_STEP across the wrap is followed.
+  time = clock.time();
+  CHECK(clock.update((time + ES_CLOCK_MAX_STEP) & (ES_CLOCK_WRAP - 1)));
+  CHECK_EQ(clock.time(), time + ES_CLOCK_MAX_STEP);
+}
+
+/**
+ * A jump, a step back or a flagged discontinuity move the clock on by
+ * the last good step, and it carries on from the new timestamps.
+ */
+static void test_clock_discontinuity()
+{
+  StreamClock clock;
+  uint64_t ts = 1000000;
+  CHECK(clock.update(ts));
+  CHECK(clock.update(ts += TEST_STEP));
+  uint64_t time = clock.time();
+
+  // Forwards by more than ES_CLOCK_MAX_STEP.
+  ts += 10 * ES_CLOCK;
+  CHECK(!clock.update(ts));
+  CHECK_EQ(clock.time(), time += TEST_STEP);
+  CHECK(clock.update(ts += TEST_STEP));
+  CHECK_EQ(clock.time(), time += TEST_STEP);
+
+  // Backwards, which is a jump of nearly 2^33 forwards.
+  ts -= 5 * ES_CLOCK;
+  CHECK(!clock.update(ts));
+  CHECK_EQ(clock.time(), time += TEST_STEP);
+  CHECK(clock.update(ts += 2 * TEST_STEP));
+  CHECK_EQ(clock.time(), time += 2 * TEST_STEP);
+
+  // Flagged, even though the step is small. The step is the one before.
+  clock.discontinuity();
+  CHECK(!clock.update(ts += 3));
+  CHECK_EQ(clock.time(), time += 2 * TEST_STEP);
+  CHECK(clock.update(ts += TEST_STEP));
+  CHECK_EQ(clock.time(), time += TEST_STEP);
+
+  // Across the wrap into a discontinuity.
+  ts = ES_CLOCK_WRAP - TEST_STEP;
+  CHECK(!clock.update(ts));
+  CHECK_EQ(clock.time(), time += TEST_STEP);
+  CHECK(clock.update(ts = 0));
+  CHECK_EQ(clock.time(), time += TEST_STEP);
+
+  // Started again, the clock takes the next timestamp as it is.
+  clock.reset();
+  CHECK(!clock.started());
+  CHECK(clock.update(12345));
+  CHECK_EQ(clock.time(), 12345);
+}
+
+/**
+ * The scanner's verdict on a PES of codec, split into packets at each of
+ * cuts, offsets into es. Every packet up to the verdict must be scanned.
+ */
+static int scan_pes(int codec, const std::vector<uint8_t>& es, const std::vector<size_t>& cuts)
+{
+  std::vector<uint8_t> pkts;
+  test_pes_start(pkts, TEST_VPID, 0, 0xE0, 0, UINT64_MAX, 0, std::vector<uint8_t>(es.begin(), es.begin() + cuts[0]));
+  // The PES header is 14 bytes, the rest of the first packet stuffing.
+  pkts.resize(4 + 14 + cuts[0]);
+  std::vector<uint8_t> start(pkts);
+  pkts.clear();
+  for (size_t i = 0; i < cuts.size(); i++)
+  {
+    size_t end = i + 1 < cuts.size() ? cuts[i + 1] : es.size();
+    test_packet(pkts, TEST_VPID, i + 1, 0, 0xFF);
+    uint8_t* pkt = &pkts[pkts.size() - TS_PACKET_SIZE];
+    // At the end of the payload, after an adaptation field of stuffing.
+    size_t len = end - cuts[i];
+    pkt[3] |= 0x20;
+    pkt[4] = TS_PACKET_SIZE - 5 - len;
+    if (pkt[4]) pkt[5] = 0;
+    memcpy(pkt + TS_PACKET_SIZE - len, &es[cuts[i]], len);
+  }
+  // The PES start at the end of its packet too.
+  std::vector<uint8_t> first;
+  test_packet(first, TEST_VPID, 0, 1, 0xFF);
+  first[3] |= 0x20;
+  first[4] = TS_PACKET_SIZE - 5 - (start.size() - 4);
+  if (first[4]) first[5] = 0;
+  memcpy(&first[TS_PACKET_SIZE - (start.size() - 4)], &start[4], start.size() - 4);
+  pkts.insert(pkts.begin(), first.begin(), first.end());
+
+  TsHeaders hdrs;
+  size_t count = pkts.size() / TS_PACKET_SIZE;
+  parse_headers(pkts.data(), count, hdrs);
+  EsScanner scanner;
+  scanner.start(codec);
+  int result = ES_MORE;
+  for (size_t i = 0; i < count && result == ES_MORE; i++)
+  {
+    result = scanner.scan(&pkts[i * TS_PACKET_SIZE], hdrs.flags[i], hdrs.payload[i]);
+  }
+  return result;
+}
+
+/**
+ * es with a NAL unit or other start code after it.
+ */
+template <size_t N>
+static std::vector<uint8_t> nal(std::vector<uint8_t> es, const uint8_t (&header)[N])
+{
+  es.push_back(0);
+  es.push_back(0);
+  es.push_back(1);
+  es.insert(es.end(), header, header + N);
+  return es;
+}
+
+/**
+ * Pictures whose start codes and headers are split between packets at
+ * every byte.
+ */
+static void test_scan_split()
+{
+  std::vector<uint8_t> idr = nal(H264_AUD, H264_IDR);
+  std::vector<uint8_t> sps = H264_AUD;
+  sps.insert(sps.end(), H264_SPS.begin(), H264_SPS.end());
+  std::vector<uint8_t> i_slice = nal(sps, H264_I_SLICE);
+  std::vector<uint8_t> p_slice = nal(sps, H264_P_SLICE);
+  std::vector<uint8_t> open_gop = nal(H264_AUD, H264_I_SLICE);
+  // MPEG-2: a sequence header, then an I and a P picture.
+  std::vector<uint8_t> mpeg2 = { 0, 0, 1, 0xB3, 0x11, 0x11, 0x11, 0x11 };
+  const uint8_t i_picture[] = { 0x00, 0x00, 0x08 };
+  const uint8_t p_picture[] = { 0x00, 0x00, 0x10 };
+  std::vector<uint8_t> mpeg2_i = nal(mpeg2, i_picture);
+  std::vector<uint8_t> mpeg2_p = nal(mpeg2, p_picture);
+  for (size_t cut = 0; cut <= idr.size(); cut++)
+  {
+    std::vector<size_t> cuts = { cut };
+    if (cut < idr.size()) CHECK_EQ(scan_pes(ES_CODEC_H264, idr, cuts), ES_RANDOM_ACCESS);
+    if (cut < i_slice.size()) CHECK_EQ(scan_pes(ES_CODEC_H264, i_slice, cuts), ES_RANDOM_ACCESS);
+    if (cut < p_slice.size()) CHECK_EQ(scan_pes(ES_CODEC_H264, p_slice, cuts), ES_NOT_RANDOM_ACCESS);
+    // Without the SPS an I slice is not one.
+    if (cut < open_gop.size()) CHECK_EQ(scan_pes(ES_CODEC_H264, open_gop, cuts), ES_NOT_RANDOM_ACCESS);
+    if (cut < mpeg2_i.size()) CHECK_EQ(scan_pes(ES_CODEC_MPEG2, mpeg2_i, cuts), ES_RANDOM_ACCESS);
+    if (cut < mpeg2_p.size()) CHECK_EQ(scan_pes(ES_CODEC_MPEG2, mpeg2_p, cuts), ES_NOT_RANDOM_ACCESS);
+  }
+  // Over three packets, one byte of the start code in the middle one.
+  for (size_t cut = 1; cut + 1 < idr.size(); cut++)
+  {
+    CHECK_EQ(scan_pes(ES_CODEC_H264, idr, { cut - 1, cut, cut + 1 }), ES_RANDOM_ACCESS);
+  }
+  // Too short to tell yet.
+  CHECK_EQ(scan_pes(ES_CODEC_H264, H264_AUD, { 2 }), ES_MORE);
+}
+
+/**
+ * HEVC: an IRAP picture is a random access point, a trailing picture is
+ * not even with the parameter sets in front of it.
+ */
+static void test_scan_hevc()
+{
+  const uint8_t vps[] = { 0x40, 0x01 }; // nal_unit_type 32
+  const uint8_t sps[] = { 0x42, 0x01 };
+  const uint8_t pps[] = { 0x44, 0x01 };
+  const uint8_t idr[] = { 0x26, 0x01 }; // IDR_W_RADL, 19
+  const uint8_t cra[] = { 0x2A, 0x01 }; // CRA, 21
+  const uint8_t trail[] = { 0x02, 0x01 }; // TRAIL_R, 1
+  const uint8_t rasl[] = { 0x10, 0x01 }; // RASL_R, 8
+  const uint8_t aud[] = { 0x46, 0x01, 0x10 };
+  std::vector<uint8_t> params = nal(nal(nal(nal(std::vector<uint8_t>(), aud), vps), sps), pps);
+  for (size_t cut = 0; cut < params.size() + 4; cut++)
+  {
+    std::vector<size_t> cuts = { cut };
+    CHECK_EQ(scan_pes(ES_CODEC_HEVC, nal(params, idr), cuts), ES_RANDOM_ACCESS);
+    CHECK_EQ(scan_pes(ES_CODEC_HEVC, nal(params, cra), cuts), ES_RANDOM_ACCESS);
+    CHECK_EQ(scan_pes(ES_CODEC_HEVC, nal(params, trail), cuts), ES_NOT_RANDOM_ACCESS);
+    CHECK_EQ(scan_pes(ES_CODEC_HEVC, nal(params, rasl), cuts), ES_NOT_RANDOM_ACCESS);
+  }
+  CHECK_EQ(scan_pes(ES_CODEC_HEVC, nal(std::vector<uint8_t>(), trail), { 0 }), ES_NOT_RANDOM_ACCESS);
+}
+
+/**
+ * A service as the segmenter would feed it to a Channel, with the batch
+ * boundaries it is cut at.
+ */
+struct TestService
+{
+  std::vector<uint8_t> packets;
+  std::vector<size_t> cuts; // Packets each batch ends after.
+  uint8_t cc[8192];
+  unsigned frames;
+
+  TestService() :
+      cc(),
+      frames(0)
+  {
+  }
+
+  /**
+   * A picture of the video, and a frame of the audio. The picture's slice
+   * is lead packets after the PES starts, with its start code split over
+   * the packet before if split. If cut the batch ends before the slice.
+   */
+  void picture(const uint8_t (&slice)[4], unsigned lead, bool split, bool cut)
+  {
+    uint64_t pts = ES_CLOCK + frames * TEST_STEP;
+    if (frames++ % 5 == 0)
+    {
+      std::vector<uint8_t> pat;
+      psi_packetize(0, psi_pat_section(1, 0x101), pat);
+      pat[3] |= cc[0]++ & 0x0F;
+      packets.insert(packets.end(), pat.begin(), pat.end());
+    }
+    std::vector<uint8_t> es = H264_AUD;
+    if (slice[0] == H264_IDR[0]) es.insert(es.end(), H264_SPS.begin(), H264_SPS.end());
+    if (!lead) es = nal(es, slice);
+    test_pes_start(packets, TEST_VPID, cc[TEST_VPID]++, 0xE0, pts, UINT64_MAX, 0, es);
+    for (unsigned i = 0; i < lead; i++)
+    {
+      test_packet(packets, TEST_VPID, cc[TEST_VPID]++, 0, 0xFF);
+    }
+    if (lead)
+    {
+      uint8_t* pkt = &packets[packets.size() - TS_PACKET_SIZE];
+      if (cut) cuts.push_back(packets.size() / TS_PACKET_SIZE - 1);
+      std::vector<uint8_t> code = nal(std::vector<uint8_t>(), slice);
+      if (split)
+      {
+        pkt[TS_PACKET_SIZE - 2] = 0;
+        pkt[TS_PACKET_SIZE - 1] = 0;
+        code.erase(code.begin(), code.begin() + 2);
+      }
+      test_packet(packets, TEST_VPID, cc[TEST_VPID]++, 0, 0x11);
+      memcpy(&packets[packets.size() - TS_PACKET_SIZE + 4], code.data(), code.size());
+    }
+    else if (cut)
+    {
+      cuts.push_back(packets.size() / TS_PACKET_SIZE - 1);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+      test_packet(packets, TEST_VPID, cc[TEST_VPID]++, 0, 0x11);
+    }
+    test_pes_start(packets, TEST_APID, cc[TEST_APID]++, 0xC0, pts, UINT64_MAX, 0, { 0xFF, 0xFD });
+  }
+
+  /**
+   * Write it all to a new channel, in batches that are gone once written
+   * as the ingest ring would reuse them. Returns the segments it wrote,
+   * the one still being written left out, and their lengths from the
+   * playlist.
+   */
+  std::vector<std::vector<uint8_t>> write(std::vector<double>& lengths)
+  {
+    // Batches also end every 100 packets.
+    size_t count = packets.size() / TS_PACKET_SIZE;
+    for (size_t end = 100; end < count; end += 100)
+    {
+      cuts.push_back(end - 1);
+    }
+    cuts.push_back(count - 1);
+    std::sort(cuts.begin(), cuts.end());
+
+    Channel channel(1, 0x101, "test");
+    channel.startPmtScan();
+    std::vector<uint8_t> pmt;
+    psi_packetize(0x101, test_pmt_section(1, TEST_VPID, TEST_APID), pmt);
+    CHECK(channel.readPmt(pmt.data()));
+    channel.setName("test");
+    timespec now = { 1000, 0 };
+    size_t start = 0;
+    static TsHeaders hdrs;
+    for (size_t last : cuts)
+    {
+      if (last < start) continue;
+      std::vector<uint8_t>* batch = new std::vector<uint8_t>(packets.begin() + start * TS_PACKET_SIZE,
+          packets.begin() + (last + 1) * TS_PACKET_SIZE);
+      size_t n = last + 1 - start;
+      parse_headers(batch->data(), n, hdrs);
+      std::vector<PacketRef> refs;
+      if (channel.handPsi()) refs.push_back({ NULL, 0, 0, 0 });
+      for (size_t i = 0; i < n; i++)
+      {
+        refs.push_back({ batch->data() + i * TS_PACKET_SIZE, hdrs.pid[i], hdrs.flags[i], hdrs.payload[i] });
+      }
+      channel.writePackets(refs.data(), refs.size(), now);
+      memset(batch->data(), 0xEE, batch->size());
+      delete batch;
+      now.tv_nsec += 1000000;
+      start = last + 1;
+    }
+
+    std::vector<std::vector<uint8_t>> segments;
+    for (unsigned n = 0; ; n++)
+    {
+      std::vector<uint8_t> segment = test_load(("test/" + std::to_string(n) + ".ts").c_str());
+      if (segment.empty()) break;
+      segments.push_back(segment);
+    }
+    CHECK(!segments.empty());
+    segments.pop_back();
+    std::ifstream playlist("test.m3u8");
+    std::string line;
+    lengths.clear();
+    while (std::getline(playlist, line))
+    {
+      if (line.compare(0, 8, "#EXTINF:") == 0) lengths.push_back(atof(line.c_str() + 8));
+    }
+    return segments;
+  }
+};
+
+/**
+ * The slice NAL header of the first picture of a segment, which must
+ * follow the service's PSI.
+ */
+static uint8_t first_slice(const std::vector<uint8_t>& segment)
+{
+  CHECK(segment.size() >= 3 * TS_PACKET_SIZE);
+  CHECK_EQ(GET_PID(segment.data()), 0);
+  CHECK_EQ(GET_PID((segment.data() + TS_PACKET_SIZE)), 0x101);
+  std::vector<uint8_t> es;
+  for (size_t offset = 0; offset < segment.size(); offset += TS_PACKET_SIZE)
+  {
+    const uint8_t* pkt = &segment[offset];
+    if (GET_PID(pkt) != TEST_VPID) continue;
+    // Sent from the start of a PES.
+    if (es.empty()) CHECK(pkt[1] & 0x40);
+    size_t payload = (pkt[3] & 0x20) ? 5 + pkt[4] : 4;
+    es.insert(es.end(), pkt + payload, pkt + TS_PACKET_SIZE);
+    for (size_t i = 0; i + 3 < es.size(); i++)
+    {
+      if (es[i] || es[i + 1] || es[i + 2] != 1) continue;
+      uint8_t type = es[i + 3] & 0x1F;
+      if (type == 1 || type == 5) return es[i + 3];
+    }
+  }
+  CHECK(0);
+  return 0;
+}
+
+/**
+ * Segments start on IDRs whose start codes are split between packets, and
+ * across batches, so that the channel has to hold the PES start until the
+ * next batch. Nothing held is lost or sent twice.
+ */
+static void test_channel_split()
+{
+  for (int variant = 0; variant < 4; variant++)
+  {
+    TestService service;
+    unsigned lead = variant == 0 ? 0 : variant;
+    for (int frame = 0; frame < 25 * 40; frame++)
+    {
+      bool key = frame % 25 == 0;
+      // The odd P picture with its slice far in, which is held too.
+      unsigned picture_lead = key ? lead : frame % 7 == 0 ? 3 : 0;
+      service.picture(key ? H264_IDR : H264_P_SLICE, picture_lead, variant >= 2, variant >= 1);
+    }
+    std::vector<double> lengths;
+    std::vector<std::vector<uint8_t>> segments = service.write(lengths);
+    CHECK(segments.size() >= 3);
+    size_t video = 0, pictures = 0;
+    for (auto& segment : segments)
+    {
+      CHECK_EQ(first_slice(segment), H264_IDR[0]);
+      for (size_t offset = 0; offset < segment.size(); offset += TS_PACKET_SIZE)
+      {
+        const uint8_t* pkt = &segment[offset];
+        CHECK(pkt[0] == 0x47 && pkt[4] != 0xEE);
+        if (GET_PID(pkt) != TEST_VPID) continue;
+        video++;
+        pictures += (pkt[1] & 0x40) != 0;
+      }
+    }
+    // Whole GOPs, each picture whole.
+    CHECK_EQ(pictures % 25, 0);
+    size_t expected = 0;
+    for (unsigned frame = 0; frame < pictures; frame++)
+    {
+      bool key = frame % 25 == 0;
+      unsigned picture_lead = key ? lead : frame % 7 == 0 ? 3 : 0;
+      expected += 5 + picture_lead + (picture_lead ? 1 : 0);
+    }
+    CHECK_EQ(video, expected);
+    // Cut on the last IDR before SEGMENT_LENGTH.
+    for (size_t i = 0; i + 1 < lengths.size(); i++)
+    {
+      CHECK(lengths[i] == 9.0);
+    }
+  }
+}
+
+/**
+ * With no random access point within SEGMENT_LENGTH, segments are cut
+ * on the PAT instead.
+ */
+static void test_channel_pat_cut()
+{
+  TestService service;
+  for (int frame = 0; frame < 25 * 40; frame++)
+  {
+    // An IDR to start on, then one more too late to cut on.
+    bool key = frame == 0 || frame == 25 * 15;
+    service.picture(key ? H264_IDR : H264_P_SLICE, 0, 0, 0);
+  }
+  std::vector<double> lengths;
+  std::vector<std::vector<uint8_t>> segments = service.write(lengths);
+  CHECK(segments.size() >= 3);
+  CHECK_EQ(first_slice(segments[0]), H264_IDR[0]);
+  CHECK_EQ(first_slice(segments[1]), H264_P_SLICE[0]);
+  for (double length : lengths)
+  {
+    // At the first PAT after SEGMENT_LENGTH, every 5 pictures.
+    CHECK(length >= TEST_SEGMENT_LENGTH && length <= TEST_SEGMENT_LENGTH + 0.2);
+  }
+}
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+  return remove(path);
+}
+
+/**
+ * The clock segments are timed by, and the scanner that finds where
+ * they can start.
+ */
+int main(int argc, char** argv)
+{
+  test_clock_wrap();
+  test_clock_discontinuity();
+  test_scan_split();
+  test_scan_hevc();
+
+  char dir[] = "/tmp/es_scanner_testXXXXXX";
+  CHECK(mkdtemp(dir));
+  CHECK(chdir(dir) == 0);
+  test_channel_split();
+  test_channel_pat_cut();
+  CHECK(chdir("/") == 0);
+  nftw(dir, remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+  return 0;
+}
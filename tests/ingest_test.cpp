@@ -0,0 +1,179 @@
+#include "test.hpp"
+#include "ingest.hpp"
+#include "util.hpp"
+
+#define TEST_PACKETS 20000
+#define TEST_CORRUPT_EVERY 500 // Packets between runs of junk bytes
+
+/**
+ * The plain loop find_sync() must agree with.
+ */
+static size_t find_sync_scalar(const uint8_t* buf, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    if (buf[i] == TS_SYNC_BYTE && (i + TS_PACKET_SIZE >= len || buf[i + TS_PACKET_SIZE] == TS_SYNC_BYTE))
+    {
+      return i;
+    }
+  }
+  return len;
+}
+
+/**
+ * find_sync() on junk with sync bytes scattered through it, some a packet
+ * apart, at every alignment and over lengths either side of the vector
+ * width and a packet.
+ */
+static void test_find_sync()
+{
+  TestRandom random;
+  std::vector<uint8_t> buf(4096);
+  for (int round = 0; round < 200; round++)
+  {
+    for (auto& byte : buf)
+    {
+      byte = random.below(255);
+      if (byte == TS_SYNC_BYTE) byte++;
+    }
+    // Fewer sync bytes each round, so matches fall further in.
+    for (unsigned n = random.below(400 / (1 + round / 10)) + 1; n; n--)
+    {
+      size_t i = random.below(buf.size());
+      buf[i] = TS_SYNC_BYTE;
+      if (random.below(4) == 0 && i + TS_PACKET_SIZE < buf.size()) buf[i + TS_PACKET_SIZE] = TS_SYNC_BYTE;
+    }
+    for (size_t offset = 0; offset < 16; offset++)
+    {
+      for (size_t len : { 0, 1, 15, 16, 17, 187, 188, 189, 203, 204, 205, 220, 400, 1000, 4000 })
+      {
+        len = std::min(len, buf.size() - offset);
+        CHECK_EQ(find_sync(&buf[offset], len), find_sync_scalar(&buf[offset], len));
+      }
+    }
+  }
+
+  // A match in every lane of the vector, and none at all.
+  std::vector<uint8_t> none(1024, 0x00);
+  CHECK_EQ(find_sync(none.data(), none.size()), none.size());
+  for (size_t i = 0; i < 64; i++)
+  {
+    std::vector<uint8_t> one(none);
+    one[i] = one[i + TS_PACKET_SIZE] = TS_SYNC_BYTE;
+    CHECK_EQ(find_sync(one.data(), one.size()), i);
+  }
+}
+
+/**
+ * A multiplex with junk between packets every so often, through TsIngest
+ * in reads of max_read bytes, inline or on the ingest thread.
+ */
+static void test_resync(const std::vector<uint8_t>& mux, size_t max_read, bool thread)
+{
+  TestRandom random;
+  uint64_t packets = mux.size() / TS_PACKET_SIZE;
+  std::vector<uint8_t> corrupt;
+  for (uint64_t i = 0; i < packets; i++)
+  {
+    if (i && i % TEST_CORRUPT_EVERY == 0)
+    {
+      corrupt.insert(corrupt.end(), 1 + random.below(TS_PACKET_SIZE - 1), 0x00);
+    }
+    corrupt.insert(corrupt.end(), mux.begin() + i * TS_PACKET_SIZE, mux.begin() + (i + 1) * TS_PACKET_SIZE);
+  }
+
+  TestSource source(corrupt, max_read);
+  TsIngest ingest(source);
+  if (thread) ingest.start_thread(-1, 0);
+  uint64_t count = 0;
+  while (!ingest.eof())
+  {
+    TsBatch batch;
+    if (!ingest.next_batch(batch)) continue;
+    for (size_t i = 0; i < batch.count; i++)
+    {
+      CHECK_EQ(batch.packets[i * TS_PACKET_SIZE], TS_SYNC_BYTE);
+    }
+    count += batch.count;
+    ingest.release(batch);
+  }
+  // The packet before each run of junk is lost with it, as it can't be told
+  // from a truncated one. Unless a short read ends on it, leaving no stride
+  // to check.
+  uint64_t lost = (packets - 1) / TEST_CORRUPT_EVERY;
+  if (max_read == INGEST_CHUNK_SIZE)
+  {
+    CHECK_EQ(count, packets - lost);
+  }
+  else
+  {
+    CHECK(count >= packets - lost && count <= packets);
+  }
+}
+
+/**
+ * A source that fails part way through.
+ */
+class FailingSource : public TestSource
+{
+  size_t m_reads;
+
+public:
+  FailingSource(const std::vector<uint8_t>& data) :
+      TestSource(data, INGEST_CHUNK_SIZE),
+      m_reads(0)
+  {
+  }
+
+  ssize_t read_bytes(uint8_t* buf, size_t size) override
+  {
+    if (++m_reads > 3) throw DvbException("Test failure");
+    return TestSource::read_bytes(buf, size);
+  }
+};
+
+/**
+ * The error from the ingest thread reaches the consumer once it has taken
+ * the batches read before it.
+ */
+static void test_error(const std::vector<uint8_t>& mux)
+{
+  FailingSource source(mux);
+  TsIngest ingest(source);
+  ingest.start_thread(-1, 0);
+  size_t batches = 0;
+  try
+  {
+    while (!ingest.eof())
+    {
+      TsBatch batch;
+      if (!ingest.next_batch(batch)) continue;
+      batches++;
+      ingest.release(batch);
+    }
+    CHECK(!"Reached the end of a failed source");
+  }
+  catch (DvbException& e)
+  {
+    CHECK(strcmp(e.what(), "Test failure") == 0);
+  }
+  CHECK_EQ(batches, 3);
+  CHECK(!ingest.eof());
+}
+
+/**
+ * The resynchronising scan for sync bytes, on its own and in TsIngest.
+ */
+int main(int argc, char** argv)
+{
+  test_find_sync();
+  std::vector<uint8_t> mux = test_mux(12, TEST_PACKETS);
+  for (bool thread : { false, true })
+  {
+    test_resync(mux, INGEST_CHUNK_SIZE, thread);
+    test_resync(mux, 20 * TS_PACKET_SIZE, thread);
+    test_resync(mux, 1000, thread);
+  }
+  test_error(mux);
+  return 0;
+}
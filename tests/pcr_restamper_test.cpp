@@ -0,0 +1,184 @@
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+
+#include "test.hpp"
+#include "pcr_restamper.hpp"
+
+#define TEST_LABELS "service=\"test\""
+#define TEST_TICKS_PER_BYTE 54 // 4Mbit/s
+#define TEST_PCR_BYTES (106 * TS_PACKET_SIZE) // About every 40ms
+#define TEST_JITTER 270 // 10us, either way
+
+/**
+ * a - b, allowing for the PCR wrapping.
+ */
+static int64_t diff(uint64_t a, uint64_t b)
+{
+  uint64_t d = (a + PCR_WRAP - b) % PCR_WRAP;
+  return d > PCR_WRAP / 2 ? (int64_t)d - (int64_t)PCR_WRAP : (int64_t)d;
+}
+
+/**
+ * The stats as Stats::write() exports them, by name.
+ */
+static std::map<std::string, uint64_t> read_stats()
+{
+  Stats::write();
+  std::map<std::string, uint64_t> stats;
+  std::ifstream in(STATS_FILE);
+  std::string name;
+  uint64_t value;
+  while (in >> name >> value)
+  {
+    stats[name] = value;
+  }
+  return stats;
+}
+
+static uint64_t stat(const char* name)
+{
+  std::map<std::string, uint64_t> stats = read_stats();
+  auto found = stats.find(std::string(name) + "{" TEST_LABELS "}");
+  CHECK(found != stats.end());
+  return found->second;
+}
+
+/**
+ * The peak distance of PCRs from the line through the two before them,
+ * for the jitter the restamper should export.
+ */
+struct Jitter
+{
+  std::vector<std::pair<uint64_t, uint64_t>> points;
+  uint64_t peak;
+
+  Jitter() :
+      peak(0)
+  {
+  }
+
+  void add(uint64_t pcr, uint64_t pos)
+  {
+    size_t n = points.size();
+    if (n >= 2)
+    {
+      int64_t ticks = diff(points[n - 1].first, points[n - 2].first);
+      int64_t bytes = points[n - 1].second - points[n - 2].second;
+      int64_t expected = ticks * (int64_t)(pos - points[n - 1].second) / bytes;
+      peak = std::max<uint64_t>(peak, llabs(diff(pcr, points[n - 1].first) - expected));
+    }
+    points.push_back({ pcr, pos });
+  }
+};
+
+/**
+ * A service at a constant bitrate whose PCRs are off by TEST_JITTER one
+ * way and then the other, from first, each packed into a packet and
+ * rewritten there as a channel does. Checks that the new PCRs keep
+ * going forwards, and that the stats exported each second are the
+ * jitter before and after.
+ */
+static void test_jitter(uint64_t first, unsigned seconds)
+{
+  PcrRestamper restamper(TEST_LABELS);
+  std::vector<uint8_t> pkt;
+  test_packet(pkt, 0x200, 0);
+  pkt[3] |= 0x20;
+  pkt[4] = 7;
+  pkt[5] = 0x10;
+
+  Jitter in, out;
+  uint64_t stats_pcr = 0;
+  uint64_t last = 0;
+  unsigned intervals = 0;
+  unsigned count = seconds * PCR_CLOCK / (TEST_PCR_BYTES * TEST_TICKS_PER_BYTE);
+  for (unsigned i = 0; i < count; i++)
+  {
+    uint64_t pos = (uint64_t)i * TEST_PCR_BYTES;
+    uint64_t pcr = (first + pos * TEST_TICKS_PER_BYTE + PCR_WRAP + (i % 2 ? -TEST_JITTER : TEST_JITTER)) % PCR_WRAP;
+    set_pcr(pkt.data(), pcr);
+    CHECK(HAS_PCR(pkt));
+    CHECK_EQ(get_pcr(pkt.data()), pcr);
+    set_pcr(pkt.data(), restamper.restamp(get_pcr(pkt.data()), pos, 0));
+    uint64_t restamped = get_pcr(pkt.data());
+    CHECK(restamped < PCR_WRAP);
+    if (i)
+    {
+      // Forwards by about the time at the bitrate, and not far off the original.
+      int64_t step = diff(restamped, last);
+      CHECK(step > 0);
+      CHECK(llabs(step - TEST_PCR_BYTES * TEST_TICKS_PER_BYTE) <= 4 * TEST_JITTER);
+      CHECK(llabs(diff(restamped, pcr)) <= (int64_t)PCR_MAX_OFFSET);
+      in.add(pcr, pos);
+      out.add(restamped, pos);
+    }
+    else
+    {
+      // The first is passed on as it is, to start from.
+      CHECK_EQ(restamped, pcr);
+      stats_pcr = pcr;
+    }
+    last = restamped;
+
+    if (diff(pcr, stats_pcr) >= (int64_t)PCR_STATS_INTERVAL)
+    {
+      stats_pcr = pcr;
+      // Every other PCR is 2 * TEST_JITTER off the line through the two
+      // before, and that line is another 2 * TEST_JITTER off.
+      CHECK_EQ(in.peak, 4 * TEST_JITTER);
+      CHECK_EQ(stat("pcr_jitter_in_ns"), in.peak * 1000 / (PCR_CLOCK / 1000000));
+      CHECK_EQ(stat("pcr_jitter_out_ns"), out.peak * 1000 / (PCR_CLOCK / 1000000));
+      // Once the bitrate has settled the new PCRs are smooth.
+      if (++intervals > 2) CHECK(out.peak < in.peak / 10);
+      in.peak = 0;
+      out.peak = 0;
+    }
+  }
+  CHECK(intervals >= seconds - 1);
+  CHECK_EQ(stat("pcr_restamp_clamped_total"), 0);
+}
+
+/**
+ * A PCR that jumps, or is flagged as a discontinuity, is started again
+ * from as it is.
+ */
+static void test_restart()
+{
+  PcrRestamper restamper(TEST_LABELS);
+  uint64_t pcr = PCR_CLOCK;
+  uint64_t pos = 0;
+  for (int i = 0; i < 100; i++)
+  {
+    restamper.restamp(pcr += TEST_PCR_BYTES * TEST_TICKS_PER_BYTE + (i % 2 ? -TEST_JITTER : TEST_JITTER), pos += TEST_PCR_BYTES, 0);
+  }
+  // A jump, and the next PCR is the first of an interval again.
+  pcr += 10 * PCR_CLOCK;
+  CHECK_EQ(restamper.restamp(pcr, pos += TEST_PCR_BYTES, 0), pcr);
+  pcr += TEST_PCR_BYTES * TEST_TICKS_PER_BYTE + TEST_JITTER;
+  CHECK_EQ(restamper.restamp(pcr, pos += TEST_PCR_BYTES, 0), pcr);
+  // Flagged, and backwards.
+  CHECK_EQ(restamper.restamp(pcr + 100, pos += TEST_PCR_BYTES, 1), pcr + 100);
+  CHECK_EQ(restamper.restamp(pcr - PCR_CLOCK, pos += TEST_PCR_BYTES, 0), pcr - PCR_CLOCK);
+}
+
+/**
+ * The PCR restamper on jittered PCRs, and across the wrap of the 33 bit
+ * PCR base.
+ */
+int main(int argc, char** argv)
+{
+  char dir[] = "/tmp/pcr_restamper_testXXXXXX";
+  CHECK(mkdtemp(dir));
+  CHECK(chdir(dir) == 0);
+  test_jitter(PCR_CLOCK, 10);
+  // The wrap comes 3 seconds in.
+  test_jitter(PCR_WRAP - 3 * PCR_CLOCK, 10);
+  test_restart();
+  unlink(STATS_FILE);
+  CHECK(chdir("/") == 0);
+  CHECK(rmdir(dir) == 0);
+  return 0;
+}
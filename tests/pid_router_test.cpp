@@ -0,0 +1,163 @@
+#include <unistd.h>
+#include <ftw.h>
+#include <set>
+#include <map>
+
+#include "test.hpp"
+#include "channel.hpp"
+#include "pid_router.hpp"
+
+#define TEST_CHANNELS 300 // More than a byte can index
+#define TEST_GROUP 8 // Channels sharing the streams of a group, more than ROUTE_FANOUT
+#define TEST_GROUP_PIDS 150 // Streams in each group, enough for more than 255 overflow lists
+#define TEST_SHARED_PID 0x1FF0 // Carried by every channel
+
+static const uint16_t si_pids[] = { 0x00, 0x11, 0x12 };
+
+/**
+ * The PMT of channel n: its own video, the audio every channel shares and,
+ * for the first and the last TEST_GROUP channels, the streams of their group.
+ */
+static std::vector<uint16_t> channel_pids(unsigned n)
+{
+  std::vector<uint16_t> pids = { (uint16_t)(0x400 + n), TEST_SHARED_PID };
+  int group = n < TEST_GROUP ? 0 : n >= TEST_CHANNELS - TEST_GROUP ? 1 : -1;
+  for (unsigned i = 0; group >= 0 && i < TEST_GROUP_PIDS; i++)
+  {
+    pids.push_back(0x1000 + group * 0x200 + i);
+  }
+  return pids;
+}
+
+/**
+ * Channel n in slot n, once it has read its PMT.
+ */
+static Channel* make_channel(unsigned n)
+{
+  std::vector<uint16_t> pids = channel_pids(n);
+  std::vector<uint8_t> section;
+  psi_start_section(section, 0x02, n + 1, 0);
+  section.push_back(0xE0 | (pids[0] >> 8)); // PCR on the video
+  section.push_back(pids[0] & 0xFF);
+  section.push_back(0xF0);
+  section.push_back(0);
+  for (size_t i = 0; i < pids.size(); i++)
+  {
+    section.push_back(i ? 0x03 : 0x1B);
+    section.push_back(0xE0 | (pids[i] >> 8));
+    section.push_back(pids[i] & 0xFF);
+    section.push_back(0xF0);
+    section.push_back(0);
+  }
+  psi_finish_section(section);
+  std::vector<uint8_t> pkts;
+  psi_packetize(0x20 + n, section, pkts);
+  for (size_t offset = 0; offset < pkts.size(); offset += TS_PACKET_SIZE)
+  {
+    pkts[offset + 3] |= (offset / TS_PACKET_SIZE) & 0x0F;
+  }
+
+  Channel* chan = new Channel(n + 1, 0x20 + n, "test");
+  chan->startPmtScan();
+  std::vector<int>* found = NULL;
+  for (size_t offset = 0; offset < pkts.size() && !found; offset += TS_PACKET_SIZE)
+  {
+    found = chan->readPmt(&pkts[offset]);
+  }
+  CHECK(found);
+  return chan;
+}
+
+/**
+ * The slots a packet on pid is written to, as the segmenter reads them.
+ */
+static std::set<unsigned> route_slots(const PidRouter& router, uint16_t pid, size_t channels)
+{
+  const PidRoute& route = router.table()[pid];
+  std::set<unsigned> slots;
+  if (route.count == ROUTE_ALL)
+  {
+    for (size_t slot = 0; slot < channels; slot++)
+    {
+      slots.insert(slot);
+    }
+  }
+  else if (route.count == ROUTE_OVERFLOW)
+  {
+    CHECK(router.overflow(route).size() > ROUTE_FANOUT);
+    slots.insert(router.overflow(route).begin(), router.overflow(route).end());
+  }
+  else
+  {
+    CHECK(route.count <= ROUTE_FANOUT);
+    slots.insert(route.slots, route.slots + route.count);
+  }
+  return slots;
+}
+
+/**
+ * Every PID routes to exactly the streaming channels that carry it.
+ */
+static void check_routes(const std::vector<Channel*>& channels)
+{
+  PidRouter router;
+  router.rebuild(channels, si_pids, sizeof(si_pids) / sizeof(si_pids[0]));
+
+  std::map<uint16_t, std::set<unsigned> > expected;
+  std::set<unsigned> streaming;
+  for (unsigned slot = 0; slot < channels.size(); slot++)
+  {
+    if (!channels[slot]->streaming()) continue;
+    streaming.insert(slot);
+    for (uint16_t pid : channel_pids(slot))
+    {
+      expected[pid].insert(slot);
+    }
+  }
+  for (uint16_t pid : si_pids)
+  {
+    expected[pid] = streaming;
+  }
+  for (uint16_t pid = 0; pid < NUM_PIDS; pid++)
+  {
+    CHECK(route_slots(router, pid, channels.size()) == expected[pid]);
+  }
+}
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+  return remove(path);
+}
+
+/**
+ * The routing table for a PID shared by more channels than fit in a
+ * route, by more than 255 of them, and for more than 255 such PIDs.
+ */
+int main(int argc, char** argv)
+{
+  char dir[] = "/tmp/pid_router_testXXXXXX";
+  CHECK(mkdtemp(dir));
+  CHECK(chdir(dir) == 0);
+  std::vector<Channel*> channels;
+  for (unsigned n = 0; n < TEST_CHANNELS; n++)
+  {
+    channels.push_back(make_channel(n));
+    CHECK(channels.back()->streaming());
+  }
+  // The SI goes to every channel.
+  check_routes(channels);
+  // Only to those streaming, once some are not.
+  channels[3]->disable();
+  channels[TEST_CHANNELS - 1]->disable();
+  check_routes(channels);
+  // A few channels, which the shared streams fit in the route of.
+  check_routes(std::vector<Channel*>(channels.begin(), channels.begin() + 4));
+
+  for (Channel* chan : channels)
+  {
+    delete chan;
+  }
+  CHECK(chdir("/") == 0);
+  nftw(dir, remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+  return 0;
+}
@@ -0,0 +1,450 @@
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "test.hpp"
+#include "util.hpp"
+#include "psi_parser.hpp"
+#include "psi_generator.hpp"
+
+#ifdef HAVE_DVBPSI
+#include <dvbpsi/dvbpsi.h>
+#include <dvbpsi/psi.h>
+#include <dvbpsi/pat.h>
+#include <dvbpsi/descriptor.h>
+#include <dvbpsi/pmt.h>
+#endif
+
+#define FUZZ_ROUNDS 20000
+
+typedef std::vector<std::vector<uint8_t> > Sections;
+
+static SectionAssembler::Handler collect(Sections& sections)
+{
+  return [&sections](const uint8_t* section, size_t len)
+  {
+    sections.push_back(std::vector<uint8_t>(section, section + len));
+  };
+}
+
+static void push_all(SectionAssembler& assembler, const std::vector<uint8_t>& packets, uint8_t& cc)
+{
+  std::vector<uint8_t> pkts(packets);
+  for (size_t offset = 0; offset < pkts.size(); offset += TS_PACKET_SIZE)
+  {
+    pkts[offset + 3] = (pkts[offset + 3] & 0xF0) | (cc++ & 0x0F);
+    assembler.push(&pkts[offset]);
+  }
+}
+
+/**
+ * An SDT with enough services to span several packets.
+ */
+static std::vector<uint8_t> sdt_section(unsigned services)
+{
+  std::vector<uint8_t> section;
+  psi_start_section(section, PSI_TABLE_SDT, 1, 3);
+  section.push_back(0x20); // original_network_id
+  section.push_back(0x85);
+  section.push_back(0xFF);
+  for (unsigned n = 1; n <= services; n++)
+  {
+    std::string name = (fmt("Service %u") % n).str();
+    section.push_back(n >> 8);
+    section.push_back(n & 0xFF);
+    section.push_back(0xFC);
+    uint16_t len = 2 + 3 + name.size();
+    section.push_back(0x80 | (len >> 8)); // Running
+    section.push_back(len & 0xFF);
+    section.push_back(0x48);
+    section.push_back(3 + name.size());
+    section.push_back(0x01); // Digital television
+    section.push_back(0); // No provider name
+    section.push_back(name.size());
+    section.insert(section.end(), name.begin(), name.end());
+  }
+  psi_finish_section(section);
+  return section;
+}
+
+static void test_round_trip()
+{
+  Sections sections;
+  SectionAssembler assembler(collect(sections));
+  uint8_t cc = 0;
+
+  std::vector<uint8_t> packets;
+  psi_packetize(0, psi_pat_section(7, 0x107), packets);
+  push_all(assembler, packets, cc);
+  CHECK_EQ(sections.size(), 1);
+  PsiPat pat;
+  CHECK(psi_parse_pat(sections[0].data(), sections[0].size(), pat));
+  CHECK_EQ(pat.count, 1);
+  CHECK_EQ(pat.programs[0].number, 7);
+  CHECK_EQ(pat.programs[0].pmt_pid, 0x107);
+
+  std::vector<uint8_t> pmt_section = test_pmt_section(7, 0x207, 0x307);
+  PsiPmt pmt;
+  CHECK(psi_parse_pmt(pmt_section.data(), pmt_section.size(), pmt));
+  CHECK_EQ(pmt.program, 7);
+  CHECK_EQ(pmt.pcr_pid, 0x207);
+  CHECK_EQ(pmt.count, 2);
+  CHECK_EQ(pmt.streams[0].type, 0x1B);
+  CHECK_EQ(pmt.streams[1].pid, 0x307);
+
+  // Spread over several packets.
+  sections.clear();
+  assembler.reset();
+  packets.clear();
+  std::vector<uint8_t> sdt = sdt_section(30);
+  CHECK(sdt.size() > 2 * TS_PACKET_SIZE);
+  psi_packetize(0x11, sdt, packets);
+  push_all(assembler, packets, cc);
+  CHECK_EQ(sections.size(), 1);
+  CHECK(sections[0] == sdt);
+  PsiSdt parsed;
+  CHECK(psi_parse_sdt(sections[0].data(), sections[0].size(), parsed));
+  CHECK_EQ(parsed.count, 30);
+  std::string name;
+  CHECK(psi_service_name(parsed.services[29].descriptors, name));
+  CHECK(name == "Service 30");
+
+  // A lost packet loses the section, but not the next copy.
+  sections.clear();
+  push_all(assembler, std::vector<uint8_t>(packets.begin(), packets.begin() + TS_PACKET_SIZE), cc);
+  cc++;
+  push_all(assembler, std::vector<uint8_t>(packets.begin() + 2 * TS_PACKET_SIZE, packets.end()), cc);
+  CHECK_EQ(sections.size(), 0);
+  push_all(assembler, packets, cc);
+  CHECK_EQ(sections.size(), 1);
+  CHECK(sections[0] == sdt);
+
+  // Two sections in one packet, the second after the first ends.
+  sections.clear();
+  assembler.reset();
+  std::vector<uint8_t> both = psi_pat_section(1, 0x101);
+  std::vector<uint8_t> second = psi_pat_section(2, 0x102);
+  both.insert(both.end(), second.begin(), second.end());
+  packets.clear();
+  psi_packetize(0, both, packets);
+  CHECK_EQ(packets.size(), TS_PACKET_SIZE);
+  push_all(assembler, packets, cc);
+  CHECK_EQ(sections.size(), 2);
+  CHECK(sections[1] == second);
+
+  // A corrupt section is dropped.
+  sections.clear();
+  packets.clear();
+  std::vector<uint8_t> corrupt = psi_pat_section(3, 0x103);
+  corrupt[9] ^= 0x01;
+  psi_packetize(0, corrupt, packets);
+  push_all(assembler, packets, cc);
+  CHECK_EQ(sections.size(), 0);
+  CHECK_EQ(assembler.crc_errors(), 1);
+}
+
+/**
+ * A section header claiming more than PSI_SECTION_MAX, followed by
+ * continuation packets, used to fill the buffer and stop the assembler
+ * making progress.
+ */
+static void test_oversized_section()
+{
+  Sections sections;
+  SectionAssembler assembler(collect(sections));
+  uint8_t cc = 0;
+  std::vector<uint8_t> packets;
+  test_packet(packets, 0, 0, 1, 0xAB);
+  packets[4] = 0; // pointer_field
+  packets[5] = 0x00;
+  packets[6] = 0xBF;
+  packets[7] = 0xFF;
+  for (int i = 0; i < 40; i++)
+  {
+    test_packet(packets, 0, 0, 0, 0xAB);
+  }
+  push_all(assembler, packets, cc);
+  CHECK_EQ(sections.size(), 0);
+
+  // Picked up again from the next section.
+  packets.clear();
+  psi_packetize(0, psi_pat_section(9, 0x109), packets);
+  push_all(assembler, packets, cc);
+  CHECK_EQ(sections.size(), 1);
+}
+
+static void check_descriptors(const std::vector<uint8_t>& section, const PsiDescriptors& descriptors)
+{
+  CHECK(descriptors.data >= section.data());
+  CHECK(descriptors.data + descriptors.len <= section.data() + section.size());
+  uint8_t len;
+  const uint8_t* found = psi_find_descriptor(descriptors, 0x48, len);
+  if (found) CHECK(found + len <= descriptors.data + descriptors.len);
+  std::string name;
+  psi_service_name(descriptors, name);
+}
+
+/**
+ * Whatever the assembler hands on must be a whole, intact section, and
+ * whatever the parsers accept must lie within it.
+ */
+static void check_section(const std::vector<uint8_t>& section)
+{
+  CHECK(section.size() >= 3);
+  CHECK(section.size() <= PSI_SECTION_MAX);
+  CHECK_EQ(3 + (((section[1] & 0x0F) << 8) | section[2]), section.size());
+  if (section[1] & 0x80) CHECK_EQ(crc32_mpeg(section.data(), section.size()), 0);
+
+  static PsiPat pat;
+  static PsiPmt pmt;
+  static PsiSdt sdt;
+  if (psi_parse_pat(section.data(), section.size(), pat))
+  {
+    CHECK(pat.count <= PSI_MAX_PROGRAMS);
+  }
+  if (psi_parse_pmt(section.data(), section.size(), pmt))
+  {
+    CHECK(pmt.count <= PSI_MAX_STREAMS);
+    check_descriptors(section, pmt.descriptors);
+    for (unsigned i = 0; i < pmt.count; i++) check_descriptors(section, pmt.streams[i].descriptors);
+  }
+  if (psi_parse_sdt(section.data(), section.size(), sdt))
+  {
+    CHECK(sdt.count <= PSI_MAX_SERVICES);
+    for (unsigned i = 0; i < sdt.count; i++) check_descriptors(section, sdt.services[i].descriptors);
+  }
+}
+
+static void test_fuzz()
+{
+  std::vector<uint8_t> clean;
+  psi_packetize(0, psi_pat_section(1, 0x101), clean);
+  psi_packetize(0x101, test_pmt_section(1, 0x201, 0x301), clean);
+  psi_packetize(0x11, sdt_section(12), clean);
+  size_t count = clean.size() / TS_PACKET_SIZE;
+
+  Sections sections;
+  std::map<uint16_t, SectionAssembler*> assemblers;
+  for (uint16_t pid : { 0x00, 0x101, 0x11 })
+  {
+    assemblers[pid] = new SectionAssembler(collect(sections));
+  }
+  TestRandom random;
+  std::vector<uint8_t> cc(8192);
+  size_t handed_on = 0;
+  for (unsigned round = 0; round < FUZZ_ROUNDS; round++)
+  {
+    std::vector<uint8_t> packets(clean);
+    // A few corrupt bytes anywhere, the headers and lengths included.
+    unsigned flips = 1 + random.below(8);
+    for (unsigned i = 0; i < flips; i++)
+    {
+      size_t at = random.below(packets.size());
+      // Mostly near the start of a packet, where the lengths are.
+      if (random.below(2)) at = at - at % TS_PACKET_SIZE + 1 + random.below(12);
+      packets[at] = random.below(4) ? random.next() : (random.below(2) ? 0xFF : 0x00);
+    }
+    // Sometimes a packet lost or repeated.
+    if (random.below(4) == 0)
+    {
+      size_t at = random.below(count) * TS_PACKET_SIZE;
+      if (random.below(2))
+      {
+        packets.erase(packets.begin() + at, packets.begin() + at + TS_PACKET_SIZE);
+      }
+      else
+      {
+        packets.insert(packets.begin() + at, packets.begin() + at, packets.begin() + at + TS_PACKET_SIZE);
+      }
+    }
+    for (size_t offset = 0; offset < packets.size(); offset += TS_PACKET_SIZE)
+    {
+      uint8_t* pkt = &packets[offset];
+      uint16_t pid = GET_PID(pkt);
+      auto assembler = assemblers.find(pid);
+      if (assembler == assemblers.end()) continue;
+      pkt[3] = (pkt[3] & 0xF0) | (cc[pid]++ & 0x0F);
+      assembler->second->push(pkt);
+    }
+    for (auto& section : sections)
+    {
+      check_section(section);
+    }
+    handed_on += sections.size();
+    sections.clear();
+
+    // Whatever came before, a clean copy gets through.
+    if (round % 100 == 99)
+    {
+      for (auto& assembler : assemblers)
+      {
+        assembler.second->reset();
+      }
+      for (size_t offset = 0; offset < clean.size(); offset += TS_PACKET_SIZE)
+      {
+        std::vector<uint8_t> pkt(clean.begin() + offset, clean.begin() + offset + TS_PACKET_SIZE);
+        uint16_t pid = GET_PID(pkt);
+        pkt[3] |= cc[pid]++ & 0x0F;
+        assemblers[pid]->push(pkt.data());
+      }
+      CHECK_EQ(sections.size(), 3);
+      sections.clear();
+    }
+  }
+  printf("Fuzzed %u rounds, %zu sections handed on\n", FUZZ_ROUNDS, handed_on);
+  for (auto& assembler : assemblers)
+  {
+    delete assembler.second;
+  }
+}
+
+#ifdef HAVE_DVBPSI
+
+/**
+ * The programs of each PAT version, and the streams of each PMT version,
+ * as "pid:type" strings that can be compared between decoders.
+ */
+typedef std::map<std::string, std::set<std::string> > Tables;
+
+struct DvbpsiDecoder
+{
+  Tables tables;
+  std::map<uint16_t, dvbpsi_t*> pmts;
+};
+
+static void dvbpsi_message(dvbpsi_t* dvbpsi, const dvbpsi_msg_level_t level, const char* msg)
+{
+}
+
+static void dvbpsi_pmt(void* data, dvbpsi_pmt_t* pmt)
+{
+  DvbpsiDecoder* decoder = static_cast<DvbpsiDecoder*>(data);
+  std::set<std::string>& streams = decoder->tables[(fmt("pmt %u v%u pcr %u") % pmt->i_program_number % (unsigned)pmt->i_version % pmt->i_pcr_pid).str()];
+  for (dvbpsi_pmt_es_t* es = pmt->p_first_es; es; es = es->p_next)
+  {
+    streams.insert((fmt("%u:%u") % es->i_pid % (unsigned)es->i_type).str());
+  }
+  dvbpsi_pmt_delete(pmt);
+}
+
+static void dvbpsi_pat(void* data, dvbpsi_pat_t* pat)
+{
+  DvbpsiDecoder* decoder = static_cast<DvbpsiDecoder*>(data);
+  std::set<std::string>& programs = decoder->tables[(fmt("pat %u v%u") % pat->i_ts_id % (unsigned)pat->i_version).str()];
+  for (dvbpsi_pat_program_t* program = pat->p_first_program; program; program = program->p_next)
+  {
+    programs.insert((fmt("%u:%u") % program->i_pid % program->i_number).str());
+    if (!program->i_number || decoder->pmts.count(program->i_pid)) continue;
+    dvbpsi_t* dvbpsi = dvbpsi_new(&dvbpsi_message, DVBPSI_MSG_NONE);
+    CHECK(dvbpsi_pmt_attach(dvbpsi, program->i_number, &dvbpsi_pmt, decoder));
+    decoder->pmts[program->i_pid] = dvbpsi;
+  }
+  dvbpsi_pat_delete(pat);
+}
+
+/**
+ * Decode the PAT and PMTs of a multiplex with both libdvbpsi and the
+ * in-tree parser, and check that they find the same tables.
+ */
+static void test_against_dvbpsi(const std::vector<uint8_t>& mux)
+{
+  DvbpsiDecoder theirs;
+  dvbpsi_t* pat_decoder = dvbpsi_new(&dvbpsi_message, DVBPSI_MSG_NONE);
+  CHECK(dvbpsi_pat_attach(pat_decoder, &dvbpsi_pat, &theirs));
+
+  Tables ours;
+  std::map<uint16_t, SectionAssembler*> assemblers;
+  PsiSections pat_seen;
+  std::map<uint16_t, uint8_t> pmt_versions;
+  std::set<std::string> pat_programs;
+  static PsiPat pat;
+  static PsiPmt pmt;
+  auto on_pat = [&](const uint8_t* section, size_t len)
+  {
+    if (!psi_parse_pat(section, len, pat)) return;
+    int seen = pat_seen.add(pat.version, pat.section, pat.last_section);
+    if (seen == PSI_SECTION_REPEAT) return;
+    if (seen == PSI_SECTION_FIRST) pat_programs.clear();
+    for (unsigned i = 0; i < pat.count; i++)
+    {
+      const PsiProgram& program = pat.programs[i];
+      pat_programs.insert((fmt("%u:%u") % program.pmt_pid % program.number).str());
+      if (!program.number || assemblers.count(program.pmt_pid)) continue;
+      uint16_t number = program.number;
+      assemblers[program.pmt_pid] = new SectionAssembler([&, number](const uint8_t* section, size_t len)
+      {
+        if (!psi_parse_pmt(section, len, pmt) || pmt.program != number) return;
+        auto version = pmt_versions.find(number);
+        if (version != pmt_versions.end() && version->second == pmt.version) return;
+        pmt_versions[number] = pmt.version;
+        std::set<std::string>& streams = ours[(fmt("pmt %u v%u pcr %u") % pmt.program % (unsigned)pmt.version % pmt.pcr_pid).str()];
+        for (unsigned i = 0; i < pmt.count; i++)
+        {
+          streams.insert((fmt("%u:%u") % pmt.streams[i].pid % (unsigned)pmt.streams[i].type).str());
+        }
+      });
+    }
+    if (pat_seen.complete()) ours[(fmt("pat %u v%u") % pat.ts_id % (unsigned)pat.version).str()] = pat_programs;
+  };
+  assemblers[0] = new SectionAssembler(on_pat);
+
+  std::vector<uint8_t> packets(mux);
+  for (size_t offset = 0; offset < packets.size(); offset += TS_PACKET_SIZE)
+  {
+    uint8_t* pkt = &packets[offset];
+    uint16_t pid = GET_PID(pkt);
+    auto assembler = assemblers.find(pid);
+    if (assembler != assemblers.end()) assembler->second->push(pkt);
+    if (pid == 0) dvbpsi_packet_push(pat_decoder, pkt);
+    auto decoder = theirs.pmts.find(pid);
+    if (decoder != theirs.pmts.end()) dvbpsi_packet_push(decoder->second, pkt);
+  }
+
+  CHECK(!theirs.tables.empty());
+  for (auto& table : theirs.tables)
+  {
+    auto found = ours.find(table.first);
+    if (found == ours.end()) fprintf(stderr, "Not decoded: %s\n", table.first.c_str());
+    CHECK(found != ours.end());
+    CHECK(found->second == table.second);
+  }
+  CHECK_EQ(ours.size(), theirs.tables.size());
+  printf("Decoded the same %zu tables as libdvbpsi\n", ours.size());
+
+  for (auto& decoder : theirs.pmts)
+  {
+    dvbpsi_pmt_detach(decoder.second);
+    dvbpsi_delete(decoder.second);
+  }
+  dvbpsi_pat_detach(pat_decoder);
+  dvbpsi_delete(pat_decoder);
+  for (auto& assembler : assemblers)
+  {
+    delete assembler.second;
+  }
+}
+
+#endif
+
+/**
+ * Optionally given a recorded multiplex, to compare with libdvbpsi on.
+ */
+int main(int argc, char** argv)
+{
+  test_round_trip();
+  test_oversized_section();
+  test_fuzz();
+#ifdef HAVE_DVBPSI
+  test_against_dvbpsi(test_mux(12, 20000));
+  if (argc > 1)
+  {
+    std::vector<uint8_t> recorded = test_load(argv[1]);
+    CHECK(!recorded.empty());
+    test_against_dvbpsi(recorded);
+  }
+#else
+  printf("Built without libdvbpsi, not comparing with it\n");
+#endif
+  return 0;
+}
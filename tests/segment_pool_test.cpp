@@ -0,0 +1,82 @@
+#include <unistd.h>
+#include <ftw.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "test.hpp"
+#include "replay.hpp"
+#include "segmenter.hpp"
+
+#define TEST_SERVICES 6
+#define TEST_SECONDS 45
+
+/**
+ * The playlist of each channel, and the bytes of the segments in it, as
+ * a replay of the recording left them.
+ */
+static std::string segment(const char* recording, unsigned threads)
+{
+  ReplaySource source("test", recording, false);
+  source.open_source();
+  Segmenter segmenter(source);
+  segmenter.use_progressive_scan(true);
+  segmenter.use_segment_threads(threads);
+  segmenter.scan();
+  segmenter.run();
+
+  // Read before the segmenter goes, which takes its output with it.
+  std::string out;
+  for (unsigned n = 1; n <= TEST_SERVICES; n++)
+  {
+    std::string dir = "service_" + std::to_string(n);
+    std::ifstream playlist(dir + ".m3u8");
+    CHECK(playlist);
+    std::string line;
+    unsigned segments = 0;
+    while (std::getline(playlist, line))
+    {
+      out += line + "\n";
+      if (line.empty() || line[0] == '#') continue;
+      std::vector<uint8_t> data = test_load(line.c_str());
+      CHECK(!data.empty());
+      out.append(data.begin(), data.end());
+      segments++;
+    }
+    CHECK(segments >= 3);
+  }
+  return out;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+  return remove(path);
+}
+
+/**
+ * The segments written by a pool of workers are the same, byte for byte,
+ * as those written on the segmenter's own thread.
+ */
+int main(int argc, char** argv)
+{
+  char dir[] = "/tmp/segment_pool_testXXXXXX";
+  CHECK(mkdtemp(dir));
+  CHECK(chdir(dir) == 0);
+  // The PMTs change part way through, while the workers may be behind.
+  std::vector<uint8_t> broadcast = test_broadcast(TEST_SERVICES, TEST_SECONDS / 2);
+  std::vector<uint8_t> changed = test_broadcast(TEST_SERVICES, TEST_SECONDS - TEST_SECONDS / 2, TEST_SECONDS / 2 * ES_CLOCK, 1);
+  broadcast.insert(broadcast.end(), changed.begin(), changed.end());
+  FILE* file = fopen("broadcast.ts", "wb");
+  CHECK(file);
+  CHECK_EQ(fwrite(broadcast.data(), 1, broadcast.size(), file), broadcast.size());
+  fclose(file);
+
+  std::string single = segment("broadcast.ts", 0);
+  for (unsigned threads : { 1, 3, 4 })
+  {
+    CHECK(segment("broadcast.ts", threads) == single);
+  }
+  CHECK(chdir("/") == 0);
+  nftw(dir, remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+  return 0;
+}
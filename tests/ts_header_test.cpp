@@ -0,0 +1,123 @@
+#include "test.hpp"
+#include "ts_header.hpp"
+
+/**
+ * Both parsers over the same packets, requiring the same headers.
+ */
+static void check_same(const std::vector<uint8_t>& pkts)
+{
+  size_t total = pkts.size() / TS_PACKET_SIZE;
+  static TsHeaders simd, scalar;
+  for (size_t start = 0; start < total; start += TS_BATCH_MAX)
+  {
+    size_t count = std::min<size_t>(total - start, TS_BATCH_MAX);
+    const uint8_t* batch = &pkts[start * TS_PACKET_SIZE];
+    memset(&simd, 0xAA, sizeof(simd));
+    memset(&scalar, 0x55, sizeof(scalar));
+    parse_headers(batch, count, simd);
+    parse_headers_scalar(batch, count, scalar);
+    for (size_t i = 0; i < count; i++)
+    {
+      CHECK_EQ(simd.pid[i], scalar.pid[i]);
+      CHECK_EQ(simd.flags[i], scalar.flags[i]);
+      CHECK_EQ(simd.cc[i], scalar.cc[i]);
+      CHECK_EQ(simd.payload[i], scalar.payload[i]);
+    }
+  }
+}
+
+/**
+ * A packet with an adaptation field of af_len bytes, its flags byte set
+ * to af_flags.
+ */
+static void af_packet(std::vector<uint8_t>& out, uint8_t afc, uint8_t af_len, uint8_t af_flags)
+{
+  test_packet(out, 0x123, 5, 1);
+  uint8_t* pkt = &out[out.size() - TS_PACKET_SIZE];
+  pkt[3] = (afc << 4) | 5;
+  pkt[4] = af_len;
+  pkt[5] = af_flags;
+}
+
+/**
+ * The headers of a few hand made packets, through the scalar parser.
+ */
+static void test_fields()
+{
+  std::vector<uint8_t> pkts;
+  test_packet(pkts, 0x1ABC, 9, 1);
+  af_packet(pkts, 3, 7, 0xD0); // Discontinuity, RAI and PCR
+  af_packet(pkts, 3, 6, 0x10); // Too short to hold a PCR
+  af_packet(pkts, 2, 183, 0x40); // Adaptation field only, filling the packet
+  af_packet(pkts, 3, 184, 0x00); // Longer than the packet
+  af_packet(pkts, 3, 0, 0xFF); // Empty, so no flags byte
+  test_packet(pkts, 0x100, 0);
+  pkts[6 * TS_PACKET_SIZE] = 0x48; // Lost sync
+  pkts[6 * TS_PACKET_SIZE + 1] |= 0x80; // and the transport error indicator
+  pkts[6 * TS_PACKET_SIZE + 3] |= 0xC0; // scrambled with the odd key
+
+  TsHeaders hdrs;
+  parse_headers_scalar(pkts.data(), 7, hdrs);
+  CHECK_EQ(hdrs.pid[0], 0x1ABC);
+  CHECK_EQ(hdrs.cc[0], 9);
+  CHECK_EQ(hdrs.flags[0], TS_FLAG_PUSI | TS_FLAG_PAYLOAD);
+  CHECK_EQ(hdrs.payload[0], TS_HEADER_SIZE);
+
+  CHECK_EQ(hdrs.flags[1], TS_FLAG_PUSI | TS_FLAG_PAYLOAD | TS_FLAG_ADAPTATION | TS_FLAG_DISCONTINUITY | TS_FLAG_RAI | TS_FLAG_PCR);
+  CHECK_EQ(hdrs.payload[1], TS_HEADER_SIZE + 8);
+  CHECK_EQ(hdrs.flags[2] & TS_FLAG_PCR, 0);
+  CHECK_EQ(hdrs.flags[3], TS_FLAG_PUSI | TS_FLAG_ADAPTATION | TS_FLAG_RAI);
+  CHECK_EQ(hdrs.payload[3], TS_PACKET_SIZE);
+  CHECK(hdrs.flags[4] & TS_FLAG_ERROR);
+  CHECK_EQ(hdrs.flags[5], TS_FLAG_PUSI | TS_FLAG_PAYLOAD | TS_FLAG_ADAPTATION);
+  CHECK_EQ(hdrs.payload[5], TS_HEADER_SIZE + 1);
+  CHECK(hdrs.flags[6] & TS_FLAG_ERROR);
+  CHECK(hdrs.flags[6] & TS_FLAG_TEI);
+  CHECK_EQ((hdrs.flags[6] & TS_FLAG_SCRAMBLED) >> TS_SCRAMBLING_SHIFT, 3);
+
+  // Wherever they fall among the packets the SIMD parser takes together.
+  for (size_t lead = 0; lead < 9; lead++)
+  {
+    std::vector<uint8_t> shifted;
+    for (size_t i = 0; i < lead; i++)
+    {
+      test_packet(shifted, 0x200, i);
+    }
+    shifted.insert(shifted.end(), pkts.begin(), pkts.end());
+    check_same(shifted);
+  }
+}
+
+/**
+ * A multiplex, and then random bytes in every header and adaptation field.
+ */
+static void test_random()
+{
+  std::vector<uint8_t> mux = test_mux(12, 20000);
+  check_same(mux);
+
+  TestRandom random;
+  for (size_t offset = 0; offset < mux.size(); offset += TS_PACKET_SIZE)
+  {
+    for (size_t i = random.below(4) ? 1 : 0; i < 6; i++)
+    {
+      mux[offset + i] = random.next();
+    }
+  }
+  check_same(mux);
+  // And batches of every length, for the packets left after the SIMD loop.
+  for (size_t count = 1; count < 20; count++)
+  {
+    check_same(std::vector<uint8_t>(mux.begin(), mux.begin() + count * TS_PACKET_SIZE));
+  }
+}
+
+/**
+ * parse_headers() against the scalar parser it stands in for.
+ */
+int main(int argc, char** argv)
+{
+  test_fields();
+  test_random();
+  return 0;
+}
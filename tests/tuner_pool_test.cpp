@@ -0,0 +1,140 @@
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "test.hpp"
+#include "replay.hpp"
+#include "segmenter.hpp"
+#include "tuner_pool.hpp"
+
+#define TEST_SERVICES 2
+#define TEST_SECONDS 60 // Longer than the test, so no stream ends by itself.
+#define TEST_WAIT 10 // seconds
+
+/**
+ * A request over the pool's control socket, and its reply. Waits for the
+ * socket, which may be left over from an earlier run until it is opened.
+ */
+static std::string request(const std::string& line)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  CHECK(fd >= 0);
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, CONTROL_SOCKET, sizeof(addr.sun_path) - 1);
+  double start = test_seconds();
+  while (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    CHECK(test_seconds() - start < TEST_WAIT);
+    usleep(10000);
+  }
+  std::string out = line + "\n";
+  CHECK_EQ(write(fd, out.data(), out.size()), out.size());
+  std::string reply;
+  char buf[256];
+  ssize_t len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0)
+  {
+    reply.append(buf, len);
+  }
+  close(fd);
+  return reply.substr(0, reply.find('\n'));
+}
+
+/**
+ * The sources the pool has opened, by multiplex.
+ */
+static std::mutex opened_lock;
+static std::map<std::string, unsigned> opened;
+
+static unsigned times_opened(const std::string& multiplex)
+{
+  std::lock_guard<std::mutex> lock(opened_lock);
+  return opened[multiplex];
+}
+
+/**
+ * Waits for the pool to open multiplex for the count'th time.
+ */
+static void wait_opened(const std::string& multiplex, unsigned count)
+{
+  double start = test_seconds();
+  while (times_opened(multiplex) < count)
+  {
+    CHECK(test_seconds() - start < TEST_WAIT);
+    usleep(10000);
+  }
+}
+
+/**
+ * Two recorded multiplexes served from one tuner, which is retuned from
+ * one to the other and back as their services are asked for.
+ */
+int main(int argc, char** argv)
+{
+  char dir[] = "/tmp/tuner_pool_testXXXXXX";
+  CHECK(mkdtemp(dir));
+  std::string recordings = dir;
+  for (const char* multiplex : { "a", "b" })
+  {
+    std::vector<uint8_t> broadcast = test_broadcast(TEST_SERVICES, TEST_SECONDS, 0, 0, std::string("Mux ") + multiplex);
+    std::string path = recordings + "/" + multiplex + ".ts";
+    FILE* file = fopen(path.c_str(), "wb");
+    CHECK(file);
+    CHECK_EQ(fwrite(broadcast.data(), 1, broadcast.size(), file), broadcast.size());
+    fclose(file);
+  }
+
+  auto open_source = [&recordings](const std::string& multiplex, uint16_t adapter) -> TsSource*
+  {
+    CHECK_EQ(adapter, 0);
+    ReplaySource* source = new ReplaySource(multiplex, recordings + "/" + multiplex + ".ts", true);
+    source->open_source();
+    std::lock_guard<std::mutex> lock(opened_lock);
+    opened[multiplex]++;
+    return source;
+  };
+  auto setup = [](Segmenter& segmenter) { segmenter.use_progressive_scan(true); };
+  {
+    TunerPool pool({ 0 }, { "a", "b" }, open_source, setup);
+    // Any tuner may be taken at once.
+    pool.set_idle_timeout(0);
+    pool.survey();
+    CHECK_EQ(times_opened("a"), 1);
+    CHECK_EQ(times_opened("b"), 1);
+    std::thread run([&pool] { pool.run(); });
+    CHECK(request("status") == "OK adapter0=free");
+    CHECK(request("watch Mux a 1").substr(0, 3) == "OK ");
+    wait_opened("a", 2);
+    CHECK(request("watch Mux a 2").substr(0, 3) == "OK ");
+    CHECK(request("status").find("OK adapter0=\"a\",") == 0);
+
+    // The other multiplex takes the tuner, once the stream on it has stopped.
+    CHECK(request("watch Mux b 1").substr(0, 3) == "OK ");
+    CHECK(request("status").find("OK adapter0=\"b\",") == 0);
+    wait_opened("b", 2);
+    CHECK_EQ(times_opened("a"), 2);
+
+    // Back and forth before the first retune is done, ending up on the last.
+    CHECK(request("watch Mux a 2").substr(0, 3) == "OK ");
+    CHECK(request("watch Mux b 2").substr(0, 3) == "OK ");
+    CHECK(request("watch Mux a 1").substr(0, 3) == "OK ");
+    wait_opened("a", 3);
+    CHECK(request("status").find("OK adapter0=\"a\",") == 0);
+
+    CHECK(request("watch Mux c 1") == "ERR unknown service Mux c 1");
+    pool.exit();
+    run.join();
+  }
+  for (const char* multiplex : { "a", "b" })
+  {
+    CHECK(unlink((recordings + "/" + multiplex + ".ts").c_str()) == 0);
+  }
+  CHECK(rmdir(dir) == 0);
+  return 0;
+}
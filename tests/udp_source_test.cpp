@@ -0,0 +1,160 @@
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+
+#include "test.hpp"
+#include "udp_source.hpp"
+
+#define TEST_DEPTH 4
+#define TEST_PACKETS_PER_DATAGRAM 7
+#define TEST_RTP_HEADER_SIZE 12
+
+/**
+ * Sends RTP datagrams over loopback, each with TS packets that carry its
+ * sequence number, so the order they are read back in can be checked.
+ */
+class RtpSender
+{
+  int m_socket;
+  sockaddr_in m_to;
+
+public:
+  RtpSender(uint16_t port) :
+      m_socket(socket(AF_INET, SOCK_DGRAM, 0))
+  {
+    CHECK(m_socket >= 0);
+    memset(&m_to, 0, sizeof(m_to));
+    m_to.sin_family = AF_INET;
+    m_to.sin_port = htons(port);
+    m_to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  }
+
+  void send(uint16_t seq)
+  {
+    std::vector<uint8_t> datagram(TEST_RTP_HEADER_SIZE, 0);
+    datagram[0] = 0x80;
+    datagram[1] = 33; // MP2T
+    datagram[2] = seq >> 8;
+    datagram[3] = seq & 0xFF;
+    for (int i = 0; i < TEST_PACKETS_PER_DATAGRAM; i++)
+    {
+      test_packet(datagram, 0x100, i);
+      uint8_t* payload = &datagram[datagram.size() - TS_PACKET_SIZE + 4];
+      payload[0] = seq >> 8;
+      payload[1] = seq & 0xFF;
+      payload[2] = i;
+    }
+    CHECK_EQ(sendto(m_socket, datagram.data(), datagram.size(), 0, (sockaddr*)&m_to, sizeof(m_to)), datagram.size());
+  }
+
+  ~RtpSender()
+  {
+    close(m_socket);
+  }
+};
+
+/**
+ * A free port on loopback, from the kernel.
+ */
+static uint16_t free_port()
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  CHECK(fd >= 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  CHECK(bind(fd, (sockaddr*)&addr, sizeof(addr)) == 0);
+  socklen_t len = sizeof(addr);
+  CHECK(getsockname(fd, (sockaddr*)&addr, &len) == 0);
+  close(fd);
+  return ntohs(addr.sin_port);
+}
+
+/**
+ * The sequence numbers of the next datagrams read back, checking that
+ * each arrives whole and in its own order.
+ */
+static std::vector<uint16_t> read_datagrams(UdpSource& source, size_t count)
+{
+  std::vector<uint16_t> seqs;
+  std::vector<uint8_t> buf(64 * TEST_PACKETS_PER_DATAGRAM * TS_PACKET_SIZE);
+  unsigned index = 0;
+  while (seqs.size() < count || index)
+  {
+    ssize_t len = source.read_bytes(buf.data(), buf.size());
+    CHECK(len > 0);
+    CHECK_EQ(len % TS_PACKET_SIZE, 0);
+    for (ssize_t offset = 0; offset < len; offset += TS_PACKET_SIZE)
+    {
+      const uint8_t* pkt = &buf[offset];
+      CHECK_EQ(pkt[0], 0x47);
+      CHECK_EQ(pkt[6], index);
+      uint16_t seq = (pkt[4] << 8) | pkt[5];
+      if (index == 0) seqs.push_back(seq);
+      CHECK_EQ(seq, seqs.back());
+      index = (index + 1) % TEST_PACKETS_PER_DATAGRAM;
+    }
+  }
+  return seqs;
+}
+
+static std::vector<uint16_t> range(uint16_t first, uint16_t last, uint16_t skip = 0xFFFF)
+{
+  std::vector<uint16_t> seqs;
+  for (uint16_t seq = first; seq <= last; seq++)
+  {
+    if (seq != skip) seqs.push_back(seq);
+  }
+  return seqs;
+}
+
+/**
+ * Reordered, lost, late and duplicated RTP packets through UdpSource's
+ * jitter buffer over loopback.
+ */
+int main(int argc, char** argv)
+{
+  uint16_t port = free_port();
+  UdpSource source("test", "127.0.0.1:" + std::to_string(port), TEST_DEPTH);
+  source.open_source();
+  RtpSender sender(port);
+
+  // Swapped pairs are put back in order. 12 never comes, and is given up on
+  // once more than the jitter depth has arrived after it.
+  for (uint16_t seq : { 0, 1, 2, 3, 4, 6, 5, 7, 8, 10, 9, 11, 13, 14, 15, 16, 17, 18, 19 })
+  {
+    sender.send(seq);
+  }
+  CHECK(read_datagrams(source, 18) == range(0, 19, 12));
+
+  // Too late for 12 now, and 21 twice is passed on once.
+  for (uint16_t seq : { 12, 20, 21, 21, 23, 22, 24 })
+  {
+    sender.send(seq);
+  }
+  CHECK(read_datagrams(source, 5) == range(20, 24));
+
+  // A gap too close to the end to fill the jitter buffer is given up on
+  // when nothing more arrives.
+  for (uint16_t seq : { 25, 27, 28 })
+  {
+    sender.send(seq);
+  }
+  CHECK(read_datagrams(source, 3) == range(25, 28, 26));
+
+  // Sequence numbers wrap around.
+  uint16_t wrap_port = free_port();
+  UdpSource wrap("test", "127.0.0.1:" + std::to_string(wrap_port), TEST_DEPTH);
+  wrap.open_source();
+  RtpSender wrap_sender(wrap_port);
+  for (uint16_t seq : { 65533, 65534, 0, 65535, 1, 2, 3, 4 })
+  {
+    wrap_sender.send(seq);
+  }
+  std::vector<uint16_t> wrapped = { 65533, 65534, 65535, 0, 1, 2, 3, 4 };
+  CHECK(read_datagrams(wrap, 8) == wrapped);
+  return 0;
+}